@@ -28,6 +28,13 @@
  */
 #include "FSP_Impl.h"
 
+#if defined(__linux__)
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#elif defined(_MSC_VER)
+# pragma comment(lib, "Synchronization.lib")	// WaitOnAddress
+#endif
+
 //
 // Start Of Reflection
 //
@@ -204,23 +211,105 @@ CStringizeNotice	noticeNames;
 
 
 
+// Given
+//	volatile uint32_t *	the lock word or the ticket of some lock
+//	uint32_t			the value that the word was seen to hold
+//	uint32_t			the maximum time to sleep, in milliseconds
+//	bool				whether the word is in memory shared between processes
+// Do
+//	Sleep until the word is changed and the sleeper is waken, or until timed out
+// Remark
+//	Spurious wake-up is possible. The caller should recheck the lock
+//	WaitOnAddress does not work across processes, so the shared word is polled on Windows
+void LOCALAPI WaitOnLockWord(volatile uint32_t *p, uint32_t seen, uint32_t ms, bool shared)
+{
+#if defined(__linux__)
+	struct timespec tv;
+	tv.tv_sec = ms / 1000;
+	tv.tv_nsec = (ms % 1000) * 1000000;
+	syscall(SYS_futex, p, shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, seen, &tv, NULL, 0);
+#else
+	if (shared)
+		Sleep(TIMER_SLICE_ms);
+	else
+		WaitOnAddress(p, &seen, sizeof(uint32_t), ms);
+#endif
+}
+
+
+
+// Given
+//	volatile uint32_t *	the lock word or the ticket of some lock
+//	int					the maximum number of sleepers to wake up
+//	bool				whether the word is in memory shared between processes
+void LOCALAPI WakeLockWaiters(volatile uint32_t *p, int n, bool shared)
+{
+#if defined(__linux__)
+	syscall(SYS_futex, p, shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+#else
+	if (shared)
+		return;
+	if (n > 1)
+		WakeByAddressAll((PVOID)p);
+	else
+		WakeByAddressSingle((PVOID)p);
+#endif
+}
+
+
+
+// Return
+//	The maximum rounds that a contender of some lock may spin before it sleeps
+int LockSpinLimit()
+{
+#if defined(__linux__)
+	static const int n = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? LOCK_SPIN_LIMIT : 0;
+#else
+	static int n = -1;
+	if (n < 0)
+	{
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		n = info.dwNumberOfProcessors > 1 ? LOCK_SPIN_LIMIT : 0;
+	}
+#endif
+	return n;
+}
+
+
+
 // Return
 //	true if obtained the mutual-exclusive lock
 //	false if timed out
 // Remark
-//	Exploit _InterlockedCompareExchange8 to keep memory access order as the coded order
+//	Spin for a while, then mark the lock word as contended and sleep on it,
+//	so that the holder knows to wake up some sleeper when it frees the lock
 bool CLightMutex::WaitSetMutex()
 {
+	uint32_t c = _InterlockedCompareExchange((PLONG)&mutex, 1, 0);
+	if (c == 0)
+		return true;
+
+	for (register int i = LockSpinLimit(); i > 0; i--)
+	{
+		YieldProcessor();
+		if (LCKREAD(mutex) == 0 && (c = _InterlockedCompareExchange((PLONG)&mutex, 1, 0)) == 0)
+			return true;
+	}
+
 	uint64_t t0 = GetTickCount64();
-	while (_InterlockedCompareExchange8(&mutex, 1, 0))
+	if (c != 2)
+		c = _InterlockedExchange((PLONG)&mutex, 2);
+	while (c != 0)
 	{
-		if (GetTickCount64() - t0 > MAX_LOCK_WAIT_ms)
+		uint64_t t = GetTickCount64() - t0;
+		if (t > MAX_LOCK_WAIT_ms)
 		{
 			BREAK_ON_DEBUG();
 			return false;
 		}
-		//
-		Sleep(TIMER_SLICE_ms);
+		WaitOnLockWord(&mutex, 2, (uint32_t)min(MAX_LOCK_WAIT_ms - t, LOCK_PARK_SLICE_ms), true);
+		c = _InterlockedExchange((PLONG)&mutex, 2);
 	}
 	return true;
 }
@@ -34,6 +34,8 @@
 
 #include "../Intrins.h"
 #include "sha256.h"
+#include "sha512.h"
+#include "curve25519.h"
 
 #if defined(__WINDOWS__)
 
@@ -72,8 +74,14 @@
 # define SINLINE static inline
 #endif
 
-#define crypto_box_curve25519xsalsa20poly1305_beforenm crypto_box_curve25519xsalsa20poly1305_tweet_beforenm
-#define crypto_box_curve25519xsalsa20poly1305_keypair crypto_box_curve25519xsalsa20poly1305_tweet_keypair
+// The radix-2^51 X25519 backend in curve25519.c is applied where available, tweetnacl otherwise
+#ifdef CURVE25519_RADIX51
+# define crypto_box_curve25519xsalsa20poly1305_beforenm crypto_box_curve25519xsalsa20poly1305_radix51_beforenm
+# define crypto_box_curve25519xsalsa20poly1305_keypair crypto_box_curve25519xsalsa20poly1305_radix51_keypair
+#else
+# define crypto_box_curve25519xsalsa20poly1305_beforenm crypto_box_curve25519xsalsa20poly1305_tweet_beforenm
+# define crypto_box_curve25519xsalsa20poly1305_keypair crypto_box_curve25519xsalsa20poly1305_tweet_keypair
+#endif
 #define crypto_hash_sha512 crypto_hash_sha512_tweet
 
 #define crypto_box_beforenm crypto_box_curve25519xsalsa20poly1305_beforenm
@@ -137,9 +145,10 @@ int UTF8ToWideChars(wchar_t[], int, LPCSTR, int);
 
 #endif
 
-// in tweetnacl.c:
+// in curve25519.c or tweetnacl.c:
 int crypto_box_beforenm(unsigned char *,const unsigned char *,const unsigned char *);
 int crypto_box_keypair(unsigned char *,unsigned char *);
+// in tweetnacl.c:
 int crypto_hash_sha512(unsigned char *,const unsigned char *,unsigned long long);
 
 #ifdef __cplusplus
@@ -183,9 +192,12 @@ SINLINE int FSPAPI CryptoNaClGetSharedSecret(octet *s, const octet *pk, const oc
 //	get the SHA512 result
 // Return
 //	0 (always succeed in presumed constant time)
+// Remark
+//	By the unrolled implementation in sha512.c, which is much faster than that of tweetnacl
 SINLINE int FSPAPI CryptoNaClHash(octet *buf, const octet *input, size_t len)
 {
-	return crypto_hash_sha512(buf, input, len);
+	sha512_hash(buf, input, len);
+	return 0;
 }
 
 
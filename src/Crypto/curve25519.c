@@ -0,0 +1,305 @@
+/*
+ * X25519 (RFC 7748) by the Montgomery ladder on field elements of five 51-bit limbs,
+ * with 64x64->128 bit multiplication. Constant time: no branch and no memory access
+ * depends on the secret scalar.
+ *
+ * The curve25519xsalsa20poly1305 key pair and 'beforenm' of NaCl are built on it,
+ * and are interchangeable with those of tweetnacl.
+ */
+#include <string.h>
+#include "curve25519.h"
+
+#ifdef CURVE25519_RADIX51
+
+typedef unsigned __int128 uint128_t;
+typedef uint64_t fe[5];
+
+#define MASK51	0x7FFFFFFFFFFFFULL
+
+static uint64_t load64_le(const uint8_t *p)
+{
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24)
+		| ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static void store64_le(uint8_t *p, uint64_t v)
+{
+	register int i;
+	for (i = 0; i < 8; i++, v >>= 8)
+		p[i] = (uint8_t)v;
+}
+
+// The top bit is ignored, as RFC 7748 requires
+static void fe_frombytes(fe h, const uint8_t s[32])
+{
+	h[0] = load64_le(s) & MASK51;
+	h[1] = (load64_le(s + 6) >> 3) & MASK51;
+	h[2] = (load64_le(s + 12) >> 6) & MASK51;
+	h[3] = (load64_le(s + 19) >> 1) & MASK51;
+	h[4] = (load64_le(s + 24) >> 12) & MASK51;
+}
+
+// Fully reduced modulo p = 2^255 - 19
+static void fe_tobytes(uint8_t s[32], const fe f)
+{
+	uint64_t h0 = f[0], h1 = f[1], h2 = f[2], h3 = f[3], h4 = f[4];
+	uint64_t q;
+	register int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		h1 += h0 >> 51; h0 &= MASK51;
+		h2 += h1 >> 51; h1 &= MASK51;
+		h3 += h2 >> 51; h2 &= MASK51;
+		h4 += h3 >> 51; h3 &= MASK51;
+		h0 += 19 * (h4 >> 51); h4 &= MASK51;
+	}
+	// q = 1 if h >= p, 0 otherwise; then h - q * p = h + 19 * q - q * 2^255
+	q = (h0 + 19) >> 51;
+	q = (h1 + q) >> 51;
+	q = (h2 + q) >> 51;
+	q = (h3 + q) >> 51;
+	q = (h4 + q) >> 51;
+	h0 += 19 * q;
+	h1 += h0 >> 51; h0 &= MASK51;
+	h2 += h1 >> 51; h1 &= MASK51;
+	h3 += h2 >> 51; h2 &= MASK51;
+	h4 += h3 >> 51; h3 &= MASK51;
+	h4 &= MASK51;
+
+	store64_le(s, h0 | (h1 << 51));
+	store64_le(s + 8, (h1 >> 13) | (h2 << 38));
+	store64_le(s + 16, (h2 >> 26) | (h3 << 25));
+	store64_le(s + 24, (h3 >> 39) | (h4 << 12));
+}
+
+static void fe_add(fe h, const fe f, const fe g)
+{
+	h[0] = f[0] + g[0];
+	h[1] = f[1] + g[1];
+	h[2] = f[2] + g[2];
+	h[3] = f[3] + g[3];
+	h[4] = f[4] + g[4];
+}
+
+// 2p is added so that no limb goes negative, provided the limbs of g are below 2^52
+static void fe_sub(fe h, const fe f, const fe g)
+{
+	h[0] = (f[0] + 0xFFFFFFFFFFFDAULL) - g[0];
+	h[1] = (f[1] + 0xFFFFFFFFFFFFEULL) - g[1];
+	h[2] = (f[2] + 0xFFFFFFFFFFFFEULL) - g[2];
+	h[3] = (f[3] + 0xFFFFFFFFFFFFEULL) - g[3];
+	h[4] = (f[4] + 0xFFFFFFFFFFFFEULL) - g[4];
+}
+
+#define FE_CARRY(h, r0, r1, r2, r3, r4) {	\
+	uint64_t c;								\
+	r1 += (uint64_t)(r0 >> 51); h[0] = (uint64_t)r0 & MASK51;	\
+	r2 += (uint64_t)(r1 >> 51); h[1] = (uint64_t)r1 & MASK51;	\
+	r3 += (uint64_t)(r2 >> 51); h[2] = (uint64_t)r2 & MASK51;	\
+	r4 += (uint64_t)(r3 >> 51); h[3] = (uint64_t)r3 & MASK51;	\
+	c = (uint64_t)(r4 >> 51); h[4] = (uint64_t)r4 & MASK51;		\
+	h[0] += c * 19;							\
+	h[1] += h[0] >> 51; h[0] &= MASK51;		\
+	}
+
+// 2^255 == 19 (mod p), so the partial products beyond the fifth limb are folded back times 19
+static void fe_mul(fe h, const fe f, const fe g)
+{
+	const uint64_t f0 = f[0], f1 = f[1], f2 = f[2], f3 = f[3], f4 = f[4];
+	const uint64_t g0 = g[0], g1 = g[1], g2 = g[2], g3 = g[3], g4 = g[4];
+	const uint64_t g1_19 = 19 * g1, g2_19 = 19 * g2, g3_19 = 19 * g3, g4_19 = 19 * g4;
+	uint128_t r0, r1, r2, r3, r4;
+
+	r0 = (uint128_t)f0 * g0 + (uint128_t)f1 * g4_19 + (uint128_t)f2 * g3_19 + (uint128_t)f3 * g2_19 + (uint128_t)f4 * g1_19;
+	r1 = (uint128_t)f0 * g1 + (uint128_t)f1 * g0 + (uint128_t)f2 * g4_19 + (uint128_t)f3 * g3_19 + (uint128_t)f4 * g2_19;
+	r2 = (uint128_t)f0 * g2 + (uint128_t)f1 * g1 + (uint128_t)f2 * g0 + (uint128_t)f3 * g4_19 + (uint128_t)f4 * g3_19;
+	r3 = (uint128_t)f0 * g3 + (uint128_t)f1 * g2 + (uint128_t)f2 * g1 + (uint128_t)f3 * g0 + (uint128_t)f4 * g4_19;
+	r4 = (uint128_t)f0 * g4 + (uint128_t)f1 * g3 + (uint128_t)f2 * g2 + (uint128_t)f3 * g1 + (uint128_t)f4 * g0;
+
+	FE_CARRY(h, r0, r1, r2, r3, r4);
+}
+
+static void fe_sq(fe h, const fe f)
+{
+	const uint64_t f0 = f[0], f1 = f[1], f2 = f[2], f3 = f[3], f4 = f[4];
+	const uint64_t f0_2 = 2 * f0, f1_2 = 2 * f1;
+	const uint64_t f1_38 = 38 * f1, f2_38 = 38 * f2, f3_38 = 38 * f3;
+	const uint64_t f3_19 = 19 * f3, f4_19 = 19 * f4;
+	uint128_t r0, r1, r2, r3, r4;
+
+	r0 = (uint128_t)f0 * f0 + (uint128_t)f1_38 * f4 + (uint128_t)f2_38 * f3;
+	r1 = (uint128_t)f0_2 * f1 + (uint128_t)f2_38 * f4 + (uint128_t)f3_19 * f3;
+	r2 = (uint128_t)f0_2 * f2 + (uint128_t)f1 * f1 + (uint128_t)f3_38 * f4;
+	r3 = (uint128_t)f0_2 * f3 + (uint128_t)f1_2 * f2 + (uint128_t)f4_19 * f4;
+	r4 = (uint128_t)f0_2 * f4 + (uint128_t)f1_2 * f3 + (uint128_t)f2 * f2;
+
+	FE_CARRY(h, r0, r1, r2, r3, r4);
+}
+
+// Square n times
+static void fe_sqn(fe h, const fe f, int n)
+{
+	fe_sq(h, f);
+	while (--n > 0)
+		fe_sq(h, h);
+}
+
+static void fe_mul_small(fe h, const fe f, uint64_t k)
+{
+	uint128_t r0 = (uint128_t)f[0] * k;
+	uint128_t r1 = (uint128_t)f[1] * k;
+	uint128_t r2 = (uint128_t)f[2] * k;
+	uint128_t r3 = (uint128_t)f[3] * k;
+	uint128_t r4 = (uint128_t)f[4] * k;
+
+	FE_CARRY(h, r0, r1, r2, r3, r4);
+}
+
+// z^(p - 2) = z^(2^255 - 21), by the addition chain of ref10
+static void fe_invert(fe out, const fe z)
+{
+	fe t0, t1, t2, t3;
+
+	fe_sq(t0, z);				// 2
+	fe_sqn(t1, t0, 2);			// 8
+	fe_mul(t1, z, t1);			// 9
+	fe_mul(t0, t0, t1);			// 11
+	fe_sq(t2, t0);				// 22
+	fe_mul(t1, t1, t2);			// 2^5 - 1
+	fe_sqn(t2, t1, 5);
+	fe_mul(t1, t2, t1);			// 2^10 - 1
+	fe_sqn(t2, t1, 10);
+	fe_mul(t2, t2, t1);			// 2^20 - 1
+	fe_sqn(t3, t2, 20);
+	fe_mul(t2, t3, t2);			// 2^40 - 1
+	fe_sqn(t2, t2, 10);
+	fe_mul(t1, t2, t1);			// 2^50 - 1
+	fe_sqn(t2, t1, 50);
+	fe_mul(t2, t2, t1);			// 2^100 - 1
+	fe_sqn(t3, t2, 100);
+	fe_mul(t2, t3, t2);			// 2^200 - 1
+	fe_sqn(t2, t2, 50);
+	fe_mul(t1, t2, t1);			// 2^250 - 1
+	fe_sqn(t1, t1, 5);			// 2^255 - 2^5
+	fe_mul(out, t1, t0);		// 2^255 - 21
+}
+
+// Swap f and g if b == 1, leave them untouched if b == 0, in constant time
+static void fe_cswap(fe f, fe g, uint64_t b)
+{
+	const uint64_t mask = 0 - b;
+	register int i;
+	for (i = 0; i < 5; i++)
+	{
+		uint64_t x = (f[i] ^ g[i]) & mask;
+		f[i] ^= x;
+		g[i] ^= x;
+	}
+}
+
+
+
+// Given
+//	uint8_t[32]		the buffer to hold the u-coordinate of the product
+//	const uint8_t[32]	the scalar, clamped here
+//	const uint8_t[32]	the u-coordinate of the point
+// Do
+//	The X25519 function of RFC 7748
+// Return
+//	0
+int curve25519_scalarmult(uint8_t q[32], const uint8_t n[32], const uint8_t p[32])
+{
+	uint8_t e[32];
+	fe x1, x2, z2, x3, z3, a, aa, b, bb, c, d, da, cb, t;
+	uint64_t swap = 0;
+	register int i;
+
+	memcpy(e, n, 32);
+	e[0] &= 248;
+	e[31] &= 127;
+	e[31] |= 64;
+
+	fe_frombytes(x1, p);
+	memset(x2, 0, sizeof(fe));
+	x2[0] = 1;
+	memset(z2, 0, sizeof(fe));
+	memcpy(x3, x1, sizeof(fe));
+	memset(z3, 0, sizeof(fe));
+	z3[0] = 1;
+
+	for (i = 254; i >= 0; i--)
+	{
+		uint64_t bit = (e[i >> 3] >> (i & 7)) & 1;
+		swap ^= bit;
+		fe_cswap(x2, x3, swap);
+		fe_cswap(z2, z3, swap);
+		swap = bit;
+
+		fe_add(a, x2, z2);
+		fe_sq(aa, a);
+		fe_sub(b, x2, z2);
+		fe_sq(bb, b);
+		fe_sub(t, aa, bb);			// E = AA - BB
+		fe_add(c, x3, z3);
+		fe_sub(d, x3, z3);
+		fe_mul(da, d, a);
+		fe_mul(cb, c, b);
+		fe_add(x3, da, cb);
+		fe_sq(x3, x3);
+		fe_sub(z3, da, cb);
+		fe_sq(z3, z3);
+		fe_mul(z3, z3, x1);
+		fe_mul(x2, aa, bb);
+		fe_mul_small(z2, t, 121665);
+		fe_add(z2, z2, aa);
+		fe_mul(z2, z2, t);
+	}
+	fe_cswap(x2, x3, swap);
+	fe_cswap(z2, z3, swap);
+
+	fe_invert(z2, z2);
+	fe_mul(x2, x2, z2);
+	fe_tobytes(q, x2);
+
+	memset(e, 0, sizeof(e));
+	return 0;
+}
+
+
+
+static const uint8_t basePoint[32] = { 9 };
+
+// The u-coordinate of the scalar multiple of the base point
+int curve25519_scalarmult_base(uint8_t q[32], const uint8_t n[32])
+{
+	return curve25519_scalarmult(q, n, basePoint);
+}
+
+
+
+// defined in tweetnacl.c
+extern int crypto_core_hsalsa20_tweet(unsigned char *, const unsigned char *, const unsigned char *, const unsigned char *);
+extern void randombytes(void *, size_t);
+
+static const uint8_t zeroNonce[16] = { 0 };
+static const uint8_t sigma[16] = { 'e','x','p','a','n','d',' ','3','2','-','b','y','t','e',' ','k' };
+
+// As crypto_box_curve25519xsalsa20poly1305_tweet_keypair
+int crypto_box_curve25519xsalsa20poly1305_radix51_keypair(uint8_t *pk, uint8_t *sk)
+{
+	randombytes(sk, 32);
+	return curve25519_scalarmult_base(pk, sk);
+}
+
+// As crypto_box_curve25519xsalsa20poly1305_tweet_beforenm: HSalsa20 of the shared point
+int crypto_box_curve25519xsalsa20poly1305_radix51_beforenm(uint8_t *k, const uint8_t *pk, const uint8_t *sk)
+{
+	uint8_t s[32];
+	curve25519_scalarmult(s, sk, pk);
+	crypto_core_hsalsa20_tweet(k, zeroNonce, s, sigma);
+	memset(s, 0, sizeof(s));
+	return 0;
+}
+
+#endif
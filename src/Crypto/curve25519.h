@@ -0,0 +1,34 @@
+#ifndef _CRYPTO_CURVE25519_H
+#define _CRYPTO_CURVE25519_H
+
+/*
+ * X25519 on 64-bit platforms whose compiler provides 128-bit integers.
+ * Elsewhere, or if CRYPTO_NACL_TWEET is defined, tweetnacl is applied instead
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__SIZEOF_INT128__) && !defined(CRYPTO_NACL_TWEET)
+# define CURVE25519_RADIX51
+#endif
+
+#ifdef CURVE25519_RADIX51
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+int curve25519_scalarmult(uint8_t q[32], const uint8_t n[32], const uint8_t p[32]);
+int curve25519_scalarmult_base(uint8_t q[32], const uint8_t n[32]);
+
+int crypto_box_curve25519xsalsa20poly1305_radix51_keypair(uint8_t *, uint8_t *);
+int crypto_box_curve25519xsalsa20poly1305_radix51_beforenm(uint8_t *, const uint8_t *, const uint8_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+#endif
@@ -0,0 +1,178 @@
+/* Crypto/Sha512.c -- SHA-512 Hash
+   Derived from Crypto/Sha256.c: the rounds are unrolled in the same way, on 64-bit words,
+   and whole blocks are hashed straight from the input instead of through the buffer */
+
+#include <string.h>
+#include "rotate-bits.h"
+#include "sha512.h"
+
+void
+sha512_init(sha512_t *p)
+{
+  p->state[0] = 0x6a09e667f3bcc908ULL;
+  p->state[1] = 0xbb67ae8584caa73bULL;
+  p->state[2] = 0x3c6ef372fe94f82bULL;
+  p->state[3] = 0xa54ff53a5f1d36f1ULL;
+  p->state[4] = 0x510e527fade682d1ULL;
+  p->state[5] = 0x9b05688c2b3e6c1fULL;
+  p->state[6] = 0x1f83d9abfb41bd6bULL;
+  p->state[7] = 0x5be0cd19137e2179ULL;
+  p->count = 0;
+}
+
+#define S0(x) (ROTR64(x,28) ^ ROTR64(x,34) ^ ROTR64(x,39))
+#define S1(x) (ROTR64(x,14) ^ ROTR64(x,18) ^ ROTR64(x,41))
+#define s0(x) (ROTR64(x, 1) ^ ROTR64(x, 8) ^ (x >> 7))
+#define s1(x) (ROTR64(x,19) ^ ROTR64(x,61) ^ (x >> 6))
+
+#define blk0(i) (W[i] = load64_be(data + 8 * (i)))
+#define blk2(i) (W[i&15] += s1(W[(i-2)&15]) + W[(i-7)&15] + s0(W[(i-15)&15]))
+
+#define Ch(x,y,z) (z^(x&(y^z)))
+#define Maj(x,y,z) ((x&y)|(z&(x|y)))
+
+#define R(a,b,c,d,e,f,g,h, i) h += S1(e) + Ch(e,f,g) + K[i+j] + (j?blk2(i):blk0(i));\
+  d += h; h += S0(a) + Maj(a, b, c)
+
+#define RX_8(i) \
+  R(a,b,c,d,e,f,g,h, i); \
+  R(h,a,b,c,d,e,f,g, (i+1)); \
+  R(g,h,a,b,c,d,e,f, (i+2)); \
+  R(f,g,h,a,b,c,d,e, (i+3)); \
+  R(e,f,g,h,a,b,c,d, (i+4)); \
+  R(d,e,f,g,h,a,b,c, (i+5)); \
+  R(c,d,e,f,g,h,a,b, (i+6)); \
+  R(b,c,d,e,f,g,h,a, (i+7))
+
+static const uint64_t K[80] = {
+  0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+  0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+  0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+  0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+  0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+  0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+  0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+  0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+  0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+  0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+  0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+  0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+  0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+  0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+  0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+  0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+  0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+  0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+  0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+  0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static uint64_t
+load64_be(const unsigned char *p)
+{
+  return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32)
+    | ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) | ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+}
+
+static void
+sha512_transform(uint64_t *state, const unsigned char *data)
+{
+  uint64_t W[16];
+  unsigned j;
+  uint64_t a,b,c,d,e,f,g,h;
+  a = state[0];
+  b = state[1];
+  c = state[2];
+  d = state[3];
+  e = state[4];
+  f = state[5];
+  g = state[6];
+  h = state[7];
+
+  for (j = 0; j < 80; j += 16)
+  {
+    RX_8(0); RX_8(8);
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+#undef S0
+#undef S1
+#undef s0
+#undef s1
+
+
+void
+sha512_hash(unsigned char *buf, const unsigned char *data, size_t size)
+{
+  sha512_t hash;
+  sha512_init(&hash);
+  sha512_update(&hash, data, size);
+  sha512_final(&hash, buf);
+}
+
+
+void
+sha512_update(sha512_t *p, const unsigned char *data, size_t size)
+{
+  unsigned curBufferPos = (unsigned)p->count & 0x7F;
+  p->count += size;
+  if (curBufferPos > 0)
+  {
+    unsigned n = 128 - curBufferPos;
+    if (n > size)
+      n = (unsigned)size;
+    memcpy(p->buffer + curBufferPos, data, n);
+    data += n;
+    size -= n;
+    if (curBufferPos + n < 128)
+      return;
+    sha512_transform(p->state, p->buffer);
+  }
+  for (; size >= 128; data += 128, size -= 128)
+    sha512_transform(p->state, data);
+  memcpy(p->buffer, data, size);
+}
+
+
+void
+sha512_final(sha512_t *p, unsigned char *digest)
+{
+  uint64_t lenInBits = (p->count << 3);
+  unsigned curBufferPos = (unsigned)p->count & 0x7F;
+  unsigned i;
+  p->buffer[curBufferPos++] = 0x80;
+  if (curBufferPos > 128 - 16)
+  {
+    memset(p->buffer + curBufferPos, 0, 128 - curBufferPos);
+    sha512_transform(p->state, p->buffer);
+    curBufferPos = 0;
+  }
+  memset(p->buffer + curBufferPos, 0, 128 - 8 - curBufferPos);
+  /* the high 64 bits of the 128-bit length */
+  p->buffer[128 - 9] = (unsigned char)(p->count >> 61);
+  for (i = 0; i < 8; i++)
+    p->buffer[128 - 8 + i] = (unsigned char)(lenInBits >> (56 - 8 * i));
+  sha512_transform(p->state, p->buffer);
+
+  for (i = 0; i < 8; i++)
+  {
+    *digest++ = (unsigned char)(p->state[i] >> 56);
+    *digest++ = (unsigned char)(p->state[i] >> 48);
+    *digest++ = (unsigned char)(p->state[i] >> 40);
+    *digest++ = (unsigned char)(p->state[i] >> 32);
+    *digest++ = (unsigned char)(p->state[i] >> 24);
+    *digest++ = (unsigned char)(p->state[i] >> 16);
+    *digest++ = (unsigned char)(p->state[i] >> 8);
+    *digest++ = (unsigned char)(p->state[i]);
+  }
+  sha512_init(p);
+}
@@ -0,0 +1,33 @@
+/* Sha512.h -- SHA-512 Hash
+   The same interface as that of Sha256.h */
+
+#ifndef __CRYPTO_SHA512_H
+#define __CRYPTO_SHA512_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#define SHA512_DIGEST_SIZE 64
+
+typedef struct sha512_t
+{
+  uint64_t state[8];
+  uint64_t count;
+  unsigned char buffer[128];
+} sha512_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+void sha512_init(sha512_t *p);
+void sha512_update(sha512_t *p, const unsigned char *data, size_t size);
+void sha512_final(sha512_t *p, unsigned char *digest);
+void sha512_hash(unsigned char *buf, const unsigned char *data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -482,6 +482,18 @@ struct FSP_KeepAlivePacket
 
 
 
+// To profile the contention on the session lock
+typedef struct CLockContention
+{
+	int64_t		countAcquired;
+	int64_t		countContended;	// the lock was busy at the first try
+	int64_t		countParked;	// the lock was still busy after spinning so that the contender slept
+	int32_t		countTimedOut;
+	int32_t		spinEstimate;	// moving average of the spinning rounds of the contended acquisitions
+} *PLockContention;
+
+
+
 // To profile the performance of the socket
 typedef struct CSocketPerformance
 {
@@ -493,6 +505,11 @@ typedef struct CSocketPerformance
 	int64_t		countZWPsent;
 	int64_t		countZWPresent;
 	int64_t		countKeepAliveLockFail;
+	int64_t		countSendKeySetup;		// send key schedules expanded on rekey
+	int64_t		countSendKeyDiverged;	// sent with the dedicated send context as rekey batches diverged
+	// contention on the lock of the session in LLS and in ULA respectively
+	CLockContention	lockLLS;
+	CLockContention	lockULA;
 	// round-log of RTT jitter
 	int64_t		rttJitters[RTT_LOG_CAPACITY];
 	uint64_t	jlogCount;
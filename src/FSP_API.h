@@ -65,6 +65,9 @@ typedef enum
 	FSP_SET_CALLBACK_ON_REQUEST,// CallbackRequested
 	FSP_SET_CALLBACK_ON_CONNECT,// CallbackConnected
 	FSP_GET_PEER_COMMITTED,
+	FSP_GET_COMPRESSION_STATISTICS,	// FSP_CompressionStatistics *
+	FSP_SET_COMPRESSION_CODEC,		// FSP_CompressionCodec
+	FSP_SET_COMPRESSION_DICTIONARY,	// const FSP_CompressionDictionary *, NULL if none
 } FSP_ControlCode;
 
 
@@ -75,6 +78,15 @@ enum FSP_SendOption
 };
 
 
+// The codec of on-the-wire compression is chosen by the sender, and each block is tagged with it.
+// The receiver decodes any of them
+typedef enum
+{
+	FSP_CODEC_LZ4,		// fast, the default
+	FSP_CODEC_ZSTD,		// much better ratio for much more CPU, worth it over WAN links
+} FSP_CompressionCodec;
+
+
 #ifdef __cplusplus
 	extern "C" {
 #endif
@@ -168,7 +180,8 @@ struct FSP_SocketParameter
 			unsigned short	precompress:1;	// data to send on connect ready were pre-compressed
 			unsigned short	tfrc:		1;	// TCP friendly rate control. By default ECN-friendly
 			unsigned short	keepAlive : 1;	// The connection should be kept alive. By default timed-out automatically
-			unsigned short	RESERVED:	9;
+			unsigned short	codec:		2;	// FSP_CompressionCodec of on-the-wire compression
+			unsigned short	RESERVED:	7;
 			unsigned short	passive:	1;	// internal use only, shall be ignored by ULA
 			unsigned short	isError:	1;	// if set, 'flags' is the error reason
 		};
@@ -181,6 +194,25 @@ struct FSP_SocketParameter
 	//
 	uint64_t	extentI64ULA;
 };
+
+// Counters of the on-the-wire compression of the session
+struct FSP_CompressionStatistics
+{
+	uint64_t	bytesIn;			// octets of the plaintext
+	uint64_t	bytesOut;			// octets put on the wire, block headers included
+	uint64_t	bytesStored;		// octets of the plaintext put on the wire as is
+	uint64_t	usCompressing;		// microseconds spent in compressing
+	uint32_t	segmentsCompressed;
+	uint32_t	segmentsStored;		// for compression did not pay
+};
+
+// The pre-trained dictionary of the zstd codec. It must be the same at both ends,
+// and must remain valid while the socket is in use for it is not copied
+struct FSP_CompressionDictionary
+{
+	const void *	buf;
+	int32_t			len;
+};
 #pragma pack(pop)
 
 // If not specified otherwise, any function that returns integer return
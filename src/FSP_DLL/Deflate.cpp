@@ -28,6 +28,8 @@
     POSSIBILITY OF SUCH DAMAGE.
  */
 #include "FSP_DLL.h"
+#define ZSTD_STATIC_LINKING_ONLY	// the dictionary is loaded by reference
+#include "zstd/zstd.h"
 
 
 /*
@@ -39,10 +41,28 @@
  * no header checksum
  * Little endian
  * Data blocks: block size [4 bytes], data
+ * The most significant octet of the block size is the codec, FSP_CODEC_LZ4 or FSP_CODEC_ZSTD,
+ * which shall not change in the transmit transaction. The zstd blocks are the flushed pieces of one frame.
+ * A negative block size -n denotes n octets of the plaintext stored as is,
+ * and the block following a stored one does not refer to any data before it
  */
 
 #define FSP_MAX_SEGMENT_SIZE (1 << 17)	// 128KB
 #define LZ4_DICTIONARY_SIZE (1 << 16)
+#define FSP_BLOCK_CODEC_SHIFT	24
+#define FSP_BLOCK_SIZE_MASK		0xFFFFFF
+
+#ifndef FSP_ZSTD_LEVEL
+# define FSP_ZSTD_LEVEL			3
+#endif
+#ifndef FSP_ZSTD_WINDOW_LOG
+# define FSP_ZSTD_WINDOW_LOG	20	// 1MB, the decoder of each transaction buffers as much
+#endif
+
+#define FSP_COMPRESS_BOUND	max(LZ4_COMPRESSBOUND(FSP_MAX_SEGMENT_SIZE), ZSTD_COMPRESSBOUND(FSP_MAX_SEGMENT_SIZE))
+
+// Compression pays if it saves at least 1/16 of the octets
+#define DEFLATE_PAYS(in, out) ((out) <= (in) - ((in) >> 4))
 
 #pragma pack(push)
 #pragma pack(1)
@@ -52,11 +72,15 @@ struct SStreamState
 	LZ4_stream_t	streamState;
 	//
 	ALIGN(8)
+	ZSTD_CCtx *	zcs;		// NULL unless the codec is zstd
 	int32_t		rNext;		// buffered but not compressed, the ring buffer
 	int32_t		dstNext;	// first available byte in the target buffer, following the ring buffer
 	int32_t		srcDstNext;	// the target buffer as source - to copy out
-	int32_t		outSize;	// number of bytes output by compression
+	int32_t		outSize;	// number of bytes output by compression, negated if the segment is stored as is
 	int8_t		rHeader;	// number of header bytes that remains to be output
+	int8_t		isStored;	// the output is the plaintext in inBuf
+	int8_t		hasHistory;	// some segment compressed may be referred to by the next one
+	int8_t		codec;
 	int32_t		limit;		// capacity of the output buffer
 	//
 	octet		dictBuf[LZ4_DICTIONARY_SIZE];
@@ -85,12 +109,15 @@ struct SStreamState
 			n -= m;
 			tgtBuf = (octet *)tgtBuf + m;
 		}
-		memcpy(tgtBuf, inBuf + sizeof(inBuf) + srcDstNext, n);
+		memcpy(tgtBuf, inBuf + (isStored ? 0 : sizeof(inBuf)) + srcDstNext, n);
 		srcDstNext += n;
 		return tgtSize;
 	}
 	//
-	int32_t ForcefullyCompress();
+	bool	InitZstd(const void *, int32_t);
+	int32_t CompressSegment(SDeflatePolicy &, int32_t);
+	int32_t Store(SDeflatePolicy &, int32_t);
+	int32_t ForcefullyCompress(SDeflatePolicy &);
 };
 
 
@@ -100,10 +127,16 @@ struct SDecodeState
 	LZ4_streamDecode_t decodeState;
 	//
 	ALIGN(8)
+	ZSTD_DCtx *	zds;		// created on the first zstd block
+	const void *zDict;		// the pre-trained dictionary of the socket
+	int32_t		zDictSize;
 	int32_t		dNext;		// data buffer, the ring buffer
 	int8_t		nbHeader;	// number of header bytes that had been read
 	int8_t		needData;
 	int8_t		isDictFull;
+	int8_t		isStored;	// the current block is the plaintext stored as is
+	int8_t		codec;		// of the transmit transaction
+	int8_t		isCodecKnown;
 	int32_t		dstNext;	// the compressed source, copy-in
 	int32_t		srcDstNext;	// the source to be decoded
 	int32_t		compressedSize;
@@ -124,12 +157,34 @@ struct SDecodeState
 		if(nbHeader < (int8_t)sizeof(compressedSize))
 			return n;
 		//
-		if (compressedSize <= 0 || compressedSize > limit)
+		if (!AcceptHeader())
 			return -EFAULT;
 		//
 		needData = 1;
 		return n;
 	}
+	// Return whether the block size just read is legal
+	bool AcceptHeader()
+	{
+		isStored = (compressedSize < 0);
+		if (isStored)
+		{
+			if (compressedSize < -FSP_MAX_SEGMENT_SIZE)
+				return false;
+			compressedSize = -compressedSize;
+			return true;
+		}
+		int8_t c = int8_t(compressedSize >> FSP_BLOCK_CODEC_SHIFT);
+		compressedSize &= FSP_BLOCK_SIZE_MASK;
+		if (compressedSize == 0 || compressedSize > limit || !IS_KNOWN_CODEC(c)
+		 || (isCodecKnown && c != codec))
+		{
+			return false;
+		}
+		codec = c;
+		isCodecKnown = 1;
+		return true;
+	}
 	// return number of octets actually copied
 	int32_t CopyIn(const void *srcBuf, int32_t n)
 	{
@@ -151,37 +206,179 @@ struct SDecodeState
 		return tgtSize;
 	}
 	//
+	int32_t DecompressZstd();
 	int32_t Decompress();
 };
 #pragma pack(pop)
 
 
-// return number of output octets
-int32_t SStreamState::ForcefullyCompress()
+// Given
+//	SDeflatePolicy &	the adaptive policy of the session
+//	int32_t				number of octets of the segment in inBuf
+// Return
+//	number of output octets, header included
+// Remark
+//	The LZ4 stream is reset, for the decoder does not take the stored segment as history
+int32_t SStreamState::Store(SDeflatePolicy &policy, int32_t messageSize)
+{
+	if(hasHistory && codec == FSP_CODEC_ZSTD)
+	{
+		ZSTD_CCtx_reset(zcs, ZSTD_reset_session_only);	// the next block starts a new frame
+		hasHistory = 0;
+	}
+	else if(hasHistory)
+	{
+		LZ4_resetStream(& streamState);
+		hasHistory = 0;
+	}
+	isStored = 1;
+	outSize = -messageSize;
+	rHeader = sizeof(outSize);
+	dstNext = messageSize;
+	policy.stat.segmentsStored++;
+	policy.stat.bytesStored += messageSize;
+	policy.stat.bytesOut += messageSize + rHeader;
+	return messageSize + rHeader;
+}
+
+
+
+// Given
+//	SDeflatePolicy &	the adaptive policy of the session
+// Return
+//	number of output octets, header included; negative if error
+// Remark
+//	The segment is stored as is while the policy backs off, or if compression of it does not save anything
+int32_t SStreamState::ForcefullyCompress(SDeflatePolicy &policy)
 {
 	int	messageSize = min(rNext, FSP_MAX_SEGMENT_SIZE);
 	if(messageSize == 0)
 		return 0;
 
-	// Make the output buffer leave room for new result
-	// assert: srcDstNext == dstNext
-	if(dstNext > 0)
+	// assert: srcDstNext == dstNext, the result of the previous segment has been copied out
+	srcDstNext = dstNext = 0;
+	rNext = 0;
+	policy.stat.bytesIn += messageSize;
+	if(policy.storedToGo > 0)
 	{
-		LZ4_saveDict(& streamState, (char *)dictBuf, sizeof(dictBuf));
-		srcDstNext = dstNext = 0;
+		policy.storedToGo--;
+		return Store(policy, messageSize);
 	}
-	//
-	outSize = LZ4_compress_fast_continue(& streamState, (char *)inBuf
-			, (char *)inBuf + sizeof(inBuf)
-			, messageSize
-			, limit
-			, 1);
-	rNext = 0;
+
+	timestamp_t t0 = NowMonotonic();
+	outSize = CompressSegment(policy, messageSize);
+	policy.stat.usCompressing += NowMonotonic() - t0;
 	if(outSize <= 0)
 		return outSize;
+	hasHistory = 1;
+
+	if(policy.isProbing)
+	{
+		policy.isProbing = 0;
+		if(DEFLATE_PAYS(messageSize, outSize))
+		{
+			memset(& policy, 0, (octet *) & policy.storedToGo - (octet *) & policy);
+			policy.backOff = 0;
+			policy.Account(messageSize, outSize);
+		}
+		else
+		{
+			policy.BackOff();
+		}
+	}
+	else
+	{
+		policy.Account(messageSize, min(outSize, messageSize));
+		if(! DEFLATE_PAYS(policy.sumIn, policy.sumOut))
+			policy.BackOff();
+	}
+
+	if(outSize >= messageSize)
+		return Store(policy, messageSize);
+
+	isStored = 0;
 	rHeader = sizeof(outSize);
-	dstNext += outSize;
-	return outSize + rHeader;
+	dstNext = outSize;
+	outSize |= int32_t(codec) << FSP_BLOCK_CODEC_SHIFT;
+	policy.stat.segmentsCompressed++;
+	policy.stat.bytesOut += dstNext + rHeader;
+	return dstNext + rHeader;
+}
+
+
+
+// Given
+//	SDeflatePolicy &	the adaptive policy of the session
+//	int32_t				number of octets of the segment in inBuf
+// Return
+//	number of octets of the compression result, which follows inBuf; non-positive if error
+int32_t SStreamState::CompressSegment(SDeflatePolicy &policy, int32_t messageSize)
+{
+	if(codec == FSP_CODEC_ZSTD)
+	{
+		ZSTD_inBuffer in = { inBuf, (size_t)messageSize, 0 };
+		ZSTD_outBuffer out = { inBuf + sizeof(inBuf), (size_t)limit, 0 };
+		// the output buffer is large enough to hold everything flushed
+		size_t r = ZSTD_compressStream2(zcs, & out, & in, ZSTD_e_flush);
+		if(ZSTD_isError(r) || r != 0)
+			return -EFAULT;
+		return (int32_t)out.pos;
+	}
+
+	int n = LZ4_compress_fast_continue(& streamState, (char *)inBuf
+			, (char *)inBuf + sizeof(inBuf)
+			, messageSize
+			, limit
+			, policy.acceleration);
+	// inBuf is to be overwritten by the next segment, which may refer to this one
+	if(n > 0)
+		LZ4_saveDict(& streamState, (char *)dictBuf, sizeof(dictBuf));
+	return n;
+}
+
+
+
+// Given
+//	const void *	the pre-trained dictionary, may be NULL
+//	int32_t			size of the dictionary
+// Return
+//	Whether the zstd compression context has been created
+bool SStreamState::InitZstd(const void *dict, int32_t dictSize)
+{
+	zcs = ZSTD_createCCtx();
+	if(zcs == NULL)
+		return false;
+	if(ZSTD_isError(ZSTD_CCtx_setParameter(zcs, ZSTD_c_compressionLevel, FSP_ZSTD_LEVEL))
+	 || ZSTD_isError(ZSTD_CCtx_setParameter(zcs, ZSTD_c_windowLog, FSP_ZSTD_WINDOW_LOG))
+	 || (dict != NULL && ZSTD_isError(ZSTD_CCtx_loadDictionary_byReference(zcs, dict, dictSize))))
+	{
+		ZSTD_freeCCtx(zcs);
+		zcs = NULL;
+		return false;
+	}
+	return true;
+}
+
+
+
+// Put the result of the segment compressed in the window over which the compression ratio is measured
+void SDeflatePolicy::Account(int32_t in, int32_t out)
+{
+	sumIn += in - segmentIn[iNext];
+	sumOut += out - segmentOut[iNext];
+	segmentIn[iNext] = in;
+	segmentOut[iNext] = out;
+	iNext = (iNext + 1) % DEFLATE_RATIO_WINDOW;
+}
+
+
+
+// Store the following segments as is, and probe whether compression pays again after them
+void SDeflatePolicy::BackOff()
+{
+	storedToGo = max(backOff, DEFLATE_MIN_BACKOFF);
+	backOff = min(storedToGo * 2, DEFLATE_MAX_BACKOFF);
+	isProbing = 1;
 }
 
 
@@ -190,6 +387,33 @@ int32_t SStreamState::ForcefullyCompress()
 // return number of output octets
 int32_t SDecodeState::Decompress()
 {
+	// here the input buffer instantly follows outBuf
+	dNext -= compressedSize;
+	if(dNext < 0)
+		return -EFAULT;
+
+	int k;
+	if(isStored)
+	{
+		// the block following does not refer to any data before it
+		memcpy(outBuf, outBuf + sizeof(outBuf), compressedSize);
+		if(zds != NULL)
+			ZSTD_DCtx_reset(zds, ZSTD_reset_session_only);
+		LZ4_setStreamDecode(& decodeState, NULL, 0);
+		srcDstNext = dstNext = 0;
+		isDictFull = 0;
+		k = compressedSize;
+		goto l_next;
+	}
+	if(codec == FSP_CODEC_ZSTD)
+	{
+		srcDstNext = dstNext = 0;
+		k = DecompressZstd();
+		if(k <= 0)
+			return k;
+		goto l_next;
+	}
+
 	if(dstNext > LZ4_DICTIONARY_SIZE)
 	{
 		memcpy(dictBuf, outBuf + dstNext - LZ4_DICTIONARY_SIZE, LZ4_DICTIONARY_SIZE); 
@@ -204,11 +428,7 @@ int32_t SDecodeState::Decompress()
 		LZ4_setStreamDecode(& decodeState, (char *)dictBuf, LZ4_DICTIONARY_SIZE);
 	}
 
-	// here the input buffer instantly follows outBuf
-	dNext -= compressedSize;
-	if(dNext < 0)
-		return -EFAULT;
-	int k = LZ4_decompress_safe_continue(& decodeState
+	k = LZ4_decompress_safe_continue(& decodeState
 		, (char *) & outBuf + sizeof(outBuf)
 		, (char *) & outBuf + dstNext
 		, compressedSize
@@ -216,8 +436,10 @@ int32_t SDecodeState::Decompress()
 	if(k <= 0)
 		return k;
 	//
+l_next:
 	octet *pNext = outBuf + sizeof(outBuf) + compressedSize;
 	// needData = 0;
+	nbHeader = 0;	// the next block may start exactly at the next packet
 	if(0 < dNext && dNext < (int32_t)sizeof(compressedSize))
 	{
 		memcpy(& compressedSize, pNext, nbHeader = dNext);
@@ -226,6 +448,8 @@ int32_t SDecodeState::Decompress()
 	else if(0 < dNext)
 	{
 		memcpy(& compressedSize, pNext, nbHeader = sizeof(compressedSize));
+		if(! AcceptHeader())
+			return -EFAULT;
 		dNext -= sizeof(compressedSize);
 		needData = 1;
 		memmove(outBuf + sizeof(outBuf), pNext + sizeof(compressedSize), dNext);
@@ -237,6 +461,38 @@ int32_t SDecodeState::Decompress()
 
 
 
+// assert: srcDstNext == dstNext == 0
+// return number of output octets, negative if error
+int32_t SDecodeState::DecompressZstd()
+{
+	if(zds == NULL)
+	{
+		zds = ZSTD_createDCtx();
+		if(zds == NULL)
+			return -ENOMEM;
+		// A frame that declares a window larger than the encoder may use is taken as corrupt
+		if(ZSTD_isError(ZSTD_DCtx_setParameter(zds, ZSTD_d_windowLogMax, FSP_ZSTD_WINDOW_LOG)))
+			return -EFAULT;
+		if(zDict != NULL && ZSTD_isError(ZSTD_DCtx_loadDictionary_byReference(zds, zDict, zDictSize)))
+			return -EFAULT;
+	}
+
+	ZSTD_inBuffer in = { outBuf + sizeof(outBuf), (size_t)compressedSize, 0 };
+	ZSTD_outBuffer out = { outBuf, sizeof(outBuf), 0 };
+	do
+	{
+		size_t r = ZSTD_decompressStream(zds, & out, & in);
+		if(ZSTD_isError(r))
+			return -EFAULT;
+	} while(in.pos < in.size && out.pos < out.size);
+	// a block is the flushed compression result of exactly one segment
+	if(in.pos < in.size || out.pos == 0)
+		return -EFAULT;
+	return (int32_t)out.pos;
+}
+
+
+
 // Return
 //	true if the internal streaming buffer for on-the-wire compression has been prepared
 //	false if no memory
@@ -247,19 +503,38 @@ bool CSocketItemDl::AllocStreamState()
 	if(pStreamState != NULL)
 		return true;
 
-	int n = LZ4_compressBound(FSP_MAX_SEGMENT_SIZE);
+	int n = FSP_COMPRESS_BOUND;
 	pStreamState = (SStreamState *)malloc(sizeof(SStreamState) + sizeof(uint32_t) + n);
 	if(pStreamState == NULL)
 		return false;
 	//
 	pStreamState->limit = n;
-	memset(& pStreamState->rNext, 0, (octet *) & pStreamState->limit - (octet *) & pStreamState->rNext);
+	memset(& pStreamState->zcs, 0, (octet *) & pStreamState->limit - (octet *) & pStreamState->zcs);
+	pStreamState->codec = (int8_t)context.codec;
+	if(context.codec == FSP_CODEC_ZSTD && !pStreamState->InitZstd(codecDictionary, codecDictionarySize))
+	{
+		free(pStreamState);
+		pStreamState = NULL;
+		return false;
+	}
 	LZ4_resetStream(& pStreamState->streamState);
 	return true;
 }
 
 
 
+void CSocketItemDl::FreeStreamState()
+{
+	if (pStreamState == NULL)
+		return;
+	if (pStreamState->zcs != NULL)
+		ZSTD_freeCCtx(pStreamState->zcs);
+	free(pStreamState);
+	pStreamState = NULL;
+}
+
+
+
 // Return
 //	true if the internal decoding buffer for on-the-wire decompression has been prepared
 //	false if no memory
@@ -270,19 +545,44 @@ bool CSocketItemDl::AllocDecodeState()
 	if(pDecodeState != NULL)
 		return true;
 
-	int n = LZ4_compressBound(FSP_MAX_SEGMENT_SIZE);
+	int n = FSP_COMPRESS_BOUND;
 	pDecodeState = (SDecodeState *)malloc(sizeof(SDecodeState) + n);
 	if(pDecodeState == NULL)
 		return false;
 
-	memset(& pDecodeState->dNext, 0, (octet *) & pDecodeState->limit - (octet *) & pDecodeState->dNext);
+	memset(& pDecodeState->zds, 0, (octet *) & pDecodeState->limit - (octet *) & pDecodeState->zds);
 	LZ4_setStreamDecode(& pDecodeState->decodeState, NULL, 0);
+	pDecodeState->zDict = codecDictionary;
+	pDecodeState->zDictSize = codecDictionarySize;
 	pDecodeState->limit = n;
 	return true;
 }
 
 
 
+void CSocketItemDl::FreeDecodeState()
+{
+	if (pDecodeState == NULL)
+		return;
+	if (pDecodeState->zds != NULL)
+		ZSTD_freeDCtx(pDecodeState->zds);
+	free(pDecodeState);
+	pDecodeState = NULL;
+}
+
+
+
+// The fuller the send queue, the more the network rather than the processor is the bottleneck
+// and the harder it is worth compressing
+void CSocketItemDl::SetDeflateAcceleration()
+{
+	int32_t n = pControlBlock->CountSendBuffered();
+	int32_t q = min(3, n * 4 / max(pControlBlock->sendBufferBlockN, 1));
+	deflatePolicy.acceleration = max(DEFLATE_MAX_ACCELERATION >> q, 1);
+}
+
+
+
 // Given
 //	void *			Target buffer
 //	int &			[_InOut_] In: the capacity of the target buffer, Out: number of bytes occupied
@@ -316,7 +616,7 @@ int	CSocketItemDl::Compress(void *pOut, int &tgtSize, const void *pIn, int srcLe
 	// The last segment of the transaction, or the one has been fulfilled should be compressed
 	if(srcLen == 0 || pCtx->rNext >= FSP_MAX_SEGMENT_SIZE)
 	{
-		pendingStreamingSize = pCtx->ForcefullyCompress();
+		pendingStreamingSize = pCtx->ForcefullyCompress(deflatePolicy);
 		if(pendingStreamingSize <= 0)
 		{
 			tgtSize = 0;
@@ -358,6 +658,17 @@ int	CSocketItemDl::Decompress(void *pOut, int &tgtSize, const void *pIn, int src
 		return 0;	// the uncompressed data is not consumed.
 	}
 
+	// A short block might have been buffered wholly along with the previous one
+	if (pCtx->needData && pCtx->dNext >= pCtx->compressedSize)
+	{
+		pCtx->needData = 0;
+		int k = pCtx->Decompress();
+		if(k < 0)
+			return k;
+		tgtSize = (tgtSize > 0 ? pCtx->CopyOut(pOut, tgtSize) : 0);
+		return 0;
+	}
+
 	if(srcLen <= 0)
 	{
 		tgtSize = 0;
@@ -425,10 +736,7 @@ bool CSocketItemDl::FlushDecodeBuffer()
 	peerCommitted |= peerCommitPending;
 	peerCommitPending = 0;
 	if(peerCommitted)
-	{
-		free(pDecodeState);
-		pDecodeState = NULL;
-	}
+		FreeDecodeState();
 	return true;
 }
 
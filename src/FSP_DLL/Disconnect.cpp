@@ -65,18 +65,15 @@ int  CSocketItemDl::Dispose()
 {
 	toCancel = 1;
 	//^So that WaitUseMutex of other thread could be interrupted
+	lockWaiters.UnparkAll();
 
-	timestamp_t t0 = NowUTC();
-	while (!TryMutexLock())
-	{
-		if (int64_t(NowUTC() - t0 - MAX_LOCK_WAIT_ms * 1000) > 0)
-			return -EDEADLK;
-		Sleep(TIMER_SLICE_ms);
-	}
+	if (!WaitMutexLock(MAX_LOCK_WAIT_ms, false))
+		return -EDEADLK;
 
 	if (pControlBlock == NULL)
 	{
 		lockOwner = 0;
+		lockWaiters.Unpark();
 		return 0;
 	}
 
@@ -98,7 +95,8 @@ void CSocketItemDl::Free()
 {
 	RecycleSimply();
 	CSocketItem::Destroy();
-	bzero((octet*)this + sizeof(CSocketItem), sizeof(CSocketItemDl) - sizeof(CSocketItem));
+	bzero(&context, sizeof(CSocketItemDl) - ((octet *)&context - (octet *)this));
+	lockWaiters.UnparkAll();
 }
 
 
@@ -52,6 +52,7 @@
 
 #ifndef __MINGW32__
 #pragma comment(lib, "Ws2_32.lib")
+#pragma comment(lib, "Synchronization.lib")	// WaitOnAddress
 #endif
 
 static DWORD		idThisProcess;	// the id of the process that attaches this DLL
@@ -198,6 +199,20 @@ timestamp_t NowUTC()
 
 
 
+// Return the number of microseconds elapsed since some fixed point of time, by the performance counter
+timestamp_t NowMonotonic()
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER t;
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&t);
+	return timestamp_t(t.QuadPart / frequency.QuadPart) * 1000000
+		+ timestamp_t(t.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+
+
 
 // Do
 //	Initialize the IPC structure to call LLS
@@ -246,7 +261,7 @@ void CSocketItemDl::CopyFatMemPointo(CommandNewSession& cmd)
 bool CSocketItemDl::StartPolling()
 {
 	timeOut_ns = TRANSIENT_STATE_TIMEOUT_ms * 1000000ULL;
-	timeLastTriggered = NowUTC();
+	timeLastTriggered = NowMonotonic();
 
 	if (!socketsTLB.InitThread())
 		return false;
@@ -352,6 +367,34 @@ bool CSlimThreadPool::NewThreadFor(CSlimThreadPoolItem* newItem)
 
 
 
+// Given
+//	int32_t		the value of the wake ticket read before the worker announced that it is idle
+// Do
+//	Wait until the wake ticket is changed
+void CSlimThreadPool::ParkWorker(int32_t ticket)
+{
+	WaitOnAddress(&wakeTicket, &ticket, sizeof(ticket), INFINITE);
+}
+
+
+
+void CSlimThreadPool::WakeOneWorker()
+{
+	_InterlockedIncrement(&wakeTicket);
+	WakeByAddressSingle((PVOID)&wakeTicket);
+}
+
+
+
+int CSlimThreadPool::CountProcessors()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+}
+
+
+
 // LLS MUST RunAs NT AUTHORITY\NETWORK SERVICE account 
 static void AllowDuplicateHandle()
 {
@@ -66,6 +66,12 @@ uint32_t * FSPAPI TranslateFSPoverIPv4(PFSP_IN6_ADDR p, uint32_t dwIPv4, uint32_
 DllSpec
 FSPHANDLE FSPAPI ListenAt(const PFSP_IN6_ADDR listenOn, PFSP_Context psp1)
 { 
+	if (!IS_KNOWN_CODEC(psp1->codec))
+	{
+		psp1->flags = -EDOM;
+		return NULL;
+	}
+
 	psp1->passive = 1;	// override what is provided by ULA
 	CSocketItemDl *socketItem = CSocketItemDl::CreateControlBlock(listenOn, psp1);
 	if(socketItem == NULL)
@@ -132,6 +138,11 @@ FSPHANDLE FSPAPI Connect2(const char *peerName, PFSP_Context psp1)
 		psp1->flags = -ENOMEM;
 		return NULL;
 	}
+	if (!IS_KNOWN_CODEC(psp1->codec))
+	{
+		psp1->flags = -EDOM;
+		return NULL;
+	}
 
 	IN6_ADDR addrAny = IN6ADDR_ANY_INIT;
 	psp1->passive = 0;		// override what is provided by ULA
@@ -253,6 +264,11 @@ void CSocketItemDl::SetConnectContext(const PFSP_Context psp1)
 
 	// could be exploited by ULA to make services distinguishable
 	memcpy(&context, psp1, sizeof(FSP_SocketParameter));
+	// The socket item might be recycled; the compression policy is learnt afresh
+	// and the dictionary of the previous owner must not be referred to
+	memset(&deflatePolicy, 0, sizeof(deflatePolicy));
+	codecDictionary = NULL;
+	codecDictionarySize = 0;
 	pendingSendBuf = (octet*)psp1->welcome;
 	pendingSendSize = psp1->len;
 }
@@ -279,6 +295,7 @@ CSocketItemDl * LOCALAPI CSocketItemDl::CreateControlBlock(const PFSP_IN6_ADDR n
 		return NULL;
 	}
 	socketItem->SetConnectContext(psp1);
+	socketItem->pControlBlock->noticeIndex = socketItem->ordinal;
 	socketItem->fidPair.source = nearAddr->idALF;
 	//
 	FSP_ADDRINFO_EX & nearEnd = socketItem->pControlBlock->nearEndInfo;
@@ -668,7 +685,8 @@ CSocketItemDl * CSocketDLLTLB::AllocItem()
 		item = new CSocketItemDl();
 		if (item == NULL)
 			goto l_bailout;	// return NULL;
-		countAllItems++;
+		item->ordinal = countAllItems;
+		itemsByOrdinal[countAllItems++] = item;
 	}
 	else
 	{
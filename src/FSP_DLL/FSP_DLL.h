@@ -61,16 +61,40 @@ typedef CSocketItem * PSocketItem;
 
 #define MAX_WORKING_THREADS (MAX_CONNECTION_NUM*2)
 
+// Return the number of microseconds elapsed since some fixed point of time, which never jumps. For the time-outs
+timestamp_t NowMonotonic();
+
+#if defined(__linux__) && MAX_CONNECTION_NUM > ULA_NOTICE_BITS
+# error Each socket of the ULA process should have a bit in the notice bitmap
+#endif
+
 struct CSocketItemDl;
 
 
-// 'Slim' in the sense that there is no job queue
-struct CSlimThreadPoolItem
+#ifndef _NO_LLS_CALLABLE
+# define SLIM_THREAD_POOL_SIZE	16	// maximum number of workers; the actual limit is the number of processors
+#else
+# define SLIM_THREAD_POOL_SIZE	2
+#endif
+#define SLIM_WORK_KINDS			8	// number of distinct callback functions that may be scheduled
+#define SLIM_WORK_RUNNING		0x80000000	// in CSocketItemDl::pendingWork, some worker owns the socket
+
+struct CSlimThreadPool;
+
+// 'Slim' in the sense that the job queue holds sockets, not jobs; the jobs pending are marked in the socket.
+// Each worker has its own queue, which is a LIFO stack to the owner and a FIFO queue to the thieves
+struct CSlimThreadPoolItem: CSRWLock
 {
-	void (CSocketItemDl::* fpWork)();	// the function to do the real job
+	CSlimThreadPool	* pool;
 	pthread_t		hThread;
-	CSocketItemDl * contextWorkingOn;	// NULL if the thread is idle
+	int32_t			head;
+	int32_t			tail;
+	CSocketItemDl *	q[MAX_CONNECTION_NUM];	// a socket is queued at most once at any time
 	//
+	CSlimThreadPoolItem() { InitMutex(); }
+	void			Push(CSocketItemDl *);
+	CSocketItemDl *	Pop();
+	CSocketItemDl *	Steal();
 	void			LoopWaitJob();
 };
 
@@ -78,14 +102,27 @@ struct CSlimThreadPoolItem
 
 struct CSlimThreadPool
 {
-#ifndef _NO_LLS_CALLABLE
-# define SLIM_THREAD_POOL_SIZE (MAX_CONNECTION_NUM * 2)
-#else
-# define SLIM_THREAD_POOL_SIZE 2
-#endif
 	CSlimThreadPoolItem items[SLIM_THREAD_POOL_SIZE];
+	// Table of the callback functions, each is mapped to a bit of CSocketItemDl::pendingWork
+	void (CSocketItemDl::* works[SLIM_WORK_KINDS])();
+	volatile int32_t	countWorks;
+	volatile int32_t	countWorkers;
+	int32_t				limitWorkers;
+	volatile uint32_t	nextQueue;		// round-robin among the queues for the job submitted by a non-worker
+	volatile int32_t	countIdle;		// number of workers parked or going to park
+	volatile int32_t	wakeTicket;		// the futex word that parked workers wait on
+	CLightMutex			mutex;			// for registering callback function and starting worker
 	//
+	int  IndexOfWork(void (CSocketItemDl::*)());
+	bool StartWorker();
+	void RunPendingWork(CSocketItemDl *);
+	CSocketItemDl * FindWork(CSlimThreadPoolItem *);
+	void WaitForWork(CSlimThreadPoolItem *);
+	// Implemented in OS-dependent way
 	bool NewThreadFor(CSlimThreadPoolItem *);
+	void ParkWorker(int32_t);
+	void WakeOneWorker();
+	static int CountProcessors();
 #if defined(__WINDOWS__)
 	static DWORD WINAPI ThreadWorkBody(LPVOID param)
 	{
@@ -113,11 +150,26 @@ class CSocketDLLTLB: CSRWLock, public CSlimThreadPool
 	CSocketItemDl * pSockets[MAX_CONNECTION_NUM];
 	CSocketItemDl * head;
 	CSocketItemDl * tail;
+	// Items are never deleted, and each is indexed by its ordinal number of creation
+	CSocketItemDl * itemsByOrdinal[MAX_CONNECTION_NUM];
 
 	CSocketItemDl * headOfInUse;
 	pthread_t		hThreadWait;
 	void			WaitEventToDispatch();
 	void	Init();
+#ifdef __linux__
+	// Commands are put into the shared ring instead of being sent over the pipe if it is set up
+	SCommandRing	*pRing;
+	int				fdDoorbell;
+	int				fdNoticeBell;
+	CLightMutex		ringMutex;
+	// Sockets whose notices are to be retried because they could not be locked
+	uint64_t		noticeDeferred[ULA_NOTICE_BITS / 64];
+	bool	hasNoticeDeferred;
+	void	InitCommandRing();
+	int		PutToRing(const void*, int);
+	void	DispatchNotices();
+#endif
 
 #if defined(__WINDOWS__)
 	static DWORD WINAPI WaitNoticeCallBack(LPVOID param)
@@ -148,6 +200,11 @@ public:
 
 	~CSocketDLLTLB();
 
+#ifdef __linux__
+	// Whether notices in the control blocks are dispatched on the notice doorbell instead of being polled
+	bool	IsEventDriven() const { return pRing != NULL; }
+#endif
+
 	// Send message to the pairing socket TLB in LLS
 	int		SendToPipe(const void*, int n = sizeof(UCommandToLLS));
 	bool	GetNoticeFromPipe(SNotification *);
@@ -162,18 +219,54 @@ public:
 struct SStreamState;
 struct SDecodeState;
 
+#define DEFLATE_RATIO_WINDOW	4	// number of the recent segments over which the compression ratio is measured
+#define DEFLATE_MIN_BACKOFF		4	// number of segments stored as is before compression is probed again
+#define DEFLATE_MAX_BACKOFF		64	// the back-off doubles each time the probe fails, up to this limit
+#define DEFLATE_MAX_ACCELERATION 8	// the LZ4 acceleration factor when the send queue is empty
+
+// The codec field of FSP_SocketParameter is wider than the set of codecs the peer may decode
+#define IS_KNOWN_CODEC(c)	((c) == FSP_CODEC_LZ4 || (c) == FSP_CODEC_ZSTD)
+
+// The adaptive policy of on-the-wire compression. Unlike SStreamState it survives transmit transactions
+struct SDeflatePolicy
+{
+	int32_t		segmentIn[DEFLATE_RATIO_WINDOW];	// plaintext octets of the recent segments compressed
+	int32_t		segmentOut[DEFLATE_RATIO_WINDOW];	// octets put on the wire for them
+	int32_t		sumIn;
+	int32_t		sumOut;
+	int32_t		iNext;			// the slot of the window to be replaced next
+	int32_t		storedToGo;		// number of segments yet to be stored as is before the probe
+	int32_t		backOff;		// number of segments to be stored as is if the probe fails
+	int32_t		acceleration;	// selected by the pressure of the send queue
+	char		isProbing;		// the next segment compressed is a probe
+	FSP_CompressionStatistics	stat;
+
+	void Account(int32_t, int32_t);
+	void BackOff();
+};
+
 
 // Data Layout for socket item in the library, had better dynamically linked
 struct CSocketItemDl : CSocketItem
 {
 	static CSocketDLLTLB	socketsTLB;
 
+	// Fields before 'context' are kept on recycling. See also SetMutexFree
+	int32_t			ordinal;
+	// Bits of the callback functions scheduled, see also CSlimThreadPool
+	volatile uint32_t	pendingWork;
+	// Contenders of the lock sleep here, which survives recycling of the socket
+	CLockWaitQueue	lockWaiters;
+
 	// for sake of incarnating new accepted connection
 	FSP_SocketParameter context;
 
 	// optional on-the-wire compression/decompression
 	SStreamState	* pStreamState;
 	SDecodeState	* pDecodeState;
+	SDeflatePolicy	deflatePolicy;
+	const void *	codecDictionary;	// pre-trained, owned by ULA
+	int32_t			codecDictionarySize;
 
 	// for sake of buffered, streamed I/O
 	ControlBlock::PFSP_SocketBuf skbImcompleteToSend;
@@ -255,10 +348,14 @@ struct CSocketItemDl : CSocketItem
 	}
 #endif
 
+#ifdef __linux__
+	void CancelTimeout();
+#else
 	void CancelTimeout() { timeOut_ns = INT64_MAX; }
-	bool IsTimedOut() { return ((int64_t(timeOut_ns - (NowUTC() - timeLastTriggered) * 1000)) < 0); }
+#endif
+	bool IsTimedOut() { return ((int64_t(timeOut_ns - (NowMonotonic() - timeLastTriggered) * 1000)) < 0); }
 	bool StartPolling();
-	void DoPolling();
+	bool DoPolling();
 
 	void ProcessNoticeLocked(FSP_NoticeCode);
 
@@ -294,12 +391,14 @@ struct CSocketItemDl : CSocketItem
 	// In Deflate.cpp
 	bool AllocStreamState();
 	bool AllocDecodeState();
+	void SetDeflateAcceleration();
 	int	 Compress(void *, int &, const void *, int);
 	int	 Decompress(void *, int &, const void *, int);
 	bool HasInternalBufferedToSend();
 	bool HasDataToCommit() { return (pendingSendSize > 0 || HasInternalBufferedToSend()); }
 	bool FlushDecodeBuffer();
-	void FreeStreamState() { if (pStreamState != NULL) { free(pStreamState); pStreamState = NULL; } }
+	void FreeStreamState();
+	void FreeDecodeState();
 	bool HasInternalBufferedToDeliver();
 	bool HasDataToDeliver() { return (pControlBlock->CountDeliverable() > 0 || HasInternalBufferedToDeliver()); }
 
@@ -374,6 +473,7 @@ public:
 	bool WaitUseMutex();
 	void SetMutexFree();
 	bool TryMutexLock();
+	bool WaitMutexLock(uint64_t, bool);
 	int  TailFreeMutexAndReturn(int);
 	bool IsInUse() { return (_InterlockedOr8(&inUse, 0) != 0) && (pControlBlock != NULL); }
 
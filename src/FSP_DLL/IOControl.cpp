@@ -95,6 +95,26 @@ int FSPAPI FSPControl(FSPHANDLE hFSPSocket, FSP_ControlCode controlCode, ULONG_P
 		case FSP_GET_PEER_COMMITTED:
 			*((int *)value) = pSocket->HasPeerCommitted() ? 1 : 0;
 			break;
+		case FSP_GET_COMPRESSION_STATISTICS:
+			*(FSP_CompressionStatistics *)value = pSocket->deflatePolicy.stat;
+			break;
+		case FSP_SET_COMPRESSION_CODEC:
+			if (!IS_KNOWN_CODEC((uint64_t)value))
+				return -EDOM;
+			pSocket->context.codec = (unsigned)(uint64_t)value;
+			break;
+		case FSP_SET_COMPRESSION_DICTIONARY:
+			if (value == 0)
+			{
+				pSocket->codecDictionary = NULL;
+				pSocket->codecDictionarySize = 0;
+				break;
+			}
+			if (((const FSP_CompressionDictionary *)value)->len < 0)
+				return -EDOM;
+			pSocket->codecDictionary = ((const FSP_CompressionDictionary *)value)->buf;
+			pSocket->codecDictionarySize = ((const FSP_CompressionDictionary *)value)->len;
+			break;
 		default:
 			return -EINVAL;
 		}
@@ -235,6 +255,7 @@ int CSocketItemDl::GetProfilingCounts(PSocketProfile pSnap)
 	//
 	int r = (int)sizeof(pControlBlock->perfCounts);
 	memcpy(pSnap, & pControlBlock->perfCounts, r);
+	pSnap->lockULA = lockWaiters.stat;
 	SetMutexFree();
 	return r;
 }
@@ -265,19 +286,69 @@ bool CSocketItemDl::TryMutexLock()
 //	if there is some thread that has exclusive access on the lock, wait patiently
 bool CSocketItemDl::WaitUseMutex()
 {
+	return WaitMutexLock(SESSION_IDLE_TIMEOUT_us / 1000, true) && IsInUse();
+}
+
+
+
+// Given
+//	uint64_t	the maximum time to wait, in milliseconds
+//	bool		whether to give up when the socket is to be cancelled or is no longer in use
+// Return
+//	true if obtained the mutual-exclusive lock
+//	false if timed out or gave up
+// Remark
+//	Spin for a while, then sleep until the lock holder passes the baton in SetMutexFree
+bool CSocketItemDl::WaitMutexLock(uint64_t timeout_ms, bool cancellable)
+{
+	if (TryMutexLock())
+	{
+		lockWaiters.OnAcquired();
+		return true;
+	}
+
 	uint64_t t0 = GetTickCount64();
-	while(!TryMutexLock())
+	int nSpin = lockWaiters.SpinLimit();
+	register int i = 0;
+	bool parked = false;
+	for (;;)
 	{
-		// possible dead lock: should trace the error in debug mode!
-		if(GetTickCount64() - t0 > SESSION_IDLE_TIMEOUT_us/1000)
-			return false;
-		if(toCancel || !IsInUse())
+		if (cancellable && (toCancel || !IsInUse()))
+		{
+			lockWaiters.Unpark();	// let the next contender give up as well
 			return false;
+		}
+
+		bool lockedHere;
+		if (i < nSpin)
+		{
+			YieldProcessor();
+			i++;
+			lockedHere = TryMutexLock();
+		}
+		else
+		{
+			// possible dead lock: should trace the error in debug mode!
+			uint64_t t = GetTickCount64() - t0;
+			if (t > timeout_ms)
+			{
+				lockWaiters.OnTimedOut();
+				return false;
+			}
+			uint32_t seen = lockWaiters.PrepareToPark();
+			lockedHere = TryMutexLock();
+			if (!lockedHere)
+				lockWaiters.Park(seen, (uint32_t)min(timeout_ms - t, UINT32_MAX));
+			lockWaiters.LeavePark();
+			parked = true;
+		}
 		//
-		Sleep(TIMER_SLICE_ms);
+		if (lockedHere)
+		{
+			lockWaiters.OnAcquired(i, parked);
+			return true;
+		}
 	}
-	//
-	return IsInUse();
 }
 
 
@@ -294,11 +365,13 @@ void CSocketItemDl::SetMutexFree()
 			Call<FSP_Reset>();
 		CSocketItem::Destroy();
 		// 'bzero' covers toReleaseMemory and locked
-		bzero((octet*)this + sizeof(CSocketItem), sizeof(CSocketItemDl) - sizeof(CSocketItem));
+		bzero(&context, sizeof(CSocketItemDl) - ((octet *)&context - (octet *)this));
+		lockWaiters.UnparkAll();
 	}
 	else
 	{
 		lockOwner = 0;
+		lockWaiters.Unpark();
 	}
 }
 
@@ -325,6 +398,10 @@ int  CSocketItemDl::TailFreeMutexAndReturn(int r)
 		ArrangeCallbackOnSent();
 	}
 
+	// LLS would not send the buffered data until the heartbeat of the idle session fired
+	if (pControlBlock->CountSendBuffered() > 0 && _InterlockedExchange8(&pControlBlock->heartbeatParked, 0) != 0)
+		Call<FSP_Start>();
+
 	SetMutexFree();
 	//
 	return r;
@@ -452,8 +529,12 @@ void CSocketItemDl::ProcessNoticeLocked(FSP_NoticeCode notice)
 
 
 
-// The function called back as the polling timer fires each round
-void CSocketItemDl::DoPolling()
+// The function called back as the polling timer fires each round,
+// or called by the notice dispatcher when the notice doorbell rang
+// Return
+//	false if the mutex lock was not gained so that it should be retried
+//	true if otherwise
+bool CSocketItemDl::DoPolling()
 {
 	bool b = TryMutexLock();
 	if (IsTimedOut())
@@ -462,23 +543,23 @@ void CSocketItemDl::DoPolling()
 		if (!b)
 		{
 			toCancel = 1;
-			return;		// And try to gain the mutex at the next round unless the socket is recycled
+			return false;	// And try to gain the mutex at the next round unless the socket is recycled
 		}
 
 		NotifyError(commandLastIssued, -ETIMEDOUT);
 		SetMutexFree();
-		return;
+		return true;
 	}
 
 	// Try to gain the mutex lock in the next round
 	if (!b)
-		return;
+		return false;
 
 	if (!IsInUse())
 	{
 		if (b)
 			SetMutexFree();
-		return;
+		return true;
 	}
 
 	// Only after it has been successfully locked may the state be tested
@@ -488,7 +569,7 @@ void CSocketItemDl::DoPolling()
 	{
 		NotifyError(commandLastIssued, -EBADF);
 		SetMutexFree();
-		return;
+		return true;
 	}
 
 	FSP_NoticeCode notice = (FSP_NoticeCode)_InterlockedExchange8((char *)&pControlBlock->singletonotice, NullNotice);
@@ -502,6 +583,7 @@ void CSocketItemDl::DoPolling()
 		ArrangeCallbackOnSent();
 
 	SetMutexFree();
+	return true;
 }
 
 
@@ -40,6 +40,10 @@
 
 # ifdef __linux__
 #  include <linux/un.h>
+#  include <linux/futex.h>
+#  include <poll.h>
+#  include <sys/eventfd.h>
+#  include <sys/syscall.h>
 # else
 #  include <sys/un.h>
 # endif
@@ -65,7 +69,171 @@ void CSocketDLLTLB::Init()
 		perror("Cannot connect with LLS");
 		exit(-2);
 	}
+#ifdef __linux__
+	InitCommandRing();
+#endif
+}
+
+
+
+#ifdef __linux__
+// Do
+//	Create the command ring in a shared memory object together with the command doorbell
+//	and the notice doorbell, both eventfd, and pass the file descriptors to LLS over the pipe,
+//	attached to a NullCommand
+// Remark
+//	If it failed, commands are sent over the pipe and notices are polled as usual
+void CSocketDLLTLB::InitCommandRing()
+{
+	char name[MAX_NAME_LENGTH];
+	snprintf(name, sizeof(name), SHARE_MEMORY_PREFIX "Ring%d", (int)getpid());
+	int hShm = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (hShm < 0)
+	{
+		perror("Cannot create the shared memory of the command ring");
+		return;
+	}
+	// The object is accessed by the file descriptor passed to LLS only
+	shm_unlink(name);
+
+	fdDoorbell = eventfd(0, EFD_CLOEXEC);
+	fdNoticeBell = eventfd(0, EFD_CLOEXEC);
+	if (fdDoorbell < 0 || fdNoticeBell < 0)
+	{
+		perror("Cannot create the doorbells of the command ring");
+		close(hShm);
+		if (fdDoorbell >= 0)
+			CLOSE_PIPE(fdDoorbell);
+		if (fdNoticeBell >= 0)
+			CLOSE_PIPE(fdNoticeBell);
+		return;
+	}
+
+	SCommandRing *p = NULL;
+	if (ftruncate(hShm, sizeof(SCommandRing)) < 0
+	 || (p = (SCommandRing *)mmap(NULL, sizeof(SCommandRing), PROT_READ | PROT_WRITE, MAP_SHARED, hShm, 0)) == MAP_FAILED)
+	{
+		perror("Cannot map the shared memory of the command ring");
+		close(hShm);
+		CLOSE_PIPE(fdDoorbell);
+		CLOSE_PIPE(fdNoticeBell);
+		return;
+	}
+
+	SCommandToLLS cmd;
+	cmd.opCode = NullCommand;
+	cmd.fiberID = 0;
+	struct iovec iov = { &cmd, sizeof(cmd) };
+	union
+	{
+		struct cmsghdr	h;
+		char			buf[CMSG_SPACE(sizeof(int) * 3)];
+	} u;
+	struct msghdr msg;
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+	struct cmsghdr *pHdr = CMSG_FIRSTHDR(&msg);
+	pHdr->cmsg_level = SOL_SOCKET;
+	pHdr->cmsg_type = SCM_RIGHTS;
+	pHdr->cmsg_len = CMSG_LEN(sizeof(int) * 3);
+	((int *)CMSG_DATA(pHdr))[0] = hShm;
+	((int *)CMSG_DATA(pHdr))[1] = fdDoorbell;
+	((int *)CMSG_DATA(pHdr))[2] = fdNoticeBell;
+
+	int r = sendmsg(sdPipe, &msg, 0);
+	close(hShm);
+	if (r != sizeof(cmd))
+	{
+		perror("Cannot pass the command ring to LLS");
+		munmap(p, sizeof(SCommandRing));
+		CLOSE_PIPE(fdDoorbell);
+		CLOSE_PIPE(fdNoticeBell);
+		return;
+	}
+
+	pRing = p;
+}
+
+
+
+// Do
+//	Call DoPolling of each socket whose bit is set in the notice bitmap, or whose notice was deferred
+// Remark
+//	'noticeRaised' is cleared at first, so that any notice raised during the scan rings the doorbell again
+//	A socket whose polling timer is not started yet is deferred as well. See also StartPolling
+void CSocketDLLTLB::DispatchNotices()
+{
+	SCommandRing *pShared = pRing;
+	if (pShared == NULL)
+		return;
+
+	_InterlockedExchange(&pShared->noticeRaised, 0);
+	hasNoticeDeferred = false;
+	for (register int i = 0; i < ULA_NOTICE_BITS / 64; i++)
+	{
+		uint64_t w = _InterlockedExchange(&pShared->noticeBits[i], 0) | noticeDeferred[i];
+		noticeDeferred[i] = 0;
+		while (w != 0)
+		{
+			int k = __builtin_ctzll(w);
+			w &= w - 1;
+			CSocketItemDl *p = itemsByOrdinal[i * 64 + k];
+			if (p == NULL || !p->IsInUse())
+				continue;
+			if (p->timer == 0 || !p->DoPolling())
+			{
+				noticeDeferred[i] |= (uint64_t)1 << k;
+				hasNoticeDeferred = true;
+			}
+		}
+	}
+}
+
+
+
+// Given
+//	const void *	the command to put into the ring
+//	int				the size of the command
+// Return
+//	the size of the command if it has been put into the ring
+//	negative if LLS had gone before the ring has room for the command
+// Remark
+//	The ring is drained by LLS concurrently; ring the doorbell only if LLS is waiting on it
+int CSocketDLLTLB::PutToRing(const void *pMsg, int n)
+{
+	if (!ringMutex.WaitSetMutex())
+		return -EDEADLK;
+
+	uint32_t t = pRing->tail;
+	while (t - LCKREAD(pRing->head) >= ULA_COMMAND_RING_SIZE)
+	{
+		uint64_t v = 1;
+		struct pollfd fdWatch = { sdPipe, 0, 0 };
+		if (write(fdDoorbell, &v, sizeof(v)) < 0 || poll(&fdWatch, 1, TIMER_SLICE_ms) != 0)
+		{
+			ringMutex.SetMutexFree();
+			return -EPIPE;	// the pipe is hung up or in error
+		}
+	}
+
+	UCommandToLLS & slot = pRing->slots[t & (ULA_COMMAND_RING_SIZE - 1)];
+	memcpy(&slot, pMsg, min(n, (int)sizeof(UCommandToLLS)));
+	// Publish the slot before checking whether the consumer is asleep, which is a full barrier
+	_InterlockedExchange(&pRing->tail, t + 1);
+	if (LCKREAD(pRing->sleeping))
+	{
+		uint64_t v = 1;
+		if (write(fdDoorbell, &v, sizeof(v)) < 0)
+			perror("Cannot ring the doorbell of the command ring");
+	}
+
+	ringMutex.SetMutexFree();
+	return n;
 }
+#endif
 
 
 inline
@@ -99,6 +267,15 @@ CSocketDLLTLB::~CSocketDLLTLB()
 		shutdown(sd, SHUT_RDWR);
 		close(sd);
 	}
+#ifdef __linux__
+	SCommandRing *p = (SCommandRing *)_InterlockedExchangePointer(&pRing, (SCommandRing *)NULL);
+	if (p != NULL)
+	{
+		munmap(p, sizeof(SCommandRing));
+		CLOSE_PIPE(fdDoorbell);
+		CLOSE_PIPE(fdNoticeBell);
+	}
+#endif
 }
 
 #endif
@@ -115,6 +292,16 @@ timestamp_t NowUTC()
 
 
 
+// Return the number of microseconds elapsed since the boot of the system
+timestamp_t NowMonotonic()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000);
+}
+
+
+
 // Do
 //	Initialize the IPC structure to call LLS
 // Return
@@ -166,8 +353,13 @@ bool CSocketItemDl::StartPolling()
 		return false;
 
 	timeOut_ns = TRANSIENT_STATE_TIMEOUT_ms * 1000000ULL;
-	timeLastTriggered = NowUTC();
+	timeLastTriggered = NowMonotonic();
 	uint32_t dueTime = TIMER_SLICE_ms;
+#ifdef __linux__
+	// Notices are dispatched on the notice doorbell, the timer is for the transient state timeout only
+	if (socketsTLB.IsEventDriven())
+		dueTime = TRANSIENT_STATE_TIMEOUT_ms;
+#endif
 
 	struct itimerspec its;
 	struct sigevent sigev;
@@ -199,17 +391,66 @@ bool CSocketItemDl::StartPolling()
 
 
 
+#ifdef __linux__
+// Do
+//	Cancel the transient state timeout. The polling timer is disarmed as well
+//	unless notices in the control block are polled
+void CSocketItemDl::CancelTimeout()
+{
+	timeOut_ns = INT64_MAX;
+	if (timer == 0 || !socketsTLB.IsEventDriven())
+		return;
+
+	struct itimerspec its;
+	bzero(&its, sizeof(its));
+	timer_settime(timer, 0, &its, NULL);
+}
+#endif
+
+
+
 // It makes no difference to send a message or a stream of octets at ULA
 int CSocketDLLTLB::SendToPipe(const void *pMsg, int n)
 {
+#ifdef __linux__
+	if (pRing != NULL)
+		return PutToRing(pMsg, n);
+#endif
 	return send(sdPipe, pMsg, n, 0);
 }
 
 
 // For ULA, size of what to receive from LLS is fixed
+// Notices in the control blocks are dispatched meanwhile if the notice doorbell is available
 bool CSocketDLLTLB::GetNoticeFromPipe(SNotification *buf)
 {
-	int r = recv(sdPipe, buf, sizeof(SNotification), 0);
+	int r;
+#ifdef __linux__
+	struct pollfd fdWatch[2];
+	uint64_t v;
+	while (pRing != NULL)
+	{
+		fdWatch[0].fd = sdPipe;
+		fdWatch[0].events = POLLIN;
+		fdWatch[1].fd = fdNoticeBell;
+		fdWatch[1].events = POLLIN;
+		r = poll(fdWatch, 2, hasNoticeDeferred ? TIMER_SLICE_ms : -1);
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("Failed to wait for notification from LLS");
+			return false;
+		}
+		if ((fdWatch[1].revents & POLLIN) != 0 && read(fdNoticeBell, &v, sizeof(v)) < 0)
+			perror("Cannot reset the notice doorbell");
+		if (r == 0 || (fdWatch[1].revents & POLLIN) != 0)
+			DispatchNotices();
+		if (fdWatch[0].revents != 0)
+			break;
+	}
+#endif
+	r = recv(sdPipe, buf, sizeof(SNotification), 0);
 	if(r < 0)
 	{
 		perror("Failed to get notification from LLS");
@@ -222,7 +463,7 @@ bool CSocketDLLTLB::GetNoticeFromPipe(SNotification *buf)
 
 bool CSlimThreadPool::NewThreadFor(CSlimThreadPoolItem* newItem)
 {
-	if (pthread_create(&newItem->hThread, NULL, ThreadWorkBody, this) != 0)
+	if (pthread_create(&newItem->hThread, NULL, ThreadWorkBody, newItem) != 0)
 	{
 		perror("Cannot create new thread for the thread pool");
 		return false;
@@ -232,5 +473,38 @@ bool CSlimThreadPool::NewThreadFor(CSlimThreadPoolItem* newItem)
 	return true;
 }
 
+
+
+// Given
+//	int32_t		the value of the wake ticket read before the worker announced that it is idle
+// Do
+//	Wait until the wake ticket is changed
+void CSlimThreadPool::ParkWorker(int32_t ticket)
+{
+#ifdef __linux__
+	syscall(SYS_futex, &wakeTicket, FUTEX_WAIT_PRIVATE, ticket, NULL, NULL, 0);
+#else
+	while (LCKREAD(wakeTicket) == ticket)
+		Sleep(TIMER_SLICE_ms);
+#endif
+}
+
+
+
+void CSlimThreadPool::WakeOneWorker()
+{
+	_InterlockedIncrement(&wakeTicket);
+#ifdef __linux__
+	syscall(SYS_futex, &wakeTicket, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+}
+
+
+
+int CSlimThreadPool::CountProcessors()
+{
+	return (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
 // UNRESOLVED! is there race condition on detecting liveness of the old thread and creating the new thread?
 #endif
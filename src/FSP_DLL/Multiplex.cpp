@@ -51,6 +51,11 @@ FSPHANDLE FSPAPI Multiply(FSPHANDLE hFSP, PFSP_Context psp1)
 		psp1->flags = -EBADF;
 		return NULL;
 	}
+	if (!IS_KNOWN_CODEC(psp1->codec))
+	{
+		psp1->flags = -EDOM;
+		return NULL;
+	}
 
 	IN6_ADDR addrAny = IN6ADDR_ANY_INIT;
 	psp1->passive = 0;	// override what is provided by ULA
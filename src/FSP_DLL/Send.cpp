@@ -585,6 +585,8 @@ int LOCALAPI CSocketItemDl::BufferData(int m)
 	// only after every field, including flag, has been set may it be unlocked
 	// otherwise WriteTo following may put further data into the last packet buffer
 	ControlBlock::PFSP_SocketBuf skb0 = p;
+	if (pStreamState != NULL)
+		SetDeflateAcceleration();
 	do
 	{
 		if (pStreamState == NULL)
@@ -28,60 +28,236 @@
  */
 #include "FSP_DLL.h"
 
+// The worker that the current thread is, NULL if it is not a worker of any pool
+static thread_local CSlimThreadPoolItem * currentWorker;
+
 
 CSlimThreadPool::CSlimThreadPool()
 {
-	bzero(items, sizeof(CSlimThreadPoolItem) * SLIM_THREAD_POOL_SIZE);
+	for (register int i = 0; i < SLIM_THREAD_POOL_SIZE; i++)
+	{
+		items[i].pool = this;
+		items[i].hThread = 0;
+		items[i].head = items[i].tail = 0;
+	}
+	countWorks = countWorkers = countIdle = wakeTicket = 0;
+	nextQueue = 0;
+	// Keep at least two workers so that a blocking callback does not stall all of the others
+	limitWorkers = max(2, min(CountProcessors(), SLIM_THREAD_POOL_SIZE));
 }
 
 
-// To make life easier for this conceptual prototype a simple linear search is applied
+
+// Given
+//	CSocketItemDl *		the socket whose callback function is to be called
+//	void (CSocketItemDl::*)()	the callback function
+// Return
+//	true if the work was scheduled, or merged into the same work pending
+//	false if it failed
+// Remark
+//	The socket is queued to some worker only if it had no work pending before
+//	A job submitted by some worker is queued to the worker itself, or else the queues take turns
+//	Exactly one parked worker, if any, is waken up for each queued socket
+//	Works for the same socket are serialized, see also RunPendingWork
 bool CSlimThreadPool::ScheduleWork(CSocketItemDl *obj, void (CSocketItemDl::*fn)())
 {
+	int k = IndexOfWork(fn);
+	if (k < 0)
+		return false;
+	if (LCKREAD(countWorkers) == 0 && !StartWorker())
+		return false;
+
+	if (_InterlockedOr(&obj->pendingWork, 1U << k) != 0)
+		return true;
+
+	if (_InterlockedOr(&countIdle, 0) == 0 && LCKREAD(countWorkers) < limitWorkers)
+		StartWorker();
+
+	CSlimThreadPoolItem *w = currentWorker;
+	if (w == NULL || w->pool != this)
+		w = &items[_InterlockedIncrement(&nextQueue) % (uint32_t)LCKREAD(countWorkers)];
+	w->Push(obj);
 #ifdef _NO_LLS_CALLABLE
 	static int successCount;
+	printf_s("%s called successfully %d times\n", __func__, successCount++);
 #endif
-	for(int i = 0; i < SLIM_THREAD_POOL_SIZE; i++)
+
+	if (_InterlockedOr(&countIdle, 0) > 0)
+		WakeOneWorker();
+	return true;
+}
+
+
+
+// Given
+//	void (CSocketItemDl::*)()	the callback function
+// Return
+//	the index of the bit in CSocketItemDl::pendingWork that is mapped to the function
+//	negative if there is no room for new function
+int CSlimThreadPool::IndexOfWork(void (CSocketItemDl::*fn)())
+{
+	register int i;
+	register int n = LCKREAD(countWorks);
+	for (i = 0; i < n; i++)
+	{
+		if (works[i] == fn)
+			return i;
+	}
+
+	if (!mutex.WaitSetMutex())
+		return -EDEADLK;
+	for (; i < countWorks; i++)
+	{
+		if (works[i] == fn)
+			break;
+	}
+	if (i >= SLIM_WORK_KINDS)
+	{
+		i = -ENOMEM;
+	}
+	else if (i >= countWorks)
+	{
+		works[i] = fn;
+		_InterlockedIncrement(&countWorks);	// publish the function after it is set
+	}
+	mutex.SetMutexFree();
+	return i;
+}
+
+
+
+// Return
+//	true if the new worker was started or there are workers as many as the limit
+//	false if it failed
+bool CSlimThreadPool::StartWorker()
+{
+	if (!mutex.WaitSetMutex())
+		return false;
+
+	bool r = true;
+	if (countWorkers < limitWorkers)
+	{
+		CSlimThreadPoolItem &item = items[countWorkers];
+		r = NewThreadFor(&item);
+		if (r)
+			_InterlockedIncrement(&countWorkers);
+	}
+	mutex.SetMutexFree();
+	return r;
+}
+
+
+
+// Given
+//	CSocketItemDl *	the socket that was queued because some work became pending
+// Do
+//	Call the callback functions that are marked pending in the socket, until no work is pending
+// Remark
+//	The worker owns the socket while SLIM_WORK_RUNNING is set. Work marked meanwhile is done by the same worker
+void CSlimThreadPool::RunPendingWork(CSocketItemDl *p)
+{
+	uint32_t w = _InterlockedExchange(&p->pendingWork, SLIM_WORK_RUNNING);
+	do
 	{
-		CSlimThreadPoolItem& r = items[i];
-		void* savedContext = _InterlockedCompareExchangePointer((PVOID*)&r.contextWorkingOn, obj, NULL);
-		if (savedContext == NULL)
+		for (register int i = 0; i < SLIM_WORK_KINDS; i++)
 		{
-			if (r.fpWork == NULL && (r.hThread != 0 || NewThreadFor(&r)))
-			{
-#ifdef _NO_LLS_CALLABLE
-				printf_s("%s called successfully %d times\n", __func__, successCount++);
-#endif
-				r.fpWork = fn;
-				return true;
-			}
-			r.contextWorkingOn = (CSocketItemDl *)savedContext;
+			if ((w & (1U << i)) != 0)
+				(p->*works[i])();
 		}
+		if (_InterlockedCompareExchange((uint32_t *)&p->pendingWork, 0U, (uint32_t)SLIM_WORK_RUNNING) == SLIM_WORK_RUNNING)
+			break;
+		w = _InterlockedExchange(&p->pendingWork, SLIM_WORK_RUNNING);
+	} while (true);
+}
+
+
+
+// Given
+//	CSlimThreadPoolItem *	the worker that is looking for work
+// Return
+//	the socket popped from the worker's own queue, or stolen from some other worker's queue
+//	NULL if all of the queues are empty
+CSocketItemDl * CSlimThreadPool::FindWork(CSlimThreadPoolItem *self)
+{
+	CSocketItemDl *p = self->Pop();
+	if (p != NULL)
+		return p;
+
+	register int n = LCKREAD(countWorkers);
+	register int k = int(self - items);
+	for (register int i = 1; i < n; i++)
+	{
+		if ((p = items[(k + i) % n].Steal()) != NULL)
+			return p;
 	}
-	return false;
+	return NULL;
+}
+
+
+
+// Remark
+//	The worker announces that it is idle before it looks for work for the last time,
+//	and the submitter checks whether there is idle worker after it has queued the socket,
+//	so either the worker finds the socket or the submitter wakes up some worker
+void CSlimThreadPool::WaitForWork(CSlimThreadPoolItem *self)
+{
+	int32_t ticket = LCKREAD(wakeTicket);
+	_InterlockedIncrement(&countIdle);
+	CSocketItemDl *p = FindWork(self);
+	if (p == NULL)
+		ParkWorker(ticket);
+	_InterlockedExchangeAdd(&countIdle, -1);
+	if (p != NULL)
+		RunPendingWork(p);
+}
+
+
+
+void CSlimThreadPoolItem::Push(CSocketItemDl *p)
+{
+	AcquireMutex();
+	assert(tail - head < MAX_CONNECTION_NUM);
+	q[tail++ & (MAX_CONNECTION_NUM - 1)] = p;
+	ReleaseMutex();
+}
+
+
+
+// The owner takes the socket queued latest, for it is likely still in the cache
+CSocketItemDl * CSlimThreadPoolItem::Pop()
+{
+	CSocketItemDl *p = NULL;
+	AcquireMutex();
+	if (head != tail)
+		p = q[--tail & (MAX_CONNECTION_NUM - 1)];
+	ReleaseMutex();
+	return p;
+}
+
+
+
+// The thief takes the socket queued earliest
+CSocketItemDl * CSlimThreadPoolItem::Steal()
+{
+	CSocketItemDl *p = NULL;
+	AcquireMutex();
+	if (head != tail)
+		p = q[head++ & (MAX_CONNECTION_NUM - 1)];
+	ReleaseMutex();
+	return p;
 }
 
 
 
 void CSlimThreadPoolItem::LoopWaitJob()
 {
-	CSocketItemDl* pSocket;
+	currentWorker = this;
 	do
 	{
-		pSocket = (CSocketItemDl*)_InterlockedExchangePointer((PVOID*)&contextWorkingOn, NULL);
-		if (pSocket == NULL)
-		{
-			Sleep(TIMER_SLICE_ms);
-			continue;
-		}
-		// This is actually a spin-lock: 
-		if (fpWork == NULL)
-		{
-			contextWorkingOn = pSocket;
-			continue;
-		}
-		(pSocket->*fpWork)();
-		//
-		fpWork = NULL;
+		CSocketItemDl *p = pool->FindWork(this);
+		if (p == NULL)
+			pool->WaitForWork(this);
+		else
+			pool->RunPendingWork(p);
 	} while (true);
 }
@@ -24,7 +24,7 @@ int32_t LOCALAPI CSocketItemExDbg::GenerateSNACK(FSP_KeepAlivePacket& buf3)
 	pSNACK->_h.length = htole16(uint16_t(len));
 	pSNACK->ackSeqNo = htole32(seq0);
 	pSNACK->latestSN = htole32(snLastRecv);
-	pSNACK->tLazyAck = htole32(uint32_t(NowUTC() - tLastRecv));
+	pSNACK->tLazyAck = htole32(uint32_t(NowMonotonic() - tLastRecv));
 
 	return (sizeof(buf3.hdr) + sizeof(buf3.mp) + len);
 }
@@ -180,22 +180,22 @@ void PrepareFlowTestResend(CSocketItemExDbg& dbgSocket, PControlBlock& pSCB)
 
 	ControlBlock::PFSP_SocketBuf skb = pSCB->GetSendBuf();
 	skb->ReInitMarkComplete();
-	skb->timeSent = NowUTC();
+	skb->timeSent = NowMonotonic();
 	assert(pSCB->sendBufferNextSN == FIRST_SN + 1);
 
 	skb = pSCB->GetSendBuf();
 	skb->ReInitMarkComplete();
-	skb->timeSent = NowUTC();
+	skb->timeSent = NowMonotonic();
 	assert(pSCB->sendBufferNextSN == FIRST_SN + 2);
 
 	skb = pSCB->GetSendBuf();
 	skb->ReInitMarkComplete();
-	skb->timeSent = NowUTC();
+	skb->timeSent = NowMonotonic();
 	assert(pSCB->sendBufferNextSN == FIRST_SN + 3);
 
 	skb = pSCB->GetSendBuf();
 	skb->ReInitMarkComplete();
-	skb->timeSent = NowUTC();
+	skb->timeSent = NowMonotonic();
 	assert(pSCB->sendBufferNextSN == FIRST_SN + 4);
 
 	skb = pSCB->GetSendBuf();
@@ -213,21 +213,21 @@ void PrepareFlowTestResend(CSocketItemExDbg& dbgSocket, PControlBlock& pSCB)
 	assert(skb5 != NULL);
 
 	skb5->ReInitMarkComplete();
-	skb5->timeRecv = NowUTC();
+	skb5->timeRecv = NowMonotonic();
 
 	skb5 = pSCB->AllocRecvBuf(FIRST_SN + 1);
 	assert(skb5 != NULL);
 	assert(pSCB->recvWindowNextSN == FIRST_SN + 2);
 
 	skb5->ReInitMarkComplete();
-	skb5->timeRecv = NowUTC();
+	skb5->timeRecv = NowMonotonic();
 
 	skb5 = pSCB->AllocRecvBuf(FIRST_SN + 3);
 	assert(skb5 != NULL);
 	assert(pSCB->recvWindowNextSN == FIRST_SN + 4);
 
 	skb5->ReInitMarkComplete();
-	skb5->timeRecv = NowUTC();
+	skb5->timeRecv = NowMonotonic();
 
 	skb5 = pSCB->AllocRecvBuf(FIRST_SN + 4);
 	assert(skb5 == NULL);	// No more space in the receive buffer
@@ -272,7 +272,7 @@ void FlowTestRetransmission()
 	dbgSocket.pktSeqNo = FIRST_SN + 3;
 	dbgSocket.lenPktData = 0;
 	dbgSocket.tRoundTrip_us = 1;
-	dbgSocket.tRecentSend = NowUTC() + 1;
+	dbgSocket.tRecentSend = NowMonotonic() + 1;
 	// See also CSocketItemEx::OnGetKeepAlive
 	FSP_SelectiveNACK *snack = &p->sentinel;
 
@@ -325,7 +325,7 @@ void FlowTestRetransmission()
 	dbgSocket.SignHeaderWith((FSP_FixedHeader *)&p->hdr, KEEP_ALIVE, uint16_t(len), pSCB->sendWindowNextSN - 1, ++dbgSocket.nextOOBSN);
 	dbgSocket.SetIntegrityCheckCode(&p->hdr, &p->mp, len - sizeof(p->hdr), dbgSocket.GetSalt(p->hdr));
 	// as it is an out-of-band packet, assume preset values are kept
-	dbgSocket.tRecentSend = NowUTC() + 3;
+	dbgSocket.tRecentSend = NowMonotonic() + 3;
 
 	n = dbgSocket.ValidateSNACK(seq5, snack);
 	assert(seq5 == FIRST_SN + 2 && n == 1);
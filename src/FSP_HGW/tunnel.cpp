@@ -28,12 +28,7 @@
  */
 
 #include "fsp_http.h"
-
-#if defined(__WINDOWS__)
-# include <ws2tcpip.h>
-#elif defined(__linux__) || defined(__CYGWIN__)
-# include <netdb.h>
-#endif
+#include "../NameCache.h"
 
 /**
   How does it work:
@@ -363,19 +358,10 @@ void FSPAPI onRelease(FSPHANDLE h, FSP_ServiceCode code, int value)
 
 static in_addr ResolveIPv4Address(const char* nodeName)
 {
-	static const struct addrinfo hints = { 0, AF_INET, };
-	const in_addr ADDR_ZERO = *(in_addr*)&hints.ai_addr;
-	struct addrinfo* pAddrInfo;
-
-	if (getaddrinfo(nodeName, NULL, &hints, &pAddrInfo) != 0)
-		return ADDR_ZERO;
-
-	if (pAddrInfo == NULL)
-		return ADDR_ZERO;
-
-	const in_addr ret = ((sockaddr_in*)pAddrInfo->ai_addr)->sin_addr;
-	freeaddrinfo(pAddrInfo);
-	return ret;
+	UNameCacheAddress a;
+	if (CNameCache::Singleton.Resolve(nodeName, NULL, AF_INET, &a, 1) <= 0)
+		memset(&a, 0, sizeof(a));
+	return a.ipv4.sin_addr;
 }
 
 
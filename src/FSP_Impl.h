@@ -252,6 +252,19 @@ protected:
  */
 #define MAX_NAME_LENGTH		64	// considerably less than MAX_PATH
 
+#ifndef ULA_COMMAND_RING_SIZE
+# define ULA_COMMAND_RING_SIZE	64	// number of command slots, MUST be power of 2
+#endif
+#ifndef ULA_NOTICE_BITS
+# define ULA_NOTICE_BITS		256	// no less than the maximum number of sockets of a ULA process, MUST be multiple of 64
+#endif
+#ifndef LOCK_SPIN_LIMIT
+# define LOCK_SPIN_LIMIT		200	// maximum rounds that a lock contender spins before it sleeps
+#endif
+#ifndef LOCK_PARK_SLICE_ms
+# define LOCK_PARK_SLICE_ms		50	// a sleeping lock contender rechecks whether to give up at least this often
+#endif
+
 #ifdef _DEBUG
 #define	CONNECT_BACKLOG_SIZE	2
 #else
@@ -424,6 +437,35 @@ struct SNotification
 
 
 
+#ifdef __linux__
+/**
+ * Lock-free single-producer single-consumer ring of commands from ULA to LLS
+ * It resides in memory shared by the ULA process and LLS, set up once per ULA process.
+ * The producer is the ULA process, whose threads are serialized by a light mutex in the DLL;
+ * the consumer is the thread of LLS that is dedicated to the ULA process.
+ * The consumer sets 'sleeping' before it waits on the doorbell (an eventfd),
+ * and the producer rings the doorbell only if the consumer is asleep.
+ * The same shared memory carries the coalesced notices in the reverse direction
+ */
+struct SCommandRing
+{
+	ALIGN(64)
+	volatile uint32_t	head;		// next slot to consume, updated by LLS only
+	volatile int32_t	sleeping;	// the consumer is, or is about to, wait on the doorbell
+	ALIGN(64)
+	volatile uint32_t	tail;		// next slot to produce, updated by ULA only
+	ALIGN(64)
+	UCommandToLLS		slots[ULA_COMMAND_RING_SIZE];
+	// Notices from LLS to ULA: LLS sets the bit of the socket whose control block has some notice raised,
+	// and rings the notice doorbell only if 'noticeRaised' was clear. ULA clears 'noticeRaised' before scanning the bits
+	ALIGN(64)
+	volatile int32_t	noticeRaised;
+	volatile uint64_t	noticeBits[ULA_NOTICE_BITS / 64];
+};
+#endif
+
+
+
 /**
 * Parameter data-structure and Session Control Block data-structure
 */
@@ -498,12 +540,69 @@ typedef struct SItemBackLog: SConnectParam
 
 
 
+// Sleep on the 32-bit word as long as it holds the given value, at most for the given milliseconds
+// The word is meant to be shared between processes if the last parameter is true
+void LOCALAPI WaitOnLockWord(volatile uint32_t *, uint32_t, uint32_t, bool);
+// Wake up at most the given number of threads sleeping on the word
+void LOCALAPI WakeLockWaiters(volatile uint32_t *, int, bool);
+// Zero on a uniprocessor, where spinning on a busy lock just wastes the time slice of the lock holder
+int LockSpinLimit();
+
+
+
+// The waiting side of an adaptive lock whose lock word is kept by the owner, so that the word may carry
+// debug attribution such as the name of the locking function. A contender spins on the lock word for
+// some rounds adapted to the recent contended acquisitions, then sleeps on 'ticket' which is bumped
+// when the lock is released while there is some sleeper. The sleeper MUST try the lock once more between
+// PrepareToPark and Park so that a release in between is not missed
+class CLockWaitQueue
+{
+	volatile uint32_t	ticket;
+	volatile uint32_t	sleepers;
+public:
+	CLockContention		stat;	// updated by the lock holder, except countTimedOut
+
+	int SpinLimit() const { return min(LockSpinLimit(), stat.spinEstimate * 2 + 16); }
+	uint32_t PrepareToPark() { _InterlockedIncrement((PLONG)&sleepers); return LCKREAD(ticket); }
+	void Park(uint32_t seen, uint32_t ms) { WaitOnLockWord(&ticket, seen, min(ms, LOCK_PARK_SLICE_ms), false); }
+	void LeavePark() { _InterlockedDecrement((PLONG)&sleepers); }
+	// Called after the lock word is cleared. Pass the baton to the next sleeper
+	void Unpark(int n = 1)
+	{
+		if (LCKREAD(sleepers) == 0)
+			return;
+		_InterlockedIncrement((PLONG)&ticket);
+		WakeLockWaiters(&ticket, n, false);
+	}
+	void UnparkAll() { Unpark(INT_MAX); }
+
+	void OnAcquired() { stat.countAcquired++; }
+	void OnAcquired(int rounds, bool parked)
+	{
+		stat.countAcquired++;
+		stat.countContended++;
+		if (parked)
+			stat.countParked++;
+		stat.spinEstimate += (rounds - stat.spinEstimate) / 8;
+	}
+	void OnTimedOut() { _InterlockedIncrement((PLONG)&stat.countTimedOut); }
+	void ClearStatistics() { memset(&stat, 0, sizeof(stat)); }
+};
+
+
+
+// The lock word is 0 if free, 1 if locked or 2 if locked and there might be some sleeper
+// It works across processes as the backlog it guards is in the shared memory
 class CLightMutex
 {
-	char mutex;
+	volatile uint32_t mutex;
 public:
 	bool WaitSetMutex();
-	void SetMutexFree() { _InterlockedExchange8(&mutex, 0); }
+	void SetMutexFree()
+	{
+		if (_InterlockedExchange((PLONG)&mutex, 0) > 1)
+			WakeLockWaiters(&mutex, 1, true);
+	}
 };
 
 #ifdef __MINGW32__
@@ -585,6 +684,8 @@ struct ControlBlock
 	FSP_NoticeCode	receiveNotice;		// later FSP_NotifyCommit may override FSP_NotifyDataReady
 	FSP_NoticeCode	sendAllowedNotice;	// later FSP_NotifyFlushed may override FSP_NotifyBufferReady
 	FSP_NoticeCode	singletonotice;		// 'singleton' notice
+	char			heartbeatParked;	// LLS slowed down the heartbeat of the idle session. ULA should kick it on sending
+	int32_t			noticeIndex;		// index of the socket in the notice bitmap of the ULA process
 
 	// 5, 6: Send window and receive window descriptor
 	typedef uint32_t seq_t;
@@ -31,6 +31,7 @@
 
 #include "../FSP_Impl.h"
 #include "gcm-aes.h"
+#include "../NameCache.h"
 
 #define COOKIE_KEY_LEN			20	// salt include, as in RFC4543 5.4
 
@@ -48,8 +49,23 @@ extern "C" void rand_w32(u32 *, int);
 #endif
 
 // Return the number of microseconds elapsed since Jan 1, 1970 (unix epoch time)
+// Only the timestamps on the wire, such as those of the cookie, need it
 extern "C" timestamp_t NowUTC();
 
+// Return the number of microseconds elapsed since some fixed but arbitrary point of time, which never jumps
+// Protocol timing, such as RTT, RTO and the time-outs, is measured by it so that stepping the wall clock does no harm
+extern "C" timestamp_t NowMonotonic();
+
+// The monotonic time sampled by the current thread at the start of the iteration of its event loop, 0 if never sampled
+extern thread_local timestamp_t tLoopStart;
+
+inline timestamp_t SetLoopTime() { return (tLoopStart = NowMonotonic()); }
+
+// Return the monotonic time cached for the current iteration of the event loop, where exactness is not needed.
+// It is never later than the exact time, so it is safe to mark a receipt but not to be compared with
+// what other threads may have just set. A thread without an event loop gets the exact time
+inline timestamp_t NowInLoop() { return (tLoopStart != 0 ? tLoopStart : NowMonotonic()); }
+
 
 struct FSP_FixedHeader : public FSP_NormalPacketHeader
 {
@@ -109,20 +125,94 @@ struct CtrlMsgHdr
 
 
 // per-host connection number and listener limit defined in LLS:
-#ifndef MAX_CONNECTION_NUM	// must be some power value of 2
-# define MAX_CONNECTION_NUM	256
+#ifndef MAX_CONNECTION_NUM	// must be some power value of 2, no greater than 2^24
+# if defined(__WINDOWS__) && !defined(OVER_UDP_IPv4)
+#  define MAX_CONNECTION_NUM	256	// every ALFID is provisioned as an IPv6 address in advance
+# else
+#  define MAX_CONNECTION_NUM	(1 << 20)
+# endif
 #endif
+// session items are allocated lazily, a slab at a time
+#define LLS_SESSION_SLAB_SIZE	(MAX_CONNECTION_NUM < 1024 ? MAX_CONNECTION_NUM : 1024)
 #define MAX_LISTENER_NUM	4
 #define MAX_RETRANSMISSION	8
 
+// maximum number of datagrams drained from a socket by one system call of the receiver thread
+#ifndef LLS_RECV_BATCH_SIZE	// 1 effectively disables batched receiving
+# define LLS_RECV_BATCH_SIZE	16
+#endif
+// maximum number of receiver threads, each of which serves a shard of ALFIDs. Limited by the number of online CPUs
+#ifndef LLS_RECV_WORKERS	// 1 effectively disables receive fan-out
+# define LLS_RECV_WORKERS	4
+#endif
+// set LLS_UDP_GRO to 1 to let the kernel coalesce bulk FSP packets of the same flow (since linux 5.0)
+#ifndef LLS_UDP_GRO
+# define LLS_UDP_GRO	0
+#endif
+# define LLS_GRO_BUFFER_SIZE	65536	// large enough to hold a coalesced super-datagram
+
+// maximum number of packets emitted in one time slice that are sent together by one system call
+#ifndef LLS_SEND_BATCH_SIZE	// 1 effectively disables batched sending
+# define LLS_SEND_BATCH_SIZE	16
+#endif
+
+// period of the heartbeat of a session which has nothing to send nor to resend, in milliseconds
+#ifndef LLS_IDLE_TICK_ms
+# define LLS_IDLE_TICK_ms	(TIMER_SLICE_ms * 16)
+#endif
+
+// life-span of a cookie secret. A cookie is accepted in the epoch it was made and in the next one
+#ifndef LLS_COOKIE_EPOCH_ms
+# define LLS_COOKIE_EPOCH_ms	60000
+#endif
+// a Bloom filter of 2^LLS_REPLAY_FILTER_BITS bits per epoch remembers the cookies accepted
+#ifndef LLS_REPLAY_FILTER_BITS
+# define LLS_REPLAY_FILTER_BITS	20
+#endif
+// INIT_CONNECT admitted per second from one source prefix, and the burst allowed
+#ifndef LLS_ADMISSION_PREFIX_RATE
+# define LLS_ADMISSION_PREFIX_RATE	64
+#endif
+#ifndef LLS_ADMISSION_PREFIX_BURST
+# define LLS_ADMISSION_PREFIX_BURST	32
+#endif
+#define LLS_ADMISSION_PREFIX_V4	24	// length of the IPv4 prefix rate-limited as a whole. That of IPv6 is 64
+#define LLS_ADMISSION_BUCKETS	4096	// number of per-prefix token buckets per receive worker, must be some power of 2
+// INIT_CONNECT admitted per second by one receive worker, beyond which it sheds the load
+#ifndef LLS_HANDSHAKE_RATE
+# define LLS_HANDSHAKE_RATE		10000
+#endif
+#ifndef LLS_HANDSHAKE_BURST
+# define LLS_HANDSHAKE_BURST	1000
+#endif
+
+// the ULA processes are registered lazily, a slab of process roots at a time
+#ifndef LLS_MAX_ULA_PROCESSES	// must be some multiple of LLS_ULA_SLAB_SIZE
+# define LLS_MAX_ULA_PROCESSES	65536
+#endif
+#define LLS_ULA_SLAB_SIZE	64
+// number of threads that wait on the command channels of the ULA processes, each serves its share of the processes
+#ifndef LLS_ULA_WORKERS
+# define LLS_ULA_WORKERS	2
+#endif
+// maximum number of commands fetched from one ULA process in one round, so that no process may starve the others
+#ifndef LLS_ULA_BATCH_SIZE
+# define LLS_ULA_BATCH_SIZE	16
+#endif
+// number of threads that resolve the peer names of the connect requests. Numeric addresses need not be resolved
+#ifndef LLS_RESOLVER_THREADS
+# define LLS_RESOLVER_THREADS	4
+#endif
+
 class CSocketItemEx;
+class CPacketReceiver;
 struct SProcessRoot;
 
 struct CommandNewSessionSrvEntry: CommandNewSessionCommon
 {
 #if defined(__linux__) || defined(__CYGWIN__)
 	int		hShm;			// handle of the shared memory, open by name
-	pthread_t	idThread;	// working thread associated with the new session request
+	char	peerName[256];	// copy of ControlBlock::peerAddr.name, for the resolver shall not touch the control block
 #elif defined(__WINDOWS__)
 	DWORD	idProcess;
 	HANDLE	hMemoryMap;		// pass to LLS by ULA, should be duplicated by the server
@@ -130,6 +220,12 @@ struct CommandNewSessionSrvEntry: CommandNewSessionCommon
 
 	int		index;
 	class	CSocketItemEx* pSocket;
+
+	// The peer addresses resolved, to be copied into ControlBlock::peerAddr.ipFSP when the connection is initiated
+	volatile int	resolved;	// number of the addresses resolved, negative if failed, zero if yet to be resolved
+	uint32_t	hostID;
+	ALFID_T		fiberID;
+	TSubnets	allowedPrefixes;
 };
 
 
@@ -138,6 +234,7 @@ class CommandNewSessionSrv: protected CommandNewSessionSrvEntry
 	friend class ConnectRequestQueue;
 	friend class CSocketItemEx;
 	friend class CSocketSrvTLB;
+	friend class CConnectResolver;
 
 	// defined in command.cpp
 	friend CSocketItemEx* LOCALAPI Connect(const CommandNewSessionSrv&, SProcessRoot *);
@@ -147,6 +244,11 @@ public:
 	CommandNewSessionSrv(const CommandNewSession*);
 	CommandNewSessionSrv() {}
 
+	int ResolveNumeric(const char *);
+	int ResolveToIPv6(const char *);
+	int ResolveToFSPoverIPv4(const char *, const char *);
+	int Resolve(const char *);
+
 	void DoConnect();
 };
 
@@ -171,11 +273,15 @@ class ConnectRequestQueue : public CLightMutex
 	int	head;
 	int tail;
 	CommandNewSessionSrvEntry q[CONNECT_BACKLOG_SIZE];
+
+	int Erase(int);
 public:
 	static ConnectRequestQueue requests;
 	ConnectRequestQueue() { memset(this, 0, sizeof(ConnectRequestQueue)); }
 	int Push(const CommandNewSessionSrv *);
 	int Remove(int);
+	void Resolved(int, int);
+	void Abandon(int);
 	CommandNewSessionSrv & operator [](int i)
 	{
 		return *(CommandNewSessionSrv *)&q[i < 0 ? 0 : i % CONNECT_BACKLOG_SIZE];
@@ -221,6 +327,159 @@ struct ScatteredSendBuffers
 };
 
 
+// A packet staged for transmission, with its own buffer for the ciphertext
+struct STransmitSlot
+{
+	ALIGN(FSP_ALIGNMENT)
+	FSP_FixedHeader	hdr;
+	ALIGN(MAC_ALIGNMENT)
+	octet	cipherText[MAX_BLOCK_SIZE];
+	void	*payload;	// either cipherText or the plaintext in the send buffer
+	int32_t	len;		// length of the payload
+	ControlBlock::PFSP_SocketBuf skb;
+};
+
+
+
+// The transmit batch is allocated in the stack of the thread that runs the event loop
+// so that it needn't any protection. See also CSocketItemEx::StageWithICC and SendBatch
+// Authenticated encryption of the staged packets is deferred, so that they are sealed in one call
+struct STransmitBatch
+{
+	int		count;
+	int		countToSeal;
+	STransmitSlot	slots[LLS_SEND_BATCH_SIZE];
+	GCM_AES_PACKET	toSeal[LLS_SEND_BATCH_SIZE];
+
+	STransmitBatch() { count = countToSeal = 0; }
+	bool IsFull() const { return count >= LLS_SEND_BATCH_SIZE; }
+	bool Seal();
+};
+
+
+
+#if defined(__linux__) || defined(__CYGWIN__)
+class CTimingWheel;
+
+// The entry of a session in some timing wheel. It is not armed if it is not linked
+struct STimerEntry
+{
+	STimerEntry		*next;
+	STimerEntry		*prev;
+	CSocketItemEx	*owner;
+	CTimingWheel	*wheel;			// the wheel that the entry was last armed in
+	uint64_t		expireTick;
+	uint32_t		period;			// in ticks, i.e. milliseconds
+	uint16_t		level;
+	uint16_t		slot;
+};
+
+
+
+// A hierarchical timing wheel with millisecond granularity, driven by one timerfd and served by one thread.
+// Periodic timers of the sessions are armed and cancelled in O(1) time; the thread sleeps till
+// the earliest timer might expire, instead of ticking at the fixed pace, and calls KeepAlive of the sessions
+class CTimingWheel: CSRWLock
+{
+	static const int	WHEEL_BITS = 6;
+	static const int	WHEEL_SIZE = 1 << WHEEL_BITS;
+	static const int	WHEEL_LEVELS = 4;
+	static const uint64_t MAX_TICKS = (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+	static const int	DISPATCH_BATCH = 64;
+
+	STimerEntry	slots[WHEEL_LEVELS][WHEEL_SIZE];	// sentinels of the circular lists of entries
+	uint64_t	bitmap[WHEEL_LEVELS];	// which slots are not empty
+	uint64_t	currentTick;	// ticks before and at which have been processed
+	uint64_t	nextWakeTick;	// when the timerfd is to expire, UINT64_MAX if disarmed
+	uint64_t	tickZero_ns;	// the monotonic time of tick zero
+	int			fdTimer;
+	pthread_t	thWheel;
+	volatile bool	stopping;	// the thread exits once it is woken up
+
+	static CTimingWheel	wheels[LLS_RECV_WORKERS];
+	static int			countWheels;
+
+	uint64_t	NowTick();
+	void		Insert(STimerEntry *);
+	void		Unlink(STimerEntry *);
+	void		Cascade();
+	uint64_t	NextEventTick();
+	void		SetWakeTick(uint64_t);
+	int			Collect(uint64_t, CSocketItemEx **);
+	void		Advance();
+
+	bool		Start();
+	void		Stop();
+	static void * Run(void *);
+
+public:
+	void		Arm(STimerEntry *, CSocketItemEx *, uint32_t);
+	void		Cancel(STimerEntry *);
+
+	// The wheel to serve the session, sharded by the near-end ALFID like the receive workers
+	static CTimingWheel & For(ALFID_T id) { return wheels[id % (uint32_t)countWheels]; }
+	static bool StartAll(int);
+	static void StopAll();
+};
+
+
+
+// A thread waiting on one epoll instance for the command pipes and the command doorbells of the ULA processes
+// assigned to it. Commands are fetched in batches and the processes are served in turn,
+// so neither the number of threads nor the dispatch latency grows with the number of the processes
+class CULACommandService
+{
+	int			fdEpoll;
+	int			fdStop;		// an eventfd, readable once the thread is to exit
+	pthread_t	thService;
+
+	static CULACommandService	services[LLS_ULA_WORKERS];
+	static int			countServices;
+	static uint32_t		countAssigned;
+
+	bool		Start();
+	void		Stop();
+	void		Serve();
+	static void * Run(void *);
+
+public:
+	bool		Watch(SProcessRoot *, int);
+
+	// The services are assigned to the ULA processes in turn
+	static CULACommandService * Assign() { return &services[_InterlockedIncrement(&countAssigned) % (uint32_t)countServices]; }
+	static bool StartAll(int);
+	static void StopAll();
+};
+
+
+
+// A fixed number of threads resolving the peer names of the connect requests in the order they are posted.
+// The work queue holds the indices into ConnectRequestQueue, so it is bounded by CONNECT_BACKLOG_SIZE as well.
+// A request resolved is handed back to the timer of the session to initiate the connection
+class CConnectResolver
+{
+	pthread_t	thResolver;
+
+	static CConnectResolver	resolvers[LLS_RESOLVER_THREADS];
+	static int			countResolvers;
+	static pthread_mutex_t	mutex;
+	static pthread_cond_t	posted;
+	static int			queue[CONNECT_BACKLOG_SIZE];
+	static int			head;
+	static int			count;
+	static bool			stopping;	// the threads exit instead of taking another request
+
+	static void * Run(void *);
+
+public:
+	static bool Post(int);
+	static bool StartAll(int);
+	static void StopAll();
+};
+#endif
+
+
+
 struct SAckFlushCache
 {
 	FSP_FixedHeader		hdr;
@@ -257,11 +516,8 @@ struct ICC_Context
 			union
 			{
 				uint64_t	precomputedCRCS0;	// precomputed CRC value for Sender role/Output side
-				struct
-				{
-					octet	key[FSP_MAX_KEY_SIZE + GMAC_SALT_LEN];
-					uint8_t	H[GCM_BLOCK_LEN];	/* hash subkey, save one block encryption */
-				} send;
+				// Expanded once a batch, so that it is ready for send when send and receive batches diverge
+				GCM_AES_CTX	send;
 			};
 		};
 	} curr, prev;
@@ -303,10 +559,14 @@ struct ICC_Context
 			, seqNo
 			, snFirstSendWithCurrKey);
 #endif
-		// From snFirstSendWithCurrKey + FSP_REKEY_THRESHOLD, inclusively, apply new key
-		if (int32_t(seqNo - snFirstSendWithCurrKey - FSP_REKEY_THRESHOLD) >= 0)
+		if (IsToRekeyBeforeSend(seqNo))
 			ForcefulRekey(0);
 	}
+	// From snFirstSendWithCurrKey + FSP_REKEY_THRESHOLD, inclusively, apply new key
+	bool IsToRekeyBeforeSend(ControlBlock::seq_t seqNo) const
+	{
+		return int32_t(seqNo - snFirstSendWithCurrKey - FSP_REKEY_THRESHOLD) >= 0;
+	}
 	// Before accepting packet, check whether it needs re-keying to validate it. If it does need, do re-key
 	// Assume every packet in the receive window is either encrypted in the new re-keyed key
 	void CheckToRekeyAnteAccept(ControlBlock::seq_t seqNo)
@@ -325,11 +585,11 @@ struct ICC_Context
 		ForcefulRekey(1);
 	}
 	// Given
-	//	GCM_AES_CTX &	[out]	Preserved storage of the GCM_AES context
 	//	ControlBlock::seq_t		The sequence number of the packet to send	
 	// Return
-	//	The GCM_AES context selected for send, might be prepared on the fly
-	GCM_AES_CTX * GetGCMContextForSend(GCM_AES_CTX &, ControlBlock::seq_t);
+	//	The GCM_AES context selected for send, either shared with receive or dedicated to send
+	GCM_AES_CTX * GetGCMContextForSend(ControlBlock::seq_t);
+	bool IsSendOnly(const GCM_AES_CTX *p) const { return p == &curr.send || p == &prev.send; }
 	// Given
 	//	const ICC_Context &		The ICC context of the parent connection
 	// Do
@@ -356,10 +616,27 @@ struct SProcessRoot
 {
 	pthread_t		hThreadWait;
 	HPIPE_T			sdPipe;
-	unsigned long	index;
+	SProcessRoot	*nextFree;	// chained in the free list of the process roots while it is not in use
 	CSocketItemEx	*latest;
-	//
+#ifdef __linux__
+	struct ucred	peer;		// credentials of the ULA process, got by SO_PEERCRED
+	class CULACommandService *service;
+	SCommandRing	*pRing;		// NULL if the ULA process sends commands over the pipe
+	int				fdDoorbell;
+	int				fdNoticeBell;
+	int				lenPartial;	// number of octets of the command partially received over the pipe
+	UCommandToLLS	partial;
+	void AcceptCommandRing(const int *, int);
+	void DetachCommandRing();
+	void RaiseNotice(int32_t);
+	bool IsOwnerOf(int) const;
+	int  FetchFromRing(UCommandToLLS *, int);
+	int  FetchCommands(UCommandToLLS *, int);
+#else
 	void LoopOnULACommand();
+#endif
+	//
+	void DispatchCommand(UCommandToLLS &);
 	int  RecvFromPipe(void* buffer, int capacity);
 	int  SendNotificationTo(ALFID_T fiberID, FSP_NoticeCode code);
 };
@@ -372,11 +649,15 @@ struct SocketItemEx : CSocketItem
 	SProcessRoot	*rootULA;
 	// chained list on the collision entry of the remote ALFID TLB
 	CSocketItemEx	*prevRemote;
-	// chained list on the collision entry of the near ALFID TLB
-	CSocketItemEx	*prevSame;
 
+#if defined(__linux__) || defined(__CYGWIN__)
+	STimerEntry		timer;
+#else
 	timer_t			timer;
+#endif
 	int				countULACommand;
+	// the connect request of which the peer name is being resolved, see also CConnectResolver
+	class CommandNewSessionSrv * volatile pendingConnect;
 
 	PktBufferBlock* headPacket;	// But UNRESOLVED! There used to be an independent packet queue for each SCB for sake of fairness
 	int32_t			lenPktData;
@@ -404,6 +685,8 @@ struct SocketItemEx : CSocketItem
 	FSP_ADDRINFO_EX	tempAddrAccept;
 
 	const char* lockedAt;	// == NULL if not locked, or else the function name that locked the socket
+	const char* lockContendedBy;	// the function that held the lock when it was lastly contended
+	CLockWaitQueue lockWaiters;
 
 	// Cached 'trunk' state
 	union
@@ -416,6 +699,8 @@ struct SocketItemEx : CSocketItem
 	char	hasAcceptedRELEASE : 1;
 	char	delayAckPending : 1;
 	char	callbackTimerPending : 1;
+	char	timerParked : 1;	// the heartbeat is slowed down to LLS_IDLE_TICK_ms
+	char	gsoUnsupported : 1;	// UDP GSO is known not to work on the path of the session
 	};
 	};
 
@@ -452,7 +737,9 @@ struct SocketItemEx : CSocketItem
 class CSocketItemEx : protected SocketItemEx
 {
 	friend class CLowerInterface;
+	friend class CPacketReceiver;
 	friend class CSocketSrvTLB;
+	friend struct SProcessRoot;
 
 	friend CSocketItemEx * Multiply(const CommandCloneSessionSrv&);
 
@@ -473,6 +760,38 @@ protected:
 	void EnableDelayAck() { delayAckPending = 1; }
 	void RemoveTimers();
 	bool LOCALAPI ReplaceTimer(uint32_t);
+	// Whether there is nothing to send, to resend or to acknowledge
+	bool IsIdle()
+	{
+		return !delayAckPending && !mobileNoticeInFlight && !isNearEndHandedOver
+			&& pControlBlock->CountSentInFlight() == 0 && pControlBlock->CountSendBuffered() == 0;
+	}
+	// Slow down the heartbeat of an idle session. See also RestartKeepAlive
+	// The hint to ULA is published before idleness is checked again, so that data buffered
+	// meanwhile either is seen here or makes ULA kick the session with FSP_Start
+	void ParkTimer()
+	{
+		_InterlockedExchange8(&pControlBlock->heartbeatParked, 1);
+		if (!IsIdle())
+		{
+			pControlBlock->heartbeatParked = 0;
+			return;
+		}
+		if (ReplaceTimer(LLS_IDLE_TICK_ms))
+			timerParked = 1;
+	}
+	void AdjustHeartbeat()
+	{
+		if (IsIdle())
+		{
+			if (!timerParked)
+				ParkTimer();
+		}
+		else if (timerParked)
+		{
+			RestartKeepAlive();
+		}
+	}
 
 	// The minimum round-trip time allowable depends on timer resolution,
 	// but do not bother to guess delay caused by near-end task-scheduling
@@ -534,12 +853,12 @@ protected:
 	{
 		register FSP_Session_State s = pControlBlock->state;
 		if (_InterlockedExchange8((char *)& lowState, s) != s)
-			tMigrate = NowUTC();
+			tMigrate = NowMonotonic();
 	}
 	void SetState(FSP_Session_State s)
 	{
 		if (_InterlockedExchange8((char*)&pControlBlock->state, s) != s)
-			tMigrate = NowUTC();
+			tMigrate = NowMonotonic();
 		lowState = s;
 	}
 
@@ -571,6 +890,8 @@ protected:
 	int	PlacePayload();
 
 	int	 SendPacket(u32, ScatteredSendBuffers);
+	int	 SendBatch(STransmitBatch &);
+	bool SealBatch(STransmitBatch &);
 	bool EmitStart();
 	bool EmitRelease();
 	bool SendAckFlush();
@@ -579,6 +900,7 @@ protected:
 
 	bool IsNearEndMoved();
 	int	 EmitWithICC(ControlBlock::PFSP_SocketBuf, ControlBlock::seq_t);
+	int	 StageWithICC(STransmitBatch &, ControlBlock::PFSP_SocketBuf, ControlBlock::seq_t);
 
 	void KeepAlive();
 	void DoEventLoop();
@@ -586,7 +908,7 @@ protected:
 #if defined(__WINDOWS__)
 	static VOID NTAPI KeepAlive(PVOID c, BOOLEAN) { ((CSocketItemEx*)c)->KeepAlive(); }
 #elif defined(__linux__) || defined(__CYGWIN__)
-	static void KeepAlive(union sigval v) { ((CSocketItemEx *)v.sival_ptr)->KeepAlive(); }
+	friend class CTimingWheel;
 #endif
 
 	static uint32_t GetSalt(const FSP_FixedHeader& h) { return *(uint32_t*)& h; }
@@ -627,6 +949,7 @@ public:
 
 #define WaitUseMutex()		WaitUseMutexAt(__FUNCTION__)		//  __func__
 	bool WaitUseMutexAt(const char *);
+	bool WaitLockAt(const char *, const char *);
 	void SetMutexFree();
 
 	bool IsInUse() { return (markInUse != 0); }
@@ -682,16 +1005,20 @@ public:
 
 	char *PeerName() const { return (char *)pControlBlock->peerAddr.name; }
 
-	int ResolveToIPv6(const char *);
-	int ResolveToFSPoverIPv4(const char *, const char *);
-
 	void Notify(FSP_NoticeCode c)
 	{
 #if ((TRACE & TRACE_PACKET) || (TRACE & TRACE_ULACALL))
 		printf_s("\nSession #%u, raise soft interrupt %s(%d).\n", fidPair.source, noticeNames[c], c);
 #endif
 		_InterlockedExchange8((char*)&pControlBlock->singletonotice, c);
+		RaiseNotice();
 	}
+#ifdef __linux__
+	// Wake up the notice dispatcher of the ULA, if it is not waken up yet
+	void RaiseNotice() { if (rootULA != NULL) rootULA->RaiseNotice(pControlBlock->noticeIndex); }
+#else
+	void RaiseNotice() { }
+#endif
 	// Given
 	//	FSP_NoticeCode		the code of the notification to alert DLL
 	// Do
@@ -712,6 +1039,7 @@ public:
 			_InterlockedCompareExchange8((char*)&pControlBlock->receiveNotice, c, 0);
 		else
 			_InterlockedExchange8((char*)&pControlBlock->receiveNotice, c);
+		RaiseNotice();
 	}
 	// Emulate 'Large send offload'
 	void NotifyBufferReady(FSP_NoticeCode c = FSP_NotifyBufferReady)
@@ -720,6 +1048,7 @@ public:
 			_InterlockedCompareExchange8((char*)&pControlBlock->sendAllowedNotice, c, 0);
 		else
 			_InterlockedExchange8((char*)&pControlBlock->sendAllowedNotice, c);
+		RaiseNotice();
 	}
 
 	//
@@ -753,7 +1082,7 @@ public:
 	}
 
 	// Given the fixed header, the content (plain-text), the length of the context and the xor-value of salt
-	void * LOCALAPI SetIntegrityCheckCode(FSP_NormalPacketHeader *, void * = NULL, int32_t = 0, uint32_t = 0);
+	void * LOCALAPI SetIntegrityCheckCode(FSP_NormalPacketHeader *, void * = NULL, int32_t = 0, uint32_t = 0, octet * = NULL, GCM_AES_PACKET * = NULL);
 
 	// Solid input,  the payload, if any, is copied later
 	bool LOCALAPI ValidateICC(FSP_NormalPacketHeader *, int32_t, ALFID_T, uint32_t);
@@ -766,6 +1095,10 @@ public:
 	inline void CheckAckToKeepAlive();
 
 	bool ScheduleConnect(int);
+	void CompleteConnect();
+#if defined(__linux__) || defined(__CYGWIN__)
+	void PostConnectResolved();
+#endif
 
 	// On Feb.18, 2020 to prepare implementation of session hibernation/adjournment
 	void Adjourn() { SetState(CLOSABLE); }
@@ -777,12 +1110,12 @@ public:
 	// Command of ULA
 	void ProcessCommand(const UCommandToLLS &);
 	void Listen();
-	void Connect();
+	void Connect(const CommandNewSessionSrv &);
 	void Accept();
 	void RefuseToMultiply(uint32_t);
 
 	// Event triggered by the remote peer
-	void OnInitConnectAck(FSP_Challenge*);
+	void OnInitConnectAck(FSP_Challenge*, const CPacketReceiver &);
 	void OnConnectRequestAck();
 	void OnGetNulCommit();
 	void OnGetPersist();
@@ -827,17 +1160,25 @@ public:
 
 
 // The translate look-aside buffer of the server's socket pool
+// Allocation and release of the socket items are serialized by the mutex,
+// while looking up by ALFID or by remote ALFID is lock-free
 class CSocketSrvTLB: CSRWLock
 {
 protected:
 	friend class CSocketItemEx;
 
 	CSocketItemEx listenerSlots[MAX_LISTENER_NUM];
-	CSocketItemEx itemStorage[MAX_CONNECTION_NUM];
 
-	// The translation look-aside buffer of the socket items
-	CSocketItemEx *tlbSockets[MAX_CONNECTION_NUM];
-	CSocketItemEx *tlbSocketsByRemote[MAX_CONNECTION_NUM];
+	// The session items are allocated lazily, LLS_SESSION_SLAB_SIZE items at a time. The slabs are never freed
+	// so that the pointer got by a lock-free lookup always refers to some session item, in use or not.
+	// The last bits of the ALFID of a session item, in host byte order, are the index of the item
+	CSocketItemEx * volatile slabs[MAX_CONNECTION_NUM / LLS_SESSION_SLAB_SIZE];
+	int32_t			countSlabs;
+
+	// Hash of the multiplied sessions by the remote ALFID. A reader retries if the version changed
+	// while it was walking the collision chain; the version is odd while some writer is modifying the chain
+	CSocketItemEx * volatile tlbSocketsByRemote[MAX_CONNECTION_NUM];
+	volatile uint32_t versionRemoteTLB;
 
 	// The free list
 	CSocketItemEx *headFreeSID, *tailFreeSID;
@@ -845,13 +1186,26 @@ protected:
 	// List of socket allocated on INIT_CONNECT. The list is meant to be auto-recycled
 	CSocketItemEx* headLRUitem, * tailLRUitem;
 
-	// The ULA forest, for this implementation we use bit field to manage ULA mapping
-	// Number of ULA is hard limitted to bit field length of unsigned long
-	SProcessRoot	forestULA[sizeof(unsigned long) * 8];
-	unsigned long	forestFreeFlags;
+	// The ULA forest. The process roots are allocated lazily, LLS_ULA_SLAB_SIZE at a time, and recycled through
+	// the free list. Like the session slabs they are never freed, so that a stale reference to some root is still valid
+	SProcessRoot	*forestULA[LLS_MAX_ULA_PROCESSES / LLS_ULA_SLAB_SIZE];
+	int32_t			countForestSlabs;
+	int32_t			countULAProcesses;
+	SProcessRoot	*headFreeRoot;
+
+	bool AllocSlab();
+	void RerandomizeALFID(CSocketItemEx *);
+	SProcessRoot * AllocProcessRoot();
+	void FreeProcessRoot(SProcessRoot *);
+	CSocketItemEx * ItemAt(uint32_t k)
+	{
+		CSocketItemEx *p = slabs[k / LLS_SESSION_SLAB_SIZE];
+		return (p == NULL ? NULL : p + k % LLS_SESSION_SLAB_SIZE);
+	}
 
 public:
 	CSocketSrvTLB();
+	~CSocketSrvTLB();
 
 	// To pre-allocate a socket to accept connect request with an arbitrary local ALFID
 	ALFID_T			AllocItemReserve();
@@ -874,9 +1228,6 @@ public:
 
 	CSocketItemEx * operator[](ALFID_T);
 
-	bool PutToListenTLB(CSocketItemEx *, int);
-	bool DetachFromListenTLB(CSocketItemEx *);
-
 	bool PutToRemoteTLB(CMultiplyBacklogItem *);
 	bool DetachFromRemoteTLB(CSocketItemEx *);
 
@@ -899,14 +1250,150 @@ static inline bool LOCALAPI IsInSubnetSet(uint64_t prefix, const TSubnets subnet
 
 
 
-// A singleton
-class CLowerInterface: public CSocketSrvTLB
+// Performance counters of a receive worker of the lower interface, shared by all sessions
+struct CLowerInterfacePerformance
 {
-private:
+	uint64_t	countRecvCalls;		// number of receive system calls that fetched at least one datagram
+	uint64_t	countRecvPackets;	// number of datagrams fetched by these system calls
+	uint64_t	countInitAdmitted;	// number of INIT_CONNECT admitted
+	uint64_t	countInitThrottled;	// number of INIT_CONNECT discarded by the token bucket of the source prefix
+	uint64_t	countInitShed;		// number of INIT_CONNECT discarded as the handshake budget was exhausted
+	uint64_t	countCookieRejected;	// number of CONNECT_REQUEST with a forged, expired or replayed cookie
+	double		PacketsPerRecvCall() const
+	{
+		return countRecvCalls == 0 ? 0 : (double)countRecvPackets / countRecvCalls;
+	}
+};
+
+
+
+// Token bucket for admission control of INIT_CONNECT. Credit is in millionths of a token
+struct SAdmissionBucket
+{
+	uint64_t	credit;
+	timestamp_t	tLastRefill;
+};
+
+
+
+class CLowerInterface;
+
+// The receive worker: the particular receipt of a remote packet and the handlers working on it.
+// The lower interface itself is the first receive worker. In Linux there might be more receive workers,
+// each of which owns a UDP socket bound with SO_REUSEPORT for each interface, see also LLS_RECV_WORKERS
+class CPacketReceiver
+{
+protected:
+	friend class CLowerInterface;
 	friend class CSocketItemEx;
 
 	// limit socket set size to no greater than bit number of long integer
 	static const int SD_SETSIZE = 31;
+
+	// intermediate buffer to hold the fixed packet header, the optional header and the data
+#if defined(__linux__) || defined(__CYGWIN__)
+	// the packet being processed, which is one slot of the receive ring
+	PktBufferBlock	*pktBuf;
+#else
+	PktBufferBlock	pktBuf[1];
+#endif
+	int32_t			countRecv;
+
+	// storage location part of the particular receipt of a remote packet, respectively
+	// remote-end address and near-end address
+	SOCKADDR_INET	addrFrom;
+	CtrlMsgHdr		nearInfo;
+
+	// descriptor of what is received, i.e. the particular receipt of a remote packet
+#if defined(__WINDOWS__)
+	WSABUF			iovec[2];
+	WSAMSG			mesgInfo;
+	LPSOCKADDR		GetPacketSource() const { return LPSOCKADDR(mesgInfo.name); }
+	ALFID_T			GetRemoteFiberID() const  { return SOCKADDR_ALFID(mesgInfo.name); }
+	const CtrlMsgHdr* GetPacketNearInfo() const { return (CtrlMsgHdr*)mesgInfo.Control.buf; }
+	void			CopySinkInfTo(CtrlMsgHdr& hdrInfo)
+	{
+		memcpy(&hdrInfo, mesgInfo.Control.buf, min(mesgInfo.Control.len, sizeof(hdrInfo)));
+	}
+#elif defined(__linux__) || defined(__CYGWIN__)
+	struct iovec  	iovec[2];
+	struct msghdr	mesgInfo;
+	const struct sockaddr* GetPacketSource() const { return (const struct sockaddr*)mesgInfo.msg_name; }
+	ALFID_T			GetRemoteFiberID() const  { return SOCKADDR_ALFID(mesgInfo.msg_name); }
+	const CtrlMsgHdr* GetPacketNearInfo() const { return (CtrlMsgHdr*)mesgInfo.msg_control; }
+	void			CopySinkInfTo(CtrlMsgHdr& hdrInfo)
+	{
+		memcpy(&hdrInfo, mesgInfo.msg_control, min((size_t)mesgInfo.msg_controllen, sizeof(hdrInfo)));
+	}
+
+	// The receive ring filled by one recvmmsg. Each datagram in the ring is in turn
+	// made the 'current' receipt, i.e. pktBuf, addrFrom, nearInfo and mesgInfo, before it is processed
+	PktBufferBlock	recvRing[LLS_RECV_BATCH_SIZE];
+	SOCKADDR_INET	addrRing[LLS_RECV_BATCH_SIZE];
+	// room for the IP_PKTINFO and the UDP_GRO control message
+	ALIGN(FSP_ALIGNMENT)
+	octet			ctrlRing[LLS_RECV_BATCH_SIZE][CMSG_SPACE(sizeof(struct in_pktinfo)) + CMSG_SPACE(sizeof(int))];
+	struct iovec	iovRing[LLS_RECV_BATCH_SIZE][2];
+	struct mmsghdr	mmsgRing[LLS_RECV_BATCH_SIZE];
+#if LLS_UDP_GRO
+	// A slot may hold a super-datagram which is split into FSP packets before they are processed
+	ALIGN(FSP_ALIGNMENT)
+	octet			groRing[LLS_RECV_BATCH_SIZE][LLS_GRO_BUFFER_SIZE];
+	inline int		GetSegmentSize(int);
+	inline bool		CopySegment(int, int32_t, int32_t);
+#endif
+
+	inline void		PrepareRecvRing();
+	inline int		RecvBatch(int);
+	inline void		SetCurrentReceipt(int, int32_t);
+
+	pthread_t		thReceiver;	// the handle of the thread that listens
+	int				index;		// the index of the worker, which is also the index of its socket in the reuseport group
+	int				sdRecv[SD_SETSIZE];	// one for each interface
+
+	static	void * ProcessRemotePacket(void *);
+	inline void		ProcessRemotePacket();
+	//^ the thread entry function for processing packet sent from the remote-end peer
+#endif
+
+	template<typename THdr> THdr * FSP_OperationHeader() { return (THdr *) & pktBuf->hdr; }
+
+	ALFID_T			GetLocalFiberID() const { return nearInfo.u.idALF; }
+	ALFID_T			SetLocalFiberID(ALFID_T);
+
+	inline CSocketItemEx *MapSocket();
+
+	// defined in remote.cpp
+	int	 ProcessReceived();
+	// processing individual type of packet header
+	void OnGetInitConnect();
+	void OnGetConnectRequest();
+
+	// defined in admission.cpp
+	SAdmissionBucket	handshakeBudget;
+	SAdmissionBucket	admissionBuckets[LLS_ADMISSION_BUCKETS];
+	uint64_t			admissionKey[2];
+	bool				shedding;
+	inline uint64_t		SourcePrefix() const;
+	bool				AdmitInitConnect();
+
+public:
+	CLowerInterfacePerformance perfCounts;
+
+	int LOCALAPI SendBack(char *, int);
+	// It might be necessary to send reset BEFORE a connection context is established
+	void LOCALAPI SendPrematureReset(uint32_t = 0, CSocketItemEx * = NULL);
+};
+
+
+
+// A singleton
+class CLowerInterface: public CSocketSrvTLB, public CPacketReceiver
+{
+private:
+	friend class CSocketItemEx;
+	friend class CPacketReceiver;
+
 	int		interfaces[SD_SETSIZE];
 	long	disableFlags;
 	SOCKADDR_IN6 addresses[SD_SETSIZE];	// by default IPv6 addresses, but an entry might be a UDP over IPv4 address
@@ -948,11 +1435,19 @@ private:
 	const octet in6addr_6to4prefix[2] = { 0x20, 0x02 };
 	const octet in6addr_teredoprefix[4] = { 0x20, 0x01, 0, 0};
 
-	pthread_t	thReceiver;	// the handle of the thread that listens
 	sigevent_t	hMobililty;	// handling mobility, the handle of the address-changed event
 	int		sdSet[SD_SETSIZE];
 	int		sdSend;		// the socket descriptor, would at last be unbound for sending only
 	int		countInterfaces;	// Should be less than SD_SETSIZE
+#if defined(__linux__) || defined(__CYGWIN__)
+	int		countWorkers;		// number of receive workers, at least 1
+	CPacketReceiver	*workers[LLS_RECV_WORKERS];
+	int		fdStopWorkers;		// an eventfd, readable once the receive workers are to stop
+
+	inline bool StartWorkers();
+	inline int	BindWorkerSocket(int, int);
+	inline bool	AttachSteeringFilter(int);
+#endif
 
 # define	LOOP_FOR_ENABLED_INTERFACE(stmt)	\
 	for (register int i = 0;	\
@@ -996,60 +1491,13 @@ private:
 	friend void UnitTestSelectPath();
 #endif
 
-	// intermediate buffer to hold the fixed packet header, the optional header and the data
-	PktBufferBlock	pktBuf[1];
-	int32_t			countRecv;
-
-	// storage location part of the particular receipt of a remote packet, respectively
-	// remote-end address and near-end address
-	SOCKADDR_INET	addrFrom;
-	CtrlMsgHdr		nearInfo;
-
-	// descriptor of what is received, i.e. the particular receipt of a remote packet
-#if defined(__WINDOWS__)
-	WSABUF			iovec[2];
-	WSAMSG			mesgInfo;
-	LPSOCKADDR		GetPacketSource() const { return LPSOCKADDR(mesgInfo.name); }
-	ALFID_T			GetRemoteFiberID() const  { return SOCKADDR_ALFID(mesgInfo.name); }
-	const CtrlMsgHdr* GetPacketNearInfo() const { return (CtrlMsgHdr*)mesgInfo.Control.buf; }
-	void			CopySinkInfTo(CtrlMsgHdr& hdrInfo)
-	{
-		memcpy(&hdrInfo, mesgInfo.Control.buf, min(mesgInfo.Control.len, sizeof(hdrInfo)));
-	}
-#elif defined(__linux__) || defined(__CYGWIN__)
-	struct iovec  	iovec[2];
-	struct msghdr	mesgInfo;
-	const struct sockaddr* GetPacketSource() const { return (const struct sockaddr*)mesgInfo.msg_name; }
-	ALFID_T			GetRemoteFiberID() const  { return SOCKADDR_ALFID(mesgInfo.msg_name); }
-	const CtrlMsgHdr* GetPacketNearInfo() const { return (CtrlMsgHdr*)mesgInfo.msg_control; }
-	void			CopySinkInfTo(CtrlMsgHdr& hdrInfo)
-	{
-		memcpy(&hdrInfo, mesgInfo.msg_control, min((size_t)mesgInfo.msg_controllen, sizeof(hdrInfo)));
-	}
-#endif
-
-	template<typename THdr> THdr * FSP_OperationHeader() { return (THdr *) & pktBuf->hdr; }
-
-	ALFID_T			GetLocalFiberID() const { return nearInfo.u.idALF; }
-	ALFID_T			SetLocalFiberID(ALFID_T);
-
-	CSocketItemEx	*MapSocket() { return (*this)[GetLocalFiberID()]; }
-
 protected:
-	// defined in remote.cpp
-	int	 ProcessReceived();
-	// processing individual type of packet header
-	void OnGetInitConnect();
-	void OnGetConnectRequest();
-
 	// FSP over IPv6 and FSP over UDP/IPv4 have different implementation
 	// defined in os-dependent source file
 	int LOCALAPI EnumEffectiveAddresses(uint64_t *);
 #if defined(__WINDOWS__)
 	inline	int SetInterfaceOptions(SOCKET);
 	static	DWORD WINAPI ProcessRemotePacket(LPVOID);
-#elif defined(__linux__) || defined(__CYGWIN__)
-	static	void * ProcessRemotePacket(void *);
 #endif
 
 public:
@@ -1057,16 +1505,14 @@ public:
 	bool Initialize();
 	void Destroy();
 
-	int LOCALAPI SendBack(char *, int);
-	// It might be necessary to send reset BEFORE a connection context is established
-	void LOCALAPI SendPrematureReset(uint32_t = 0, CSocketItemEx * = NULL);
-
 	inline bool IsPrefixDuplicated(int, PIN6_ADDR);
 	inline bool LearnAddresses();
 	inline void MakeALFIDsPool();
 
+#if defined(__WINDOWS__)
 	inline void ProcessRemotePacket();
 	//^ the thread entry function for processing packet sent from the remote-end peer
+#endif
 
 #ifndef OVER_UDP_IPv4
 	// For FSP over IPv6 raw-socket, preconfigure an IPv6 interface with ALFID pool
@@ -1088,12 +1534,18 @@ public:
 	static CLowerInterface Singleton;	// this class is effectively a namespace
 };
 
+
+
+inline CSocketItemEx * CPacketReceiver::MapSocket() { return CLowerInterface::Singleton[GetLocalFiberID()]; }
+
 // defined in socket.cpp
 void LOCALAPI DumpHexical(const void *, int);
 void LOCALAPI DumpNetworkUInt16(uint16_t *, int);
 
-// defined in mobile.cpp
+// defined in admission.cpp
 uint64_t LOCALAPI CalculateCookie(const void *, int, timestamp_t);
+bool LOCALAPI ValidateCookie(const void *, int, timestamp_t, uint64_t);
+void LOCALAPI RecordCookie(timestamp_t, uint64_t);
 
 // defined in CRC64.c
 extern "C" uint64_t CalculateCRC64(register uint64_t, register const void *, size_t);
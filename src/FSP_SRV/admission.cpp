@@ -0,0 +1,384 @@
+/*
+ * FSP lower-layer service program, the stateless front end of the connection handshake:
+ * the cookie, admission control of INIT_CONNECT and the filter of replayed cookies
+ *
+    Copyright (c) 2012, Jason Gao
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without modification,
+    are permitted provided that the following conditions are met:
+
+    - Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT,INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "fsp_srv.h"
+
+// The cookie is computed with SipHash-2-4 [Aumasson & Bernstein, 2012] instead of a GCM pass,
+// as it has to be computed for every INIT_CONNECT and checked for every CONNECT_REQUEST, forged or not
+#define ROTL64(x, b)	(uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND()				\
+	do {						\
+		v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32);	\
+		v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;	\
+		v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;	\
+		v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32);	\
+	} while(0)
+
+#define COOKIE_MATERIAL_WORDS	4	// maximum length of the cookie material, in 64-bit words
+
+// Secret of the cookie of an epoch. The secret of the current epoch and that of the previous one are kept
+struct SCookieSecret
+{
+	volatile uint32_t	epoch;	// the epoch that the key is for, 0 if the slot is being updated
+	uint64_t	key[2];
+};
+
+// Filter of the cookies that have been accepted in an epoch, a Bloom filter
+struct SReplayFilter
+{
+	volatile uint32_t	epoch;
+	uint32_t	bits[(1 << LLS_REPLAY_FILTER_BITS) / 32];
+};
+
+static SCookieSecret	cookieSecrets[2];
+static SReplayFilter	replayFilters[2];
+static CLightMutex		mutexCookieSecret;
+static CLightMutex		mutexReplayFilter;
+
+
+
+// Given
+//	const uint64_t [2]	the 128-bit key
+//	const uint64_t *	the message, in 64-bit words
+//	int					number of words of the message
+// Return
+//	SipHash-2-4 of the message. The words are taken in host byte order, which is alright as the cookie
+//	is verified by the very host that made it
+static uint64_t SipHash24(const uint64_t k[2], const uint64_t *m, int n)
+{
+	register uint64_t v0 = k[0] ^ 0x736f6d6570736575ULL;
+	register uint64_t v1 = k[1] ^ 0x646f72616e646f6dULL;
+	register uint64_t v2 = k[0] ^ 0x6c7967656e657261ULL;
+	register uint64_t v3 = k[1] ^ 0x7465646279746573ULL;
+	for (register int i = 0; i < n; i++)
+	{
+		v3 ^= m[i];
+		SIPROUND();
+		SIPROUND();
+		v0 ^= m[i];
+	}
+	const uint64_t b = (uint64_t)(n * 8) << 56;
+	v3 ^= b;
+	SIPROUND();
+	SIPROUND();
+	v0 ^= b;
+	v2 ^= 0xff;
+	SIPROUND();
+	SIPROUND();
+	SIPROUND();
+	SIPROUND();
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+
+static inline uint32_t CookieEpoch(timestamp_t t) { return uint32_t(t / (LLS_COOKIE_EPOCH_ms * 1000ULL)); }
+
+
+
+// Given
+//	uint32_t	the epoch
+//	uint64_t [2]	placeholder of the key
+// Return
+//	true if the key of the epoch is available and copied, false if it has expired or not been made yet
+// Remark
+//	Lock-free. Epoch numbers are unique, so if the epoch tag is the same before and after the key is copied
+//	the key is not overwritten in the meantime
+static bool GetCookieKey(uint32_t e, uint64_t k[2])
+{
+	SCookieSecret & s = cookieSecrets[e & 1];
+	if (LCKREAD(s.epoch) != e)
+		return false;
+	k[0] = s.key[0];
+	k[1] = s.key[1];
+	return (LCKREAD(s.epoch) == e);
+}
+
+
+
+// Given
+//	uint32_t	the current epoch
+//	uint64_t [2]	placeholder of the key
+// Do
+//	Make the new secret of the current epoch, which overwrites the secret of the epoch before the previous one
+// Return
+//	true if the key is made and copied, false if the lock could not be obtained
+static bool MakeCookieKey(uint32_t e, uint64_t k[2])
+{
+	if (!mutexCookieSecret.WaitSetMutex())
+		return false;
+
+	SCookieSecret & s = cookieSecrets[e & 1];
+	if (s.epoch != e)
+	{
+		_InterlockedExchange((PLONG)&s.epoch, 0);
+		rand_w32((uint32_t *)s.key, (int)(sizeof(s.key) / 4));
+		_InterlockedExchange((PLONG)&s.epoch, e);
+	}
+	k[0] = s.key[0];
+	k[1] = s.key[1];
+
+	mutexCookieSecret.SetMutexFree();
+	return true;
+}
+
+
+
+static uint64_t CookieOf(const uint64_t k[2], const void *header, int sizeHdr, timestamp_t t0)
+{
+	uint64_t m[COOKIE_MATERIAL_WORDS + 1];
+	const int n = (sizeHdr + 7) / 8;
+	m[n - 1] = 0;
+	memcpy(m, header, sizeHdr);
+	m[n] = t0;
+	return SipHash24(k, m, n + 1);
+}
+
+
+
+// Given
+//	uint32_t	the epoch of the cookie
+//	uint64_t	the cookie which has been validated
+// Return
+//	true if the cookie has been accepted before in the epoch, false if it is new
+// Remark
+//	The cookie is a keyed hash already, so three slices of it index the Bloom filter directly.
+//	A false positive costs the initiator a retry of the whole handshake
+static bool TestReplayFilter(uint32_t e, uint64_t cookie)
+{
+	SReplayFilter & f = replayFilters[e & 1];
+	if (LCKREAD(f.epoch) != e)
+		return false;	// nothing has been accepted in the epoch yet
+
+	const uint32_t mask = (1 << LLS_REPLAY_FILTER_BITS) - 1;
+	for (register int i = 0; i < 3; i++)
+	{
+		uint32_t j = uint32_t(cookie >> (i * 21)) & mask;
+		if ((LCKREAD(f.bits[j >> 5]) & (1U << (j & 31))) == 0)
+			return false;
+	}
+	return true;
+}
+
+
+
+// Given
+//	uint32_t	the epoch of the cookie
+//	uint64_t	the cookie which has been accepted
+// Do
+//	Set the bits of the cookie in the Bloom filter of the epoch, which is cleared at first if it is stale
+// Remark
+//	If the filter cannot be locked for clearing, the cookie is simply not recorded:
+//	contention on the lock shall not reject a legitimate connection request
+static void SetReplayFilter(uint32_t e, uint64_t cookie)
+{
+	SReplayFilter & f = replayFilters[e & 1];
+	if (LCKREAD(f.epoch) != e)
+	{
+		if (!mutexReplayFilter.WaitSetMutex())
+			return;
+		if (f.epoch != e)
+		{
+			_InterlockedExchange((PLONG)&f.epoch, 0);
+			memset(f.bits, 0, sizeof(f.bits));
+			_InterlockedExchange((PLONG)&f.epoch, e);
+		}
+		mutexReplayFilter.SetMutexFree();
+	}
+
+	const uint32_t mask = (1 << LLS_REPLAY_FILTER_BITS) - 1;
+	for (register int i = 0; i < 3; i++)
+	{
+		uint32_t j = uint32_t(cookie >> (i * 21)) & mask;
+		_InterlockedOr((PLONG)&f.bits[j >> 5], 1U << (j & 31));
+	}
+}
+
+
+
+// Given
+//	const void *pointer to the byte string of cookie material for the calculation
+//	int			the length of the cookie material
+//	timestamp_t	the time associated with the cookie, which determines the epoch of the secret
+// Do
+//	Calculate the cookie with the secret of the epoch. The secret of the current epoch is made on demand
+// Return
+//	The 64-bit cookie value, 0 if the epoch has expired or failed to make the secret
+uint64_t LOCALAPI CalculateCookie(const void *header, int sizeHdr, timestamp_t t0)
+{
+	uint64_t k[2];
+	if (sizeHdr <= 0 || sizeHdr > COOKIE_MATERIAL_WORDS * 8)
+		return 0;
+
+	const uint32_t e = CookieEpoch(t0);
+	if (!GetCookieKey(e, k) && (e != CookieEpoch(NowUTC()) || !MakeCookieKey(e, k)))
+		return 0;
+	return CookieOf(k, header, sizeHdr, t0);
+}
+
+
+
+// Given
+//	const void *pointer to the byte string of cookie material for the calculation
+//	int			the length of the cookie material
+//	timestamp_t	the time associated with the cookie, i.e. when the cookie was made
+//	uint64_t	the cookie to validate
+// Return
+//	true if the cookie was made in the current or the previous epoch by this host and has not been accepted
+//	false if it is forged, expired or replayed
+// Remark
+//	The cookie is not recorded as seen until RecordCookie is called,
+//	so a request dropped for lack of resource may be retransmitted
+bool LOCALAPI ValidateCookie(const void *header, int sizeHdr, timestamp_t t0, uint64_t cookie)
+{
+	uint64_t k[2];
+	if (sizeHdr <= 0 || sizeHdr > COOKIE_MATERIAL_WORDS * 8)
+		return false;
+
+	const uint32_t e = CookieEpoch(t0);
+	const uint32_t eNow = CookieEpoch(NowUTC());
+	if ((e != eNow && e + 1 != eNow) || !GetCookieKey(e, k))
+		return false;
+	if (CookieOf(k, header, sizeHdr, t0) != cookie)
+		return false;
+
+	return !TestReplayFilter(e, cookie);
+}
+
+
+
+// Given
+//	timestamp_t	the time associated with the cookie, i.e. when the cookie was made
+//	uint64_t	the cookie validated by ValidateCookie
+// Do
+//	Record that the cookie has been accepted, so that it is rejected if replayed
+void LOCALAPI RecordCookie(timestamp_t t0, uint64_t cookie)
+{
+	SetReplayFilter(CookieEpoch(t0), cookie);
+}
+
+
+
+// Given
+//	SAdmissionBucket &	the token bucket
+//	timestamp_t		the current monotonic time
+//	uint64_t		rate of the tokens, per second
+//	uint64_t		capacity of the bucket, in tokens
+// Do
+//	Refill the bucket according to the time elapsed since it was refilled the last time
+static inline void RefillBucket(SAdmissionBucket & b, timestamp_t tNow, uint64_t rate, uint64_t burst)
+{
+	const uint64_t capacity = burst * 1000000;
+	int64_t d = int64_t(tNow - b.tLastRefill);
+	if (d <= 0)
+		return;
+	b.credit = ((uint64_t)d >= capacity / rate) ? capacity : min(capacity, b.credit + (uint64_t)d * rate);
+	b.tLastRefill = tNow;
+}
+
+
+
+static inline bool TakeToken(SAdmissionBucket & b)
+{
+	if (b.credit < 1000000)
+		return false;
+	b.credit -= 1000000;
+	return true;
+}
+
+
+
+// Return the network prefix of the source of the current receipt: /24 of IPv4 or /64 of IPv6,
+// tagged with the address family so that the two never collide
+inline uint64_t CPacketReceiver::SourcePrefix() const
+{
+	if (addrFrom.si_family == AF_INET)
+		return (uint64_t(AF_INET) << 48) | (be32toh(addrFrom.Ipv4.sin_addr.s_addr) >> (32 - LLS_ADMISSION_PREFIX_V4));
+	return *(uint64_t *)&addrFrom.Ipv6.sin6_addr;
+}
+
+
+
+// Do
+//	Admission control of the current INIT_CONNECT, before any per-session state is touched or any crypto is computed
+// Return
+//	true if it is admitted, false if it is to be discarded silently
+// Remark
+//	Each source prefix has a token bucket of LLS_ADMISSION_PREFIX_RATE, and the receive worker has a handshake budget of
+//	LLS_HANDSHAKE_RATE. Once the budget is exhausted the worker sheds all INIT_CONNECT without looking up the prefix,
+//	until it regains half of the burst. Established sessions are served by the very receive worker,
+//	so they are protected by keeping the cost of a rejected INIT_CONNECT minimal.
+//	The buckets are per receive worker, so no lock is needed. The prefixes that collide share the bucket,
+//	and the index is keyed so that the attacker cannot aim at the bucket of a victim prefix.
+//	A bucket never used starts with a single token instead of the full burst, so that spoofing
+//	fresh prefixes does not earn credit faster than the buckets refill
+bool CPacketReceiver::AdmitInitConnect()
+{
+	const timestamp_t tNow = NowInLoop();
+
+	RefillBucket(handshakeBudget, tNow, LLS_HANDSHAKE_RATE, LLS_HANDSHAKE_BURST);
+	if (shedding)
+	{
+		if (handshakeBudget.credit < LLS_HANDSHAKE_BURST * 1000000 / 2)
+		{
+			perfCounts.countInitShed++;
+			return false;
+		}
+		shedding = false;
+	}
+
+	if (admissionKey[0] == 0 && admissionKey[1] == 0)
+		rand_w32((uint32_t *)admissionKey, (int)(sizeof(admissionKey) / 4));
+	const uint64_t prefix = SourcePrefix();
+	SAdmissionBucket & b = admissionBuckets[SipHash24(admissionKey, &prefix, 1) & (LLS_ADMISSION_BUCKETS - 1)];
+	if (b.tLastRefill == 0)
+	{
+		b.credit = 1000000;
+		b.tLastRefill = tNow;
+	}
+	else
+	{
+		RefillBucket(b, tNow, LLS_ADMISSION_PREFIX_RATE, LLS_ADMISSION_PREFIX_BURST);
+	}
+	if (!TakeToken(b))
+	{
+		perfCounts.countInitThrottled++;
+		return false;
+	}
+
+	if (!TakeToken(handshakeBudget))
+	{
+		shedding = true;
+		perfCounts.countInitShed++;
+		return false;
+	}
+
+	perfCounts.countInitAdmitted++;
+	return true;
+}
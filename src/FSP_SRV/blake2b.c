@@ -1,9 +1,28 @@
 // A simple BLAKE2b Reference Implementation.
 //	Saarinen & Aumasson
 //	RFC 7693               BLAKE2 Crypto Hash and MAC          November 2015
+// With SSE4.1 and AVX2 compression functions selected at run time,
+// and the BLAKE2bp parallel mode of four leaves.
 
+#include <string.h>
 #include "blake2b.h"
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+# if defined(_MSC_VER)
+#  include <intrin.h>
+#  define X86_TARGET(s)
+# else
+#  include <cpuid.h>
+#  include <immintrin.h>
+#  define X86_TARGET(s)  __attribute__((target(s)))
+# endif
+# ifndef BLAKE2B_NO_SIMD
+#  define BLAKE2B_SIMD
+#  define SSE41_TARGET  X86_TARGET("sse4.1")
+#  define AVX2_TARGET   X86_TARGET("avx2")
+# endif
+#endif
+
 // Cyclic right rotation.
 
 #ifndef ROTR64
@@ -44,102 +63,485 @@ static const uint64_t blake2b_iv[8] = {
     0x1F83D9ABFB41BD6B, 0x5BE0CD19137E2179
 };
 
-// Compression function. "last" flag indicates last block.
-
-static void blake2b_compress(blake2b_ctx *ctx, int last)
-{
-    const uint8_t sigma[12][16] = {
-        { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
-        { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
-        { 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
-        { 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
-        { 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
-        { 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
-        { 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
-        { 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
-        { 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
-        { 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
-        { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
-        { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 }
-    };
+// Message schedule.
+
+static const uint8_t blake2b_sigma[12][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+    { 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+    { 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+    { 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+    { 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+    { 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+    { 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+    { 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+    { 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 }
+};
+
+// Finalization flags of the compression function.
+
+#define B2B_LAST_BLOCK  1
+#define B2B_LAST_NODE   2               // the last node of a layer in tree mode
+
+// Compression function, the portable reference.
+//      "last" flags indicate last block, and last node if it is of a tree.
+
+static void blake2b_compress_ref(uint64_t h[8], const uint64_t t[2],
+    const uint8_t *block, int last)
+{
     int i;
     uint64_t v[16], m[16];
 
     for (i = 0; i < 8; i++) {           // init work variables
-        v[i] = ctx->h[i];
+        v[i] = h[i];
         v[i + 8] = blake2b_iv[i];
     }
 
-    v[12] ^= ctx->t[0];                 // low 64 bits of offset
-    v[13] ^= ctx->t[1];                 // high 64 bits
-    if (last)                           // last block flag set ?
+    v[12] ^= t[0];                      // low 64 bits of offset
+    v[13] ^= t[1];                      // high 64 bits
+    if (last & B2B_LAST_BLOCK)          // last block flag set ?
         v[14] = ~v[14];
+    if (last & B2B_LAST_NODE)           // last node flag set ?
+        v[15] = ~v[15];
 
     for (i = 0; i < 16; i++)            // get little-endian words
-        m[i] = B2B_GET64(&ctx->b[8 * i]);
+        m[i] = B2B_GET64(&block[8 * i]);
 
     for (i = 0; i < 12; i++) {          // twelve rounds
-        B2B_G( 0, 4,  8, 12, m[sigma[i][ 0]], m[sigma[i][ 1]]);
-        B2B_G( 1, 5,  9, 13, m[sigma[i][ 2]], m[sigma[i][ 3]]);
-        B2B_G( 2, 6, 10, 14, m[sigma[i][ 4]], m[sigma[i][ 5]]);
-        B2B_G( 3, 7, 11, 15, m[sigma[i][ 6]], m[sigma[i][ 7]]);
-        B2B_G( 0, 5, 10, 15, m[sigma[i][ 8]], m[sigma[i][ 9]]);
-        B2B_G( 1, 6, 11, 12, m[sigma[i][10]], m[sigma[i][11]]);
-        B2B_G( 2, 7,  8, 13, m[sigma[i][12]], m[sigma[i][13]]);
-        B2B_G( 3, 4,  9, 14, m[sigma[i][14]], m[sigma[i][15]]);
+        B2B_G( 0, 4,  8, 12, m[blake2b_sigma[i][ 0]], m[blake2b_sigma[i][ 1]]);
+        B2B_G( 1, 5,  9, 13, m[blake2b_sigma[i][ 2]], m[blake2b_sigma[i][ 3]]);
+        B2B_G( 2, 6, 10, 14, m[blake2b_sigma[i][ 4]], m[blake2b_sigma[i][ 5]]);
+        B2B_G( 3, 7, 11, 15, m[blake2b_sigma[i][ 6]], m[blake2b_sigma[i][ 7]]);
+        B2B_G( 0, 5, 10, 15, m[blake2b_sigma[i][ 8]], m[blake2b_sigma[i][ 9]]);
+        B2B_G( 1, 6, 11, 12, m[blake2b_sigma[i][10]], m[blake2b_sigma[i][11]]);
+        B2B_G( 2, 7,  8, 13, m[blake2b_sigma[i][12]], m[blake2b_sigma[i][13]]);
+        B2B_G( 3, 4,  9, 14, m[blake2b_sigma[i][14]], m[blake2b_sigma[i][15]]);
     }
 
     for( i = 0; i < 8; ++i )
-        ctx->h[i] ^= v[i] ^ v[i + 8];
+        h[i] ^= v[i] ^ v[i + 8];
 }
 
-// Initialize the hashing context "ctx" with optional key "key".
-//      1 <= outlen <= 64 gives the digest size in bytes.
-//      Secret key (also <= 64 bytes) is optional (keylen = 0).
 
-int blake2b_init(blake2b_ctx *ctx, size_t outlen,
-    const void *key, size_t keylen)        // (keylen=0: no key)
+
+#ifdef BLAKE2B_SIMD
+
+#define B2B_USE_SSE41   1
+#define B2B_USE_AVX2    2
+
+static int simdLevel = -1;
+
+// Return the widest SIMD extension usable, probed by CPUID at the first call.
+
+static int blake2b_simd_level(void)
 {
-    size_t i;
+    if (simdLevel < 0) {
+        unsigned int a, b, c = 0, d;
+        unsigned int b7 = 0, xcr0 = 0;
+        int f = 0;
+#if defined(_MSC_VER)
+        int r[4];
+        __cpuid(r, 0);
+        if (r[0] >= 7) {
+            __cpuidex(r, 7, 0);
+            b7 = r[1];
+        }
+        __cpuid(r, 1);
+        c = r[2];
+        if ((c & (1 << 27)) != 0)       // OSXSAVE
+            xcr0 = (unsigned int)_xgetbv(0);
+#else
+        if (__get_cpuid_max(0, NULL) >= 7)
+            __cpuid_count(7, 0, a, b7, c, d);
+        __get_cpuid(1, &a, &b, &c, &d);
+        if ((c & bit_OSXSAVE) != 0)
+            __asm__ ("xgetbv" : "=a"(xcr0), "=d"(d) : "c"(0));
+#endif
+        if ((c & (1 << 19)) != 0)       // SSE4.1
+            f = B2B_USE_SSE41;
+        // AVX2: leaf 7 EBX bit 5; XMM and YMM states saved by the OS
+        if (f != 0 && (b7 & (1 << 5)) != 0 && (xcr0 & 6) == 6)
+            f = B2B_USE_AVX2;
+        simdLevel = f;
+    }
+    return simdLevel;
+}
 
-    if (outlen == 0 || outlen > 64 || keylen > 64)
-        return -1;                      // illegal parameters
+
+
+// SSE4.1: each row of the 4x4 work matrix takes two registers, one G on each 64-bit lane.
+
+#define B2B_ROTR32_128(x)   _mm_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define B2B_ROTR24_128(x)   _mm_shuffle_epi8((x), r24)
+#define B2B_ROTR16_128(x)   _mm_shuffle_epi8((x), r16)
+#define B2B_ROTR63_128(x)   _mm_xor_si128(_mm_srli_epi64((x), 63), _mm_add_epi64((x), (x)))
+
+#define B2B_G1_128(xl, xh) {                                                    \
+    row1l = _mm_add_epi64(_mm_add_epi64(row1l, row2l), xl);                     \
+    row1h = _mm_add_epi64(_mm_add_epi64(row1h, row2h), xh);                     \
+    row4l = B2B_ROTR32_128(_mm_xor_si128(row4l, row1l));                        \
+    row4h = B2B_ROTR32_128(_mm_xor_si128(row4h, row1h));                        \
+    row3l = _mm_add_epi64(row3l, row4l);                                        \
+    row3h = _mm_add_epi64(row3h, row4h);                                        \
+    row2l = B2B_ROTR24_128(_mm_xor_si128(row2l, row3l));                        \
+    row2h = B2B_ROTR24_128(_mm_xor_si128(row2h, row3h)); }
+
+#define B2B_G2_128(yl, yh) {                                                    \
+    row1l = _mm_add_epi64(_mm_add_epi64(row1l, row2l), yl);                     \
+    row1h = _mm_add_epi64(_mm_add_epi64(row1h, row2h), yh);                     \
+    row4l = B2B_ROTR16_128(_mm_xor_si128(row4l, row1l));                        \
+    row4h = B2B_ROTR16_128(_mm_xor_si128(row4h, row1h));                        \
+    row3l = _mm_add_epi64(row3l, row4l);                                        \
+    row3h = _mm_add_epi64(row3h, row4h);                                        \
+    row2l = B2B_ROTR63_128(_mm_xor_si128(row2l, row3l));                        \
+    row2h = B2B_ROTR63_128(_mm_xor_si128(row2h, row3h)); }
+
+// Rotate rows 2, 3 and 4 left by 1, 2 and 3 columns so that the diagonals become columns.
+#define B2B_DIAGONALIZE_128() {                                                 \
+    __m128i t0 = _mm_alignr_epi8(row2h, row2l, 8);                              \
+    __m128i t1 = _mm_alignr_epi8(row2l, row2h, 8);                              \
+    row2l = t0; row2h = t1;                                                     \
+    t0 = row3l; row3l = row3h; row3h = t0;                                      \
+    t0 = _mm_alignr_epi8(row4h, row4l, 8);                                      \
+    t1 = _mm_alignr_epi8(row4l, row4h, 8);                                      \
+    row4l = t1; row4h = t0; }
+
+#define B2B_UNDIAGONALIZE_128() {                                               \
+    __m128i t0 = _mm_alignr_epi8(row2l, row2h, 8);                              \
+    __m128i t1 = _mm_alignr_epi8(row2h, row2l, 8);                              \
+    row2l = t0; row2h = t1;                                                     \
+    t0 = row3l; row3l = row3h; row3h = t0;                                      \
+    t0 = _mm_alignr_epi8(row4h, row4l, 8);                                      \
+    t1 = _mm_alignr_epi8(row4l, row4h, 8);                                      \
+    row4l = t0; row4h = t1; }
+
+#define B2B_MSG_128(r, i, j)    _mm_set_epi64x((int64_t)m[blake2b_sigma[r][j]], (int64_t)m[blake2b_sigma[r][i]])
+
+#define B2B_ROUND_128(r) {                                                      \
+    B2B_G1_128(B2B_MSG_128(r, 0, 2), B2B_MSG_128(r, 4, 6));                     \
+    B2B_G2_128(B2B_MSG_128(r, 1, 3), B2B_MSG_128(r, 5, 7));                     \
+    B2B_DIAGONALIZE_128();                                                      \
+    B2B_G1_128(B2B_MSG_128(r, 8, 10), B2B_MSG_128(r, 12, 14));                  \
+    B2B_G2_128(B2B_MSG_128(r, 9, 11), B2B_MSG_128(r, 13, 15));                  \
+    B2B_UNDIAGONALIZE_128(); }
+
+SSE41_TARGET
+static void blake2b_compress_sse41(uint64_t h[8], const uint64_t t[2],
+    const uint8_t *block, int last)
+{
+    const __m128i r16 = _mm_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+    const __m128i r24 = _mm_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+    uint64_t m[16];
+    __m128i row1l, row1h, row2l, row2h, row3l, row3h, row4l, row4h;
+
+    memcpy(m, block, sizeof(m));        // x86 is little-endian
+
+    row1l = _mm_loadu_si128((const __m128i *)&h[0]);
+    row1h = _mm_loadu_si128((const __m128i *)&h[2]);
+    row2l = _mm_loadu_si128((const __m128i *)&h[4]);
+    row2h = _mm_loadu_si128((const __m128i *)&h[6]);
+    row3l = _mm_loadu_si128((const __m128i *)&blake2b_iv[0]);
+    row3h = _mm_loadu_si128((const __m128i *)&blake2b_iv[2]);
+    row4l = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&blake2b_iv[4]),
+        _mm_loadu_si128((const __m128i *)t));
+    row4h = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&blake2b_iv[6]),
+        _mm_set_epi64x((last & B2B_LAST_NODE) ? -1 : 0, (last & B2B_LAST_BLOCK) ? -1 : 0));
+
+    B2B_ROUND_128(0);
+    B2B_ROUND_128(1);
+    B2B_ROUND_128(2);
+    B2B_ROUND_128(3);
+    B2B_ROUND_128(4);
+    B2B_ROUND_128(5);
+    B2B_ROUND_128(6);
+    B2B_ROUND_128(7);
+    B2B_ROUND_128(8);
+    B2B_ROUND_128(9);
+    B2B_ROUND_128(10);
+    B2B_ROUND_128(11);
+
+    _mm_storeu_si128((__m128i *)&h[0], _mm_xor_si128(_mm_loadu_si128((const __m128i *)&h[0]),
+        _mm_xor_si128(row1l, row3l)));
+    _mm_storeu_si128((__m128i *)&h[2], _mm_xor_si128(_mm_loadu_si128((const __m128i *)&h[2]),
+        _mm_xor_si128(row1h, row3h)));
+    _mm_storeu_si128((__m128i *)&h[4], _mm_xor_si128(_mm_loadu_si128((const __m128i *)&h[4]),
+        _mm_xor_si128(row2l, row4l)));
+    _mm_storeu_si128((__m128i *)&h[6], _mm_xor_si128(_mm_loadu_si128((const __m128i *)&h[6]),
+        _mm_xor_si128(row2h, row4h)));
+}
+
+
+
+// AVX2: each row of the 4x4 work matrix takes one register, four G's in parallel.
+
+#define B2B_ROTR32_256(x)   _mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define B2B_ROTR24_256(x)   _mm256_shuffle_epi8((x), r24)
+#define B2B_ROTR16_256(x)   _mm256_shuffle_epi8((x), r16)
+#define B2B_ROTR63_256(x)   _mm256_xor_si256(_mm256_srli_epi64((x), 63), _mm256_add_epi64((x), (x)))
+
+#define B2B_G_256(a, b, c, d, x, y) {                                           \
+    a = _mm256_add_epi64(_mm256_add_epi64(a, b), x);                            \
+    d = B2B_ROTR32_256(_mm256_xor_si256(d, a));                                 \
+    c = _mm256_add_epi64(c, d);                                                 \
+    b = B2B_ROTR24_256(_mm256_xor_si256(b, c));                                 \
+    a = _mm256_add_epi64(_mm256_add_epi64(a, b), y);                            \
+    d = B2B_ROTR16_256(_mm256_xor_si256(d, a));                                 \
+    c = _mm256_add_epi64(c, d);                                                 \
+    b = B2B_ROTR63_256(_mm256_xor_si256(b, c)); }
+
+#define B2B_MSG_256(r, i, j, k, l)  _mm256_set_epi64x(                          \
+    (int64_t)m[blake2b_sigma[r][l]], (int64_t)m[blake2b_sigma[r][k]],           \
+    (int64_t)m[blake2b_sigma[r][j]], (int64_t)m[blake2b_sigma[r][i]])
+
+#define B2B_ROUND_256(r) {                                                      \
+    B2B_G_256(row1, row2, row3, row4, B2B_MSG_256(r, 0, 2, 4, 6), B2B_MSG_256(r, 1, 3, 5, 7));  \
+    row2 = _mm256_permute4x64_epi64(row2, _MM_SHUFFLE(0, 3, 2, 1));             \
+    row3 = _mm256_permute4x64_epi64(row3, _MM_SHUFFLE(1, 0, 3, 2));             \
+    row4 = _mm256_permute4x64_epi64(row4, _MM_SHUFFLE(2, 1, 0, 3));             \
+    B2B_G_256(row1, row2, row3, row4, B2B_MSG_256(r, 8, 10, 12, 14), B2B_MSG_256(r, 9, 11, 13, 15));  \
+    row2 = _mm256_permute4x64_epi64(row2, _MM_SHUFFLE(2, 1, 0, 3));             \
+    row3 = _mm256_permute4x64_epi64(row3, _MM_SHUFFLE(1, 0, 3, 2));             \
+    row4 = _mm256_permute4x64_epi64(row4, _MM_SHUFFLE(0, 3, 2, 1)); }
+
+AVX2_TARGET
+static void blake2b_compress_avx2(uint64_t h[8], const uint64_t t[2],
+    const uint8_t *block, int last)
+{
+    const __m256i r16 = _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+        2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+    const __m256i r24 = _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+        3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+    uint64_t m[16];
+    __m256i row1, row2, row3, row4, h0, h1;
+
+    memcpy(m, block, sizeof(m));        // x86 is little-endian
+
+    row1 = h0 = _mm256_loadu_si256((const __m256i *)&h[0]);
+    row2 = h1 = _mm256_loadu_si256((const __m256i *)&h[4]);
+    row3 = _mm256_loadu_si256((const __m256i *)&blake2b_iv[0]);
+    row4 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&blake2b_iv[4]),
+        _mm256_set_epi64x((last & B2B_LAST_NODE) ? -1 : 0, (last & B2B_LAST_BLOCK) ? -1 : 0,
+            (int64_t)t[1], (int64_t)t[0]));
+
+    B2B_ROUND_256(0);
+    B2B_ROUND_256(1);
+    B2B_ROUND_256(2);
+    B2B_ROUND_256(3);
+    B2B_ROUND_256(4);
+    B2B_ROUND_256(5);
+    B2B_ROUND_256(6);
+    B2B_ROUND_256(7);
+    B2B_ROUND_256(8);
+    B2B_ROUND_256(9);
+    B2B_ROUND_256(10);
+    B2B_ROUND_256(11);
+
+    _mm256_storeu_si256((__m256i *)&h[0], _mm256_xor_si256(h0, _mm256_xor_si256(row1, row3)));
+    _mm256_storeu_si256((__m256i *)&h[4], _mm256_xor_si256(h1, _mm256_xor_si256(row2, row4)));
+}
+
+
+
+// AVX2, four-way: the four leaves of BLAKE2bp are compressed at the same time,
+// each 64-bit lane of a register holds the same word of the four work matrices.
+// Never the last block, which is compressed by the leaf itself in blake2bp_final.
+
+#define B2B_G_4WAY(a, b, c, d, x, y) B2B_G_256(v[a], v[b], v[c], v[d], m[x], m[y])
+
+#define B2B_ROUND_4WAY(r) {                                                     \
+    B2B_G_4WAY(0, 4,  8, 12, blake2b_sigma[r][ 0], blake2b_sigma[r][ 1]);       \
+    B2B_G_4WAY(1, 5,  9, 13, blake2b_sigma[r][ 2], blake2b_sigma[r][ 3]);       \
+    B2B_G_4WAY(2, 6, 10, 14, blake2b_sigma[r][ 4], blake2b_sigma[r][ 5]);       \
+    B2B_G_4WAY(3, 7, 11, 15, blake2b_sigma[r][ 6], blake2b_sigma[r][ 7]);       \
+    B2B_G_4WAY(0, 5, 10, 15, blake2b_sigma[r][ 8], blake2b_sigma[r][ 9]);       \
+    B2B_G_4WAY(1, 6, 11, 12, blake2b_sigma[r][10], blake2b_sigma[r][11]);       \
+    B2B_G_4WAY(2, 7,  8, 13, blake2b_sigma[r][12], blake2b_sigma[r][13]);       \
+    B2B_G_4WAY(3, 4,  9, 14, blake2b_sigma[r][14], blake2b_sigma[r][15]); }
+
+AVX2_TARGET
+static void blake2b_compress4_avx2(blake2b_ctx *leaves, const uint8_t *block[4])
+{
+    const __m256i r16 = _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+        2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+    const __m256i r24 = _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+        3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+    __m256i v[16], m[16], h[8];
+    uint64_t w[8][4];
+    int i;
+
+    // transpose the message words, four at a time from each block
+    for (i = 0; i < 16; i += 4) {
+        __m256i r0 = _mm256_loadu_si256((const __m256i *)(block[0] + 8 * i));
+        __m256i r1 = _mm256_loadu_si256((const __m256i *)(block[1] + 8 * i));
+        __m256i r2 = _mm256_loadu_si256((const __m256i *)(block[2] + 8 * i));
+        __m256i r3 = _mm256_loadu_si256((const __m256i *)(block[3] + 8 * i));
+        __m256i t0 = _mm256_unpacklo_epi64(r0, r1);
+        __m256i t1 = _mm256_unpackhi_epi64(r0, r1);
+        __m256i t2 = _mm256_unpacklo_epi64(r2, r3);
+        __m256i t3 = _mm256_unpackhi_epi64(r2, r3);
+        m[i] = _mm256_permute2x128_si256(t0, t2, 0x20);
+        m[i + 1] = _mm256_permute2x128_si256(t1, t3, 0x20);
+        m[i + 2] = _mm256_permute2x128_si256(t0, t2, 0x31);
+        m[i + 3] = _mm256_permute2x128_si256(t1, t3, 0x31);
+    }
+
+    for (i = 0; i < 8; i++) {
+        v[i] = h[i] = _mm256_set_epi64x((int64_t)leaves[3].h[i], (int64_t)leaves[2].h[i],
+            (int64_t)leaves[1].h[i], (int64_t)leaves[0].h[i]);
+        v[i + 8] = _mm256_set1_epi64x((int64_t)blake2b_iv[i]);
+    }
+    v[12] = _mm256_xor_si256(v[12], _mm256_set_epi64x((int64_t)leaves[3].t[0],
+        (int64_t)leaves[2].t[0], (int64_t)leaves[1].t[0], (int64_t)leaves[0].t[0]));
+    v[13] = _mm256_xor_si256(v[13], _mm256_set_epi64x((int64_t)leaves[3].t[1],
+        (int64_t)leaves[2].t[1], (int64_t)leaves[1].t[1], (int64_t)leaves[0].t[1]));
+
+    B2B_ROUND_4WAY(0);
+    B2B_ROUND_4WAY(1);
+    B2B_ROUND_4WAY(2);
+    B2B_ROUND_4WAY(3);
+    B2B_ROUND_4WAY(4);
+    B2B_ROUND_4WAY(5);
+    B2B_ROUND_4WAY(6);
+    B2B_ROUND_4WAY(7);
+    B2B_ROUND_4WAY(8);
+    B2B_ROUND_4WAY(9);
+    B2B_ROUND_4WAY(10);
+    B2B_ROUND_4WAY(11);
+
+    for (i = 0; i < 8; i++)
+        _mm256_storeu_si256((__m256i *)w[i], _mm256_xor_si256(h[i], _mm256_xor_si256(v[i], v[i + 8])));
+    for (i = 0; i < 8; i++) {
+        leaves[0].h[i] = w[i][0];
+        leaves[1].h[i] = w[i][1];
+        leaves[2].h[i] = w[i][2];
+        leaves[3].h[i] = w[i][3];
+    }
+}
+
+#endif
+
+
+
+// Compression function. Dispatched to the widest SIMD implementation available.
+
+static void blake2b_compress(blake2b_ctx *ctx, const uint8_t *block, int last)
+{
+#ifdef BLAKE2B_SIMD
+    int level = blake2b_simd_level();
+    if (level == B2B_USE_AVX2)
+        blake2b_compress_avx2(ctx->h, ctx->t, block, last);
+    else if (level == B2B_USE_SSE41)
+        blake2b_compress_sse41(ctx->h, ctx->t, block, last);
+    else
+#endif
+        blake2b_compress_ref(ctx->h, ctx->t, block, last);
+}
+
+// Add a full block to the byte counter and compress it, not the last one.
+
+static void blake2b_next_block(blake2b_ctx *ctx, const uint8_t *block)
+{
+    ctx->t[0] += 128;                   // add counters
+    if (ctx->t[0] < 128)                // carry overflow ?
+        ctx->t[1]++;                    // high word
+    blake2b_compress(ctx, block, 0);    // compress (not last)
+}
+
+// Initialize the state by the parameter block, which is given by its first three words.
+
+static void blake2b_init_param(blake2b_ctx *ctx, size_t outlen,
+    uint64_t p0, uint64_t p1, uint64_t p2)
+{
+    size_t i;
 
     for (i = 0; i < 8; i++)             // state, "param block"
         ctx->h[i] = blake2b_iv[i];
-    ctx->h[0] ^= 0x01010000 ^ (keylen << 8) ^ outlen;
+    ctx->h[0] ^= p0;
+    ctx->h[1] ^= p1;
+    ctx->h[2] ^= p2;
 
     ctx->t[0] = 0;                      // input count low word
     ctx->t[1] = 0;                      // input count high word
     ctx->c = 0;                         // pointer within buffer
     ctx->outlen = outlen;
+}
+
+// Load the key, if any, as the first block, zero padded.
 
-    for (i = keylen; i < 128; i++)      // zero input block
-        ctx->b[i] = 0;
+static void blake2b_init_key(blake2b_ctx *ctx, const void *key, size_t keylen)
+{
     if (keylen > 0) {
-        blake2b_update(ctx, key, keylen);
+        memcpy(ctx->b, key, keylen);
+        memset(ctx->b + keylen, 0, 128 - keylen);
         ctx->c = 128;                   // at the end
     }
+}
+
+// Generate the message digest, as the last node of a tree if "last" has B2B_LAST_NODE set.
+
+static void blake2b_final_node(blake2b_ctx *ctx, void *out, int last)
+{
+    size_t i;
+
+    ctx->t[0] += ctx->c;                // mark last block offset
+    if (ctx->t[0] < ctx->c)             // carry overflow
+        ctx->t[1]++;                    // high word
+
+    memset(ctx->b + ctx->c, 0, 128 - ctx->c);   // fill up with zeros
+    ctx->c = 128;
+    blake2b_compress(ctx, ctx->b, B2B_LAST_BLOCK | last);
+
+    // little endian convert and store
+    for (i = 0; i < ctx->outlen; i++) {
+        ((uint8_t *) out)[i] =
+            (ctx->h[i >> 3] >> (8 * (i & 7))) & 0xFF;
+    }
+}
+
+// Initialize the hashing context "ctx" with optional key "key".
+//      1 <= outlen <= 64 gives the digest size in bytes.
+//      Secret key (also <= 64 bytes) is optional (keylen = 0).
+
+int blake2b_init(blake2b_ctx *ctx, size_t outlen,
+    const void *key, size_t keylen)        // (keylen=0: no key)
+{
+    if (outlen == 0 || outlen > 64 || keylen > 64)
+        return -1;                      // illegal parameters
+
+    blake2b_init_param(ctx, outlen, 0x01010000 ^ (keylen << 8) ^ outlen, 0, 0);
+    blake2b_init_key(ctx, key, keylen);
 
     return 0;
 }
 
 // Add "inlen" bytes from "in" into the hash.
+//      The last block is always kept in the buffer, for it is to be
+//      compressed with the last block flag set.
 
 void blake2b_update(blake2b_ctx *ctx,
     const void *in, size_t inlen)       // data bytes
 {
-    size_t i;
+    const uint8_t *p = (const uint8_t *) in;
+    size_t n;
 
-    for (i = 0; i < inlen; i++) {
+    while (inlen > 0) {
         if (ctx->c == 128) {            // buffer full ?
-            ctx->t[0] += ctx->c;        // add counters
-            if (ctx->t[0] < ctx->c)     // carry overflow ?
-                ctx->t[1]++;            // high word
-            blake2b_compress(ctx, 0);   // compress (not last)
+            blake2b_next_block(ctx, ctx->b);
             ctx->c = 0;                 // counter to zero
         }
-        ctx->b[ctx->c++] = ((const uint8_t *) in)[i];
+        if (ctx->c == 0) {              // compress directly from the input
+            for (; inlen > 128; p += 128, inlen -= 128)
+                blake2b_next_block(ctx, p);
+        }
+        n = 128 - ctx->c;
+        if (n > inlen)
+            n = inlen;
+        memcpy(ctx->b + ctx->c, p, n);
+        ctx->c += n;
+        p += n;
+        inlen -= n;
     }
 }
 
@@ -148,21 +550,7 @@ void blake2b_update(blake2b_ctx *ctx,
 
 void blake2b_final(blake2b_ctx *ctx, void *out)
 {
-    size_t i;
-
-    ctx->t[0] += ctx->c;                // mark last block offset
-    if (ctx->t[0] < ctx->c)             // carry overflow
-        ctx->t[1]++;                    // high word
-
-    while (ctx->c < 128)                // fill up with zeros
-        ctx->b[ctx->c++] = 0;
-    blake2b_compress(ctx, 1);           // final block flag = 1
-
-    // little endian convert and store
-    for (i = 0; i < ctx->outlen; i++) {
-        ((uint8_t *) out)[i] =
-            (ctx->h[i >> 3] >> (8 * (i & 7))) & 0xFF;
-    }
+    blake2b_final_node(ctx, out, 0);
 }
 
 // Convenience function for all-in-one computation.
@@ -180,3 +568,170 @@ int blake2b(void *out, size_t outlen,
 
     return 0;
 }
+
+
+
+// BLAKE2bp: four BLAKE2b leaves of a tree of depth 2, the i-th 128-byte block
+//      of the input goes to the (i % 4)-th leaf, the root hashes the four
+//      64-byte leaf digests. The leaves are kept in step so that they can be
+//      compressed at the same time.
+
+#define B2BP_LEAVES     4
+#define B2BP_GROUP      (B2BP_LEAVES * 128)
+
+// Parameter block: fanout 4, depth 2, inner length 64, node depth of the leaves 0, of the root 1.
+
+#define B2BP_PARAM0(outlen, keylen) \
+    ((uint64_t) (outlen) ^ ((uint64_t) (keylen) << 8) ^ ((uint64_t) B2BP_LEAVES << 16) ^ (2 << 24))
+
+// Compress one block of each leaf, none of which is the last.
+
+static void blake2bp_compress(blake2bp_ctx *ctx, const uint8_t *block[B2BP_LEAVES])
+{
+    int i;
+
+#ifdef BLAKE2B_SIMD
+    if (blake2b_simd_level() == B2B_USE_AVX2) {
+        for (i = 0; i < B2BP_LEAVES; i++) {
+            ctx->leaves[i].t[0] += 128;
+            if (ctx->leaves[i].t[0] < 128)
+                ctx->leaves[i].t[1]++;
+        }
+        blake2b_compress4_avx2(ctx->leaves, block);
+        return;
+    }
+#endif
+    for (i = 0; i < B2BP_LEAVES; i++)
+        blake2b_next_block(&ctx->leaves[i], block[i]);
+}
+
+// Initialize the hashing context "ctx" with optional key "key".
+//      1 <= outlen <= 64 gives the digest size in bytes.
+//      Secret key (also <= 64 bytes) is optional (keylen = 0).
+
+int blake2bp_init(blake2bp_ctx *ctx, size_t outlen,
+    const void *key, size_t keylen)
+{
+    size_t i;
+
+    if (outlen == 0 || outlen > 64 || keylen > 64)
+        return -1;                      // illegal parameters
+
+    for (i = 0; i < B2BP_LEAVES; i++) {
+        blake2b_init_param(&ctx->leaves[i], 64, B2BP_PARAM0(64, keylen), i, (uint64_t) 64 << 8);
+        blake2b_init_key(&ctx->leaves[i], key, keylen);
+    }
+    ctx->buflen = 0;
+    ctx->outlen = outlen;
+    ctx->keylen = keylen;
+
+    return 0;
+}
+
+// Compress the blocks pending in the leaves, for more input to each leaf is to come.
+
+static void blake2bp_flush(blake2bp_ctx *ctx)
+{
+    const uint8_t *block[B2BP_LEAVES];
+    int i;
+
+    if (ctx->leaves[0].c < 128)         // the leaves are in step
+        return;
+    for (i = 0; i < B2BP_LEAVES; i++) {
+        block[i] = ctx->leaves[i].b;
+        ctx->leaves[i].c = 0;
+    }
+    blake2bp_compress(ctx, block);
+}
+
+// Hand a group of four blocks to the leaves, where they are pending.
+
+static void blake2bp_push(blake2bp_ctx *ctx, const uint8_t *group)
+{
+    int i;
+
+    blake2bp_flush(ctx);
+    for (i = 0; i < B2BP_LEAVES; i++) {
+        memcpy(ctx->leaves[i].b, group + 128 * i, 128);
+        ctx->leaves[i].c = 128;
+    }
+}
+
+// Add "inlen" bytes from "in" into the hash.
+//      The input is buffered up to a group of four blocks, one for each leaf.
+//      A group is handed to the leaves only when some bytes of the next group
+//      have arrived, where it is pending until more input to each leaf is
+//      known to come. So the leaves are always in step.
+
+void blake2bp_update(blake2bp_ctx *ctx,
+    const void *in, size_t inlen)
+{
+    const uint8_t *p = (const uint8_t *) in;
+    const uint8_t *block[B2BP_LEAVES];
+    size_t i, n;
+
+    while (inlen > 0) {
+        if (ctx->buflen == B2BP_GROUP) {
+            blake2bp_push(ctx, ctx->buf);
+            ctx->buflen = 0;
+        }
+        // a group followed by another full group is compressed directly from the input
+        if (ctx->buflen == 0 && inlen > B2BP_GROUP) {
+            blake2bp_flush(ctx);
+            for (; inlen > 2 * B2BP_GROUP; p += B2BP_GROUP, inlen -= B2BP_GROUP) {
+                for (i = 0; i < B2BP_LEAVES; i++)
+                    block[i] = p + 128 * i;
+                blake2bp_compress(ctx, block);
+            }
+            blake2bp_push(ctx, p);
+            p += B2BP_GROUP;
+            inlen -= B2BP_GROUP;
+        }
+        n = B2BP_GROUP - ctx->buflen;
+        if (n > inlen)
+            n = inlen;
+        memcpy(ctx->buf + ctx->buflen, p, n);
+        ctx->buflen += n;
+        p += n;
+        inlen -= n;
+    }
+}
+
+// Generate the message digest (size given in init).
+//      Result placed in "out".
+
+void blake2bp_final(blake2bp_ctx *ctx, void *out)
+{
+    uint8_t digest[B2BP_LEAVES][64];
+    blake2b_ctx root;
+    size_t i;
+
+    for (i = 0; i < B2BP_LEAVES; i++) {
+        if (ctx->buflen > 128 * i) {
+            size_t n = ctx->buflen - 128 * i;
+            blake2b_update(&ctx->leaves[i], ctx->buf + 128 * i, n < 128 ? n : 128);
+        }
+        blake2b_final_node(&ctx->leaves[i], digest[i], i == B2BP_LEAVES - 1 ? B2B_LAST_NODE : 0);
+    }
+
+    // the root takes the key length as a parameter, but not the key
+    blake2b_init_param(&root, ctx->outlen, B2BP_PARAM0(ctx->outlen, ctx->keylen), 0, 1 ^ ((uint64_t) 64 << 8));
+    blake2b_update(&root, digest, sizeof(digest));
+    blake2b_final_node(&root, out, B2B_LAST_NODE);
+}
+
+// Convenience function for all-in-one computation.
+
+int blake2bp(void *out, size_t outlen,
+    const void *key, size_t keylen,
+    const void *in, size_t inlen)
+{
+    blake2bp_ctx ctx;
+
+    if (blake2bp_init(&ctx, outlen, key, keylen))
+        return -1;
+    blake2bp_update(&ctx, in, inlen);
+    blake2bp_final(&ctx, out);
+
+    return 0;
+}
@@ -16,6 +16,15 @@ typedef struct {
     size_t outlen;                      // digest size
 } blake2b_ctx;
 
+// BLAKE2bp state context: four leaves and the input buffer of one block for each leaf
+typedef struct {
+    blake2b_ctx leaves[4];              // kept in step
+    uint8_t buf[4 * 128];               // input buffer
+    size_t buflen;                      // pointer for buf[]
+    size_t outlen;                      // digest size
+    size_t keylen;                      // key size, a parameter of the root
+} blake2bp_ctx;
+
 
 #ifdef __cplusplus
 extern "C"
@@ -41,6 +50,20 @@ int blake2b(void *out, size_t outlen,   // return buffer for digest
     const void *key, size_t keylen,     // optional secret key
     const void *in, size_t inlen);      // data to be hashed
 
+// BLAKE2bp, the 4-way parallel variant for bulk hashing. The digest differs
+// from that of BLAKE2b, the API is the same.
+int blake2bp_init(blake2bp_ctx *ctx, size_t outlen,
+    const void *key, size_t keylen);
+
+void blake2bp_update(blake2bp_ctx *ctx,
+    const void *in, size_t inlen);
+
+void blake2bp_final(blake2bp_ctx *ctx, void *out);
+
+int blake2bp(void *out, size_t outlen,
+    const void *key, size_t keylen,
+    const void *in, size_t inlen);
+
 #ifdef __cplusplus
 };
 #endif
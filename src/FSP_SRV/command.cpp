@@ -77,7 +77,7 @@ l_bailout2:
 //	SProcessRoot&			root of the ULA's kinship tree 
 // Do
 //	Map the command context and put the connect request into the queue
-//	LLS try to make the connection request to the remote end in the queued thread
+//	LLS try to make the connection request to the remote end once the peer name is resolved
 // Remark
 //	If the command context memory block cannot be mapped into LLS's memory space the function fails
 //	The notice queue of the command context is preset to FSP_IPC_CannotReturn
@@ -282,40 +282,26 @@ void CSocketItemEx::Listen()
 
 
 
+// Given
+//	const CommandNewSessionSrv &	the connect request of which the peer name has been resolved
 // Do
 //	Make initiative connect context and initiate session establishment
-void CSocketItemEx::Connect()
+// Remark
+//	If the peer name could not be resolved the ULA is signaled FSP_NameResolutionFailed and the socket is freed
+void CSocketItemEx::Connect(const CommandNewSessionSrv &cmd)
 {
 #if (TRACE & TRACE_ULACALL)
 	printf_s("Try to make connection to %s (@local fiber#%u(_%X_)\n", PeerName(), fidPair.source, be32toh(fidPair.source));
 #endif
-	char nodeName[INET6_ADDRSTRLEN];
-	char *peerName = PeerName();
-#ifndef OVER_UDP_IPv4
-	int r = ResolveToIPv6(peerName);
-	if (r <= 0)
-#else
-	int r;
-#endif
+	if (cmd.resolved <= 0)
 	{
-		const char *serviceName = strchr(peerName, ':');
-		if (serviceName != NULL)
-		{
-			size_t n = serviceName - peerName;
-			n = n < INET6_ADDRSTRLEN ? n : INET6_ADDRSTRLEN - 1;
-			strncpy(nodeName, peerName, n);
-			nodeName[n] = 0;
-			peerName = nodeName;
-			serviceName++;
-		}
-		r = ResolveToFSPoverIPv4(peerName, serviceName);
-		if (r <= 0)
-		{
-			SignalNMI(FSP_NameResolutionFailed);
-			Free();
-			return;
-		}
+		SignalNMI(FSP_NameResolutionFailed);
+		Free();
+		return;
 	}
+	memcpy(pControlBlock->peerAddr.ipFSP.allowedPrefixes, cmd.allowedPrefixes, sizeof(uint64_t) * cmd.resolved);
+	pControlBlock->peerAddr.ipFSP.hostID = cmd.hostID;
+	pControlBlock->peerAddr.ipFSP.fiberID = cmd.fiberID;
 	pControlBlock->connectParams.idRemote = pControlBlock->peerAddr.ipFSP.fiberID;	// Exploited in OnInitConnectAck 
 
 	// By default Connect() prefer initiating connection from an IPv6 interface
@@ -338,46 +324,102 @@ void CSocketItemEx::Connect()
 
 
 
+// Do
+//	Initiate the connection of which the peer name has been resolved
+// Remark
+//	It is called in the timer context with the socket locked. The connect request is taken over exclusively,
+//	for the socket might be freed by the ULA at the same time. See also CSocketSrvTLB::FreeItemDonotCareLock
+void CSocketItemEx::CompleteConnect()
+{
+	CommandNewSessionSrv *p = (CommandNewSessionSrv *)_InterlockedExchangePointer((PVOID *)&pendingConnect, NULL);
+	if (p == NULL)
+		return;
+
+	Connect(*p);
+	ConnectRequestQueue::requests.Remove(p->index);
+}
+
+
+
+// Given
+//	const char *	the name of the peer, which might be the string representation of an IPv6 address,
+//					or that of an IPv4 address optionally followed by ':' and the decimal port number
+// Do
+//	Translate the numeric address of the peer directly, without resorting to the name resolver
+// Return
+//	1 if the name is of some numeric address, 0 if it is not
+int CommandNewSessionSrv::ResolveNumeric(const char *peerName)
+{
+	char nodeName[INET_ADDRSTRLEN];
+	struct in_addr ipv4;
+#ifndef OVER_UDP_IPv4
+	IN6_ADDR ipv6;
+	if (inet_pton(AF_INET6, peerName, &ipv6) == 1)
+	{
+		allowedPrefixes[0] = ((PFSP_IN6_ADDR)&ipv6)->subnet;
+		hostID = ((PFSP_IN6_ADDR)&ipv6)->idHost;
+		fiberID = ((PFSP_IN6_ADDR)&ipv6)->idALF;
+		return 1;
+	}
+#endif
+	const char *serviceName = strchr(peerName, ':');
+	size_t n = (serviceName != NULL ? serviceName - peerName : strlen(peerName));
+	if (n >= INET_ADDRSTRLEN)
+		return 0;
+	memcpy(nodeName, peerName, n);
+	nodeName[n] = 0;
+	if (inet_pton(AF_INET, nodeName, &ipv4) != 1)
+		return 0;
+
+	unsigned long port = 0;
+	if (serviceName != NULL)
+	{
+		char *end;
+		port = strtoul(++serviceName, &end, 10);
+		if (end == serviceName || *end != 0 || port > 65535)
+			return 0;	// the service name is left to the resolver
+	}
+
+	// Must keep in consistent with ResolveToFSPoverIPv4
+	register PFSP_IN4_ADDR_PREFIX prefixes = (PFSP_IN4_ADDR_PREFIX)allowedPrefixes;
+	prefixes[0].prefix = PREFIX_FSP_IP6to4;
+	prefixes[0].port = DEFAULT_FSP_UDPPORT;
+	prefixes[0].ipv4 = *(u32 *)&ipv4;
+	hostID = 0;
+	fiberID = PORT2ALFID(htons((uint16_t)port));
+	return 1;
+}
+
+
+
 // Given
 //	PCTSTR			the name of the node to be resolved, which might be an IPv4 string representation
 //	PCTSTR			the name of the service to be resolved, which might be a string of decimal port number
 // Do
-//	Resolve the UDP socket addresses of the given remote peer and store them in the peerAddr field of SCB
+//	Resolve the UDP socket addresses of the given remote peer and store them in the request
 // Return
 //	Number of addresses resolved, negative if error
-int CSocketItemEx::ResolveToFSPoverIPv4(const char *nodeName, const char *serviceName)
+int CommandNewSessionSrv::ResolveToFSPoverIPv4(const char *nodeName, const char *serviceName)
 {
-	static const ADDRINFOA hints = { 0, AF_INET, };
-	PADDRINFOA pAddrInfo;
-
-	// assume the project is compiled in ANSI/MBCS language mode
-	if(getaddrinfo(nodeName, serviceName, & hints, & pAddrInfo) != 0)
+	UNameCacheAddress addresses[MAX_PHY_INTERFACES];
+	int n = CNameCache::Singleton.Resolve(nodeName, serviceName, AF_INET, addresses, MAX_PHY_INTERFACES);
+	if (n <= 0)
 	{
-#if !defined(NDEBUG) &&  defined(__WINDOWS__)
-		TraceLastError(__FILE__, __LINE__, __FUNCTION__, nodeName);
-#elif !defined(NDEBUG) && (defined(__linux__) || defined(__CYGWIN__))
-		perror("IPv4 getaddrinfo() failed");
-#endif
-		return -1;
+		REPORT_ERRMSG_ON_TRACE("Cannot resolve the name to IPv4 addresses");
+		return n;
 	}
 
-	if(pAddrInfo == NULL)
-		return 0;
-
 	// See also CLowerInterface::EnumEffectiveAddresses
-	register PFSP_IN4_ADDR_PREFIX prefixes = (PFSP_IN4_ADDR_PREFIX)pControlBlock->peerAddr.ipFSP.allowedPrefixes;
-	int n = 0;
-	pControlBlock->peerAddr.ipFSP.hostID = 0;
-	pControlBlock->peerAddr.ipFSP.fiberID = PORT2ALFID( ((PSOCKADDR_IN)pAddrInfo->ai_addr)->sin_port );
-	do
+	register PFSP_IN4_ADDR_PREFIX prefixes = (PFSP_IN4_ADDR_PREFIX)allowedPrefixes;
+	hostID = 0;
+	fiberID = PORT2ALFID(addresses[0].ipv4.sin_port);
+	for (register int i = 0; i < n; i++)
 	{
 		// Must keep in consistent with TranslateFSPoverIPv4
-		prefixes[n].prefix = PREFIX_FSP_IP6to4;
-		prefixes[n].port = DEFAULT_FSP_UDPPORT;
-		prefixes[n].ipv4 = *(u32*) & ((PSOCKADDR_IN)pAddrInfo->ai_addr)->sin_addr;
-	} while(++n < MAX_PHY_INTERFACES && (pAddrInfo = pAddrInfo->ai_next) != NULL);
-
-	freeaddrinfo(pAddrInfo);
+		prefixes[i].prefix = PREFIX_FSP_IP6to4;
+		prefixes[i].port = DEFAULT_FSP_UDPPORT;
+		prefixes[i].ipv4 = *(u32*) & addresses[i].ipv4.sin_addr;
+	}
 	return n;
 }
 
@@ -386,52 +428,68 @@ int CSocketItemEx::ResolveToFSPoverIPv4(const char *nodeName, const char *servic
 // Given
 //	PCTSTR			the name of the node to be resolved, which might be an IPv6 string representation
 // DO
-//	Resolve the IPv6 addresses of the given remote peer and store them in the peerAddr field of SCB
+//	Resolve the IPv6 addresses of the given remote peer and store them in the request
 // Return
 //	Number of addresses resolved, negative if error
-int CSocketItemEx::ResolveToIPv6(const char *nodeName)
+int CommandNewSessionSrv::ResolveToIPv6(const char *nodeName)
 {
-	static const ADDRINFOA hints = { 0, AF_INET6, };
-	PADDRINFOA pAddrInfo;
-	// A value of zero for ai_socktype indicates the caller will accept any socket type. 
-	// A value of zero for ai_protocol indicates the caller will accept any protocol. 
-
-	// assume the project is compiled in ANSI/MBCS language mode
-	if(getaddrinfo(nodeName, NULL, & hints, & pAddrInfo) != 0)
+	UNameCacheAddress addresses[MAX_PHY_INTERFACES];
+	int n = CNameCache::Singleton.Resolve(nodeName, NULL, AF_INET6, addresses, MAX_PHY_INTERFACES);
+	if (n <= 0)
 	{
-#if !defined(NDEBUG) &&  defined(__WINDOWS__)
-		TraceLastError(__FILE__, __LINE__, __FUNCTION__, nodeName);
-#elif !defined(NDEBUG) && (defined(__linux__) || defined(__CYGWIN__))
-		perror("IPv6 getaddrinfo() failed");
-#endif
-		return -1;
+		REPORT_ERRMSG_ON_TRACE("Cannot resolve the name to IPv6 addresses");
+		return n;
 	}
 
-	if(pAddrInfo == NULL)
-		return 0;
-
 	// See also CLowerInterface::EnumEffectiveAddresses
-	register uint64_t * prefixes = pControlBlock->peerAddr.ipFSP.allowedPrefixes;
-	int n = 0;
-	pControlBlock->peerAddr.ipFSP.fiberID = SOCKADDR_ALFID(pAddrInfo->ai_addr);
-	pControlBlock->peerAddr.ipFSP.hostID = SOCKADDR_HOSTID(pAddrInfo->ai_addr);
-	do
-	{
-		prefixes[n] = *(uint64_t*) & ((PSOCKADDR_IN6)pAddrInfo->ai_addr)->sin6_addr;
-	} while(++n < MAX_PHY_INTERFACES && (pAddrInfo = pAddrInfo->ai_next) != NULL);
-
-	freeaddrinfo(pAddrInfo);
+	fiberID = SOCKADDR_ALFID(&addresses[0].sa);
+	hostID = SOCKADDR_HOSTID(&addresses[0].sa);
+	for (register int i = 0; i < n; i++)
+		allowedPrefixes[i] = *(uint64_t*) & addresses[i].ipv6.sin6_addr;
 	return n;
 }
 
 
 
+// Given
+//	const char *	the name of the peer, in the form of [node name|IPv6 address|IPv4 address[:service name]]
+// Return
+//	Number of addresses resolved, non-positive if failed
+// Remark
+//	It might block for some time unless the name is of some numeric address
+int CommandNewSessionSrv::Resolve(const char *peerName)
+{
+	char nodeName[INET6_ADDRSTRLEN];
+	int r = ResolveNumeric(peerName);
+	if (r > 0)
+		return r;
+#ifndef OVER_UDP_IPv4
+	r = ResolveToIPv6(peerName);
+	if (r > 0)
+		return r;
+#endif
+	const char *serviceName = strchr(peerName, ':');
+	if (serviceName != NULL)
+	{
+		size_t n = serviceName - peerName;
+		n = n < INET6_ADDRSTRLEN ? n : INET6_ADDRSTRLEN - 1;
+		strncpy(nodeName, peerName, n);
+		nodeName[n] = 0;
+		peerName = nodeName;
+		serviceName++;
+	}
+	return ResolveToFSPoverIPv4(peerName, serviceName);
+}
+
+
+
 // a helper function which is self-describing
 void CommandNewSessionSrv::DoConnect()
 {
 	if(pSocket->WaitUseMutex())	// in case of memory access error
 	{
-		pSocket->Connect();
+		resolved = Resolve(pSocket->PeerName());
+		pSocket->Connect(*this);
 		pSocket->SetMutexFree();
 	}
 	ConnectRequestQueue::requests.Remove(index);
@@ -483,18 +541,21 @@ int ConnectRequestQueue::Push(const CommandNewSessionSrv *p)
 int ConnectRequestQueue::Remove(int i)
 {
 	WaitSetMutex();
-	// 
+	int r = Erase(i);
+	SetMutexFree();
+	return r;
+}
+
+
+
+// The body of Remove. Assume the mutex has been obtained
+int ConnectRequestQueue::Erase(int i)
+{
 	if (tail < 0 || tail >= CONNECT_BACKLOG_SIZE)
-	{
-		SetMutexFree();
 		return -1;
-	}
 	//
 	if(mayFull == 0 && head == tail)
-	{
-		SetMutexFree();
 		return -1;
-	}
 	//
 	q[i].opCode = NullCommand;
 	if(i == head)
@@ -504,66 +565,93 @@ int ConnectRequestQueue::Remove(int i)
 				head = 0;
 		} while(head != tail && q[head].opCode == NullCommand);
 	mayFull = 0;
-	//
-	SetMutexFree();
 	return 0;
-}	
+}
 
 
 
-void SProcessRoot::LoopOnULACommand()
+// Given
+//	int		the index of the connect request of which the socket is freed before the connection is initiated
+// Do
+//	Detach the socket from the request. The request is removed at once if its peer name has been resolved,
+//	or else it is removed by the resolver. See also Resolved
+void ConnectRequestQueue::Abandon(int i)
+{
+	WaitSetMutex();
+	q[i].pSocket = NULL;
+	if (q[i].resolved != 0)
+		Erase(i);
+	SetMutexFree();
+}
+
+
+
+// Given
+//	UCommandToLLS &		the command received from the ULA process
+// Do
+//	Dispatch the command to the socket it is about, or create a new socket in kinship with the ULA process
+// Remark
+//	ULA is notified of FSP_IPC_Failure if the command cannot be dispatched
+void SProcessRoot::DispatchCommand(UCommandToLLS &cmd)
 {
-	UCommandToLLS cmd;
-	int cbRead;
 	static int n;
 #if defined(TRACE) && (TRACE & TRACE_ULACALL)
-	printf_s("\nTo get ULA command from socket %d\n", (int)sdPipe);
+	printf_s("\n#%d global command"
+		", %s(code = %d)\n"
+		, n
+		, CServiceCode::sof(cmd.sharedInfo.opCode), cmd.sharedInfo.opCode);
 #endif
-	while ((cbRead = RecvFromPipe(&cmd, sizeof(UCommandToLLS))) > 0)
+	CSocketItemEx* pSocket = NULL;
+	switch (cmd.sharedInfo.opCode)
 	{
+	case FSP_Listen:		// register a passive socket
+		pSocket = ::Listen(CommandNewSessionSrv(&cmd.creation), this);
+		break;
+	case InitConnection:	// register an initiative socket
+		pSocket = ::Connect(CommandNewSessionSrv(&cmd.creation), this);
+		break;
+	case FSP_Accept:
+		pSocket = ::Accept(CommandNewSessionSrv(&cmd.creation));
+		break;
+	case FSP_Multiply:
+		pSocket = ::Multiply(CommandCloneSessionSrv(&cmd.clone));
+		break;
+	default:
+		// The ALFID maps to the socket directly; it must be in kinship with this ULA process
+		pSocket = CLowerInterface::Singleton[cmd.sharedInfo.fiberID];
+		if (pSocket != NULL && pSocket->rootULA == this)
+			pSocket->ProcessCommand(cmd);
+		else
+			pSocket = NULL;
+	}
+	//
 #if defined(TRACE) && (TRACE & TRACE_ULACALL)
-		printf_s("\n#%d global command"
-			", %s(code = %d)\n"
-			, n
-			, CServiceCode::sof(cmd.sharedInfo.opCode), cmd.sharedInfo.opCode);
+	printf_s("^#%d global command processed.\n", n);
 #endif
-		CSocketItemEx* pSocket = NULL;
-		switch (cmd.sharedInfo.opCode)
-		{
-		case FSP_Listen:		// register a passive socket
-			pSocket = ::Listen(CommandNewSessionSrv(&cmd.creation), this);
-			break;
-		case InitConnection:	// register an initiative socket
-			pSocket = ::Connect(CommandNewSessionSrv(&cmd.creation), this);
-			break;
-		case FSP_Accept:
-			pSocket = ::Accept(CommandNewSessionSrv(&cmd.creation));
-			break;
-		case FSP_Multiply:
-			pSocket = ::Multiply(CommandCloneSessionSrv(&cmd.clone));
-			break;
-		default:
-			for (CSocketItem *p = (CSocketItem *)latest; p != NULL; p = p->prev)
-			{
-				if (p->fidPair.source == cmd.sharedInfo.fiberID)
-				{
-					pSocket = (CSocketItemEx *)p;
-					pSocket->ProcessCommand(cmd);
-					break;
-				}
-			}
-		}
-		//
+	n++;
+
+	if (pSocket == NULL)
+		SendNotificationTo(cmd.sharedInfo.fiberID, FSP_IPC_Failure);
+}
+
+
+
+#ifndef __linux__
+// The thread-per-process command loop. On Linux the commands are served by CULACommandService instead
+void SProcessRoot::LoopOnULACommand()
+{
+	UCommandToLLS cmd;
 #if defined(TRACE) && (TRACE & TRACE_ULACALL)
-		printf_s("^%d octets, #%d global command processed.\n", cbRead, n);
+	printf_s("\nTo get ULA command from socket %d\n", (int)sdPipe);
 #endif
-		n++;
-
-		if (pSocket == NULL)
-			SendNotificationTo(cmd.sharedInfo.fiberID, FSP_IPC_Failure);
+	while (RecvFromPipe(&cmd, sizeof(UCommandToLLS)) > 0)
+	{
+		SetLoopTime();
+		DispatchCommand(cmd);
 	}
 #if defined(TRACE) && (TRACE & TRACE_ULACALL)
 	printf_s("\nThe ULA channel of socket %d is closed.\n", (int)sdPipe);
 #endif
 	CLowerInterface::Singleton.FreeULAChannel(this);
 }
+#endif
@@ -34,44 +34,512 @@
 #define gfinc(J) ( *(uint32_t *)((uint8_t *)(J) + GCM_IV_LEN_FIXED)	\
 	= htobe32(be32toh(*(uint32_t *)((uint8_t *)(J) + GCM_IV_LEN_FIXED)) + 1) )
 
-#define gf_addlen(bytesA, bytesC, X) (\
-	((uint64_t *)(X))[0] ^= htobe64((uint64_t)(bytesA) << 3),	\
-	((uint64_t *)(X))[1] ^= htobe64((uint64_t)(bytesC) << 3)	\
+#define gf_setlen(bytesA, bytesC, B) (\
+	((uint64_t *)(B))[0] = htobe64((uint64_t)(bytesA) << 3),	\
+	((uint64_t *)(B))[1] = htobe64((uint64_t)(bytesC) << 3)	\
 	)
 
 
 const uint8_t J0[4] = { 0, 0, 0, 1};
 
-/* Computes a block multiplication in the GF(2^128) */
-/* didnot bother to enhance performance of ghash_gfmul */
-/* should take use of hardware acceleration for large messages */
-static void ghash_gfmul(void *X, void *Y, void *Z)
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+# if defined(_MSC_VER)
+#  include <intrin.h>
+#  define X86_TARGET(s)
+# else
+#  include <cpuid.h>
+#  include <immintrin.h>
+#  define X86_TARGET(s)	__attribute__((target(s)))
+# endif
+# ifndef GCM_NO_CLMUL
+#  define GCM_CLMUL
+#  define CLMUL_TARGET	X86_TARGET("pclmul,ssse3")
+# endif
+# ifndef GCM_NO_AESNI
+#  define GCM_AESNI
+#  define AESNI_TARGET	X86_TARGET("aes,sse4.1")
+#  define VAES_TARGET	X86_TARGET("vaes,avx2,aes,sse4.1")
+# endif
+
+# define CPU_HAS_CLMUL	1	// PCLMULQDQ and SSSE3
+# define CPU_HAS_AESNI	2	// AES-NI and SSE4.1
+# define CPU_HAS_VAES	4	// VAES on 256-bit registers, with AVX2 enabled by the OS
+
+static int cpuFeatures = -1;
+
+// Return the features that the GCM backends are to exploit, probed by CPUID at the first call
+static int CPUFeatures()
+{
+	if (cpuFeatures < 0)
+	{
+		unsigned int a = 0, b = 0, c = 0, d = 0;
+		unsigned int b7 = 0, c7 = 0;
+		unsigned int xcr0 = 0;
+		int f = 0;
+#if defined(_MSC_VER)
+		int r[4];
+		__cpuid(r, 0);
+		a = r[0];
+		if (a >= 7)
+		{
+			__cpuidex(r, 7, 0);
+			b7 = r[1];
+			c7 = r[2];
+		}
+		__cpuid(r, 1);
+		c = r[2];
+		if ((c & (1 << 27)) != 0)	// OSXSAVE
+			xcr0 = (unsigned int)_xgetbv(0);
+#else
+		if (__get_cpuid_max(0, NULL) >= 7 && !__get_cpuid_count(7, 0, &a, &b7, &c7, &d))
+			b7 = c7 = 0;
+		if (!__get_cpuid(1, &a, &b, &c, &d))
+			c = 0;
+		if ((c & bit_OSXSAVE) != 0)
+			__asm__ ("xgetbv" : "=a"(xcr0), "=d"(d) : "c"(0));
+#endif
+		if ((c & (1 << 1)) != 0 && (c & (1 << 9)) != 0)
+			f |= CPU_HAS_CLMUL;
+		if ((c & (1 << 25)) != 0 && (c & (1 << 19)) != 0)
+			f |= CPU_HAS_AESNI;
+		// VAES: leaf 7 ECX bit 9; AVX2: leaf 7 EBX bit 5; XMM and YMM states saved by the OS
+		if ((f & CPU_HAS_AESNI) && (c7 & (1 << 9)) != 0 && (b7 & (1 << 5)) != 0 && (xcr0 & 6) == 6)
+			f |= CPU_HAS_VAES;
+		cpuFeatures = f;
+	}
+	return cpuFeatures;
+}
+#endif
+
+
+
+/**
+ * GHASH by Shoup's 4-bit table: 16 multiples of H, the product is accumulated four bits a time
+ * The table and the accumulator are 128-bit integers in host byte order, most significant half first
+ */
+#define REDUCE1BIT(V) {	\
+	uint64_t T = 0xE100000000000000ULL & (0 - ((V)[1] & 1));	\
+	(V)[1] = ((V)[0] << 63) | ((V)[1] >> 1);	\
+	(V)[0] = ((V)[0] >> 1) ^ T;	\
+	}
+
+static const uint64_t rem_4bit[16] =
+{
+	0x0000ULL << 48, 0x1C20ULL << 48, 0x3840ULL << 48, 0x2460ULL << 48,
+	0x7080ULL << 48, 0x6CA0ULL << 48, 0x48C0ULL << 48, 0x54E0ULL << 48,
+	0xE100ULL << 48, 0xFD20ULL << 48, 0xD940ULL << 48, 0xC560ULL << 48,
+	0x9180ULL << 48, 0x8DA0ULL << 48, 0xA9C0ULL << 48, 0xB5E0ULL << 48
+};
+
+static void ghash_init_4bit(uint64_t M[16][2], const uint8_t *H)
+{
+	uint64_t V[2];
+	register int i, j;
+
+	V[0] = be64toh(*(uint64_t *)H);
+	V[1] = be64toh(*(uint64_t *)(H + 8));
+
+	M[0][0] = M[0][1] = 0;
+	for (i = 8; i > 0; i >>= 1)
+	{
+		M[i][0] = V[0];
+		M[i][1] = V[1];
+		REDUCE1BIT(V);
+	}
+	// Multiplication distributes over addition (XOR)
+	for (i = 2; i < 16; i <<= 1)
+	{
+		for (j = 1; j < i; j++)
+		{
+			M[i + j][0] = M[i][0] ^ M[j][0];
+			M[i + j][1] = M[i][1] ^ M[j][1];
+		}
+	}
+}
+
+// X := (X + each block) * H
+static void ghash_blocks_4bit(const GCM_AES_CTX *ctx, uint8_t *X, const uint8_t *p, uint32_t nBlocks)
+{
+	const uint64_t (*M)[2] = (const uint64_t (*)[2])ctx->HT;
+	uint8_t	x[GCM_BLOCK_LEN];
+	uint64_t Z[2];
+	register int i;
+
+	for (; nBlocks > 0; nBlocks--, p += GCM_BLOCK_LEN)
+	{
+		for (i = 0; i < GCM_BLOCK_LEN; i++)
+			x[i] = X[i] ^ p[i];
+
+		Z[0] = Z[1] = 0;
+		for (i = GCM_BLOCK_LEN - 1; i >= 0; i--)
+		{
+			uint8_t n = x[i];
+			uint8_t r;
+			// the low nibble
+			r = (uint8_t)(Z[1] & 0xF);
+			Z[1] = (Z[0] << 60) | (Z[1] >> 4);
+			Z[0] = (Z[0] >> 4) ^ rem_4bit[r];
+			Z[0] ^= M[n & 0xF][0];
+			Z[1] ^= M[n & 0xF][1];
+			// the high nibble
+			r = (uint8_t)(Z[1] & 0xF);
+			Z[1] = (Z[0] << 60) | (Z[1] >> 4);
+			Z[0] = (Z[0] >> 4) ^ rem_4bit[r];
+			Z[0] ^= M[n >> 4][0];
+			Z[1] ^= M[n >> 4][1];
+		}
+		// The very first shift was of zero, so it does not matter that the last one is missing
+		((uint64_t *)X)[0] = htobe64(Z[0]);
+		((uint64_t *)X)[1] = htobe64(Z[1]);
+	}
+}
+
+
+
+#ifdef GCM_CLMUL
+/**
+ * GHASH by carry-less multiplication, as of the Intel white paper 'Intel Carry-Less Multiplication
+ * Instruction and its Usage for Computing the GCM Mode' by Shay Gueron and Michael E. Kounavis
+ * Operands are byte-reversed so that the bit-reflected product is just shifted left by one bit
+ * before reduction. As shifting and reduction are linear, the 256-bit products of several blocks
+ * are summed up and reduced only once
+ */
+// Accumulate the unreduced 256-bit product a * b into (lo, hi)
+static __inline CLMUL_TARGET
+void clmul_accumulate(__m128i a, __m128i b, __m128i *lo, __m128i *hi)
+{
+	__m128i t0 = _mm_clmulepi64_si128(a, b, 0x00);
+	__m128i t1 = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+	__m128i t2 = _mm_clmulepi64_si128(a, b, 0x11);
+	*lo = _mm_xor_si128(*lo, _mm_xor_si128(t0, _mm_slli_si128(t1, 8)));
+	*hi = _mm_xor_si128(*hi, _mm_xor_si128(t2, _mm_srli_si128(t1, 8)));
+}
+
+// Shift the bit-reflected 256-bit (lo, hi) left by one bit and reduce it modulo x^128 + x^7 + x^2 + x + 1
+static __inline CLMUL_TARGET
+__m128i clmul_reduce(__m128i lo, __m128i hi)
+{
+	__m128i t7, t8, t9;
+	t7 = _mm_srli_epi32(lo, 31);
+	t8 = _mm_srli_epi32(hi, 31);
+	lo = _mm_slli_epi32(lo, 1);
+	hi = _mm_slli_epi32(hi, 1);
+	t9 = _mm_srli_si128(t7, 12);
+	t8 = _mm_slli_si128(t8, 4);
+	t7 = _mm_slli_si128(t7, 4);
+	lo = _mm_or_si128(lo, t7);
+	hi = _mm_or_si128(_mm_or_si128(hi, t8), t9);
+
+	t7 = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+	t8 = _mm_srli_si128(t7, 4);
+	lo = _mm_xor_si128(lo, _mm_slli_si128(t7, 12));
+	t9 = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+	t9 = _mm_xor_si128(t9, t8);
+	return _mm_xor_si128(hi, _mm_xor_si128(lo, t9));
+}
+
+static CLMUL_TARGET
+__m128i clmul_gfmul(__m128i a, __m128i b)
+{
+	__m128i lo = _mm_setzero_si128();
+	__m128i hi = _mm_setzero_si128();
+	clmul_accumulate(a, b, &lo, &hi);
+	return clmul_reduce(lo, hi);
+}
+
+// HT[i] := H^(i+1), byte-reversed
+static CLMUL_TARGET
+void ghash_init_clmul(uint64_t M[16][2], const uint8_t *H)
+{
+	const __m128i BSWAP = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i h = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)H), BSWAP);
+	__m128i p = h;
+	register int i;
+
+	_mm_store_si128((__m128i *)M[0], h);
+	for (i = 1; i < GHASH_AGGREGATE; i++)
+	{
+		p = clmul_gfmul(p, h);
+		_mm_store_si128((__m128i *)M[i], p);
+	}
+}
+
+// X := (X + each block) * H, GHASH_AGGREGATE blocks are reduced at a time
+static CLMUL_TARGET
+void ghash_blocks_clmul(const GCM_AES_CTX *ctx, uint8_t *X, const uint8_t *p, uint32_t nBlocks)
+{
+	const __m128i BSWAP = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i *M = (const __m128i *)ctx->HT;
+	__m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)X), BSWAP);
+	register int i;
+
+	for (; nBlocks >= GHASH_AGGREGATE; nBlocks -= GHASH_AGGREGATE, p += GCM_BLOCK_LEN * GHASH_AGGREGATE)
+	{
+		__m128i lo = _mm_setzero_si128();
+		__m128i hi = _mm_setzero_si128();
+		// X' = (X + C1) * H^n + C2 * H^(n-1) + ... + Cn * H
+		x = _mm_xor_si128(x, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), BSWAP));
+		clmul_accumulate(x, _mm_load_si128(M + GHASH_AGGREGATE - 1), &lo, &hi);
+		for (i = 1; i < GHASH_AGGREGATE; i++)
+		{
+			x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + GCM_BLOCK_LEN * i)), BSWAP);
+			clmul_accumulate(x, _mm_load_si128(M + GHASH_AGGREGATE - 1 - i), &lo, &hi);
+		}
+		x = clmul_reduce(lo, hi);
+	}
+
+	for (; nBlocks > 0; nBlocks--, p += GCM_BLOCK_LEN)
+	{
+		x = _mm_xor_si128(x, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), BSWAP));
+		x = clmul_gfmul(x, _mm_load_si128(M));
+	}
+
+	_mm_storeu_si128((__m128i *)X, _mm_shuffle_epi8(x, BSWAP));
+}
+#endif
+
+
+
+/**
+ * AES by AES-NI, and by VAES which does two blocks in one 256-bit register. The round keys are
+ * kept in ctx->K in octet order instead of the big-endian words of rijndaelKeySetupEnc.
+ * Counter mode blocks are independent of each other, so they are interleaved to fill the pipeline
+ */
+#ifdef GCM_AESNI
+#define AESNI_INTERLEAVE	4
+
+static AESNI_TARGET
+void aes_encrypt_aesni(const GCM_AES_CTX *ctx, const uint8_t *in, uint8_t *out)
 {
-	uint8_t	*x = (uint8_t *)X;
-	uint64_t	y[2];
-	uint64_t	z[2] = { 0, 0 };
-	int64_t		mul;
+	const __m128i *rk = (const __m128i *)ctx->K;
+	__m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), _mm_loadu_si128(rk));
 	register int i;
+	for (i = 1; i < ctx->rounds; i++)
+		b = _mm_aesenc_si128(b, _mm_loadu_si128(rk + i));
+	_mm_storeu_si128((__m128i *)out, _mm_aesenclast_si128(b, _mm_loadu_si128(rk + i)));
+}
+
+// Given
+//	const uint8_t *	the counter block whose leftmost 96 bits are taken
+//	uint32_t	the counter of the first block, in host byte order
+//	uint32_t	number of full blocks to encrypt
+// Return
+//	the counter of the next block
+static AESNI_TARGET
+uint32_t aes_ctr_aesni(const GCM_AES_CTX *ctx, const uint8_t *J, uint32_t ctr, const uint8_t *in, uint8_t *out, uint32_t nBlocks)
+{
+	__m128i k[RIJNDAEL_MAXNR + 1];
+	__m128i j = _mm_loadu_si128((const __m128i *)J);
+	__m128i b[AESNI_INTERLEAVE];
+	register int i, r;
 
-	y[0] = be64toh(((uint64_t *)Y)[0]);
-	y[1] = be64toh(((uint64_t *)Y)[1]);
+	for (r = 0; r <= ctx->rounds; r++)
+		k[r] = _mm_loadu_si128((const __m128i *)ctx->K + r);
 
-	for (i = 0; i < GCM_BLOCK_LEN * 8; i++) 
+	for (; nBlocks >= AESNI_INTERLEAVE; nBlocks -= AESNI_INTERLEAVE)
 	{
-		if (x[i >> 3] & (1 << (~i & 7)))
+		for (i = 0; i < AESNI_INTERLEAVE; i++)
+			b[i] = _mm_xor_si128(_mm_insert_epi32(j, (int)htobe32(ctr + i), 3), k[0]);
+		for (r = 1; r < ctx->rounds; r++)
+		{
+			for (i = 0; i < AESNI_INTERLEAVE; i++)
+				b[i] = _mm_aesenc_si128(b[i], k[r]);
+		}
+		for (i = 0; i < AESNI_INTERLEAVE; i++)
 		{
-			z[0] ^= y[0];
-			z[1] ^= y[1];
+			b[i] = _mm_aesenclast_si128(b[i], k[r]);
+			_mm_storeu_si128((__m128i *)out, _mm_xor_si128(b[i], _mm_loadu_si128((const __m128i *)in)));
+			in += GCM_BLOCK_LEN;
+			out += GCM_BLOCK_LEN;
 		}
+		ctr += AESNI_INTERLEAVE;
+	}
+
+	for (; nBlocks > 0; nBlocks--, ctr++)
+	{
+		b[0] = _mm_xor_si128(_mm_insert_epi32(j, (int)htobe32(ctr), 3), k[0]);
+		for (r = 1; r < ctx->rounds; r++)
+			b[0] = _mm_aesenc_si128(b[0], k[r]);
+		b[0] = _mm_aesenclast_si128(b[0], k[r]);
+		_mm_storeu_si128((__m128i *)out, _mm_xor_si128(b[0], _mm_loadu_si128((const __m128i *)in)));
+		in += GCM_BLOCK_LEN;
+		out += GCM_BLOCK_LEN;
+	}
+
+	return ctr;
+}
+
+// Encrypt 8 blocks a round in four 256-bit registers, leave the remainder to aes_ctr_aesni
+static VAES_TARGET
+uint32_t aes_ctr_vaes(const GCM_AES_CTX *ctx, const uint8_t *J, uint32_t ctr, const uint8_t *in, uint8_t *out, uint32_t nBlocks)
+{
+	__m256i k[RIJNDAEL_MAXNR + 1];
+	__m256i j = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)J));
+	__m256i b[4];
+	register int i, r;
+
+	for (r = 0; r <= ctx->rounds; r++)
+		k[r] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)ctx->K + r));
+
+	for (; nBlocks >= 8; nBlocks -= 8, ctr += 8)
+	{
+		for (i = 0; i < 4; i++)
+		{
+			b[i] = _mm256_insert_epi32(j, (int)htobe32(ctr + 2 * i), 3);
+			b[i] = _mm256_insert_epi32(b[i], (int)htobe32(ctr + 2 * i + 1), 7);
+			b[i] = _mm256_xor_si256(b[i], k[0]);
+		}
+		for (r = 1; r < ctx->rounds; r++)
+		{
+			for (i = 0; i < 4; i++)
+				b[i] = _mm256_aesenc_epi128(b[i], k[r]);
+		}
+		for (i = 0; i < 4; i++)
+		{
+			b[i] = _mm256_aesenclast_epi128(b[i], k[r]);
+			_mm256_storeu_si256((__m256i *)out, _mm256_xor_si256(b[i], _mm256_loadu_si256((const __m256i *)in)));
+			in += GCM_BLOCK_LEN * 2;
+			out += GCM_BLOCK_LEN * 2;
+		}
+	}
+	_mm256_zeroupper();
+
+	return aes_ctr_aesni(ctx, J, ctr, in, out, nBlocks);
+}
+#endif
+
+
+
+// Given
+//	const GCM_AES_CTX *	the context whose key schedule is to use
+//	const uint8_t *		the input block
+//	uint8_t *			the output block, may be the same as the input
+static void aes_encrypt(const GCM_AES_CTX *ctx, const uint8_t *in, uint8_t *out)
+{
+#ifdef GCM_AESNI
+	if (CPUFeatures() & CPU_HAS_AESNI)
+	{
+		aes_encrypt_aesni(ctx, in, out);
+		return;
+	}
+#endif
+	rijndaelEncrypt(ctx->K, ctx->rounds, in, out);
+}
+
+
+
+// Given
+//	const GCM_AES_CTX *	the context whose key schedule is to use
+//	uint8_t *		the initial counter block, advanced on return
+//	const uint8_t *	the input, plaintext or ciphertext
+//	uint8_t *		the output, which may be the same as the input
+//	uint32_t		length in bytes of the input
+// Do
+//	GCTR: XOR the input with the key stream of the successive counter blocks
+// Remark
+//	The counter block is advanced for each full block. The last partial block does not advance it
+static void aes_ctr(const GCM_AES_CTX *ctx, uint8_t *J, const uint8_t *in, uint8_t *out, uint32_t bytes)
+{
+	uint8_t		keystream[GCM_BLOCK_LEN];
+	uint32_t	nBlocks = bytes >> GCM_BLOCK_LEN_POWER;
+	uint32_t	plen = bytes & (GCM_BLOCK_LEN - 1);
+	uint64_t	blk[2];
+	register uint32_t i;
+
+#ifdef GCM_AESNI
+	if ((CPUFeatures() & CPU_HAS_AESNI) && nBlocks > 0)
+	{
+		uint32_t ctr = be32toh(*(uint32_t *)(J + GCM_IV_LEN_FIXED));
+		ctr = (CPUFeatures() & CPU_HAS_VAES)
+			? aes_ctr_vaes(ctx, J, ctr, in, out, nBlocks)
+			: aes_ctr_aesni(ctx, J, ctr, in, out, nBlocks);
+		*(uint32_t *)(J + GCM_IV_LEN_FIXED) = htobe32(ctr);
+		in += nBlocks * GCM_BLOCK_LEN;
+		out += nBlocks * GCM_BLOCK_LEN;
+		nBlocks = 0;
+	}
+#endif
+	for (; nBlocks > 0; nBlocks--)
+	{
+		rijndaelEncrypt(ctx->K, ctx->rounds, J, keystream);
+		bcopy(in, (uint8_t *)blk, GCM_BLOCK_LEN);
+		gfadd(blk, keystream, blk);
+		bcopy((uint8_t *)blk, out, GCM_BLOCK_LEN);
+		in += GCM_BLOCK_LEN;
+		out += GCM_BLOCK_LEN;
+		gfinc(J);
+	}
+
+	if (plen != 0)
+	{
+		aes_encrypt(ctx, J, keystream);
+		for (i = 0; i < plen; i++)
+			out[i] = in[i] ^ keystream[i];
+	}
+
+	blk[0] = blk[1] = 0;
+	bzero(keystream, sizeof(keystream));	// for security reason
+}
+
+
+
+// Given
+//	const GCM_AES_CTX *	the context whose hash subkey is to use
+//	uint8_t *		the hash state to update
+//	const void *	the data to hash, which needs not be aligned
+//	uint32_t		length in bytes of the data. The last partial block is padded with zeros
+static void ghash_update(const GCM_AES_CTX *ctx, uint8_t *X, const void *data, uint32_t bytes)
+{
+	uint8_t		blk[GCM_BLOCK_LEN];
+	uint32_t	n = bytes >> GCM_BLOCK_LEN_POWER;
+	uint32_t	plen = bytes & (GCM_BLOCK_LEN - 1);
+	void (*blocks)(const GCM_AES_CTX *, uint8_t *, const uint8_t *, uint32_t) = ghash_blocks_4bit;
+
+#ifdef GCM_CLMUL
+	if (CPUFeatures() & CPU_HAS_CLMUL)
+		blocks = ghash_blocks_clmul;
+#endif
+	if (n > 0)
+		blocks(ctx, X, (const uint8_t *)data, n);
+	if (plen != 0)
+	{
+		bzero(blk, GCM_BLOCK_LEN);
+		bcopy((const uint8_t *)data + (bytes - plen), blk, plen);
+		blocks(ctx, X, blk, 1);
+		bzero(blk, GCM_BLOCK_LEN);	// for security reason
+	}
+}
 
-		mul = y[1] & 1;
-		y[1] = (y[0] << 63) | (y[1] >> 1);
-		y[0] = (y[0] >> 1) ^ (0xE100000000000000LL & (-mul));
-		// works only for complementary coding of negative number
+
+
+void GCM_AES_SetHashKey(GCM_AES_CTX *ctx, const octet *H)
+{
+	if (H != ctx->H)
+		bcopy(H, ctx->H, GCM_BLOCK_LEN);
+#ifdef GCM_CLMUL
+	if (CPUFeatures() & CPU_HAS_CLMUL)
+	{
+		ghash_init_clmul(ctx->HT, ctx->H);
+		return;
 	}
+#endif
+	ghash_init_4bit(ctx->HT, ctx->H);
+}
 
-	((uint64_t *)Z)[0] = htobe64(z[0]);
-	((uint64_t *)Z)[1] = htobe64(z[1]);
+
+
+void GCM_AES_SetCipherKey(GCM_AES_CTX *ctx, const octet *K, int bytesK)
+{
+	ctx->rounds = rijndaelKeySetupEnc(ctx->K, K, bytesK * 8);
+#ifdef GCM_AESNI
+	// AES-NI takes the round keys in octet order
+	if (CPUFeatures() & CPU_HAS_AESNI)
+	{
+		register int i;
+		for (i = 0; i < 4 * (ctx->rounds + 1); i++)
+			ctx->K[i] = htobe32(ctx->K[i]);
+	}
+#endif
 }
 
 
@@ -103,12 +571,13 @@ void GCM_AES_SetIV(GCM_AES_CTX *ctx, const uint8_t *IV)
 void GCM_AES_SetKey(GCM_AES_CTX *ctx, const octet *K, int bytesK)
 {
 	// AES key schedule
-	ctx->rounds = rijndaelKeySetupEnc(ctx->K, K, (bytesK & 0xF8) * 8);
+	GCM_AES_SetCipherKey(ctx, K, bytesK & 0xF8);
 
 	// The HASH sub-key
 	bzero(ctx->H, GCM_BLOCK_LEN);
 	bzero(ctx->X, GCM_BLOCK_LEN);
-	rijndaelEncrypt(ctx->K, ctx->rounds, ctx->X, ctx->H);
+	aes_encrypt(ctx, ctx->X, ctx->H);
+	GCM_AES_SetHashKey(ctx, ctx->H);
 
 	*(uint32_t *)ctx->J = (bytesK & 7) == 0 ? 0 : *(uint32_t *)(K + (bytesK & 0xF8));
 }
@@ -131,10 +600,7 @@ int	GCM_AES_AuthenticatedEncrypt(GCM_AES_CTX *ctx, uint64_t IV
 								, octet *T, int bytesT)
 {
 	uint8_t		keystream[GCM_BLOCK_LEN];
-	uint64_t	blk[2] = { 0, 0 };
-	int	plen;
-	int nMinus1;
-	uint64_t *x;
+	uint64_t	blk[2];
 	register int i;
 
 	if(bytesT > GCM_BLOCK_LEN)
@@ -144,67 +610,26 @@ int	GCM_AES_AuthenticatedEncrypt(GCM_AES_CTX *ctx, uint64_t IV
 
 	// AAD at first
 	if (bytesA > 0)
-	{
-		nMinus1 = bytesA >> GCM_BLOCK_LEN_POWER;
-		plen = bytesA & (GCM_BLOCK_LEN - 1);
-		x = (uint64_t *)aad;
-		for (i = 0; i < nMinus1; i++)
-		{
-			gfadd(ctx->X, x, ctx->X);
-			ghash_gfmul(ctx->X, ctx->H, ctx->X);
-			x += GCM_BLOCK_LEN / sizeof(uint64_t);
-		}
-		if (plen != 0)
-		{
-			bcopy((uint8_t *)aad + (bytesA - plen), (uint8_t *)blk, plen);
-			gfadd(ctx->X, blk, ctx->X);
-			ghash_gfmul(ctx->X, ctx->H, ctx->X);
-			blk[0] = blk[1] = 0;		// for security reason
-		}
-	}
+		ghash_update(ctx, ctx->X, aad, bytesA);
 
 	// Do cipher
 	if(bytesP > 0)
 	{
-		nMinus1 = bytesP >> GCM_BLOCK_LEN_POWER;
-		plen = bytesP & (GCM_BLOCK_LEN - 1);
-		x = bufCipherText;
 		// ICB
 		gfinc(ctx->J);
-		for(i = 0; i < nMinus1; i++)
-		{
-			rijndaelEncrypt(ctx->K, ctx->rounds, ctx->J, keystream);
-			bcopy(P, (uint8_t *)blk, GCM_BLOCK_LEN);
-			P += GCM_BLOCK_LEN;
-			gfadd(blk, keystream, x);
-			gfinc(ctx->J);
-			//
-			gfadd(ctx->X, x, ctx->X);
-			ghash_gfmul(ctx->X, ctx->H, ctx->X);
-			x += GCM_BLOCK_LEN / sizeof(uint64_t);
-		}
-
-		blk[0] = blk[1] = 0;	// there maybe some plaintext in the temporary buffer
-		if (plen != 0)
-		{
-			rijndaelEncrypt(ctx->K, ctx->rounds, ctx->J, keystream);
-			for(i = 0; i < plen; i++)
-				((uint8_t *)x)[i] = P[i] ^ keystream[i];
-			bcopy(x, (uint8_t *)blk, plen);
-			gfadd(ctx->X, blk, ctx->X);
-			ghash_gfmul(ctx->X, ctx->H, ctx->X);
-			blk[0] = blk[1] = 0;		// for security reason
-		}
+		aes_ctr(ctx, ctx->J, P, (uint8_t *)bufCipherText, bytesP);
+		// GHASH the ciphertext in bulk so that multiple blocks may be reduced at a time
+		ghash_update(ctx, ctx->X, bufCipherText, bytesP);
 	}
 
 	// The length round: somewhat roll-out of ghash_update (but conform to the original GCM specification)
-	gf_addlen(bytesA, bytesP, ctx->X);
-	ghash_gfmul(ctx->X, ctx->H, ctx->X);
+	gf_setlen(bytesA, bytesP, blk);
+	ghash_update(ctx, ctx->X, blk, GCM_BLOCK_LEN);
 
 	// The final round, compute the secured digest
 	/* GCTR(J0); assume IV is 96 bits; recover J0 first */
 	*(uint32_t *) & ctx->J[GCM_IV_LEN_FIXED] = *(const uint32_t *)J0;
-	rijndaelEncrypt(ctx->K, ctx->rounds, ctx->J, keystream);
+	aes_encrypt(ctx, ctx->J, keystream);
 	for (i = 0; i < bytesT; i++)
 		T[i] = ctx->X[i] ^ keystream[i];
 	bzero(ctx->X, GCM_BLOCK_LEN);
@@ -224,10 +649,7 @@ int	GCM_AES_AuthenticateAndDecrypt(GCM_AES_CTX *ctx, uint64_t IV
 									)
 {
 	uint8_t		keystream[GCM_BLOCK_LEN];
-	uint64_t	blk[2] = { 0, 0 };
-	int	plen;
-	int nMinus1;
-	uint64_t *x;
+	uint64_t	blk[2];
 	register int i;
 
 	if(bytesT > GCM_BLOCK_LEN)
@@ -237,57 +659,20 @@ int	GCM_AES_AuthenticateAndDecrypt(GCM_AES_CTX *ctx, uint64_t IV
 
 	// AAD at first
 	if (bytesA > 0)
-	{
-		nMinus1 = bytesA >> GCM_BLOCK_LEN_POWER;
-		plen = bytesA & (GCM_BLOCK_LEN - 1);
-		x = (uint64_t *)aad;
-		for (i = 0; i < nMinus1; i++)
-		{
-			gfadd(ctx->X, x, ctx->X);
-			ghash_gfmul(ctx->X, ctx->H, ctx->X);
-			x += GCM_BLOCK_LEN / sizeof(uint64_t);
-		}
-		if (plen != 0)
-		{
-			bcopy((uint8_t *)aad + (bytesA - plen), (uint8_t *)blk, plen);
-			gfadd(ctx->X, blk, ctx->X);
-			ghash_gfmul(ctx->X, ctx->H, ctx->X);
-			blk[0] = blk[1] = 0;		// for security reason
-		}
-	}
+		ghash_update(ctx, ctx->X, aad, bytesA);
 
 	// Continue GHASH on C
 	if(bytesC > 0)
-	{
-		const uint8_t *x = C;
-		nMinus1 = bytesC >> GCM_BLOCK_LEN_POWER;
-		plen = bytesC & (GCM_BLOCK_LEN - 1);
-		for (i = 0; i < nMinus1; i++)
-		{
-			bcopy(x, (uint8_t *)blk, GCM_BLOCK_LEN); 
-			gfadd(ctx->X, blk, ctx->X);
-			ghash_gfmul(ctx->X, ctx->H, ctx->X);
-			x += GCM_BLOCK_LEN;
-		}
-
-		blk[0] = blk[1] = 0;	// there maybe some ciphertext in the temporary buffer
-		if (plen != 0)
-		{
-			bcopy(x, (uint8_t *)blk, plen);
-			gfadd(ctx->X, blk, ctx->X);
-			ghash_gfmul(ctx->X, ctx->H, ctx->X);
-			blk[0] = blk[1] = 0;		// for security reason
-		}
-	}
+		ghash_update(ctx, ctx->X, C, bytesC);
 
 	// The length round: somewhat roll-out of ghash_update (but conform to the original GCM specification)
-	gf_addlen(bytesA, bytesC, ctx->X);
-	ghash_gfmul(ctx->X, ctx->H, ctx->X);
+	gf_setlen(bytesA, bytesC, blk);
+	ghash_update(ctx, ctx->X, blk, GCM_BLOCK_LEN);
 
 	// The final round, authenticate the digest
 	/* GCTR(J0); assume IV is 96 bits; recover J0 first */
 	*(uint32_t *) & ctx->J[GCM_IV_LEN_FIXED] = *(uint32_t *)J0;
-	rijndaelEncrypt(ctx->K, ctx->rounds, ctx->J, keystream);
+	aes_encrypt(ctx, ctx->J, keystream);
 	for (i = 0; i < bytesT; i++)
 	{
 		if(T[i] != (ctx->X[i] ^ keystream[i]))
@@ -297,31 +682,461 @@ int	GCM_AES_AuthenticateAndDecrypt(GCM_AES_CTX *ctx, uint64_t IV
 	// Do de-cipher, assume H is kept, while S, Z have been zeroed and J have been reset to J0
 	if(bytesC > 0)
 	{
-		nMinus1 = bytesC >> GCM_BLOCK_LEN_POWER;
-		plen = bytesC & (GCM_BLOCK_LEN - 1);
-		x = bufPlainText;
 		// ICB
 		gfinc(ctx->J);
-		for(i = 0; i < nMinus1; i++)
+		aes_ctr(ctx, ctx->J, C, (uint8_t *)bufPlainText, bytesC);
+	}
+
+	bzero(ctx->X, GCM_BLOCK_LEN);
+	bzero(keystream, sizeof(keystream));	// for security reason
+
+	return 0;	// no error
+}
+
+
+
+/**
+ * Batched authenticated encryption and decryption. A packet of the batch is described by its lane,
+ * which holds the per-packet counter block and hash state so that packets may share the context.
+ * Counter blocks of short packets, as well as the blocks that mask the tags, are queued and
+ * enciphered AES_LANES a time in lock step, so that the AES pipeline is filled across packets.
+ * GHASH chains of short packets are stepped GHASH_LANES in turn, so that latency of the reduction
+ * in one chain is hidden by the others. The chain of a long packet is busy enough on its own
+ */
+#define AES_LANES		8
+#define GHASH_LANES		4
+#define GCM_BATCH_GROUP	16	// number of packets whose lanes are kept in the stack at a time
+
+// With VAES packets of at least so many full blocks are enciphered on their own
+#ifndef GCM_BATCH_WIDE_BLOCKS
+# define GCM_BATCH_WIDE_BLOCKS	AES_LANES
+#endif
+
+// Packets whose AAD, text and length block fit in so many blocks are hashed in interleaved lanes
+#ifndef GCM_BATCH_SHORT_BLOCKS
+# define GCM_BATCH_SHORT_BLOCKS	20
+#endif
+
+// A block queued to be enciphered in counter mode
+typedef struct
+{
+	const GCM_AES_CTX *ctx;
+	const uint8_t *J;	// the counter block whose leftmost 96 bits are taken
+	uint32_t	ctr;	// the rightmost 32 bits of the counter block, in host byte order
+	uint32_t	len;	// no more than GCM_BLOCK_LEN
+	const uint8_t *in;	// NULL if the key stream itself is wanted, to mask the tag
+	uint8_t		*out;
+} AES_LANE;
+
+typedef struct
+{
+	int			n;
+	AES_LANE	lane[AES_LANES];
+} AES_LANE_QUEUE;
+
+// The state of a packet in the batch
+typedef struct
+{
+	const GCM_AES_CTX *ctx;
+	uint8_t		J[GCM_BLOCK_LEN];	// the counter block
+	uint8_t		X[GCM_BLOCK_LEN];	// the hash state
+	uint8_t		S[GCM_BLOCK_LEN];	// E(K, J0), to mask the tag
+	uint64_t	L[2];				// the length block
+	// A short packet is hashed in a GHASH lane. The AAD and the text are gathered and padded
+	uint32_t	nBlocks;
+	ALIGN(16)
+	uint8_t		B[GCM_BATCH_SHORT_BLOCKS * GCM_BLOCK_LEN];
+} GCM_LANE;
+
+
+
+#ifdef GCM_AESNI
+// One round of the AES_LANES (== 8) lanes, unrolled so that the blocks are kept in registers
+#define AES_LANES_ROUND(aesenc, r) {	\
+	b[0] = aesenc(b[0], _mm_loadu_si128(rk[0] + (r)));	\
+	b[1] = aesenc(b[1], _mm_loadu_si128(rk[1] + (r)));	\
+	b[2] = aesenc(b[2], _mm_loadu_si128(rk[2] + (r)));	\
+	b[3] = aesenc(b[3], _mm_loadu_si128(rk[3] + (r)));	\
+	b[4] = aesenc(b[4], _mm_loadu_si128(rk[4] + (r)));	\
+	b[5] = aesenc(b[5], _mm_loadu_si128(rk[5] + (r)));	\
+	b[6] = aesenc(b[6], _mm_loadu_si128(rk[6] + (r)));	\
+	b[7] = aesenc(b[7], _mm_loadu_si128(rk[7] + (r)));	\
+	}
+
+// Assume all the lanes share the same number of rounds. Lanes are always enciphered AES_LANES a time,
+// the idle ones repeat the first
+static AESNI_TARGET
+void aes_lanes_aesni(const AES_LANE *q, int n)
+{
+	const __m128i *rk[AES_LANES];
+	__m128i b[AES_LANES];
+	const int rounds = q[0].ctx->rounds;
+	register int i, r;
+
+	for (i = 0; i < AES_LANES; i++)
+	{
+		const AES_LANE *p = q + (i < n ? i : 0);
+		rk[i] = (const __m128i *)p->ctx->K;
+		b[i] = _mm_insert_epi32(_mm_loadu_si128((const __m128i *)p->J), (int)htobe32(p->ctr), 3);
+		b[i] = _mm_xor_si128(b[i], _mm_loadu_si128(rk[i]));
+	}
+	for (r = 1; r < rounds; r++)
+		AES_LANES_ROUND(_mm_aesenc_si128, r);
+	AES_LANES_ROUND(_mm_aesenclast_si128, r);
+
+	for (i = 0; i < n; i++)
+	{
+		const AES_LANE *p = q + i;
+		if (p->in == NULL)
 		{
-			rijndaelEncrypt(ctx->K, ctx->rounds, ctx->J, keystream);
-			bcopy(C, (uint8_t *)blk, GCM_BLOCK_LEN);
-			C += GCM_BLOCK_LEN;
-			gfadd(blk, keystream, x);
-			gfinc(ctx->J);
-			x += GCM_BLOCK_LEN / sizeof(uint64_t);
+			_mm_storeu_si128((__m128i *)p->out, b[i]);
 		}
-		if (plen)
+		else if (p->len == GCM_BLOCK_LEN)
 		{
-			rijndaelEncrypt(ctx->K, ctx->rounds, ctx->J, keystream);
-			for(i = 0; i < plen; i++)
-				 ((uint8_t *)x)[i] = C[i] ^ keystream[i];
+			_mm_storeu_si128((__m128i *)p->out, _mm_xor_si128(b[i], _mm_loadu_si128((const __m128i *)p->in)));
+		}
+		else
+		{
+			ALIGN(16) uint8_t ks[GCM_BLOCK_LEN];
+			register uint32_t k;
+			_mm_store_si128((__m128i *)ks, b[i]);
+			for (k = 0; k < p->len; k++)
+				p->out[k] = p->in[k] ^ ks[k];
+			_mm_store_si128((__m128i *)ks, _mm_setzero_si128());	// for security reason
 		}
-		blk[0] = blk[1] = 0;	// for security reason
 	}
+}
+#endif
 
-	bzero(ctx->X, GCM_BLOCK_LEN);
-	bzero(keystream, sizeof(keystream));	// for security reason
 
-	return 0;	// no error
+
+// Encipher the queued blocks and XOR the input with the key stream
+static void aes_lanes_flush(AES_LANE_QUEUE *q)
+{
+	uint64_t	blk[2];
+	uint64_t	ks[2];
+	register int i;
+	register uint32_t k;
+
+	if (q->n <= 0)
+		return;
+
+#ifdef GCM_AESNI
+	for (i = 1; i < q->n && q->lane[i].ctx->rounds == q->lane[0].ctx->rounds; i++)
+		continue;
+	if ((CPUFeatures() & CPU_HAS_AESNI) && i >= q->n)
+	{
+		aes_lanes_aesni(q->lane, q->n);
+		q->n = 0;
+		return;
+	}
+#endif
+	for (i = 0; i < q->n; i++)
+	{
+		AES_LANE *p = q->lane + i;
+		bcopy(p->J, (uint8_t *)blk, GCM_IV_LEN_FIXED);
+		*(uint32_t *)((uint8_t *)blk + GCM_IV_LEN_FIXED) = htobe32(p->ctr);
+		aes_encrypt(p->ctx, (uint8_t *)blk, (uint8_t *)ks);
+		if (p->in == NULL)
+		{
+			bcopy((uint8_t *)ks, p->out, GCM_BLOCK_LEN);
+		}
+		else if (p->len == GCM_BLOCK_LEN)
+		{
+			bcopy(p->in, (uint8_t *)blk, GCM_BLOCK_LEN);
+			gfadd(blk, ks, blk);
+			bcopy((uint8_t *)blk, p->out, GCM_BLOCK_LEN);
+		}
+		else
+		{
+			for (k = 0; k < p->len; k++)
+				p->out[k] = p->in[k] ^ ((uint8_t *)ks)[k];
+		}
+	}
+
+	q->n = 0;
+	bzero(blk, sizeof(blk));
+	bzero(ks, sizeof(ks));	// for security reason
+}
+
+
+
+// Queue the blocks of a packet to encipher in counter mode. The counter block is advanced
+// for each full block, as aes_ctr does. NULL input means to mask the tag by E(K, J0)
+// Remark
+//	The leftmost 96 bits of the counter block must be kept until the queue is flushed
+static void aes_lanes_queue(AES_LANE_QUEUE *q, const GCM_AES_CTX *ctx, uint8_t *J, const uint8_t *in, uint8_t *out, uint32_t bytes)
+{
+	uint32_t ctr = be32toh(*(uint32_t *)(J + GCM_IV_LEN_FIXED));
+	while (bytes > 0)
+	{
+		AES_LANE *p = q->lane + q->n;
+		p->ctx = ctx;
+		p->J = J;
+		p->ctr = ctr;
+		p->len = bytes < GCM_BLOCK_LEN ? bytes : GCM_BLOCK_LEN;
+		p->in = in;
+		p->out = out;
+		if (in != NULL)
+		{
+			ctr += (p->len == GCM_BLOCK_LEN);
+			in += p->len;
+		}
+		out += p->len;
+		bytes -= p->len;
+		if (++q->n >= AES_LANES)
+			aes_lanes_flush(q);
+	}
+	*(uint32_t *)(J + GCM_IV_LEN_FIXED) = htobe32(ctr);
+}
+
+
+
+// Encipher the text of the packet, either queued or on its own. Without AES-NI there is no pipeline
+// to fill, and with VAES a long packet is enciphered two blocks a register on its own
+static __inline
+void aes_lanes_ctr(AES_LANE_QUEUE *q, GCM_LANE *s, const uint8_t *in, uint8_t *out, uint32_t bytes)
+{
+#ifdef GCM_AESNI
+	int f = CPUFeatures();
+	if ((f & CPU_HAS_AESNI) && !((f & CPU_HAS_VAES) && bytes >= GCM_BATCH_WIDE_BLOCKS * GCM_BLOCK_LEN))
+	{
+		aes_lanes_queue(q, s->ctx, s->J, in, out, bytes);
+		return;
+	}
+#endif
+	aes_ctr(s->ctx, s->J, in, out, bytes);
+}
+
+
+
+// Set J0 and the length block of the packet, queue E(K, J0), then make J the initial counter block
+// Return
+//	false if the parameter is illegal
+static int gcm_lane_init(GCM_LANE *s, AES_LANE_QUEUE *q, const GCM_AES_PACKET *p)
+{
+	if (p->bytesT < 0 || p->bytesT > GCM_BLOCK_LEN)
+		return 0;
+
+	s->ctx = p->ctx;
+	*(uint32_t *)s->J = *(const uint32_t *)p->ctx->J ^ p->salt;
+	bcopy(&p->IV, s->J + GMAC_SALT_LEN, GCM_IV_LEN_FIXED - GMAC_SALT_LEN);
+	*(uint32_t *)(s->J + GCM_IV_LEN_FIXED) = *(const uint32_t *)J0;
+	bzero(s->X, GCM_BLOCK_LEN);
+	gf_setlen(p->bytesA, p->bytes, s->L);
+
+	aes_lanes_queue(q, s->ctx, s->J, NULL, s->S, GCM_BLOCK_LEN);
+	gfinc(s->J);
+	return 1;
+}
+
+
+
+// Hash the AAD, the text and the length block of the packet into the hash state of its lane
+static __inline
+void ghash_lane(GCM_LANE *s, const GCM_AES_PACKET *p, const void *text)
+{
+	if (p->bytesA > 0)
+		ghash_update(s->ctx, s->X, p->aad, p->bytesA);
+	if (p->bytes > 0)
+		ghash_update(s->ctx, s->X, text, p->bytes);
+	ghash_update(s->ctx, s->X, s->L, GCM_BLOCK_LEN);
+}
+
+
+
+#ifdef GCM_CLMUL
+// Gather the AAD, the text and the length block of the packet, each padded to the block border
+// Return
+//	false if the packet is too long to be hashed in a GHASH lane
+static int ghash_lane_gather(GCM_LANE *s, const GCM_AES_PACKET *p, const void *text)
+{
+	uint32_t pA = (p->bytesA + GCM_BLOCK_LEN - 1) & ~(GCM_BLOCK_LEN - 1);
+	uint32_t pC = (p->bytes + GCM_BLOCK_LEN - 1) & ~(GCM_BLOCK_LEN - 1);
+
+	if (pA + pC + GCM_BLOCK_LEN > sizeof(s->B))
+		return 0;
+
+	if (pA > 0)
+	{
+		bzero(s->B + pA - GCM_BLOCK_LEN, GCM_BLOCK_LEN);
+		bcopy(p->aad, s->B, p->bytesA);
+	}
+	if (pC > 0)
+	{
+		bzero(s->B + pA + pC - GCM_BLOCK_LEN, GCM_BLOCK_LEN);
+		bcopy(text, s->B + pA, p->bytes);
+	}
+	bcopy((uint8_t *)s->L, s->B + pA + pC, GCM_BLOCK_LEN);
+	s->nBlocks = (pA + pC) / GCM_BLOCK_LEN + 1;
+	return 1;
+}
+
+
+
+// Step the GHASH chains of GHASH_LANES lanes in turn, GHASH_AGGREGATE blocks a step
+static CLMUL_TARGET
+void ghash_lanes_clmul(GCM_LANE **v, int n)
+{
+	const __m128i BSWAP = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i x[GHASH_LANES];
+	uint32_t done;
+	int		base, m, active;
+	register int i;
+	register uint32_t k;
+
+	for (base = 0; base < n; base += GHASH_LANES)
+	{
+		m = (n - base < GHASH_LANES ? n - base : GHASH_LANES);
+		for (i = 0; i < m; i++)
+			x[i] = _mm_setzero_si128();
+		for (done = 0, active = m; active > 0; done += GHASH_AGGREGATE)
+		{
+			active = 0;
+			for (i = 0; i < m; i++)
+			{
+				const GCM_LANE *s = v[base + i];
+				const __m128i *M = (const __m128i *)s->ctx->HT;
+				const __m128i *p = (const __m128i *)s->B + done;
+				__m128i lo, hi;
+
+				if (done >= s->nBlocks)
+					continue;
+				lo = _mm_setzero_si128();
+				hi = _mm_setzero_si128();
+				x[i] = _mm_xor_si128(x[i], _mm_shuffle_epi8(_mm_load_si128(p), BSWAP));
+				if (s->nBlocks - done >= GHASH_AGGREGATE)
+				{
+					clmul_accumulate(x[i], _mm_load_si128(M + GHASH_AGGREGATE - 1), &lo, &hi);
+					for (k = 1; k < GHASH_AGGREGATE; k++)
+						clmul_accumulate(_mm_shuffle_epi8(_mm_load_si128(p + k), BSWAP), _mm_load_si128(M + GHASH_AGGREGATE - 1 - k), &lo, &hi);
+				}
+				else
+				{
+					uint32_t nBlocks = s->nBlocks - done;
+					clmul_accumulate(x[i], _mm_load_si128(M + nBlocks - 1), &lo, &hi);
+					for (k = 1; k < nBlocks; k++)
+						clmul_accumulate(_mm_shuffle_epi8(_mm_load_si128(p + k), BSWAP), _mm_load_si128(M + nBlocks - 1 - k), &lo, &hi);
+				}
+				x[i] = clmul_reduce(lo, hi);
+				active++;
+			}
+		}
+		for (i = 0; i < m; i++)
+			_mm_storeu_si128((__m128i *)v[base + i]->X, _mm_shuffle_epi8(x[i], BSWAP));
+	}
+}
+#endif
+
+
+
+// Hash each packet that is not rejected into the hash state of its lane
+static void ghash_batch(GCM_LANE *s, const GCM_AES_PACKET *p, int m, int toOpen)
+{
+#ifdef GCM_CLMUL
+	GCM_LANE *v[GCM_BATCH_GROUP];
+	int nLanes = 0;
+#endif
+	register int i;
+
+	for (i = 0; i < m; i++)
+	{
+		const void *text = toOpen ? (const void *)p[i].in : (const void *)p[i].out;
+		if (p[i].result != 0)
+			continue;
+#ifdef GCM_CLMUL
+		if ((CPUFeatures() & CPU_HAS_CLMUL) && ghash_lane_gather(s + i, p + i, text))
+		{
+			v[nLanes++] = s + i;
+			continue;
+		}
+#endif
+		ghash_lane(s + i, p + i, text);
+	}
+#ifdef GCM_CLMUL
+	if (nLanes > 0)
+		ghash_lanes_clmul(v, nLanes);
+#endif
+}
+
+
+
+int GCM_AES_SealBatch(GCM_AES_PACKET *pkt, int n)
+{
+	GCM_LANE		s[GCM_BATCH_GROUP];
+	AES_LANE_QUEUE	q;
+	int		base, m, r = 0;
+	register int i, k;
+
+	for (base = 0; base < n; base += GCM_BATCH_GROUP)
+	{
+		GCM_AES_PACKET *p = pkt + base;
+		m = (n - base < GCM_BATCH_GROUP ? n - base : GCM_BATCH_GROUP);
+		q.n = 0;
+		for (i = 0; i < m; i++)
+		{
+			p[i].result = gcm_lane_init(s + i, &q, p + i) ? 0 : -2;
+			if (p[i].result == 0)
+				aes_lanes_ctr(&q, s + i, p[i].in, (uint8_t *)p[i].out, p[i].bytes);
+		}
+		aes_lanes_flush(&q);
+
+		ghash_batch(s, p, m, 0);
+		for (i = 0; i < m; i++)
+		{
+			if (p[i].result != 0)
+				continue;
+			for (k = 0; k < p[i].bytesT; k++)
+				p[i].T[k] = s[i].X[k] ^ s[i].S[k];
+			r++;
+		}
+	}
+
+	bzero(s, sizeof(s));	// for security reason
+	bzero(&q, sizeof(q));
+	return r;
+}
+
+
+
+int GCM_AES_OpenBatch(GCM_AES_PACKET *pkt, int n)
+{
+	GCM_LANE		s[GCM_BATCH_GROUP];
+	AES_LANE_QUEUE	q;
+	int		base, m, r = 0;
+	register int i, k;
+
+	for (base = 0; base < n; base += GCM_BATCH_GROUP)
+	{
+		GCM_AES_PACKET *p = pkt + base;
+		m = (n - base < GCM_BATCH_GROUP ? n - base : GCM_BATCH_GROUP);
+		q.n = 0;
+		for (i = 0; i < m; i++)
+			p[i].result = gcm_lane_init(s + i, &q, p + i) ? 0 : -2;
+		aes_lanes_flush(&q);
+
+		ghash_batch(s, p, m, 1);
+		for (i = 0; i < m; i++)
+		{
+			if (p[i].result != 0)
+				continue;
+			for (k = 0; k < p[i].bytesT; k++)
+			{
+				if (p[i].T[k] != (s[i].X[k] ^ s[i].S[k]))
+					break;
+			}
+			if (k < p[i].bytesT)
+			{
+				p[i].result = -1;
+				continue;
+			}
+			aes_lanes_ctr(&q, s + i, p[i].in, (uint8_t *)p[i].out, p[i].bytes);
+			r++;
+		}
+		aes_lanes_flush(&q);
+	}
+
+	bzero(s, sizeof(s));	// for security reason
+	bzero(&q, sizeof(q));
+	return r;
 }
@@ -27,6 +27,7 @@
 #define GCM_IV_LEN_FIXED	12
 #define GCM_BLOCK_LEN_POWER 4	// 2^^4 == 16
 #define GMAC_SALT_LEN		4	// As of RFC4543
+#define GHASH_AGGREGATE		4	// number of blocks that carry-less multiplication reduces at a time
 
 typedef struct _GCM_AES_CTX {
 	uint32_t	K[4*(RIJNDAEL_MAXNR + 1)];
@@ -34,8 +35,27 @@ typedef struct _GCM_AES_CTX {
 	uint8_t		X[GCM_BLOCK_LEN];	/* to X<m+n+1> */
 	uint8_t		J[GCM_BLOCK_LEN];	/* counter block */
 	int32_t		rounds;
+	/* Precomputed from H: the 4-bit multiplication table, or H^1..H^GHASH_AGGREGATE byte-reversed */
+	/* for carry-less multiplication if the CPU supports it. See also GCM_AES_SetHashKey */
+	ALIGN(16)
+	uint64_t	HT[16][2];
 } GCM_AES_CTX;
 
+// A packet to seal or to open in a batch. See also GCM_AES_SealBatch and GCM_AES_OpenBatch
+typedef struct _GCM_AES_PACKET {
+	GCM_AES_CTX		*ctx;	/* packets of a batch may share the context, which is not modified */
+	uint64_t		IV;		/* the rightmost 64-bit of the 96-bit initial vector */
+	uint32_t		salt;	/* XOR'ed with the salt of the context for this packet only */
+	uint32_t		bytes;	/* length in bytes of the plaintext or the ciphertext */
+	const octet		*in;
+	uint64_t		*out;	/* may be the same as the input */
+	const uint64_t	*aad;
+	uint32_t		bytesA;
+	int32_t			bytesT;
+	octet			T[GCM_BLOCK_LEN];	/* the tag, output of sealing or input of opening */
+	int32_t			result;	/* 0 if success, -1 if authentication failed, -2 if parameter error */
+} GCM_AES_PACKET;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -57,6 +77,25 @@ void	GCM_AES_SetKey(GCM_AES_CTX *, const octet *, int);
 //	The salt is the leftmost 32-bit of the 96-bit IV. The value is just a bit string of length 32
 uint32_t GCM_AES_XorSalt(GCM_AES_CTX *, uint32_t);
 
+// Given
+//	GCM_AES_CTX *	pointer to the GCM context
+//	const octet *	octet array representation of AES key
+//	int				length in bytes of the key, must be 16, 24 or 32
+// Do
+//	Set the AES key schedule only, in the form that the backend selected by CPUID takes
+// Remark
+//	Neither the hash subkey nor the salt is touched
+void	GCM_AES_SetCipherKey(GCM_AES_CTX *, const octet *, int);
+
+// Given
+//	GCM_AES_CTX *	pointer to the GCM context
+//	const octet *	the hash subkey, GCM_BLOCK_LEN octets
+// Do
+//	Set the hash subkey and precompute the GHASH tables from it
+// Remark
+//	GCM_AES_SetKey calls it. Call it instead of copying H when the AES key schedule is set by GCM_AES_SetCipherKey
+void	GCM_AES_SetHashKey(GCM_AES_CTX *, const octet *);
+
 
 // Given
 //	GCM_AES_CTX *	pointer to the GCM context
@@ -111,6 +150,28 @@ int	GCM_AES_AuthenticateAndDecrypt(GCM_AES_CTX *ctx, uint64_t IV
 									, uint64_t *bufPlainText	// capacity of plaintext buffer MUST be no less than bytesC
 									);
 
+// Given
+//	GCM_AES_PACKET *	array of the packets to seal, in the same or in different contexts
+//	int					number of the packets
+// Do
+//	Encrypt each packet's plaintext 'in' into 'out' and store the tag into T,
+//	as if GCM_AES_AuthenticatedEncrypt were called on each of them in turn
+// Return
+//	Number of packets sealed. 'result' of each packet tells whether it was sealed
+// Remark
+//	Counter blocks of short packets and GHASH chains of different packets are interleaved
+int	GCM_AES_SealBatch(GCM_AES_PACKET *, int);
+
+// Given
+//	GCM_AES_PACKET *	array of the packets to open, in the same or in different contexts
+//	int					number of the packets
+// Do
+//	Authenticate each packet's ciphertext 'in', the additional data and the tag T,
+//	and decrypt it into 'out' if and only if it is authentic
+// Return
+//	Number of packets authenticated. 'result' of each packet tells whether it is authentic
+int	GCM_AES_OpenBatch(GCM_AES_PACKET *, int);
+
 #ifdef __cplusplus
 }
 #endif
@@ -32,7 +32,7 @@
 #include "blake2b.h"
 
 // From the receiver's point of view the local fiber id was stored in the peer fiber id field of the received packet
-ALFID_T CLowerInterface::SetLocalFiberID(ALFID_T value)
+ALFID_T CPacketReceiver::SetLocalFiberID(ALFID_T value)
 {
 	if(nearInfo.IsIPv6())
 		nearInfo.u.idALF = value;
@@ -48,7 +48,7 @@ ALFID_T CLowerInterface::SetLocalFiberID(ALFID_T value)
 //	Send back the echoed reset at the same interface of receiving
 //	in CHALLENGING, CONNECT_AFFIRMING, resumable CLOSABLE and unrecoverable CLOSED state,
 //	and of course, throttled LISTENING state
-void LOCALAPI CLowerInterface::SendPrematureReset(uint32_t reasons, CSocketItemEx *pSocket)
+void LOCALAPI CPacketReceiver::SendPrematureReset(uint32_t reasons, CSocketItemEx *pSocket)
 {
 	struct FSP_RejectConnect reject;
 	SetHeaderSignature(reject, RESET);
@@ -182,76 +182,6 @@ l_matched:
 #endif
 
 
-// Given
-//	const void *pointer to the byte string of cookie material for the calculation
-//	int			the length of the cookie material
-//	timestamp_t	the time associated with the cookie, to deduce the life-span of the cookie
-// Do
-//	Calculate the cookie
-// Return
-//	The 64-bit cookie value
-uint64_t LOCALAPI CalculateCookie(const void *header, int sizeHdr, timestamp_t t0)
-{
-	static struct
-	{
-		timestamp_t timeStamp;
-		timestamp_t timeSign;
-		GCM_AES_CTX	ctx;
-	} prevCookieContext, cookieContext;
-	//
-	ALIGN(FSP_ALIGNMENT) octet m[sizeof(FSP_InitiateRequest)];
-	timestamp_t t1 = NowUTC();
-
-#if defined(TRACE) && (TRACE & TRACE_PACKET)
-	printf("\n**** Cookie Context Time-stamp ****\n");
-	printf("Previous = 0x%016" PRIx64 "\n", prevCookieContext.timeStamp);
-	printf("Current  = 0x%016" PRIx64 "\n", cookieContext.timeStamp);
-	printf("Packet   = 0x%016" PRIx64 "\n", t0);
-	printf("JustNow  = 0x%016" PRIx64 "\n", t1);
-#endif
-
-	// public information included in cookie calculation should be as little as possible
-	if(sizeHdr < 0 || sizeHdr > (int)sizeof(m))
-		return 0;
-	memcpy(m, header, sizeHdr);
-	memset(m + sizeHdr, 0, sizeof(m) - sizeHdr);
-
-	if(t1 - cookieContext.timeStamp > INT_MAX)
-	{
-		ALIGN(FSP_ALIGNMENT)
-		octet	st[COOKIE_KEY_LEN];
-		memcpy(& prevCookieContext, & cookieContext, sizeof(cookieContext));
-		//
-		cookieContext.timeStamp = t1;
-		rand_w32((uint32_t *) & st, sizeof(st) / sizeof(uint32_t));
-		//
-		GCM_AES_SetKey(& cookieContext.ctx, st, COOKIE_KEY_LEN);
-	}
-
-	GCM_AES_CTX *ctx;
-	uint64_t tag;
-	uint64_t nonce;
-	if((long long)(t0 - cookieContext.timeStamp) < INT_MAX)
-	{
-		nonce = cookieContext.timeSign = t0;
-		ctx = &cookieContext.ctx;
-	}
-	else
-	{
-		nonce = prevCookieContext.timeSign = t0;
-		ctx = &prevCookieContext.ctx;
-	}
-	GCM_AES_AuthenticatedEncrypt(ctx, nonce
-		, NULL, 0,
-		(const uint64_t *)m, sizeof(m)
-		, NULL
-		, (octet *)& tag, sizeof(tag));
-
-	return tag;
-}
-
-
-
 // The ephemeral key is weakly securely established. It is a 64-bit value meant to make obfuscation of the CRC64 tag
 // The algorithm:
 //	Take 'fidPair' as the initial accumulative CRC64 value,
@@ -398,8 +328,7 @@ void ICC_Context::InitiateExternalKey(const void *ikm, int n)
 	blake2b(keyBuffer, originalKeyLength + GMAC_SALT_LEN, masterKey, FSP_MAX_KEY_SIZE, info, 30);
 
 	GCM_AES_SetKey(&curr.gcm_aes, keyBuffer, originalKeyLength + GMAC_SALT_LEN);
-	memcpy(curr.send.key, keyBuffer, originalKeyLength + GMAC_SALT_LEN);
-	memcpy(curr.send.H, curr.gcm_aes.H, GCM_BLOCK_LEN);
+	curr.send = curr.gcm_aes;
 	bzero(keyBuffer, sizeof(keyBuffer));
 }
 
@@ -467,15 +396,8 @@ void ICC_Context::ForcefulRekey(int ioFlag)
 
 	if (ioFlag == 0)
 	{
-		memcpy(curr.send.key, keyBuffer, originalKeyLength + GMAC_SALT_LEN);
-		bzero(curr.send.H, GCM_BLOCK_LEN);
-		// See also GCM_AES_SetKey
-		GCM_AES_CTX ctx;
-		ctx.rounds = rijndaelKeySetupEnc(ctx.K, curr.send.key, originalKeyLength * 8);
-		bzero(ctx.X, GCM_BLOCK_LEN);
-		rijndaelEncrypt(ctx.K, ctx.rounds, ctx.X, curr.send.H);
-		//
-		bzero(&ctx, sizeof(ctx));
+		// The key schedule and the GHASH tables are expanded here once a batch
+		GCM_AES_SetKey(&curr.send, keyBuffer, originalKeyLength + GMAC_SALT_LEN);
 	}
 	else
 	{
@@ -498,8 +420,9 @@ void ICC_Context::ForcefulRekey(int ioFlag)
 
 // For very large (roughly up to 2^10 * 2^29 = 512 GB in IPv6) file transfer, automatically re-key
 // For most session the first key would live to the end of the connection.
+// When send and receive batches diverge the send context, which is expanded by ForcefulRekey, applies
 inline
-GCM_AES_CTX * ICC_Context::GetGCMContextForSend(GCM_AES_CTX & ctx, ControlBlock::seq_t seqNo)
+GCM_AES_CTX * ICC_Context::GetGCMContextForSend(ControlBlock::seq_t seqNo)
 {
 	bool b = int32_t(seqNo - snFirstSendWithCurrKey) < 0;
 	if (iBatchSend - iBatchRecv == 0)
@@ -511,12 +434,7 @@ GCM_AES_CTX * ICC_Context::GetGCMContextForSend(GCM_AES_CTX & ctx, ControlBlock:
 	if (iBatchSend - iBatchRecv == -1 && !b)
 		return &prev.gcm_aes;
 	// prefer clarity over cleverness - if ever there is some cleverness?
-	octet *sendKey = (b ? prev.send.key : curr.send.key);
-	ctx.rounds = rijndaelKeySetupEnc(ctx.K, sendKey, originalKeyLength * 8);
-	//	ctx.X would be zeroed every time GCM_AES_SetIV() is called
-	memcpy(ctx.H, (b ? prev.send.H : curr.send.H), GCM_BLOCK_LEN);
-	*(uint32_t *)ctx.J = *(uint32_t *)(sendKey + originalKeyLength);	// set the salt
-	return &ctx;
+	return (b ? &prev.send : &curr.send);
 }
 
 
@@ -555,10 +473,7 @@ void ICC_Context::InheritS0(const ICC_Context &src)
 	}
 	else
 	{
-		prev.gcm_aes.rounds = rijndaelKeySetupEnc(prev.gcm_aes.K, src.curr.send.key, originalKeyLength * 8);
-		//	ctx.X would be zeroed every time GCM_AES_SetIV() is called
-		memcpy(prev.gcm_aes.H, src.curr.send.H, GCM_BLOCK_LEN);
-		*(uint32_t *)prev.gcm_aes.J = *(uint32_t *)(src.curr.send.key + originalKeyLength);	// set the salt
+		prev.gcm_aes = src.curr.send;
 	}
 
 	iBatchRecv = iBatchSend = 1;
@@ -627,8 +542,7 @@ void ICC_Context::Derive(const octet *info, int LEN)
 	blake2b_final(&ctx, keyBuffer);
 
 	GCM_AES_SetKey(&curr.gcm_aes, keyBuffer, originalKeyLength + GMAC_SALT_LEN);
-	memcpy(curr.send.key, keyBuffer, originalKeyLength + GMAC_SALT_LEN);
-	memcpy(curr.send.H, curr.gcm_aes.H, GCM_BLOCK_LEN);
+	curr.send = curr.gcm_aes;
 
 	bzero(&ctx, sizeof(ctx));
 	bzero(keyBuffer, sizeof(keyBuffer));
@@ -742,23 +656,30 @@ inline void CSocketItemEx::CheckAckToKeepAlive()
 //	void *	[in,out]			The plaintext/ciphertext, either payload or optional header
 //	int32_t						The payload length
 //	uint32_t					The xor'ed salt
+//	octet *						The buffer to hold the ciphertext, NULL if to use the internal buffer
+//	GCM_AES_PACKET *			[out] If not NULL, authenticated encryption may be deferred to be done in batch
 // Do
 //	Set ICC value
 // Return
-//	The pointer to the ciphertext. == content if CRC64 applied, == internal buffer if GCM_AES applied.
+//	The pointer to the ciphertext. == content if CRC64 applied, == the ciphertext buffer if GCM_AES applied.
 // Remark
 //	IV = (sequenceNo, expectedSN)
 //	AAD = (source fiber ID, destination fiber ID, flags, receive window free pages
 //		 , version, OpCode, header stack pointer, optional headers)
 //	This function is NOT multi-thread safe
 //	Retransmission DOES consume the key life of authenticated encryption
-void * LOCALAPI CSocketItemEx::SetIntegrityCheckCode(FSP_NormalPacketHeader *p1, void *content, int32_t ptLen, uint32_t salt)
+//	If sealing is deferred the ctx of the packet to seal is set, and the ciphertext and the ICC
+//	are not available until GCM_AES_SealBatch is called. The caller should seal the pending packets
+//	before the send key is rekeyed, for the send context is updated in place
+void * LOCALAPI CSocketItemEx::SetIntegrityCheckCode(FSP_NormalPacketHeader *p1, void *content, int32_t ptLen, uint32_t salt, octet *outBuf, GCM_AES_PACKET *toSeal)
 {
 	// number of octets that 'additional data' in Galois Counter Mode
 	const uint32_t byteA = sizeof(FSP_NormalPacketHeader);
 	//
 	uint32_t seqNo = be32toh(p1->sequenceNo);
 	void * buf = content;
+	if (toSeal != NULL)
+		toSeal->ctx = NULL;
 	// CRC64 is the initial integrity check algorithm
 	if(contextOfICC.keyLifeRemain == 0)
 	{
@@ -797,9 +718,13 @@ void * LOCALAPI CSocketItemEx::SetIntegrityCheckCode(FSP_NormalPacketHeader *p1,
 			contextOfICC.keyLifeRemain = 1;	// As a sentinel
 
 		// assert(pControlBlock->sendBufferBlockN <= FSP_REKEY_THRESHOLD);
+		int32_t iBatch = contextOfICC.iBatchSend;
 		contextOfICC.CheckToRekeyBeforeSend(seqNo);
-		GCM_AES_CTX ctx;
-		GCM_AES_CTX *pCtx = contextOfICC.GetGCMContextForSend(ctx, seqNo);
+		if (contextOfICC.iBatchSend != iBatch)
+			pControlBlock->perfCounts.countSendKeySetup++;
+		GCM_AES_CTX *pCtx = contextOfICC.GetGCMContextForSend(seqNo);
+		if (contextOfICC.IsSendOnly(pCtx))
+			pControlBlock->perfCounts.countSendKeyDiverged++;
 
 		ALIGN(MAC_ALIGNMENT) uint64_t tag[FSP_TAG_SIZE / sizeof(uint64_t)];
 		p1->integrity.id = fidPair;
@@ -812,11 +737,26 @@ void * LOCALAPI CSocketItemEx::SetIntegrityCheckCode(FSP_NormalPacketHeader *p1,
 		DumpNetworkUInt16((uint16_t *)p1, byteA / 2);
 		DumpNetworkUInt16((uint16_t*)buf, ptLen / 2);
 #endif
+		buf = (outBuf != NULL ? outBuf : this->cipherText);
+		// Every send context is persistent till the next send rekey, so sealing may be deferred
+		if (toSeal != NULL)
+		{
+			toSeal->ctx = pCtx;
+			toSeal->IV = *(uint64_t *)p1;
+			toSeal->salt = salt;
+			toSeal->bytes = ptLen;
+			toSeal->in = (const octet *)content;
+			toSeal->out = (uint64_t *)buf;
+			toSeal->aad = (const uint64_t *)p1;
+			toSeal->bytesA = byteA;
+			toSeal->bytesT = FSP_TAG_SIZE;
+			return buf;
+		}
 		GCM_AES_XorSalt(pCtx, salt);
 		if(GCM_AES_AuthenticatedEncrypt(pCtx, *(uint64_t *)p1
 			, (const uint8_t *)content, ptLen
 			, (const uint64_t *)p1, byteA
-			, (uint64_t *)this->cipherText
+			, (uint64_t *)buf
 			, (uint8_t *)tag, FSP_TAG_SIZE)
 			!= 0)
 		{
@@ -824,7 +764,6 @@ void * LOCALAPI CSocketItemEx::SetIntegrityCheckCode(FSP_NormalPacketHeader *p1,
 			return NULL;
 		}
 		GCM_AES_XorSalt(pCtx, salt);
-		buf = this->cipherText;
 		p1->integrity.code = tag[0];
 	}
 
@@ -962,7 +901,7 @@ bool CSocketItemEx::EmitStart()
 		Reset();
 		return false;
 	}
-	skb->timeSent = NowUTC();
+	skb->timeSent = NowMonotonic();
 	//^This make the initial RTT including the near end's send delay, including timer slice jitter
 
 	int result;
@@ -1014,7 +953,7 @@ bool CSocketItemEx::EmitRelease()
 	if (!skb->IsComplete() || skb->opCode != RELEASE)
 		return false;
 	int const result = EmitWithICC(skb, pControlBlock->sendWindowFirstSN);
-	skb->timeSent = NowUTC();
+	skb->timeSent = NowMonotonic();
 	skb->MarkSent();
 	pControlBlock->sendWindowNextSN = pControlBlock->sendBufferNextSN;
 	pControlBlock->sendWindowNextPos = pControlBlock->sendBufferNextPos;
@@ -1030,17 +969,11 @@ bool CSocketItemEx::EmitRelease()
 // Given
 //	ControlBlock::PFSP_SocketBuf	pointer to the buffer descriptor of the packet to send
 //	ControlBlock::seq_t				the sequence number assigned to the packet to send
-// Do
-//	Transmit a packet to the remote end, enforcing secure mobility support
 // Return
-//	Number of octets sent, 0 if nothing sent successfully
-//	Negative if failed otherwise
-// Remark
-//  The IP address of the near end may change dynamically
-//	ICC, if required, is always set just before being sent
-int CSocketItemEx::EmitWithICC(ControlBlock::PFSP_SocketBuf skb, ControlBlock::seq_t seq)
+//	0 if the packet may be emitted
+//	Negative if it is discarded deliberately or it should not be emitted this way
+static inline int LOCALAPI CheckToEmit(ControlBlock::PFSP_SocketBuf skb, ControlBlock::seq_t seq)
 {
-	ALIGN(FSP_ALIGNMENT) FSP_FixedHeader hdr;
 #ifdef EMULATE_LOSS
 	volatile unsigned int vRand = 0;
 	if (rand_s((unsigned int *)&vRand) == 0 && vRand > (UINT_MAX >> 2) + (UINT_MAX >> 1))
@@ -1061,6 +994,29 @@ int CSocketItemEx::EmitWithICC(ControlBlock::PFSP_SocketBuf skb, ControlBlock::s
 		return -EDOM;
 	}
 #endif
+	return 0;
+}
+
+
+
+// Given
+//	ControlBlock::PFSP_SocketBuf	pointer to the buffer descriptor of the packet to send
+//	ControlBlock::seq_t				the sequence number assigned to the packet to send
+// Do
+//	Transmit a packet to the remote end, enforcing secure mobility support
+// Return
+//	Number of octets sent, 0 if nothing sent successfully
+//	Negative if failed otherwise
+// Remark
+//  The IP address of the near end may change dynamically
+//	ICC, if required, is always set just before being sent
+int CSocketItemEx::EmitWithICC(ControlBlock::PFSP_SocketBuf skb, ControlBlock::seq_t seq)
+{
+	ALIGN(FSP_ALIGNMENT) FSP_FixedHeader hdr;
+	int r = CheckToEmit(skb, seq);
+	if (r < 0)
+		return r;
+
 	void  *payload = (FSP_NormalPacketHeader *)this->GetSendPtr(skb);
 	if(payload == NULL)
 	{
@@ -1078,7 +1034,7 @@ int CSocketItemEx::EmitWithICC(ControlBlock::PFSP_SocketBuf skb, ControlBlock::s
 	if(paidLoad == NULL)
 		return -EPERM;
 	//
-	int r = skb->len > 0
+	r = skb->len > 0
 		? SendPacket(2, ScatteredSendBuffers(&hdr, sizeof(FSP_NormalPacketHeader), paidLoad, skb->len))
 		: SendPacket(1, ScatteredSendBuffers(&hdr, sizeof(FSP_NormalPacketHeader)));
 	skb->timeSent = tRecentSend;
@@ -1087,6 +1043,110 @@ int CSocketItemEx::EmitWithICC(ControlBlock::PFSP_SocketBuf skb, ControlBlock::s
 
 
 
+// Given
+//	STransmitBatch &				the transmit batch of the calling thread
+//	ControlBlock::PFSP_SocketBuf	pointer to the buffer descriptor of the packet to send
+//	ControlBlock::seq_t				the sequence number assigned to the packet to send
+// Do
+//	Set the ICC of the packet and put it into the transmit batch. The batch is flushed at first if it is full
+// Return
+//	Number of octets staged, 0 if the full batch cannot be flushed
+//	Negative if failed otherwise
+// Remark
+//	The payload encrypted is kept in the slot of the batch, so the internal cipherText buffer is untouched.
+//	The plaintext payload referred by the slot is stable as long as the session is locked
+//	Time the packet is sent is set when the batch is flushed
+int CSocketItemEx::StageWithICC(STransmitBatch &batch, ControlBlock::PFSP_SocketBuf skb, ControlBlock::seq_t seq)
+{
+	int r = CheckToEmit(skb, seq);
+	if (r < 0)
+		return r;
+
+	void  *payload = (FSP_NormalPacketHeader *)this->GetSendPtr(skb);
+	if(payload == NULL)
+	{
+		REPORT_ERRMSG_ON_TRACE("TODO: debug log memory corruption error");
+		BREAK_ON_DEBUG();
+		return -EFAULT;
+	}
+
+	if (batch.IsFull() && SendBatch(batch) <= 0)
+		return 0;
+
+	// The send context that the pending packets refer to is to be overwritten by rekeying
+	if (batch.countToSeal > 0 && contextOfICC.IsToRekeyBeforeSend(seq) && !SealBatch(batch))
+		return -EPERM;
+
+	STransmitSlot &slot = batch.slots[batch.count];
+	SetHeaderSignature(slot.hdr, skb->opCode);
+	skb->CopyFlagsTo(&slot.hdr);
+	SetSequenceAndWS(&slot.hdr, seq);
+
+	GCM_AES_PACKET &aead = batch.toSeal[batch.countToSeal];
+	slot.payload = SetIntegrityCheckCode(&slot.hdr, (octet*)payload, skb->len, 0, slot.cipherText, &aead);
+	if (slot.payload == NULL)
+		return -EPERM;
+	if (aead.ctx != NULL)
+		batch.countToSeal++;
+	slot.len = skb->len;
+	slot.skb = skb;
+	batch.count++;
+	// Stamped as soon as staged so that the resend scan of the same time slice skips it.
+	// SendBatch refines it with the time when the batch is actually sent
+	skb->timeSent = NowMonotonic();
+
+	return int(sizeof(ALFIDPair) + sizeof(FSP_NormalPacketHeader) + skb->len);
+}
+
+
+
+// Do
+//	Seal the packets whose authenticated encryption was deferred by StageWithICC, in one call
+// Return
+//	true if all of them are sealed
+//	false if otherwise
+// Remark
+//	The AAD of the packet to seal is the fixed header whose ICC is to be filled with the tag
+bool STransmitBatch::Seal()
+{
+	const int n = countToSeal;
+	countToSeal = 0;
+	if (n <= 0)
+		return true;
+
+	int r = GCM_AES_SealBatch(toSeal, n);
+	for (register int i = 0; i < n; i++)
+	{
+		FSP_NormalPacketHeader *p1 = (FSP_NormalPacketHeader *)toSeal[i].aad;
+		memcpy(&p1->integrity.code, toSeal[i].T, FSP_TAG_SIZE);
+	}
+	return (r == n);
+}
+
+
+
+// Given
+//	STransmitBatch &	the transmit batch whose pending packets are to be sealed
+// Return
+//	true if all of the pending packets are sealed
+//	false if otherwise, and the batch is emptied
+// Remark
+//	Packets of the batch that failed to be sealed are not sent, but made due for retransmission at once
+bool CSocketItemEx::SealBatch(STransmitBatch &batch)
+{
+	if (batch.Seal())
+		return true;
+
+	REPORT_ERRMSG_ON_TRACE("Cannot seal the packets in the transmit batch, to retransmit them");
+	timestamp_t t = NowMonotonic() - tRTO_us;
+	for (register int k = 0; k < batch.count; k++)
+		batch.slots[k].skb->timeSent = t;
+	batch.count = 0;
+	return false;
+}
+
+
+
 // Check whether local address of the near end is changed because of, say, reconfiguration or hand-over
 // It is conservative in the sense that
 // it would not suppress overwhelming KEEP_ALIVE if the change is only removal of some subnet entry
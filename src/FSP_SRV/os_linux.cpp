@@ -52,12 +52,69 @@ extern "C" void rand_w32(u32 *p, int n)
 #include <ifaddrs.h>
 #include <net/if.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <linux/filter.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/random.h>
+#include <sys/timerfd.h>
 #include "blake2b.h"
 
-static ALFID_T	preallocatedIDs[MAX_CONNECTION_NUM];
-static octet	keyInternalRand[FSP_MAX_KEY_SIZE];
+#ifndef UDP_SEGMENT	// Generic segmentation offload for UDP, since linux 4.18
+# define UDP_SEGMENT	103
+#endif
+#ifndef UDP_GRO		// Generic receive offload for UDP, since linux 5.0
+# define UDP_GRO		104
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF	// steer packets among the reuseport group, since linux 4.5
+# define SO_ATTACH_REUSEPORT_CBPF	51
+#endif
+
+#define LLS_CLOCK_MONOTONIC			0	// clock_gettime(CLOCK_MONOTONIC), exact and served by the vDSO
+#define LLS_CLOCK_MONOTONIC_COARSE	1	// clock_gettime(CLOCK_MONOTONIC_COARSE), the cheapest, but only as fine as the jiffy
+#define LLS_CLOCK_TSC				2	// the invariant TSC calibrated against CLOCK_MONOTONIC
+#ifndef LLS_CLOCK_SOURCE	// the time base of NowMonotonic
+# if defined(__x86_64__)
+#  define LLS_CLOCK_SOURCE	LLS_CLOCK_TSC
+# else
+#  define LLS_CLOCK_SOURCE	LLS_CLOCK_MONOTONIC
+# endif
+#endif
+#ifndef LLS_TSC_CALIBRATION_ms
+# define LLS_TSC_CALIBRATION_ms	20
+#endif
+
+#if LLS_CLOCK_SOURCE == LLS_CLOCK_TSC
+# include <cpuid.h>
+# include <x86intrin.h>
+static uint64_t		tscBase;	// the TSC when calibrated
+static timestamp_t	tscBase_us;	// CLOCK_MONOTONIC when calibrated
+static uint64_t		tscScale;	// microseconds per cycle in 32.32 fixed point, 0 if the TSC is not to be used
+#endif
+static void InitMonotonicClock();
+
+#ifndef LLS_DRBG_CHUNK_SIZE	// octets of random output generated at a time by the per-thread DRBG
+# define LLS_DRBG_CHUNK_SIZE	4096
+#endif
+#define DRBG_BLOCK_SIZE		64	// the longest BLAKE2b digest. LLS_DRBG_CHUNK_SIZE shall be a multiple of it
+
+// The per-thread deterministic random bit generator, BLAKE2b in a key-erasure construction:
+// each refill expands the key into a new key and a chunk of output, the old key is overwritten at once
+// and each octet of output is wiped as soon as it is handed out, so that a captured state reveals nothing generated before
+struct SRandomBitGenerator
+{
+	octet		key[FSP_MAX_KEY_SIZE];
+	uint64_t	counter;
+	int32_t		generation;	// the value of forkGeneration when the generator was seeded
+	int32_t		available;	// number of octets at the tail of the chunk not handed out yet
+	octet		chunk[LLS_DRBG_CHUNK_SIZE];
+};
+
+static thread_local SRandomBitGenerator	drbg;
+static int32_t			forkGeneration = 1;	// so that a zeroed generator is taken as not seeded
+static pthread_once_t	onceForkHandler = PTHREAD_ONCE_INIT;
 
 /*
  * The OS-dependent CommandNewSessionSrv constructor
@@ -81,13 +138,7 @@ CommandNewSessionSrv::CommandNewSessionSrv(const CommandNewSession* pCmd)
 // TODO: create rule entries in the firewall setting to enable FSP traffic?
 bool CLowerInterface::Initialize()
 {
-	// Safely assume length of pid_t is no greater than FSP_MAX_KEY_SIZE
-	u32 key32[FSP_MAX_KEY_SIZE / sizeof(u32)];
-	*(pid_t *)keyInternalRand = getpid();
-	rand_w32(key32, FSP_MAX_KEY_SIZE / sizeof(u32));
-	memcpy(keyInternalRand, key32, FSP_MAX_KEY_SIZE);
-
-	memset(& nearInfo, 0, sizeof(nearInfo));
+	InitMonotonicClock();
 
 	sdSend = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 	if (sdSend == INVALID_SOCKET)
@@ -95,33 +146,177 @@ bool CLowerInterface::Initialize()
 		BREAK_ON_DEBUG();
 		return false;
 	}
-	//
-	nearInfo.pktHdr.cmsg_type = IP_PKTINFO;
-	nearInfo.pktHdr.cmsg_level = IPPROTO_IP;
-	nearInfo.pktHdr.cmsg_len = sizeof(nearInfo.pktHdr) + sizeof(struct in_pktinfo);
+
+	// One receive worker per online CPU, but no more than LLS_RECV_WORKERS. The lower interface itself is the first one
+	countWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (countWorkers > LLS_RECV_WORKERS)
+		countWorkers = LLS_RECV_WORKERS;
+	if (countWorkers < 1)
+		countWorkers = 1;
+	index = 0;
+	workers[0] = this;
+	fdStopWorkers = -1;	// no receiver thread to stop until StartWorkers succeeds
 
 	if(! LearnAddresses())
 		return false;
-	MakeALFIDsPool();
 
-	mesgInfo.msg_name =  (struct sockaddr *) & addrFrom;
-	mesgInfo.msg_namelen = sizeof(addrFrom);
-	mesgInfo.msg_control = (void *) & nearInfo;
-	mesgInfo.msg_controllen = sizeof(nearInfo);
-	iovec[0].iov_base = (void*)&pktBuf->fidPair;
-	iovec[0].iov_len = sizeof(ALFIDPair);
-	mesgInfo.msg_iov = iovec;
-	mesgInfo.msg_iovlen = 2;
+	// Each receive worker is accompanied by a timing wheel which serves the same shard of sessions
+	if(! CTimingWheel::StartAll(countWorkers))
+		return false;
+
+	if(! CULACommandService::StartAll(LLS_ULA_WORKERS))
+		return false;
+
+	if(! CConnectResolver::StartAll(LLS_RESOLVER_THREADS))
+		return false;
 
 	// only after the required fields initialized may the listener thread started
 	// fetch message from remote endpoint and deliver them to upper layer application
-	if(pthread_create(&thReceiver, NULL, ProcessRemotePacket, this) != 0)
+	return StartWorkers();
+}
+
+
+
+// Given
+//	int		the index of the receive worker
+//	int		the position of the interface whose address is to bind
+// Return
+//	The socket descriptor which joins the reuseport group of the interface, negative if error
+// Remark
+//	Sockets are added to the group in the order of the worker index,
+//	so that the index returned by the steering filter is the index of the worker
+inline int CLowerInterface::BindWorkerSocket(int w, int k)
+{
+	int value = 1;
+	int sd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sd == INVALID_SOCKET)
+	{
+		perror("Create socket for the receive worker");
+		return -1;
+	}
+	if (::setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value)) != 0
+	 || ::setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) != 0)
+	{
+		perror("Cannot set the socket option to share the local address with other workers");
+		goto l_bailout;
+	}
+	if (::bind(sd, (const struct sockaddr *)&addresses[k], sizeof(SOCKADDR_IN)) != 0)
+	{
+		perror("Cannot bind the receive worker to the selected address");
+		goto l_bailout;
+	}
+	if (::setsockopt(sd, IPPROTO_IP, IP_PKTINFO, &value, sizeof(value)) != 0)
+	{
+		perror("Cannot set socket option to fetch the source IP address");
+		goto l_bailout;
+	}
+#if LLS_UDP_GRO
+	if (::setsockopt(sd, SOL_UDP, UDP_GRO, &value, sizeof(value)) != 0)
+		perror("Cannot enable UDP generic receive offload");
+#endif
+#if defined(TRACE) && (TRACE & TRACE_ADDRESS)
+	printf_s("Receive worker #%d bound to interface #%d with socket #%d\n", w, k, sd);
+#endif
+	return sd;
+
+l_bailout:
+	close(sd);
+	return -1;
+}
+
+
+
+// Given
+//	int		the socket descriptor of some member of the reuseport group
+// Do
+//	Steer a packet to the receive worker indexed by the receiver's ALFID modulo the number of workers,
+//	so that all packets of a session are processed by the same worker
+// Return
+//	true if the filter is attached, false if the kernel's default 4-tuple hash is applied
+inline bool CLowerInterface::AttachSteeringFilter(int sd)
+{
+	// when the filter is run the data offset is that of the UDP payload, i.e. the prefixed ALFID pair
+	struct sock_filter code[] =
+	{
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, offsetof(ALFIDPair, peer) },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)countWorkers },
+		{ BPF_RET | BPF_A, 0, 0, 0 }
+	};
+	struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+	if (::setsockopt(sd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0)
+	{
+		perror("Cannot attach the filter to steer packets to the receive workers");
+		return false;
+	}
+	return true;
+}
+
+
+
+// Do
+//	Start the receiver thread of the lower interface itself, create and start the other receive workers,
+//	and then steer packets to them
+// Return
+//	true if at least the receiver thread of the lower interface itself is started
+// Remark
+//	If some worker cannot get its sockets or its thread fewer workers are created.
+//	A failed worker is the last one that joined the reuseport groups, so closing its sockets
+//	leaves the index of every started worker in the groups intact.
+//	The steering filter is attached only after the number of workers is final
+inline bool CLowerInterface::StartWorkers()
+{
+	register int w, k;
+	fdStopWorkers = eventfd(0, EFD_CLOEXEC);
+	if (fdStopWorkers < 0)
+	{
+		perror("Cannot create the eventfd to stop the receive workers");
+		return false;
+	}
+	memcpy(sdRecv, sdSet, sizeof(sdRecv));
+	PrepareRecvRing();
+	// joinable, for Destroy shall not free the worker or its sockets while it is still running
+	if (pthread_create(&thReceiver, NULL, CPacketReceiver::ProcessRemotePacket, workers[0]) != 0)
 	{
 		perror("Cannot create the thread to handle incoming packet");
+		close(fdStopWorkers);
+		fdStopWorkers = -1;
 		return false;
 	}
-	pthread_detach(thReceiver);
 
+	for (w = 1; w < countWorkers; w++)
+	{
+		CPacketReceiver *p = new CPacketReceiver();
+		p->index = w;
+		for (k = 0; k < countInterfaces; k++)
+		{
+			if ((p->sdRecv[k] = BindWorkerSocket(w, k)) < 0)
+				break;
+		}
+		if (k == countInterfaces)
+		{
+			p->PrepareRecvRing();
+			if (pthread_create(&p->thReceiver, NULL, CPacketReceiver::ProcessRemotePacket, p) == 0)
+			{
+				workers[w] = p;
+				continue;
+			}
+			perror("Cannot create the thread to handle incoming packet");
+		}
+		while (--k >= 0)
+			close(p->sdRecv[k]);
+		delete p;
+		break;
+	}
+	countWorkers = w;
+
+	if (countWorkers > 1)
+	{
+		for (k = 0; k < countInterfaces; k++)
+			AttachSteeringFilter(sdSet[k]);
+	}
+#ifdef TRACE
+	printf_s("Lower interface: %d receive worker(s) started\n", countWorkers);
+#endif
 	return true;
 }
 
@@ -130,7 +325,40 @@ bool CLowerInterface::Initialize()
 // The body of the class destructor
 void CLowerInterface::Destroy()
 {
-	pthread_cancel(thReceiver);
+	CLowerInterfacePerformance sum;
+	memset(&sum, 0, sizeof(sum));
+	// The workers stop at the next poll, which is woken up by the eventfd that is never read
+	uint64_t one = 1;
+	if (fdStopWorkers < 0)
+		countWorkers = 0;
+	else if (write(fdStopWorkers, &one, sizeof(one)) < 0)
+		perror("Cannot signal the receive workers to stop");
+	for(register int w = countWorkers - 1; w >= 0; w--)
+	{
+		CPacketReceiver *p = workers[w];
+		pthread_join(p->thReceiver, NULL);
+		sum.countRecvCalls += p->perfCounts.countRecvCalls;
+		sum.countRecvPackets += p->perfCounts.countRecvPackets;
+		sum.countInitAdmitted += p->perfCounts.countInitAdmitted;
+		sum.countInitThrottled += p->perfCounts.countInitThrottled;
+		sum.countInitShed += p->perfCounts.countInitShed;
+		sum.countCookieRejected += p->perfCounts.countCookieRejected;
+		if (w == 0)
+			break;
+		// close the listening sockets of the additional receive worker
+		for(register int i = 0; i < countInterfaces; i++)
+		{
+			close(p->sdRecv[i]);
+		}
+		delete p;
+	}
+	if (fdStopWorkers >= 0)
+		close(fdStopWorkers);
+	fdStopWorkers = -1;
+	countWorkers = 0;
+	CTimingWheel::StopAll();
+	CULACommandService::StopAll();
+	CConnectResolver::StopAll();
 
 	// close all of the listening socket
 	for(register int i = 0; i < countInterfaces; i++)
@@ -140,37 +368,25 @@ void CLowerInterface::Destroy()
 
 	// close the unbound socket for sending
 	close(sdSend);
-}
-
-
-
-// Preallocate a pool of re-usable random ALFIDs. Preallocation would later make the lower network interface to provision the corresponding IP addresses
-// This is a workaround as we cannot receive a unicast packet whose destination IPv6 address does not match any known unicast IP address on an NIC
-// even if it has been put to promiscuous mode
-inline void CLowerInterface::MakeALFIDsPool()
-{
-	register int k;
-	ALFID_T id;
-	//
-	// refuse to continue if the random number generator doesn't work
-	for (register int i = 0; i < MAX_CONNECTION_NUM; i++)
-	{
-		// Here 'id', as a random number, is generated as a 32-bit integer in network byte order
-		// while 'k' is a simple hash number derived in host byte order
-		// See also LearnAddresses, operator::[], AllocItem, FreeItem
-		do
-		{
-			do
-			{
-				rand_w32(&id, 1);
-				k = be32toh(id);
-			} while (k <= LAST_WELL_KNOWN_ALFID);
-			//
-			k &= MAX_CONNECTION_NUM - 1;
-		} while (tlbSockets[k]->fidPair.source != 0);
-		//
-		tlbSockets[k]->fidPair.source = preallocatedIDs[i] = id;
-	}
+#ifdef TRACE
+	printf_s("Lower interface: %llu packets received by %llu system calls, %.2f packets per call\n"
+		, (unsigned long long)sum.countRecvPackets
+		, (unsigned long long)sum.countRecvCalls
+		, sum.PacketsPerRecvCall());
+	printf_s("INIT_CONNECT: %llu admitted, %llu throttled by prefix, %llu shed; %llu cookies rejected\n"
+		, (unsigned long long)sum.countInitAdmitted
+		, (unsigned long long)sum.countInitThrottled
+		, (unsigned long long)sum.countInitShed
+		, (unsigned long long)sum.countCookieRejected);
+	SNameCacheStatistics nameStat;
+	CNameCache::Singleton.GetStatistics(nameStat);
+	printf_s("Name cache: %llu hits, %llu negative hits, %llu misses, %llu coalesced, %llu evicted\n"
+		, (unsigned long long)nameStat.countHit
+		, (unsigned long long)nameStat.countNegativeHit
+		, (unsigned long long)nameStat.countMiss
+		, (unsigned long long)nameStat.countCoalesced
+		, (unsigned long long)nameStat.countEvicted);
+#endif
 }
 
 
@@ -199,6 +415,13 @@ int CLowerInterface::BindSendRecv(const SOCKADDR_IN *pAddrListen, int k)
 		perror("Cannot set the socket option to reuse existing local address");
 		return -1;
 	}
+	// The socket is the first member of the reuseport group that the receive workers share
+	if(countWorkers > 1
+	&& ::setsockopt(sdSend, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) != 0)
+	{
+		perror("Cannot set the socket option to share the local address with the receive workers");
+		return -1;
+	}
 	if (::bind(sdSend, (const struct sockaddr *)pAddrListen, sizeof(SOCKADDR_IN)) != 0)
 	{
 		perror("Cannot bind to the selected address");
@@ -210,6 +433,11 @@ int CLowerInterface::BindSendRecv(const SOCKADDR_IN *pAddrListen, int k)
 		perror("Cannot set socket option to fetch the source IP address");
 		return -1;
 	}
+#if LLS_UDP_GRO
+	// Not fatal: datagrams that are not coalesced are processed as super-datagrams of one segment
+	if (::setsockopt(sdSend, SOL_UDP, UDP_GRO, &value, sizeof(value)) != 0)
+		perror("Cannot enable UDP generic receive offload");
+#endif
 
 	memcpy(&addresses[k], pAddrListen, sizeof(SOCKADDR_IN));
 	interfaces[k] = 0;
@@ -285,13 +513,153 @@ inline bool CLowerInterface::LearnAddresses()
 
 
 
+// Bind each slot of the receive ring with its own packet buffer, remote address and control message buffer,
+// and initialize the descriptor of the current receipt
+inline void CPacketReceiver::PrepareRecvRing()
+{
+	memset(& nearInfo, 0, sizeof(nearInfo));
+	nearInfo.pktHdr.cmsg_type = IP_PKTINFO;
+	nearInfo.pktHdr.cmsg_level = IPPROTO_IP;
+	nearInfo.pktHdr.cmsg_len = sizeof(nearInfo.pktHdr) + sizeof(struct in_pktinfo);
+
+	pktBuf = recvRing;
+	mesgInfo.msg_name =  (struct sockaddr *) & addrFrom;
+	mesgInfo.msg_namelen = sizeof(addrFrom);
+	mesgInfo.msg_control = (void *) & nearInfo;
+	mesgInfo.msg_controllen = sizeof(nearInfo);
+	iovec[0].iov_base = (void*)&pktBuf->fidPair;
+	iovec[0].iov_len = sizeof(ALFIDPair);
+	mesgInfo.msg_iov = iovec;
+	mesgInfo.msg_iovlen = 2;
+
+	memset(mmsgRing, 0, sizeof(mmsgRing));
+	for (register int k = 0; k < LLS_RECV_BATCH_SIZE; k++)
+	{
+#if LLS_UDP_GRO
+		iovRing[k][0].iov_base = (void*)groRing[k];
+		iovRing[k][0].iov_len = LLS_GRO_BUFFER_SIZE;
+		mmsgRing[k].msg_hdr.msg_iovlen = 1;
+#else
+		iovRing[k][0].iov_base = (void*)&recvRing[k].fidPair;
+		iovRing[k][0].iov_len = sizeof(ALFIDPair);
+		iovRing[k][1].iov_base = (void*)&recvRing[k].hdr;
+		iovRing[k][1].iov_len = MAX_BLOCK_SIZE + sizeof(FSP_NormalPacketHeader);
+		mmsgRing[k].msg_hdr.msg_iovlen = 2;
+#endif
+		mmsgRing[k].msg_hdr.msg_name = (struct sockaddr*)&addrRing[k];
+		mmsgRing[k].msg_hdr.msg_iov = iovRing[k];
+		mmsgRing[k].msg_hdr.msg_control = (void*)ctrlRing[k];
+	}
+}
+
+
+
+// Given
+//	int		the socket descriptor which has been polled readable
+// Do
+//	Drain at most LLS_RECV_BATCH_SIZE datagrams from the socket into the receive ring by one system call
+// Return
+//	Number of datagrams received, negative if error
+inline int CPacketReceiver::RecvBatch(int sd)
+{
+	for (register int k = 0; k < LLS_RECV_BATCH_SIZE; k++)
+	{
+		// value-result fields must be reset before each call
+		mmsgRing[k].msg_hdr.msg_namelen = sizeof(SOCKADDR_INET);
+		mmsgRing[k].msg_hdr.msg_controllen = sizeof(ctrlRing[k]);
+		mmsgRing[k].msg_hdr.msg_flags = 0;
+	}
+	// MSG_WAITFORONE: do not block once the first datagram is available
+	int n = recvmmsg(sd, mmsgRing, LLS_RECV_BATCH_SIZE, MSG_WAITFORONE, NULL);
+	if (n > 0)
+	{
+		perfCounts.countRecvCalls++;
+		perfCounts.countRecvPackets += n;
+	}
+	return n;
+}
+
+
+
+// Given
+//	int		the index of the slot in the receive ring
+//	int32_t	the length of the FSP packet, including the prefixed ALFID pair
+// Do
+//	Make the packet in the slot the current receipt that ProcessReceived and SendBack work on
+// Remark
+//	The control message of IP_PKTINFO is not necessarily the first one, so it is searched
+inline void CPacketReceiver::SetCurrentReceipt(int k, int32_t len)
+{
+	struct msghdr &hdr = mmsgRing[k].msg_hdr;
+	pktBuf = &recvRing[k];
+	countRecv = len;
+	addrFrom = addrRing[k];
+	mesgInfo.msg_namelen = hdr.msg_namelen;
+	mesgInfo.msg_controllen = 0;
+	for (struct cmsghdr *p = CMSG_FIRSTHDR(&hdr); p != NULL; p = CMSG_NXTHDR(&hdr, p))
+	{
+		if (p->cmsg_level == IPPROTO_IP && p->cmsg_type == IP_PKTINFO)
+		{
+			mesgInfo.msg_controllen = (octet *)hdr.msg_control + hdr.msg_controllen - (octet *)p;
+			memcpy(&nearInfo, p, min((size_t)mesgInfo.msg_controllen, sizeof(CtrlMsgHdr)));
+			break;
+		}
+	}
+	iovec[0].iov_base = (void*)&pktBuf->fidPair;
+	SOCKADDR_ALFID(mesgInfo.msg_name) = pktBuf->fidPair.source;	// For FSP over UDP/IPv4
+}
+
+
+
+#if LLS_UDP_GRO
+// Given
+//	int		the index of the slot in the receive ring
+// Return
+//	The size of the segments that the super-datagram in the slot was coalesced from,
+//	or the length of the datagram if it was not coalesced
+inline int CPacketReceiver::GetSegmentSize(int k)
+{
+	struct msghdr &hdr = mmsgRing[k].msg_hdr;
+	for (struct cmsghdr *p = CMSG_FIRSTHDR(&hdr); p != NULL; p = CMSG_NXTHDR(&hdr, p))
+	{
+		if (p->cmsg_level == SOL_UDP && p->cmsg_type == UDP_GRO)
+			return *(int *)CMSG_DATA(p);
+	}
+	return (int)mmsgRing[k].msg_len;
+}
+
+
+
+// Given
+//	int		the index of the slot in the receive ring
+//	int32_t	the offset of the segment in the super-datagram
+//	int32_t	the length of the segment
+// Do
+//	Copy the segment into the aligned packet buffer of the slot
+// Return
+//	true if the segment is copied, false if it cannot be an FSP packet
+inline bool CPacketReceiver::CopySegment(int k, int32_t offset, int32_t len)
+{
+	if (len < (int32_t)(sizeof(ALFIDPair) + sizeof(FSP_FixedHeader))
+	 || len > (int32_t)(sizeof(ALFIDPair) + sizeof(FSP_NormalPacketHeader) + MAX_BLOCK_SIZE))
+	{
+		return false;
+	}
+	memcpy(&recvRing[k].fidPair, groRing[k] + offset, sizeof(ALFIDPair));
+	memcpy(&recvRing[k].hdr, groRing[k] + offset + sizeof(ALFIDPair), len - sizeof(ALFIDPair));
+	return true;
+}
+#endif
+
+
+
 // retrieve message from remote end point
 // it's a thread entry
-void * CLowerInterface::ProcessRemotePacket(void *pInstance)
+void * CPacketReceiver::ProcessRemotePacket(void *pInstance)
 {
 	try
 	{
-		((CLowerInterface *)pInstance)->ProcessRemotePacket();
+		((CPacketReceiver *)pInstance)->ProcessRemotePacket();
 	}
 	catch(...)
 	{
@@ -304,12 +672,13 @@ void * CLowerInterface::ProcessRemotePacket(void *pInstance)
 
 
 // the real top-level handler to accept and process the remote packets
-inline void CLowerInterface::ProcessRemotePacket()
+inline void CPacketReceiver::ProcessRemotePacket()
 {
-	struct pollfd readFDs[SD_SETSIZE];
+	struct pollfd readFDs[SD_SETSIZE + 1];
 	register int i;
-	int r;
+	int r, n;
 
+	const int countInterfaces = CLowerInterface::Singleton.countInterfaces;
 	if(countInterfaces <= 0)
 		throw EDOM;
 	//
@@ -319,12 +688,15 @@ inline void CLowerInterface::ProcessRemotePacket()
 		memset(readFDs, 0, sizeof(readFDs));
 		for(i = 0; i < countInterfaces; i++)
 		{
-			readFDs[i].fd = sdSet[i];
+			readFDs[i].fd = sdRecv[i];
 			readFDs[i].events = POLLIN;
 			readFDs[i].revents = 0;
 		}
+		// the last one tells the worker to stop
+		readFDs[countInterfaces].fd = CLowerInterface::Singleton.fdStopWorkers;
+		readFDs[countInterfaces].events = POLLIN;
 		// poll() conforms to POSIX.1-2001 and POSIX.1-2008.
-		r = poll(readFDs, countInterfaces, -1);
+		r = poll(readFDs, countInterfaces + 1, -1);
 		if(r == -1)
 		{
 			int	err = errno;
@@ -343,26 +715,42 @@ inline void CLowerInterface::ProcessRemotePacket()
 			perror("Select failure");
 			break;	// TODO: crash recovery from select
 		}
+		if (readFDs[countInterfaces].revents != 0)
+			break;
 		//
 		for(i = 0; i < countInterfaces; i++)
 		{
-			iovec[1].iov_base = (void*)&pktBuf->hdr;
-			iovec[1].iov_len = MAX_BLOCK_SIZE + sizeof(FSP_NormalPacketHeader);
-			mesgInfo.msg_flags = 0;
-			r = 0;
-			if(readFDs[i].revents != 0)
-			{
+			if(readFDs[i].revents == 0)
+				continue;
 #if defined(TRACE) && (TRACE & TRACE_PACKET)
-				printf_s("\nTo process packet on socket #%X:\n", (unsigned)readFDs[i].fd);
-#endif				
-				countRecv = recvmsg(readFDs[i].fd, &mesgInfo, 0);
-				if (countRecv < 0)
+			printf_s("\nTo process packet on socket #%X:\n", (unsigned)readFDs[i].fd);
+#endif
+			n = RecvBatch(readFDs[i].fd);
+			if (n < 0)
+			{
+				perror("Cannot recvmmsg");
+				continue;
+			}
+			SetLoopTime();	// it is the time of receipt of the whole batch
+			for (register int k = 0; k < n; k++)
+			{
+#if LLS_UDP_GRO
+				const int32_t m = (int32_t)mmsgRing[k].msg_len;
+				const int32_t segSize = GetSegmentSize(k);
+				if (segSize > 0 && m > segSize)	// the coalesced ones count as packets received as well
+					perfCounts.countRecvPackets += (m - 1) / segSize;
+				for (int32_t offset = 0; segSize > 0 && offset < m; offset += segSize)
 				{
-					perror("Cannot recvmsg");
-					continue;
+					int32_t len = min(segSize, m - offset);
+					if (!CopySegment(k, offset, len))
+						continue;
+					SetCurrentReceipt(k, len);
+					r = ProcessReceived();
 				}
-				SOCKADDR_ALFID(mesgInfo.msg_name) = pktBuf->fidPair.source;	// For FSP over UDP/IPv4
+#else
+				SetCurrentReceipt(k, (int32_t)mmsgRing[k].msg_len);
 				r = ProcessReceived();
+#endif
 #if defined(TRACE) && (TRACE & TRACE_PACKET)
 				printf_s("\nPacket on socket #%X: processed, result = %d\n", (unsigned)readFDs[i].fd, r);
 #endif
@@ -382,7 +770,7 @@ inline void CLowerInterface::ProcessRemotePacket()
 //	Number of bytes actually sent (0 means error)
 // Remark
 //	It is safely assume that remote and near address are of the same address family
-int LOCALAPI CLowerInterface::SendBack(char * buf, int len)
+int LOCALAPI CPacketReceiver::SendBack(char * buf, int len)
 {
 #if defined(TRACE) && (TRACE & TRACE_ADDRESS)
 	printf_s("\nSend back to peer socket address:\n");
@@ -392,10 +780,10 @@ int LOCALAPI CLowerInterface::SendBack(char * buf, int len)
 	iovec[1].iov_base = buf;
 	iovec[1].iov_len = len;
 	((PSOCKADDR_IN)mesgInfo.msg_name)->sin_port = DEFAULT_FSP_UDPPORT;
-	int n = (int)sendmsg(sdSend, &mesgInfo, 0);
+	int n = (int)sendmsg(CLowerInterface::Singleton.sdSend, &mesgInfo, 0);
 	if (n < 0)
 	{
-		perror("CLowerInterface::SendBack");
+		perror("CPacketReceiver::SendBack");
 		return 0;
 	}
 #if defined(TRACE) && (TRACE & TRACE_PACKET)
@@ -421,184 +809,1140 @@ extern "C" timestamp_t NowUTC()
 
 
 
-// Given
-//	u32 *	pointer to the buffer to store the random 32-bit word
-//	int		number of 32-bit words to generate
-// Do
-//	Generate (pseudo) random number of designated length and store it in the buffer given
-extern "C" void rand_w32(u32 *p, int n)
+static inline uint64_t ReadClock_ns(clockid_t id)
 {
-	static uint64_t nonce;
-	struct
-	{
-		struct timeval tv;
-		uint64_t nonce;
-	} _rm;	// random material
-	_rm.nonce = _InterlockedIncrement(&nonce);
-	gettimeofday(&_rm.tv, NULL);
-	blake2b(p, n * sizeof(u32), keyInternalRand, sizeof(keyInternalRand), &_rm, sizeof(_rm));
+	struct timespec ts;
+	clock_gettime(id, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
 }
 
-
-
-int SProcessRoot::RecvFromPipe(void *chBuf, int capacity)
-{
-	return recv(sdPipe, chBuf, capacity, 0);
-}
+static inline timestamp_t ReadClock_us(clockid_t id) { return ReadClock_ns(id) / 1000; }
 
 
 
-// Given
-//	HPIPE_T		the handle to the communication pipe
-//	ALFID_T		the application layer fiber ID
-//	FSP_NoticeCode		the code of the notice to send
-// Return
-//	positive if it is number of octets sent
-//	negative if error occurred
-int  SProcessRoot::SendNotificationTo(ALFID_T fiberID, FSP_NoticeCode code)
+// Do
+//	Calibrate the TSC against CLOCK_MONOTONIC if it is the clock source configured and it is invariant
+// Remark
+//	Called before the receive workers and the timing wheels are started. Before it is called,
+//	or if the TSC is not invariant, NowMonotonic reads CLOCK_MONOTONIC instead
+static void InitMonotonicClock()
 {
-	SNotification resp;
-	resp.sig = code;
-	resp.fiberID = fiberID;
-	return send(sdPipe, &resp, sizeof(SNotification), 0);
+#if LLS_CLOCK_SOURCE == LLS_CLOCK_TSC
+	unsigned int a, b, c, d;
+	if (__get_cpuid(0x80000007, &a, &b, &c, &d) == 0 || (d & (1 << 8)) == 0)
+		return;
+
+	struct timespec req = { 0, LLS_TSC_CALIBRATION_ms * 1000000L };
+	uint64_t t0 = ReadClock_ns(CLOCK_MONOTONIC);
+	uint64_t c0 = __rdtsc();
+	nanosleep(&req, NULL);
+	uint64_t t1 = ReadClock_ns(CLOCK_MONOTONIC);
+	uint64_t c1 = __rdtsc();
+	if (c1 <= c0 || t1 <= t0)
+		return;
+
+	tscBase = c1;
+	tscBase_us = t1 / 1000;
+	tscScale = (uint64_t)(((unsigned __int128)(t1 - t0) << 32) / ((unsigned __int128)(c1 - c0) * 1000));
+#endif
 }
 
 
 
-// Given
-//	uint32_t		number of millisecond delayed to trigger the timer
-// Return
-//	true if the timer was set, false if it failed.
-bool LOCALAPI CSocketItemEx::ReplaceTimer(uint32_t period)
+// Return the number of microseconds elapsed since the boot of the system, from the clock source configured
+extern "C" timestamp_t NowMonotonic()
 {
-    struct itimerspec its;
-	if (timer == 0)
-	{
-	    struct sigevent sigev;
-		sigev.sigev_notify = SIGEV_THREAD;
-		sigev.sigev_value.sival_ptr = this;
-		sigev.sigev_notify_function = KeepAlive;
-		sigev.sigev_notify_attributes = NULL;
-		int k = timer_create(CLOCK_MONOTONIC, &sigev, &timer);
-		if (k == -1)
-		{
-			perror("What? cannot create the timer!");
-			return false;
-		}
-	}
-
-    its.it_value.tv_sec = period / 1000;
-    its.it_value.tv_nsec = period % 1000 * 1000000;
-    its.it_interval.tv_sec = its.it_value.tv_sec;
-    its.it_interval.tv_nsec = its.it_value.tv_nsec;
-    //^ periodic timer
-    if (timer_settime(timer, 0, &its, NULL) == 0)
-		return true;
-	perror("What? cannot set the timer!");
-	timer_delete(timer);
-	timer = 0;
-	return false;
+#if LLS_CLOCK_SOURCE == LLS_CLOCK_TSC
+	if (tscScale != 0)
+		return tscBase_us + (timestamp_t)(((unsigned __int128)(__rdtsc() - tscBase) * tscScale) >> 32);
+	return ReadClock_us(CLOCK_MONOTONIC);
+#elif LLS_CLOCK_SOURCE == LLS_CLOCK_MONOTONIC_COARSE
+	return ReadClock_us(CLOCK_MONOTONIC_COARSE);
+#else
+	return ReadClock_us(CLOCK_MONOTONIC);
+#endif
 }
 
 
 
-// Assume a mutex has been obtained
-void CSocketItemEx::RemoveTimers()
+// Only the thread that called fork() survives in the child process, with a copy of the parent's generator
+// which must not be used any more. Bump the generation so that the child reseeds before generating
+static void ReseedOnFork()
 {
-	timer_t h;
-	if((h = (timer_t)_InterlockedExchange(& timer, 0)) != 0)
-		timer_delete(h);
+	forkGeneration++;
 }
 
 
 
-static void* WaitULACommand(void* p)
+static void RegisterForkHandler()
 {
-	((SProcessRoot*)p)->LoopOnULACommand();
-	return p;
+	pthread_atfork(NULL, NULL, ReseedOnFork);
 }
 
 
 
 // Given
-//	SOCKET		the socket that created as a two-way stream end point
+//	SRandomBitGenerator &	the generator to seed
 // Do
-//	Set the socket as the bi-directional IPC end point and create the thread
-// Return
-//	true the communication channel was established successfully
-//	false if it failed
-bool CSocketSrvTLB::AddULAChannel(SOCKET sd)
+//	Fetch a fresh key from the kernel's CSPRNG and discard any output buffered
+// Remark
+//	getrandom() blocks only until the kernel's pool is initialized at boot. If it is unavailable,
+//	fall back to hashing whatever is unpredictable locally, as the generator did before
+static void SeedRandomBitGenerator(SRandomBitGenerator & g)
 {
-	AcquireMutex();
+	pthread_once(&onceForkHandler, RegisterForkHandler);
 
-	unsigned long bitIndex;
-	char isNonZero = 0;
-	for (bitIndex = 0; bitIndex < sizeof(forestFreeFlags) * 8; bitIndex++)
+	register int i = 0;
+	while (i < (int)sizeof(g.key))
 	{
-		if ((forestFreeFlags & (1 << bitIndex)) != 0)
-		{
-			isNonZero = 1;
+		ssize_t r = getrandom(g.key + i, sizeof(g.key) - i, 0);
+		if (r > 0)
+			i += (int)r;
+		else if (r < 0 && errno != EINTR)
 			break;
-		}
 	}
-	if (!isNonZero)
+	if (i < (int)sizeof(g.key))
 	{
-		ReleaseMutex();
-		return false;
+		struct
+		{
+			struct timespec	ts;
+			pid_t		pid;
+			pthread_t	tid;
+			void *		addr;
+		} _rm;	// random material
+		clock_gettime(CLOCK_REALTIME, &_rm.ts);
+		_rm.pid = getpid();
+		_rm.tid = pthread_self();
+		_rm.addr = &g;
+		blake2b(g.key, sizeof(g.key), g.key, i, &_rm, sizeof(_rm));
 	}
 
-	SProcessRoot& r = forestULA[bitIndex];
-	r.latest = NULL;
-	r.sdPipe = sd;
-#ifdef TRACE
-	printf("New socket to accept ULA command: %d\n", sd);
+	g.counter = 0;
+	g.available = 0;
+	memset(g.chunk, 0, sizeof(g.chunk));
+	g.generation = forkGeneration;
+}
+
+
+
+// Given
+//	SRandomBitGenerator &	the generator to refill
+// Do
+//	Expand the key into a new key and LLS_DRBG_CHUNK_SIZE octets of output
+// Remark
+//	Each 64-octet block is the unkeyed BLAKE2b of the key concatenated with a counter,
+//	which costs a single compression as the input fits in one block
+static void RefillRandomBits(SRandomBitGenerator & g)
+{
+	struct
+	{
+		octet		key[FSP_MAX_KEY_SIZE];
+		uint64_t	counter;
+	} _in;
+	octet nextKey[DRBG_BLOCK_SIZE];
+
+	memcpy(_in.key, g.key, sizeof(_in.key));
+	for (register int i = 0; i < LLS_DRBG_CHUNK_SIZE; i += DRBG_BLOCK_SIZE)
+	{
+		_in.counter = g.counter++;
+		blake2b(g.chunk + i, DRBG_BLOCK_SIZE, NULL, 0, &_in, sizeof(_in));
+	}
+	_in.counter = g.counter++;
+	blake2b(nextKey, DRBG_BLOCK_SIZE, NULL, 0, &_in, sizeof(_in));
+	memcpy(g.key, nextKey, sizeof(g.key));
+
+	memset(nextKey, 0, sizeof(nextKey));
+	memset(&_in, 0, sizeof(_in));
+	g.available = LLS_DRBG_CHUNK_SIZE;
+}
+
+
+
+// Given
+//	u32 *	pointer to the buffer to store the random 32-bit word
+//	int		number of 32-bit words to generate
+// Do
+//	Generate (pseudo) random number of designated length and store it in the buffer given
+// Remark
+//	The generator is per-thread, so no lock is needed. It is seeded on first use and reseeded in a forked child
+extern "C" void rand_w32(u32 *p, int n)
+{
+	SRandomBitGenerator & g = drbg;
+	if (g.generation != forkGeneration)
+		SeedRandomBitGenerator(g);
+
+	octet *buf = (octet *)p;
+	int len = n * (int)sizeof(u32);
+	while (len > 0)
+	{
+		if (g.available <= 0)
+			RefillRandomBits(g);
+		octet *src = g.chunk + LLS_DRBG_CHUNK_SIZE - g.available;
+		int m = min(len, g.available);
+		memcpy(buf, src, m);
+		memset(src, 0, m);
+		g.available -= m;
+		buf += m;
+		len -= m;
+	}
+}
+
+
+
+// Given
+//	UCommandToLLS *	the buffer to hold the commands
+//	int		the capacity of the buffer, in number of commands
+// Return
+//	number of commands fetched from the command ring, which may be zero
+// Remark
+//	The consumer announces that it is to sleep only when the ring is drained, and the ULA process
+//	rings the doorbell only if the consumer is sleeping. If the buffer is full before the ring is drained
+//	the doorbell is rung by the consumer itself so that the rest is fetched in the next round
+int SProcessRoot::FetchFromRing(UCommandToLLS *cmds, int capacity)
+{
+	uint64_t v;
+	int n = 0;
+	if (pRing == NULL)
+		return 0;
+
+	pRing->sleeping = 0;
+	for (;;)
+	{
+		uint32_t h = pRing->head;
+		uint32_t t = LCKREAD(pRing->tail);
+		for (; n < capacity && h != t; n++, h++)
+			memcpy(&cmds[n], &pRing->slots[h & (ULA_COMMAND_RING_SIZE - 1)], sizeof(UCommandToLLS));
+		_InterlockedExchange(&pRing->head, h);
+		if (n >= capacity)
+		{
+			v = 1;
+			if (h != LCKREAD(pRing->tail) && write(fdDoorbell, &v, sizeof(v)) < 0)
+				perror("Cannot ring the doorbell of the command ring");
+			return n;
+		}
+		// Reset the doorbell, then re-check the ring after announcing that it is to sleep, so that no doorbell is missed
+		if (read(fdDoorbell, &v, sizeof(v)) < 0 && errno != EAGAIN)
+			perror("Cannot reset the doorbell of the command ring");
+		_InterlockedExchange(&pRing->sleeping, 1);
+		if (h == LCKREAD(pRing->tail))
+			return n;
+		pRing->sleeping = 0;
+	}
+}
+
+
+
+// Given
+//	void *	the buffer to hold the commands
+//	int		the capacity of the buffer, in octets
+// Return
+//	number of octets of the whole commands received from the pipe, 0 if there is none available
+//	negative if the pipe was closed or error occurred
+// Remark
+//	It does not block. The pipe is a stream, the octets of the command partially received are kept
+//	until the rest arrives. The command ring is set up by a NullCommand that carries its file descriptors
+//	over the pipe; the kernel does not glue octets sent after the file descriptors to them
+int SProcessRoot::RecvFromPipe(void *buffer, int capacity)
+{
+	octet *chBuf = (octet *)buffer;
+	union
+	{
+		struct cmsghdr	h;
+		char			buf[CMSG_SPACE(sizeof(int) * 3)];
+	} u;
+	memcpy(chBuf, &partial, lenPartial);
+	struct iovec iov = { chBuf + lenPartial, (size_t)(capacity - lenPartial) };
+	struct msghdr msg;
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+	int r = (int)recvmsg(sdPipe, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (r < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : r;
+	if (r == 0)
+		return -1;
+	r += lenPartial;
+
+	struct cmsghdr *pHdr = CMSG_FIRSTHDR(&msg);
+	if (pHdr != NULL && pHdr->cmsg_level == SOL_SOCKET && pHdr->cmsg_type == SCM_RIGHTS)
+	{
+		int *fds = (int *)CMSG_DATA(pHdr);
+		int n = (int)((pHdr->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+		int k = r - (int)sizeof(SCommandToLLS);
+		if (k >= 0 && k % sizeof(UCommandToLLS) == 0 && ((SCommandToLLS *)(chBuf + k))->opCode == NullCommand)
+		{
+			AcceptCommandRing(fds, n);
+			r = k;
+		}
+		else
+		{
+			for (register int i = 0; i < n; i++)
+				close(fds[i]);
+		}
+	}
+
+	lenPartial = r % sizeof(UCommandToLLS);
+	r -= lenPartial;
+	memcpy(&partial, chBuf + r, lenPartial);
+	return r;
+}
+
+
+
+// Given
+//	UCommandToLLS *	the buffer to hold the commands
+//	int		the capacity of the buffer, in number of commands
+// Return
+//	number of commands fetched, either from the command ring or from the pipe
+//	negative if the pipe was closed or error occurred and there was no command fetched
+int SProcessRoot::FetchCommands(UCommandToLLS *cmds, int capacity)
+{
+	const bool hasRing = (pRing != NULL);
+	int n = FetchFromRing(cmds, capacity);
+	if (n >= capacity)
+		return n;
+
+	int r = RecvFromPipe(cmds + n, (capacity - n) * (int)sizeof(UCommandToLLS));
+	if (r < 0)
+		return (n > 0 ? n : r);
+	n += r / (int)sizeof(UCommandToLLS);
+	// The ULA process would not ring the doorbell of the new ring until the consumer is sleeping
+	if (!hasRing && pRing != NULL && n < capacity)
+		n += FetchFromRing(cmds + n, capacity - n);
+	return n;
+}
+
+
+
+// Given
+//	int		the file descriptor of some object passed by the ULA process
+// Return
+//	true if the object is owned by the user of the ULA process, as told by SO_PEERCRED, or the ULA process is privileged
+bool SProcessRoot::IsOwnerOf(int fd) const
+{
+	struct stat st;
+	return (fstat(fd, &st) == 0 && (st.st_uid == peer.uid || peer.uid == 0));
+}
+
+
+
+// Given
+//	int		the file descriptor of some object passed by the ULA process
+// Return
+//	true if the object is an eventfd, as told by its anonymous inode
+static bool IsEventFD(int fd)
+{
+	char path[32];
+	char target[32];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	ssize_t n = readlink(path, target, sizeof(target) - 1);
+	if (n < 0)
+		return false;
+	target[n] = 0;
+	return strcmp(target, "anon_inode:[eventfd]") == 0;
+}
+
+
+
+// Given
+//	const int *	array of file descriptors passed by the ULA process
+//	int			number of the file descriptors
+// Do
+//	Map the shared memory of the command ring and take the doorbells if there are
+//	exactly the shared memory object, the command doorbell and the notice doorbell passed
+// Remark
+//	Received file descriptors that are not taken are closed
+//	Both doorbells must be eventfds; they are made non-blocking so that neither
+//	the command dispatcher nor the notice raiser could be stalled by the ULA process
+void SProcessRoot::AcceptCommandRing(const int *fds, int n)
+{
+	struct stat st;
+	if (pRing != NULL || n != 3 || !IsOwnerOf(fds[0])
+	 || fstat(fds[0], &st) < 0 || st.st_size < (off_t)sizeof(SCommandRing)
+	 || !IsEventFD(fds[1]) || !IsEventFD(fds[2]))
+	{
+		for (register int i = 0; i < n; i++)
+			close(fds[i]);
+		return;
+	}
+
+	void *p = mmap(NULL, sizeof(SCommandRing), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	close(fds[0]);
+	if (p == MAP_FAILED)
+	{
+		perror("Cannot map the command ring of the ULA process");
+		close(fds[1]);
+		close(fds[2]);
+		return;
+	}
+
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+	fcntl(fds[2], F_SETFL, fcntl(fds[2], F_GETFL) | O_NONBLOCK);
+	fdDoorbell = fds[1];
+	fdNoticeBell = fds[2];
+	pRing = (SCommandRing *)p;
+	if (!service->Watch(this, fdDoorbell))
+		perror("Cannot watch the doorbell of the command ring");
+#if defined(TRACE) && (TRACE & TRACE_ULACALL)
+	printf_s("The ULA channel of socket %d takes use of the command ring\n", (int)sdPipe);
 #endif
-	DWORD optval = 1;
-	setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, (const char*)&optval, sizeof(optval));
+}
+
+
+
+void SProcessRoot::DetachCommandRing()
+{
+	if (pRing == NULL)
+		return;
+	munmap(pRing, sizeof(SCommandRing));
+	pRing = NULL;
+	CLOSE_PIPE(fdDoorbell);
+	CLOSE_PIPE(fdNoticeBell);
+}
+
+
+
+// Given
+//	int32_t		index of the socket in the notice bitmap of the ULA process
+// Do
+//	Mark the socket as having some notice raised, and ring the notice doorbell
+//	unless it has been rung since the ULA process scanned the bitmap last time
+void SProcessRoot::RaiseNotice(int32_t index)
+{
+	SCommandRing *p = pRing;
+	if (p == NULL)
+		return;
+
+	index &= ULA_NOTICE_BITS - 1;
+	_InterlockedOr(&p->noticeBits[index >> 6], (uint64_t)1 << (index & 63));
+	if (_InterlockedExchange(&p->noticeRaised, 1) != 0)
+		return;
+
+	// EAGAIN means the counter is saturated, i.e. the doorbell has been signalled already
+	uint64_t v = 1;
+	if (write(fdNoticeBell, &v, sizeof(v)) < 0 && errno != EAGAIN)
+		perror("Cannot ring the notice doorbell of the ULA process");
+}
+
+
+
+// Given
+//	HPIPE_T		the handle to the communication pipe
+//	ALFID_T		the application layer fiber ID
+//	FSP_NoticeCode		the code of the notice to send
+// Return
+//	positive if it is number of octets sent
+//	negative if error occurred
+int  SProcessRoot::SendNotificationTo(ALFID_T fiberID, FSP_NoticeCode code)
+{
+	SNotification resp;
+	resp.sig = code;
+	resp.fiberID = fiberID;
+	return send(sdPipe, &resp, sizeof(SNotification), 0);
+}
+
+
+
+// Given
+//	uint32_t		number of millisecond delayed to trigger the timer
+// Return
+//	true if the timer was set, false if it failed.
+// Remark
+//	The timer is periodic. It is put in the timing wheel that the session is sharded to
+bool LOCALAPI CSocketItemEx::ReplaceTimer(uint32_t period)
+{
+	CTimingWheel *w = timer.wheel;
+	if (w == NULL)
+		w = &CTimingWheel::For(fidPair.source);
+	timerParked = 0;
+	w->Arm(&timer, this, period);
+	return true;
+}
+
+
+
+// Assume a mutex has been obtained
+void CSocketItemEx::RemoveTimers()
+{
+	if (timer.wheel != NULL)
+		timer.wheel->Cancel(&timer);
+}
+
+
+
+CTimingWheel	CTimingWheel::wheels[LLS_RECV_WORKERS];
+int				CTimingWheel::countWheels;
+
+// Return the number of milliseconds elapsed since tick zero
+inline uint64_t CTimingWheel::NowTick()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec - tickZero_ns) / 1000000;
+}
+
+
+
+// Given
+//	STimerEntry *	the entry to put into the wheel, where expireTick has been set
+// Do
+//	Put the entry into the slot of the lowest level that the expiry time fits in
+// Remark
+//	Assume the lock of the wheel has been obtained
+inline void CTimingWheel::Insert(STimerEntry *e)
+{
+	if (int64_t(e->expireTick - currentTick) < 0)
+		e->expireTick = currentTick;
+	else if (e->expireTick - currentTick > MAX_TICKS)
+		e->expireTick = currentTick + MAX_TICKS;
+
+	register uint64_t delta = e->expireTick - currentTick;
+	register int level = 0;
+	while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1))))
+		level++;
+	register int k = int(e->expireTick >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+
+	STimerEntry *head = &slots[level][k];
+	e->level = (uint16_t)level;
+	e->slot = (uint16_t)k;
+	e->prev = head->prev;
+	e->next = head;
+	head->prev->next = e;
+	head->prev = e;
+	bitmap[level] |= 1ULL << k;
+}
+
+
+
+// Assume the lock of the wheel has been obtained and the entry is linked
+inline void CTimingWheel::Unlink(STimerEntry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	e->next = e->prev = NULL;
+	STimerEntry *head = &slots[e->level][e->slot];
+	if (head->next == head)
+		bitmap[e->level] &= ~(1ULL << e->slot);
+}
+
+
+
+// Re-distribute the entries in the higher level slots which are due at the current tick to the lower levels
+// Assume the lock of the wheel has been obtained
+inline void CTimingWheel::Cascade()
+{
+	register int level = 1;
+	while (level < WHEEL_LEVELS - 1 && (currentTick & ((1ULL << (WHEEL_BITS * (level + 1))) - 1)) == 0)
+		level++;
+	// from the highest level whose slot is due to the lowest one
+	for (; level > 0; level--)
+	{
+		if ((currentTick & ((1ULL << (WHEEL_BITS * level)) - 1)) != 0)
+			continue;
+		STimerEntry *head = &slots[level][int(currentTick >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)];
+		while (head->next != head)
+		{
+			STimerEntry *e = head->next;
+			Unlink(e);
+			Insert(e);
+		}
+	}
+}
+
+
+
+// Return
+//	The earliest tick after the current tick at which some entry might expire or be cascaded,
+//	UINT64_MAX if the wheel is empty
+// Remark
+//	Assume the lock of the wheel has been obtained
+inline uint64_t CTimingWheel::NextEventTick()
+{
+	uint64_t t1 = UINT64_MAX;
+	for (register int level = 0; level < WHEEL_LEVELS; level++)
+	{
+		if (bitmap[level] == 0)
+			continue;
+		const int shift = WHEEL_BITS * level;
+		const int r = (int(currentTick >> shift) + 1) & (WHEEL_SIZE - 1);
+		// rotate so that bit 0 stands for the slot next to the current one
+		uint64_t m = (r == 0) ? bitmap[level] : (bitmap[level] >> r) | (bitmap[level] << (WHEEL_SIZE - r));
+		uint64_t t = ((currentTick >> shift) + __builtin_ctzll(m) + 1) << shift;
+		if (t < t1)
+			t1 = t;
+	}
+	return t1;
+}
+
+
+
+// Given
+//	uint64_t	the tick at which the thread of the wheel is to be waked up. UINT64_MAX to sleep indefinitely
+// Remark
+//	Assume the lock of the wheel has been obtained
+inline void CTimingWheel::SetWakeTick(uint64_t t)
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if (t != UINT64_MAX)
+	{
+		uint64_t ns = tickZero_ns + t * 1000000;
+		its.it_value.tv_sec = ns / 1000000000ULL;
+		its.it_value.tv_nsec = ns % 1000000000ULL;
+	}
+	nextWakeTick = t;
+	if (timerfd_settime(fdTimer, TFD_TIMER_ABSTIME, &its, NULL) != 0)
+		perror("Cannot set the timerfd of the timing wheel");
+}
+
+
+
+// Given
+//	uint64_t			the tick which the wheel is to run to
+//	CSocketItemEx **	the array to store the sessions whose timer expired, of DISPATCH_BATCH entries
+// Do
+//	Advance the wheel, skipping the ticks where nothing happens, and re-insert the expired periodic entries
+// Return
+//	Number of sessions to be called back
+// Remark
+//	Assume the lock of the wheel has been obtained
+inline int CTimingWheel::Collect(uint64_t now, CSocketItemEx **due)
+{
+	int n = 0;
+	do
+	{
+		STimerEntry *head = &slots[0][int(currentTick) & (WHEEL_SIZE - 1)];
+		while (head->next != head)
+		{
+			if (n >= DISPATCH_BATCH)
+				return n;
+			STimerEntry *e = head->next;
+			Unlink(e);
+			due[n++] = e->owner;
+			e->expireTick = currentTick + e->period;
+			Insert(e);
+		}
+		if (currentTick >= now)
+			break;
+		currentTick = min(NextEventTick(), now);
+		Cascade();
+	} while (true);
+	return n;
+}
+
+
 
-	if (pthread_create(&r.hThreadWait, NULL, ::WaitULACommand, &r) != 0)
+// Run the wheel to the current time and call back the sessions whose timer expired
+// The callback is made without the lock of the wheel so that the session may re-arm or cancel its timer
+inline void CTimingWheel::Advance()
+{
+	CSocketItemEx *due[DISPATCH_BATCH];
+	int n;
+	do
 	{
-		perror("Cannot create new thread to wait for ULA command");
+		AcquireMutex();
+		n = Collect(NowTick(), due);
+		if (n < DISPATCH_BATCH)
+			SetWakeTick(NextEventTick());
 		ReleaseMutex();
+		//
+		SetLoopTime();
+		for (register int i = 0; i < n; i++)
+			due[i]->KeepAlive();
+	} while (n >= DISPATCH_BATCH);
+}
+
+
+
+// Given
+//	STimerEntry *		the timer entry of the session
+//	CSocketItemEx *		the session
+//	uint32_t			the period of the timer, in milliseconds
+// Do
+//	(Re-)arm the periodic timer to expire the first time after the period elapsed
+// Remark
+//	An entry shall always be re-armed in the same wheel, see also ReplaceTimer
+void CTimingWheel::Arm(STimerEntry *e, CSocketItemEx *owner, uint32_t period)
+{
+	AcquireMutex();
+	if (e->next != NULL)
+		Unlink(e);
+	e->owner = owner;
+	e->wheel = this;
+	e->period = max(period, 1U);
+	// the current tick might lag behind if the thread is sleeping or busy
+	e->expireTick = max(NowTick() + e->period, currentTick + 1);
+	Insert(e);
+	if (e->expireTick < nextWakeTick)
+		SetWakeTick(e->expireTick);
+	ReleaseMutex();
+}
+
+
+
+// Given
+//	STimerEntry *		the timer entry of the session, which might not be armed
+void CTimingWheel::Cancel(STimerEntry *e)
+{
+	AcquireMutex();
+	if (e->next != NULL)
+		Unlink(e);
+	ReleaseMutex();
+}
+
+
+
+// Do
+//	Initialize the wheel, create the timerfd and start the thread of the wheel
+// Return
+//	true if no error, false if failed
+bool CTimingWheel::Start()
+{
+	struct timespec ts;
+	InitMutex();
+	for (register int level = 0; level < WHEEL_LEVELS; level++)
+	{
+		for (register int k = 0; k < WHEEL_SIZE; k++)
+			slots[level][k].next = slots[level][k].prev = &slots[level][k];
+		bitmap[level] = 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	tickZero_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	currentTick = 0;
+	nextWakeTick = UINT64_MAX;
+	stopping = false;
+
+	fdTimer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (fdTimer < 0)
+	{
+		perror("Cannot create the timerfd of the timing wheel");
+		return false;
+	}
+	if (pthread_create(&thWheel, NULL, Run, this) != 0)
+	{
+		perror("Cannot create the thread of the timing wheel");
+		close(fdTimer);
 		return false;
 	}
-	pthread_detach(r.hThreadWait);
+	return true;
+}
+
 
-	r.index = bitIndex;
-	forestFreeFlags ^= 1 << bitIndex;
 
+// Do
+//	Tell the thread of the wheel to exit, wake it up by the timerfd expired at once and wait for it
+// Remark
+//	The stop flag is checked after Advance as well, in case Advance re-armed the timerfd
+//	after it was set to expire at once
+void CTimingWheel::Stop()
+{
+	AcquireMutex();
+	stopping = true;
+	SetWakeTick(0);	// tick zero has passed
 	ReleaseMutex();
+	pthread_join(thWheel, NULL);
+	close(fdTimer);
+}
+
+
+
+// The thread entry of the timing wheel
+void * CTimingWheel::Run(void *p)
+{
+	CTimingWheel *w = (CTimingWheel *)p;
+	uint64_t expirations;
+	while (!w->stopping)
+	{
+		if (read(w->fdTimer, &expirations, sizeof(expirations)) < 0 && errno != EINTR)
+		{
+			perror("Cannot read the timerfd of the timing wheel");
+			break;
+		}
+		if (w->stopping)
+			break;
+		w->Advance();
+	}
+	return p;
+}
+
+
+
+// Given
+//	int		number of the timing wheels to start, no greater than LLS_RECV_WORKERS
+// Return
+//	true if at least one timing wheel is started
+bool CTimingWheel::StartAll(int n)
+{
+	for (countWheels = 0; countWheels < n && countWheels < LLS_RECV_WORKERS; countWheels++)
+	{
+		if (!wheels[countWheels].Start())
+			break;
+	}
+	return (countWheels > 0);
+}
+
+
+
+void CTimingWheel::StopAll()
+{
+	for (register int i = 0; i < countWheels; i++)
+		wheels[i].Stop();
+	countWheels = 0;
+}
+
+
+
+CULACommandService	CULACommandService::services[LLS_ULA_WORKERS];
+int			CULACommandService::countServices;
+uint32_t	CULACommandService::countAssigned;
+
+// Given
+//	SProcessRoot *	the ULA process whose command channel is to be watched
+//	int				the file descriptor of the command pipe or the command doorbell
+// Return
+//	true if the file descriptor is added to the epoll instance
+// Remark
+//	Both the pipe and the doorbell of a ULA process refer to its root. They are removed from the epoll instance
+//	automatically when they are closed, for they are not duplicated
+bool CULACommandService::Watch(SProcessRoot *pRoot, int fd)
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = pRoot;
+	return (epoll_ctl(fdEpoll, EPOLL_CTL_ADD, fd, &ev) == 0);
+}
+
+
+
+// Wait for any ULA process assigned to have some command to process, fetch at most LLS_ULA_BATCH_SIZE commands
+// from each ready process at a time and dispatch them. A process is freed once its pipe is closed.
+// Return once the stop eventfd, which is tagged with the service itself, is signalled
+void CULACommandService::Serve()
+{
+	struct epoll_event events[LLS_ULA_BATCH_SIZE];
+	UCommandToLLS cmds[LLS_ULA_BATCH_SIZE];
+	for (;;)
+	{
+		int n = epoll_wait(fdEpoll, events, LLS_ULA_BATCH_SIZE, -1);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("Cannot wait for any ULA command");
+			break;
+		}
+		for (register int i = 0; i < n; i++)
+		{
+			if (events[i].data.ptr == this)
+				return;
+			SProcessRoot *pRoot = (SProcessRoot *)events[i].data.ptr;
+			if (pRoot == NULL)
+				continue;
+			int k = pRoot->FetchCommands(cmds, LLS_ULA_BATCH_SIZE);
+			for (register int j = 0; j < k; j++)
+			{
+				SetLoopTime();
+				pRoot->DispatchCommand(cmds[j]);
+			}
+			if (k >= 0)
+				continue;
+#if defined(TRACE) && (TRACE & TRACE_ULACALL)
+			printf_s("\nThe ULA channel of socket %d is closed.\n", (int)pRoot->sdPipe);
+#endif
+			// The other event of the same process, if any, is stale once the process root is recycled
+			for (register int j = i + 1; j < n; j++)
+			{
+				if (events[j].data.ptr == pRoot)
+					events[j].data.ptr = NULL;
+			}
+			CLowerInterface::Singleton.FreeULAChannel(pRoot);
+		}
+	}
+}
+
+
+
+void * CULACommandService::Run(void *p)
+{
+	((CULACommandService *)p)->Serve();
+	return p;
+}
+
+
+
+bool CULACommandService::Start()
+{
+	struct epoll_event ev;
+	fdEpoll = epoll_create1(EPOLL_CLOEXEC);
+	if (fdEpoll < 0)
+	{
+		perror("Cannot create the epoll instance to wait for ULA command");
+		return false;
+	}
+	fdStop = eventfd(0, EFD_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.ptr = this;
+	if (fdStop < 0 || epoll_ctl(fdEpoll, EPOLL_CTL_ADD, fdStop, &ev) != 0)
+	{
+		perror("Cannot create the eventfd to stop the ULA command service");
+		goto l_bailout;
+	}
+	if (pthread_create(&thService, NULL, Run, this) != 0)
+	{
+		perror("Cannot create the thread to wait for ULA command");
+		goto l_bailout;
+	}
 	return true;
+
+l_bailout:
+	if (fdStop >= 0)
+		close(fdStop);
+	close(fdEpoll);
+	return false;
 }
 
 
 
-// For ScheduleConnect
-static void * HandleConnect(void *p)
+// Do
+//	Signal the thread to exit, which never reads the eventfd so it stays signalled, and wait for it
+//	before the epoll instance is closed
+void CULACommandService::Stop()
 {
-	try
+	uint64_t one = 1;
+	if (write(fdStop, &one, sizeof(one)) < 0)
+		perror("Cannot signal the ULA command service to stop");
+	pthread_join(thService, NULL);
+	close(fdStop);
+	close(fdEpoll);
+}
+
+
+
+bool CULACommandService::StartAll(int n)
+{
+	for (countServices = 0; countServices < n && countServices < LLS_ULA_WORKERS; countServices++)
 	{
-		((CommandNewSessionSrv *)p)->DoConnect();
-		return p;
+		if (!services[countServices].Start())
+			break;
 	}
-	catch (...)
+	return (countServices > 0);
+}
+
+
+
+void CULACommandService::StopAll()
+{
+	for (register int i = 0; i < countServices; i++)
+		services[i].Stop();
+	countServices = 0;
+}
+
+
+
+// Given
+//	SOCKET		the socket that created as a two-way stream end point
+// Do
+//	Register the ULA process at the other end of the socket and let some command service watch the socket
+// Return
+//	true the communication channel was established successfully
+//	false if it failed
+bool CSocketSrvTLB::AddULAChannel(SOCKET sd)
+{
+	struct ucred peer;
+	socklen_t len = sizeof(peer);
+	if (getsockopt(sd, SOL_SOCKET, SO_PEERCRED, &peer, &len) != 0)
 	{
-		return NULL;
+		perror("Cannot get the credentials of the ULA process");
+		return false;
+	}
+
+	AcquireMutex();
+	SProcessRoot *pRoot = AllocProcessRoot();
+	ReleaseMutex();
+	if (pRoot == NULL)
+	{
+		REPORT_ERRMSG_ON_TRACE("Too many ULA processes");
+		return false;
+	}
+
+	SProcessRoot& r = *pRoot;
+	r.latest = NULL;
+	r.pRing = NULL;
+	r.fdDoorbell = INVALID_SOCKET;
+	r.fdNoticeBell = INVALID_SOCKET;
+	r.lenPartial = 0;
+	r.peer = peer;
+	r.sdPipe = sd;
+#ifdef TRACE
+	printf("New socket to accept ULA command: %d, process %d of user %d\n", sd, (int)peer.pid, (int)peer.uid);
+#endif
+	r.service = CULACommandService::Assign();
+	if (!r.service->Watch(pRoot, sd))
+	{
+		perror("Cannot watch the socket to accept ULA command");
+		AcquireMutex();
+		FreeProcessRoot(pRoot);
+		ReleaseMutex();
+		return false;
 	}
+	return true;
 }
 
 
 
 // The OS-dependent implementation of scheduling connection-request queue
+// Remark
+//	A numeric address of the peer is translated in place and the connection is initiated at once,
+//	or else the peer name is resolved by some resolver and the connection is initiated in the timer context
 bool CSocketItemEx::ScheduleConnect(int i)
 {
 	CommandNewSessionSrv &cmd = ConnectRequestQueue::requests[i];
 	cmd.pSocket = this;
 	cmd.index = i;
-	int r = pthread_create(&cmd.idThread, NULL, HandleConnect, &cmd);
-	if(r == 0)
-		pthread_detach(cmd.idThread);
-    return(r == 0);
+	cmd.resolved = cmd.ResolveNumeric(PeerName());
+	if (cmd.resolved > 0)
+	{
+		if (!WaitUseMutex())
+			return false;
+		Connect(cmd);
+		SetMutexFree();
+		ConnectRequestQueue::requests.Remove(i);
+		return true;
+	}
+
+	strncpy(cmd.peerName, PeerName(), sizeof(cmd.peerName) - 1);
+	cmd.peerName[sizeof(cmd.peerName) - 1] = 0;
+	pendingConnect = &cmd;
+	if (CConnectResolver::Post(i))
+		return true;
+
+	pendingConnect = NULL;
+	return false;
+}
+
+
+
+// Arm the timer of the session to expire at once, so that the connection is initiated in the timer context
+// Remark
+//	It is called by the resolver which does not lock the session, so the flags of the session are not touched
+//	See also ReplaceTimer
+void CSocketItemEx::PostConnectResolved()
+{
+	CTimingWheel *w = timer.wheel;
+	if (w == NULL)
+		w = &CTimingWheel::For(fidPair.source);
+	w->Arm(&timer, this, 1);
+}
+
+
+
+// Given
+//	int		the index of the connect request
+//	int		number of the peer addresses resolved, non-positive if failed
+// Do
+//	Hand the request over to the timer of its socket, or remove it if the socket has been freed meanwhile
+void ConnectRequestQueue::Resolved(int i, int n)
+{
+	WaitSetMutex();
+	q[i].resolved = (n > 0 ? n : -1);
+	if (q[i].pSocket != NULL)
+		q[i].pSocket->PostConnectResolved();
+	else
+		Erase(i);
+	SetMutexFree();
+}
+
+
+
+CConnectResolver	CConnectResolver::resolvers[LLS_RESOLVER_THREADS];
+int				CConnectResolver::countResolvers;
+pthread_mutex_t	CConnectResolver::mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t	CConnectResolver::posted = PTHREAD_COND_INITIALIZER;
+int				CConnectResolver::queue[CONNECT_BACKLOG_SIZE];
+int				CConnectResolver::head;
+int				CConnectResolver::count;
+bool			CConnectResolver::stopping;
+
+// Given
+//	int		the index of the connect request in ConnectRequestQueue
+// Return
+//	true if the request is posted to the resolvers
+bool CConnectResolver::Post(int i)
+{
+	pthread_mutex_lock(&mutex);
+	if (countResolvers <= 0 || count >= CONNECT_BACKLOG_SIZE)
+	{
+		pthread_mutex_unlock(&mutex);
+		return false;
+	}
+	queue[(head + count) % CONNECT_BACKLOG_SIZE] = i;
+	count++;
+	pthread_cond_signal(&posted);
+	pthread_mutex_unlock(&mutex);
+	return true;
+}
+
+
+
+// Take the connect requests posted in turn and resolve the peer names one by one, till told to stop
+void * CConnectResolver::Run(void *p)
+{
+	for (;;)
+	{
+		pthread_mutex_lock(&mutex);
+		while (count <= 0 && !stopping)
+			pthread_cond_wait(&posted, &mutex);
+		if (stopping)
+		{
+			pthread_mutex_unlock(&mutex);
+			break;
+		}
+		int i = queue[head];
+		head = (head + 1) % CONNECT_BACKLOG_SIZE;
+		count--;
+		pthread_mutex_unlock(&mutex);
+		//
+		CommandNewSessionSrv &cmd = ConnectRequestQueue::requests[i];
+		ConnectRequestQueue::requests.Resolved(i, cmd.Resolve(cmd.peerName));
+	}
+	return p;
+}
+
+
+
+bool CConnectResolver::StartAll(int n)
+{
+	stopping = false;
+	for (countResolvers = 0; countResolvers < n && countResolvers < LLS_RESOLVER_THREADS; countResolvers++)
+	{
+		if (pthread_create(&resolvers[countResolvers].thResolver, NULL, Run, &resolvers[countResolvers]) != 0)
+		{
+			perror("Cannot create the thread to resolve the peer name");
+			break;
+		}
+	}
+	return (countResolvers > 0);
+}
+
+
+
+// Do
+//	Refuse further requests, wake up the idle threads and wait for all of the threads to exit
+// Remark
+//	A thread that is resolving some peer name exits after the resolution is done;
+//	the requests left in the queue are not resolved
+void CConnectResolver::StopAll()
+{
+	pthread_mutex_lock(&mutex);
+	int n = countResolvers;
+	countResolvers = 0;	// so that Post fails
+	stopping = true;
+	pthread_cond_broadcast(&posted);
+	pthread_mutex_unlock(&mutex);
+	for (register int i = 0; i < n; i++)
+		pthread_join(resolvers[i].thResolver, NULL);
 }
 
 
@@ -627,6 +1971,13 @@ bool CSocketItemEx::MapControlBlock(const CommandNewSessionSrv &cmd)
 		printf("Cannot open the shared memory allocated by ULA");
 		return false;
 	}
+	// The name of the shared memory is given by ULA, which might be that of some other user's
+	if (rootULA != NULL && !rootULA->IsOwnerOf(cmd.hShm))
+	{
+		printf("The shared memory is not owned by the user of the ULA process\n");
+		close(cmd.hShm);
+		return false;
+	}
 
 	dwMemorySize = cmd.dwMemorySize;
 	pControlBlock = (ControlBlock *)mmap(NULL, dwMemorySize,  PROT_READ | PROT_WRITE, MAP_SHARED, cmd.hShm, 0);
@@ -675,7 +2026,7 @@ int CSocketItemEx::SendPacket(register u32 n1, ScatteredSendBuffers s)
 	printf_s("\nPeer socket address:\n");
 	DumpNetworkUInt16((uint16_t *)sockAddrTo, sizeof(SOCKADDR_IN6) / 2);
 #endif
-	timestamp_t t = NowUTC();
+	timestamp_t t = NowMonotonic();
 	int n = (int)sendmsg(CLowerInterface::Singleton.sdSend, &msg, 0);
 	if (n < 0)
 	{
@@ -689,4 +2040,108 @@ int CSocketItemEx::SendPacket(register u32 n1, ScatteredSendBuffers s)
 	return n;
 }
 
+
+
+// Given
+//	STransmitBatch &	the transmit batch to flush
+// Do
+//	Seal the packets staged in the batch at first, then send them. If the payloads are of the same length,
+//	except that the last one might be shorter, they are sent as one UDP GSO super-datagram,
+//	otherwise they are sent by sendmmsg
+// Return
+//	Number of packets sent. The batch is emptied anyway
+// Remark
+//	Packets that failed to be sent are taken as lost and would be retransmitted.
+//	UDP GSO is given up for the session only if the kernel or the NIC driver rejects it as such,
+//	a transient failure falls back to sendmmsg for the batch only
+int CSocketItemEx::SendBatch(STransmitBatch &batch)
+{
+	struct iovec	iov[LLS_SEND_BATCH_SIZE * 3];
+	struct mmsghdr	msgs[LLS_SEND_BATCH_SIZE];
+	if (!SealBatch(batch))
+		return 0;
+
+	const int n = batch.count;
+	bool sameSize = true;
+	register int k;
+
+	batch.count = 0;
+	if (n <= 0)
+		return 0;
+
+	for (k = 0; k < n; k++)
+	{
+		STransmitSlot &slot = batch.slots[k];
+		iov[k * 3].iov_base = &fidPair;
+		iov[k * 3].iov_len = sizeof(fidPair);
+		iov[k * 3 + 1].iov_base = &slot.hdr;
+		iov[k * 3 + 1].iov_len = sizeof(FSP_NormalPacketHeader);
+		iov[k * 3 + 2].iov_base = slot.payload;
+		iov[k * 3 + 2].iov_len = slot.len;
+		if (slot.len != batch.slots[0].len && (k < n - 1 || slot.len > batch.slots[0].len))
+			sameSize = false;
+	}
+
+	timestamp_t t = NowMonotonic();
+	int m = 0;
+	if (n > 1 && sameSize && !gsoUnsupported)
+	{
+		char control[CMSG_SPACE(sizeof(uint16_t))];
+		struct msghdr msg;
+		memset(control, 0, sizeof(control));
+		msg.msg_name = sockAddrTo;
+		msg.msg_namelen = sizeof(SOCKADDR_IN);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n * 3;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		msg.msg_flags = 0;
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		*(uint16_t *)CMSG_DATA(cmsg) = uint16_t(sizeof(ALFIDPair) + sizeof(FSP_NormalPacketHeader) + batch.slots[0].len);
+
+		if (sendmsg(CLowerInterface::Singleton.sdSend, &msg, 0) >= 0)
+			m = n;
+		else if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)
+			gsoUnsupported = 1;	// no checksum offload or no UDP_SEGMENT support
+		else
+			perror("CSocketItemEx::SendBatch with UDP GSO");
+	}
+
+	if (m == 0)
+	{
+		for (k = 0; k < n; k++)
+		{
+			memset(&msgs[k], 0, sizeof(struct mmsghdr));
+			msgs[k].msg_hdr.msg_name = sockAddrTo;
+			msgs[k].msg_hdr.msg_namelen = sizeof(SOCKADDR_IN);
+			msgs[k].msg_hdr.msg_iov = &iov[k * 3];
+			msgs[k].msg_hdr.msg_iovlen = 3;
+		}
+		while (m < n)
+		{
+			int r = sendmmsg(CLowerInterface::Singleton.sdSend, msgs + m, n - m, 0);
+			if (r <= 0)
+			{
+				perror("CSocketItemEx::SendBatch");
+				break;
+			}
+			m += r;
+		}
+	}
+
+	if (m <= 0)
+		return 0;
+	for (k = 0; k < m; k++)
+		batch.slots[k].skb->timeSent = t;
+	tRecentSend = t;
+#if defined(TRACE) && (TRACE & TRACE_PACKET)
+	printf_s("\n#%u(Near end's ALFID): %d packets sent in batch.\n", fidPair.source, m);
+#endif
+	return m;
+}
+
 #endif
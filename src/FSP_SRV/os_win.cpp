@@ -47,6 +47,11 @@
 	ReportWSAError(s)\
 	)
 
+// Capacity of the interface address list queried, independent of the session limit
+#ifndef MAX_LISTED_ADDRESSES
+# define MAX_LISTED_ADDRESSES	(256 * MAX_PHY_INTERFACES)
+#endif
+
 // The handle of the global timer wheel timer queue
 static HANDLE	globalTimerQueue;
 
@@ -257,28 +262,18 @@ void CLowerInterface::Destroy()
 // even if it has been put to promiscuous mode
 inline void CLowerInterface::MakeALFIDsPool()
 {
-	register int k;
-	ALFID_T id;
-	//
-	// refuse to continue if the random number generator doesn't work
+#ifndef OVER_UDP_IPv4
+	// All of the session items are allocated in advance so that their ALFIDs are known
+	// It is called before the receiver thread is started so that the TLB needn't be locked
+	// See also LearnAddresses, operator::[], AllocItem, FreeItem
+	while (AllocSlab())
+		continue;
 	for (register int i = 0; i < MAX_CONNECTION_NUM; i++)
 	{
-		// Here 'id', as a random number, is generated as a 32-bit integer in network byte order
-		// while 'k' is a simple hash number derived in host byte order
-		// See also LearnAddresses, operator::[], AllocItem, FreeItem
-		do
-		{
-			do
-			{
-				rand_w32(&id, 1);
-				k = be32toh(id);
-			} while (k <= LAST_WELL_KNOWN_ALFID);
-			//
-			k &= MAX_CONNECTION_NUM - 1;
-		} while (tlbSockets[k]->fidPair.source != 0);
-		//
-		tlbSockets[k]->fidPair.source = preallocatedIDs[i] = id;
+		CSocketItemEx *p = ItemAt(i);
+		preallocatedIDs[i] = (p != NULL ? p->fidPair.source : 0);
 	}
+#endif
 }
 
 
@@ -640,13 +635,13 @@ inline bool CLowerInterface::LearnAddresses()
 {
 	struct {
 	    INT iAddressCount;
-		SOCKET_ADDRESS Address[MAX_CONNECTION_NUM * MAX_PHY_INTERFACES];
-		ALIGN(16) SOCKADDR placeholder[MAX_CONNECTION_NUM * MAX_PHY_INTERFACES];
+		SOCKET_ADDRESS Address[MAX_LISTED_ADDRESSES];
+		ALIGN(16) SOCKADDR placeholder[MAX_LISTED_ADDRESSES];
 	} listAddress;
 
 	DWORD n = 0;
 	int r = 0;
-	listAddress.iAddressCount = MAX_CONNECTION_NUM * MAX_PHY_INTERFACES;
+	listAddress.iAddressCount = MAX_LISTED_ADDRESSES;
 	if((r = WSAIoctl(sdSend, SIO_ADDRESS_LIST_QUERY, NULL, 0, & listAddress, sizeof(listAddress), & n, NULL, NULL)) != 0)
 	{
 		REPORT_WSAERROR_TRACE("Cannot query list of addresses");
@@ -847,7 +842,7 @@ inline void CLowerInterface::ProcessRemotePacket()
 // Remark
 //	It is safely assume that remote and near address are of the same address family
 //	and the remote address is kept till this function returns, by mutex-locking
-int LOCALAPI CLowerInterface::SendBack(char * buf, int len)
+int LOCALAPI CPacketReceiver::SendBack(char * buf, int len)
 {
 	DWORD n = 0;
 	iovec[1].buf = buf;
@@ -860,17 +855,17 @@ int LOCALAPI CLowerInterface::SendBack(char * buf, int len)
 	printf_s("\nSend back to peer socket address:\n");
 	DumpNetworkUInt16((uint16_t *)& addrFrom, sizeof(SOCKADDR_IN6) / 2);
 #endif
-	int r = WSASendTo(sdSend
+	int r = WSASendTo(CLowerInterface::Singleton.sdSend
 		, iovec, 2, &n
 		, 0
 		, (const sockaddr *)& addrFrom, mesgInfo.namelen
 		, NULL, NULL);
 #else
-	int r = WSASendMsg(sdSend, &mesgInfo, 0, &n, NULL, NULL);
+	int r = WSASendMsg(CLowerInterface::Singleton.sdSend, &mesgInfo, 0, &n, NULL, NULL);
 #endif
 	if (r != 0)
 	{
-		ReportWSAError("CLowerInterface::SendBack");
+		ReportWSAError("CPacketReceiver::SendBack");
 		return 0;
 	}
 #if defined(TRACE) && (TRACE & TRACE_PACKET)
@@ -969,12 +964,27 @@ extern "C" timestamp_t NowUTC()
 
 
 
+// Return the number of microseconds elapsed since some fixed point of time, by the performance counter
+extern "C" timestamp_t NowMonotonic()
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER t;
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&t);
+	return timestamp_t(t.QuadPart / frequency.QuadPart) * 1000000
+		+ timestamp_t(t.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+
+
 // Given
 //	uint32_t		number of millisecond delayed to trigger the timer
 // Return
 //	true if the timer was set, false if it failed.
 bool LOCALAPI CSocketItemEx::ReplaceTimer(uint32_t period)
 {
+	timerParked = 0;
 	return (
 		(timer == NULL 
 		 &&	::CreateTimerQueueTimer(& timer, globalTimerQueue
@@ -1182,17 +1192,16 @@ static DWORD WINAPI WaitULACommand(LPVOID p)
 //	false if it failed
 bool CSocketSrvTLB::AddULAChannel(HANDLE sd)
 {
-	unsigned long bitIndex;
 	AcquireMutex();
 
-	octet isNonZero = _BitScanForward(&bitIndex, forestFreeFlags);
-	if (!isNonZero)
+	SProcessRoot *pRoot = AllocProcessRoot();
+	if (pRoot == NULL)
 	{
 		ReleaseMutex();
 		return false;
 	}
 
-	SProcessRoot& r = forestULA[bitIndex];
+	SProcessRoot& r = *pRoot;
 	r.latest = NULL;
 	r.sdPipe = sd;
 	r.hThreadWait = CreateThread(NULL // LPSECURITY_ATTRIBUTES, get a default security descriptor inherited
@@ -1204,11 +1213,10 @@ bool CSocketSrvTLB::AddULAChannel(HANDLE sd)
 
 	if (r.hThreadWait == NULL)
 	{
+		FreeProcessRoot(pRoot);
 		ReleaseMutex();
 		return false;
 	}
-	r.index = bitIndex;
-	forestFreeFlags ^= 1 << bitIndex;
 
 	ReleaseMutex();
 	return true;
@@ -1436,7 +1444,7 @@ int CSocketItemEx::SendPacket(register u32 n1, ScatteredSendBuffers s)
 	printf_s("Target address:\n\t");
 	DumpNetworkUInt16((uint16_t *)wsaMsg.name, wsaMsg.namelen / 2);
 # endif
-	timestamp_t t = NowUTC();
+	timestamp_t t = NowMonotonic();
 	r = WSASendMsg(CLowerInterface::Singleton.sdSend, & wsaMsg, 0, &n, NULL, NULL);
 #else
 	s.scattered[0].buf = (CHAR *)& fidPair;
@@ -1446,7 +1454,7 @@ int CSocketItemEx::SendPacket(register u32 n1, ScatteredSendBuffers s)
 	printf_s("\nPeer socket address:\n");
 	DumpNetworkUInt16((uint16_t *)sockAddrTo, sizeof(SOCKADDR_IN6) / 2);
 #endif
-	timestamp_t t = NowUTC();
+	timestamp_t t = NowMonotonic();
 	r = WSASendTo(CLowerInterface::Singleton.sdSend
 		, s.scattered, n1
 		, &n
@@ -1471,6 +1479,37 @@ int CSocketItemEx::SendPacket(register u32 n1, ScatteredSendBuffers s)
 
 
 
+// Given
+//	STransmitBatch &	the transmit batch to flush
+// Do
+//	Seal the packets staged in the batch, then send them one by one.
+//	Scalable batched sending is not exploited in Windows yet
+// Return
+//	Number of packets sent. The batch is emptied anyway
+int CSocketItemEx::SendBatch(STransmitBatch &batch)
+{
+	if (!SealBatch(batch))
+		return 0;
+
+	const int n = batch.count;
+	int m = 0;
+	batch.count = 0;
+	for (register int k = 0; k < n; k++)
+	{
+		STransmitSlot &slot = batch.slots[k];
+		int r = slot.len > 0
+			? SendPacket(2, ScatteredSendBuffers(&slot.hdr, sizeof(FSP_NormalPacketHeader), slot.payload, slot.len))
+			: SendPacket(1, ScatteredSendBuffers(&slot.hdr, sizeof(FSP_NormalPacketHeader)));
+		if (r <= 0)
+			break;
+		slot.skb->timeSent = tRecentSend;
+		m++;
+	}
+	return m;
+}
+
+
+
 /**
  *	Manipulation of the host firewall
  *	Return
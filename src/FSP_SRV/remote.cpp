@@ -64,7 +64,7 @@ struct _CookieMaterial
 // The handler's main body to accept and process one particular remote packet
 // See also SendPacket
 // From the receiver's point of view the local fiber id was stored in the peer fiber id field of the received packet
-int CLowerInterface::ProcessReceived()
+int CPacketReceiver::ProcessReceived()
 {
 	// From the receiver's point of view the local fiber id was stored in the peer fiber id field of the received packet
 #ifdef OVER_UDP_IPv4
@@ -90,13 +90,14 @@ int CLowerInterface::ProcessReceived()
 	switch (opCode)
 	{
 	case INIT_CONNECT:
-		OnGetInitConnect();
+		if (AdmitInitConnect())
+			OnGetInitConnect();
 		break;
 	case ACK_INIT_CONNECT:
 		pSocket = MapSocket();
 		if (pSocket == NULL || !pSocket->IsInUse())
 			break;
-		pSocket->OnInitConnectAck(FSP_OperationHeader<FSP_Challenge>());
+		pSocket->OnInitConnectAck(FSP_OperationHeader<FSP_Challenge>(), *this);
 		break;
 	case CONNECT_REQUEST:
 		OnGetConnectRequest();
@@ -163,10 +164,9 @@ int CLowerInterface::ProcessReceived()
 //  Usually an FSP node allocate a new ALFID randomly and respond with the new ALFID, not the listening ALFID.
 //	Collision might occur o allocating the new ALFID in a high-load responder, but the possibility is low enough.
 //	For a low-power IoT device the listener may accept only one connection request, and thus respond with the listening ALFID.
-// TODO: there should be some connection initiation throttle control in RandALFID
-// TODO: UNRESOLVED! admission-control here?
+//	It is only called for the INIT_CONNECT admitted, see also AdmitInitConnect
 // TODO: UNRESOLVED! For FSP over IPv6, attach responder's resource reservation...
-void CLowerInterface::OnGetInitConnect()
+void CPacketReceiver::OnGetInitConnect()
 {
 	// Silently discard connection request to black hole, and avoid attacks alike 'port scan'
 	CSocketItemEx *pSocket = MapSocket();
@@ -201,10 +201,10 @@ void CLowerInterface::OnGetInitConnect()
 		// by default exploit the first interface configured
 		if (*(uint64_t*)hintAddr == 0)
 		{
-			memcpy(hintAddr, &addresses[0].sin6_addr, 12);
+			memcpy(hintAddr, &CLowerInterface::Singleton.addresses[0].sin6_addr, 12);
 			*(ALFID_T*)((octet*)hintAddr + 12) = fiberID;
 		}
-		else if(SetEffectiveALFID(hintAddr, fiberID))
+		else if(CLowerInterface::Singleton.SetEffectiveALFID(hintAddr, fiberID))
 		{
 			REPORT_ERROR_ON_TRACE();
 			goto l_return;
@@ -251,7 +251,7 @@ l_return:
 // Remark
 //	It does not matter whether idListener == GetRemoteFiberID()
 // TODO: UNRESOLVED!? get resource reservation requirement from IPv6 extension header
-void CSocketItemEx::OnInitConnectAck(FSP_Challenge* pkt)
+void CSocketItemEx::OnInitConnectAck(FSP_Challenge* pkt, const CPacketReceiver& receipt)
 {
 	if (!WaitUseMutex())
 		return;
@@ -269,9 +269,9 @@ void CSocketItemEx::OnInitConnectAck(FSP_Challenge* pkt)
 	memset(initState.allowedPrefixes, 0, sizeof(initState.allowedPrefixes));
 	memcpy(initState.allowedPrefixes, pkt->params.subnets, sizeof(pkt->params.subnets));
 
-	SetRemoteFiberID(initState.idRemote = CLowerInterface::Singleton.GetRemoteFiberID());
+	SetRemoteFiberID(initState.idRemote = receipt.GetRemoteFiberID());
 	//^ set to new peer fiber ID: to support multi-home it is necessary even for IPv6
-	SetNearEndInfo(CLowerInterface::Singleton.nearInfo);
+	SetNearEndInfo(receipt.nearInfo);
 
 	initState.timeDelta = pkt->timeDelta;
 	initState.cookie = pkt->cookie;
@@ -300,7 +300,7 @@ l_return:
 //		-->{new context}CHALLENGING-->[Send ACK_CONNECT_REQ]
 //	|-->[{return}Reject]-->[Send RESET]{abort creating new context}
 // UNRESOLVED!? Should queuing the request in case of single thread congestion because of WaitUseMutex
-void CLowerInterface::OnGetConnectRequest()
+void CPacketReceiver::OnGetConnectRequest()
 {
 	FSP_ConnectRequest *q = FSP_OperationHeader<FSP_ConnectRequest>();
 	CSocketItemEx *pSocket = MapSocket();
@@ -325,13 +325,10 @@ void CLowerInterface::OnGetConnectRequest()
 	}
 
 	// Silently discard the request onto illegal or non-listening socket
-	pSocket = (*this)[q->params.idListener];	// a dialect of MapSocket
+	pSocket = CLowerInterface::Singleton[q->params.idListener];	// a dialect of MapSocket
 	if (pSocket == NULL || !pSocket->IsPassive())
 		return;
 
-	if (!pSocket->WaitUseMutex())
-		return;
-
 	// cf. OnInitConnectAck() and SocketItemEx::AffirmConnect()
 	ALFID_T fiberID = GetLocalFiberID();
 	struct _CookieMaterial cm;
@@ -340,17 +337,20 @@ void CLowerInterface::OnGetConnectRequest()
 	cm.idListener = q->params.idListener;
 	// Attention please! Granularity of the time delta can be designated arbitrarily by the responder,
 	// provided it is consistent between OnGetInitConnect and OnGetConnectRequest
-	// UNRESOLVED! TODO: search the cookie blacklist at first
+	// The cookie is validated before the listener is locked, so that a forged one costs no more than a keyed hash
 	timestamp_t tRecvInit = be64toh(q->_init.timeStamp) + q->timeDelta;
-	if (q->cookie != CalculateCookie(&cm, sizeof(cm), tRecvInit))
+	if (!ValidateCookie(&cm, sizeof(cm), tRecvInit, q->cookie))
 	{
 #ifdef TRACE
-		printf_s("UNRESOLVED! TODO: put the cookie into the blacklist to fight against DDoS attack!?\n");
+		printf_s("Forged, expired or replayed cookie of CONNECT_REQUEST discarded\n");
 #endif
-		pSocket->SetMutexFree();
+		perfCounts.countCookieRejected++;
 		return;		// the packet has been updated and should be discarded
 	}
 
+	if (!pSocket->WaitUseMutex())
+		return;
+
 	// Simply ignore the duplicated request
 	SItemBackLog backlogItem;
 	backlogItem.idRemote = GetRemoteFiberID();
@@ -358,7 +358,7 @@ void CLowerInterface::OnGetConnectRequest()
 	if(pSocket->pControlBlock->backLog.Has(backlogItem))
 		goto l_return;
 
-	newItem = AllocItemCommit(pSocket->rootULA, GetLocalFiberID());
+	newItem = CLowerInterface::Singleton.AllocItemCommit(pSocket->rootULA, GetLocalFiberID());
 	if (newItem == NULL)
 		goto l_return;
 
@@ -421,9 +421,11 @@ void CLowerInterface::OnGetConnectRequest()
 		printf_s("Cannot put the connection request into the backlog of the listening session's control block.\n");
 #endif
 		newItem->RemoveTimers();
-		FreeItem(newItem);
+		CLowerInterface::Singleton.FreeItem(newItem);
 		goto l_return;
 	}
+	// Only a request that is committed to the backlog makes its cookie count as used
+	RecordCookie(tRecvInit, q->cookie);
 	pSocket->Notify(FSP_NotifyAccepting);
 
 l_return:
@@ -1017,7 +1019,7 @@ void CSocketItemEx::OnGetKeepAlive()
 #if (TRACE & (TRACE_HEARTBEAT | TRACE_PACKET | TRACE_SLIDEWIN))
 	printf_s("Fiber#%u: SNACK packet with %d gap(s) advertised received\n", fidPair.source, n);
 #endif
-	tLastRecvAny = NowUTC();
+	tLastRecvAny = NowInLoop();
 	if (acknowledgible)
 	{
 		int r = AcceptSNACK(ackSeqNo, pSNACK->gaps, n);
@@ -1222,7 +1224,7 @@ void CSocketItemEx::OnAckFlush()
 	}
 #endif
 	AcceptSNACK(ackSeqNo, NULL, 0);
-	tLastRecvAny = NowUTC();
+	tLastRecvAny = NowInLoop();
 
 	if (InState(PRE_CLOSED))
 	{
@@ -1401,7 +1403,7 @@ void CSocketItemEx::OnGetMultiply()
 	newItem->idParent = idParent;
 	CLowerInterface::Singleton.PutToRemoteTLB(newItem);
 
-	newItem->tLastRecv = newItem->tLastRecvAny = tLastRecvAny = NowUTC();
+	newItem->tLastRecv = newItem->tLastRecvAny = tLastRecvAny = NowInLoop();
 	newItem->snLastRecv = pktSeqNo;
 
 	// See also InitiateMultiply, setting of nextOOBSN
@@ -1492,7 +1494,7 @@ int CSocketItemEx::PlacePayload()
 		memcpy(ubuf, (octet*)pHdr + be16toh(pHdr->hs.offset), len);
 	}
 	// Or else might be zero for ACK_START or MULTIPLY packet
-	skb->timeRecv = tLastRecv = tLastRecvAny = NowUTC();
+	skb->timeRecv = tLastRecv = tLastRecvAny = NowInLoop();
 	snLastRecv = pktSeqNo;
 
 	skb->version = pHdr->hs.major;
@@ -33,29 +33,163 @@
 
 
 // Translation-Look-aside-Buffer of the Service Sockets, the constructor
+// Session items are not allocated until they are requested, see also AllocSlab
 CSocketSrvTLB::CSocketSrvTLB()
 {
 	memset(listenerSlots, 0, sizeof(listenerSlots));
-	memset(itemStorage, 0, sizeof(itemStorage));
-	memset(tlbSockets, 0, sizeof(tlbSockets));
-	memset(tlbSocketsByRemote, 0, sizeof(tlbSocketsByRemote));
+	memset((void *)slabs, 0, sizeof(slabs));
+	memset((void *)tlbSocketsByRemote, 0, sizeof(tlbSocketsByRemote));
 	//^ assert(NULL == 0)
-	headFreeSID = & itemStorage[0];
-	tailFreeSID = & itemStorage[MAX_CONNECTION_NUM - 1];
+	countSlabs = 0;
+	versionRemoteTLB = 0;
+	headFreeSID = tailFreeSID = NULL;
+	headLRUitem = tailLRUitem = NULL;
 
-	register CSocketItemEx *p = headFreeSID;
-	register int i = 0;
-	while(i < MAX_CONNECTION_NUM)
+	memset(forestULA, 0, sizeof(forestULA));
+	countForestSlabs = 0;
+	countULAProcesses = 0;
+	headFreeRoot = NULL;
+
+	InitMutex();
+}
+
+
+
+CSocketSrvTLB::~CSocketSrvTLB()
+{
+	for (register int i = 0; i < countSlabs; i++)
+		free(slabs[i]);
+	for (register int i = 0; i < countForestSlabs; i++)
+		free(forestULA[i]);
+}
+
+
+
+// Given
+//	uint32_t	the random word
+//	uint32_t	the index of the session item
+// Return
+//	The ALFID, in network byte order, whose last bits in host byte order are the index
+//	and whose other bits are taken from the random word
+static ALFID_T MakeRandomALFID(uint32_t v, uint32_t k)
+{
+	v = (v & ~(uint32_t)(MAX_CONNECTION_NUM - 1)) | k;
+	while (v <= LAST_WELL_KNOWN_ALFID)
+	{
+		rand_w32(&v, 1);
+		v = (v & ~(uint32_t)(MAX_CONNECTION_NUM - 1)) | k;
+	}
+	return htobe32(v);
+}
+
+
+
+// Do
+//	Give the session item a new random ALFID while keeping its index, so that a slot reused
+//	does not keep the same identity for the life of the process
+// Remark
+//	Assume having obtained the lock of TLB
+void CSocketSrvTLB::RerandomizeALFID(CSocketItemEx *p)
+{
+	uint32_t v;
+	rand_w32(&v, 1);
+	p->fidPair.source = MakeRandomALFID(v, be32toh(p->fidPair.source) & (MAX_CONNECTION_NUM - 1));
+}
+
+
+
+// Do
+//	Allocate a new slab of session items, assign each item a random ALFID whose last bits
+//	are the index of the item, and put the items onto the free list
+// Return
+//	true if the slab was allocated, false if the table is full or out of memory
+// Remark
+//	Assume having obtained the lock of TLB
+//	The hash algorithm MUST be kept synchronized with operator[]
+bool CSocketSrvTLB::AllocSlab()
+{
+	if (countSlabs >= MAX_CONNECTION_NUM / LLS_SESSION_SLAB_SIZE)
+		return false;
+
+	CSocketItemEx *slab = (CSocketItemEx *)calloc(LLS_SESSION_SLAB_SIZE, sizeof(CSocketItemEx));
+	if (slab == NULL)
+	{
+		REPORT_ERRMSG_ON_TRACE("Cannot allocate a new slab of socket items");
+		return false;
+	}
+
+	// The random generator yields at most one BLAKE2b digest, i.e. 64 octets, at a time
+	uint32_t random[64 / sizeof(uint32_t)];
+	uint32_t k = (uint32_t)countSlabs * LLS_SESSION_SLAB_SIZE;
+	for (register int i = 0; i < LLS_SESSION_SLAB_SIZE; i++, k++)
 	{
-		tlbSockets[i] = p;
-		tlbSockets[i++]->next = ++p;
+		register int j = i % (int)(sizeof(random) / sizeof(uint32_t));
+		if (j == 0)
+			rand_w32(random, (int)(sizeof(random) / sizeof(uint32_t)));
+		// Here 'id' is a 32-bit integer in network byte order while 'k' is in host byte order
+		slab[i].fidPair.source = MakeRandomALFID(random[j], k);
+		slab[i].next = (i + 1 < LLS_SESSION_SLAB_SIZE) ? &slab[i + 1] : NULL;
 		// other link pointers are already set to NULL
 	}
-	tailFreeSID->next = NULL;	// reset last 'next' pointer
 
-	forestFreeFlags = ~0;
+	if (tailFreeSID == NULL)
+	{
+		headFreeSID = slab;
+	}
+	else
+	{
+		tailFreeSID->next = slab;
+		slab->prev = tailFreeSID;
+	}
+	tailFreeSID = &slab[LLS_SESSION_SLAB_SIZE - 1];
 
-	InitMutex();
+	// Publish the slab only after the items are initialized, for the lock-free readers
+	(void)_InterlockedExchangePointer((PVOID *)&slabs[countSlabs], slab);
+	countSlabs++;
+	return true;
+}
+
+
+
+// Return
+//	The root of a new socket kinship tree for some ULA process, NULL if there are too many ULA processes
+// Remark
+//	Assume having obtained the lock of TLB
+//	A new slab of process roots is allocated if the free list is empty
+SProcessRoot * CSocketSrvTLB::AllocProcessRoot()
+{
+	if (headFreeRoot == NULL)
+	{
+		if (countForestSlabs >= LLS_MAX_ULA_PROCESSES / LLS_ULA_SLAB_SIZE)
+			return NULL;
+
+		SProcessRoot *slab = (SProcessRoot *)calloc(LLS_ULA_SLAB_SIZE, sizeof(SProcessRoot));
+		if (slab == NULL)
+		{
+			REPORT_ERRMSG_ON_TRACE("Cannot allocate a new slab of ULA process roots");
+			return NULL;
+		}
+		for (register int i = 0; i < LLS_ULA_SLAB_SIZE - 1; i++)
+			slab[i].nextFree = &slab[i + 1];
+		headFreeRoot = slab;
+		forestULA[countForestSlabs++] = slab;
+	}
+
+	SProcessRoot *p = headFreeRoot;
+	headFreeRoot = p->nextFree;
+	p->nextFree = NULL;
+	countULAProcesses++;
+	return p;
+}
+
+
+
+// Assume having obtained the lock of TLB
+void CSocketSrvTLB::FreeProcessRoot(SProcessRoot *p)
+{
+	p->nextFree = headFreeRoot;
+	headFreeRoot = p;
+	countULAProcesses--;
 }
 
 
@@ -66,6 +200,9 @@ ALFID_T CSocketSrvTLB::AllocItemReserve()
 {
 	AcquireMutex();
 
+	if (headFreeSID == NULL)
+		AllocSlab();
+
 	CSocketItemEx *p = headFreeSID;
 	if (p == NULL)
 	{
@@ -82,8 +219,9 @@ ALFID_T CSocketSrvTLB::AllocItemReserve()
 			ReleaseMutex();
 			return p->fidPair.source;
 		}
-		// The head of the LRU list is reused at first
+		// The head of the LRU list is reused at first, not to be committed by the stale reservation
 		headLRUitem = (CSocketItemEx*)p->next;
+		RerandomizeALFID(p);
 	}
 	else
 	{
@@ -117,7 +255,7 @@ CSocketItemEx * CSocketSrvTLB::AllocItemCommit(SProcessRoot *pULA, ALFID_T idPro
 	AcquireMutex();
 
 	CSocketItemEx *p = (*this)[idProactive];
-	if (p->IsInUse())
+	if (p == NULL || p->IsInUse())
 	{
 		ReleaseMutex();
 		return NULL;
@@ -159,7 +297,7 @@ CSocketItemEx* CSocketSrvTLB::AllocItem(SProcessRoot *pULA)
 	CSocketItemEx* p;
 	AcquireMutex();
 
-	if (headFreeSID == NULL)
+	if (headFreeSID == NULL && !AllocSlab())
 	{
 		ReleaseMutex();
 		return NULL;
@@ -210,12 +348,11 @@ CSocketItemEx * CSocketSrvTLB::AllocItem(ALFID_T idListener)
 
 	if (p != NULL)
 	{
-		unsigned m = sizeof(CSocketItem) + sizeof(SProcessRoot *) + sizeof(CSocketItemEx *) * 2;
+		unsigned m = sizeof(CSocketItem) + sizeof(SProcessRoot *) + sizeof(CSocketItemEx *);
 		bzero((octet *)p + m, sizeof(CSocketItemEx) - m);
-		p->markInUse = 1;
-		p->SetPassive();
 		p->fidPair.source = idListener;
-		PutToListenTLB(p, be32toh(idListener) & (MAX_CONNECTION_NUM - 1));
+		p->SetPassive();
+		p->markInUse = 1;
 	}
 
 	ReleaseMutex();
@@ -224,65 +361,6 @@ CSocketItemEx * CSocketSrvTLB::AllocItem(ALFID_T idListener)
 
 
 
-// Given
-//	CSocketItemEx *		pointer to the socket item to be inserted, might be updated
-//	int					the 'compressed' hash key for searching the socket item
-// Do
-//	Insert the given socket item into the translation-look-aside buffer of listening sockets
-// Return
-//	true if it succeeded. if the entry has been registered in the TLB, return true. 
-//	false if it failed, typically because some entry with the same ALFID has been registered
-bool CSocketSrvTLB::PutToListenTLB(CSocketItemEx *p1, int k)
-{
-	register CSocketItemEx *p = tlbSockets[k];
-	while (p != NULL)
-	{
-		if (p == p1)
-			return true;
-		if (p->fidPair.source == p1->fidPair.source)
-		{
-			REPORT_ERRMSG_ON_TRACE("collision found when putting socket into sockets TLB");
-			return false;
-		}
-		p = p->prevSame;
-	}
-	p1->prevSame = tlbSockets[k];
-	tlbSockets[k] = p1;
-	return true;
-}
-
-
-
-// Given
-//	CSocketItemEx *		pointer to the socket item to be detached
-// Do
-//	Detach the given socket item from the translation-look-aside buffer of listening sockets
-// Return
-//	true if the socket was registered in the TLB of listening sockets
-//	false if the TLB cache missed
-bool CSocketSrvTLB::DetachFromListenTLB(CSocketItemEx *p1)
-{
-	int k = be32toh(p1->fidPair.source) & (MAX_CONNECTION_NUM - 1);
-	CSocketItemEx *p = tlbSockets[k];
-	if (p == p1)
-	{
-		tlbSockets[k] = p->prevSame;
-		return true;
-	}
-	while (p != NULL)
-	{
-		if (p->prevSame == p1)
-		{
-			p->prevSame = p1->prevSame;
-			return true;
-		}
-		p = p->prevSame;
-	}
-	return false;
-}
-
-
-
 // Given
 //	CSocketItemEx	The pointer to the socket item to free
 // Do
@@ -294,16 +372,21 @@ void CSocketSrvTLB::FreeItemDonotCareLock(CSocketItemEx *p)
 	assert(p->rootULA != NULL);
 	p->RemoveULAKinship();
 
+	// The connect request pending is taken over exclusively, either here or by CompleteConnect
+	CommandNewSessionSrv *pConnect = (CommandNewSessionSrv *)_InterlockedExchangePointer((PVOID *)&p->pendingConnect, NULL);
+	if (pConnect != NULL)
+		ConnectRequestQueue::requests.Abandon(pConnect->index);
+
 	p->allFlags = 0;
+	p->lockWaiters.ClearStatistics();
 	p->Destroy();
 
+	// The listener slot is free as it is not in use any longer
 	if (p->IsPassive())
-	{
-		DetachFromListenTLB(p);
 		return;
-	}
 
 	DetachFromRemoteTLB(p);
+	RerandomizeALFID(p);
 	if (tailFreeSID == NULL)
 	{
 		headFreeSID = tailFreeSID = p;
@@ -336,7 +419,10 @@ bool CSocketSrvTLB::FreeULAChannel(SProcessRoot *pRoot)
 		p = p1;
 	}
 	assert(r.latest == NULL);
-	forestFreeFlags |= 1 << r.index;
+#ifdef __linux__
+	r.DetachCommandRing();
+#endif
+	FreeProcessRoot(&r);
 
 	ReleaseMutex();
 
@@ -350,18 +436,20 @@ bool CSocketSrvTLB::FreeULAChannel(SProcessRoot *pRoot)
 // Return
 //	The pointer to the socket item entry that matches the ID
 // Remark
-//	The hash algorithm MUST be kept synchronized with PoolingALFIDs
+//	The hash algorithm MUST be kept synchronized with AllocSlab
+//	It is lock-free. The socket item might be freed just after it is found,
+//	so the caller MUST check whether it is in use after obtaining the mutex of the socket
 CSocketItemEx * CSocketSrvTLB::operator[](ALFID_T id)
 {
-	register CSocketItemEx *p = tlbSockets[be32toh(id) & (MAX_CONNECTION_NUM-1)];
-	do
+	for (register int i = 0; i < MAX_LISTENER_NUM; i++)
 	{
-		if(p->fidPair.source == id)
-			return p;
-		p = p->prevSame;
-	} while(p != NULL);
-	//
-	return p;	// assert(p == NULL);
+		register CSocketItemEx &r = listenerSlots[i];
+		if (r.fidPair.source == id && r.IsInUse() && r.IsPassive())
+			return &r;
+	}
+
+	register CSocketItemEx *p = ItemAt(be32toh(id) & (MAX_CONNECTION_NUM - 1));
+	return (p != NULL && p->fidPair.source == id ? p : NULL);
 }
 
 
@@ -381,15 +469,16 @@ bool CSocketSrvTLB::PutToRemoteTLB(CMultiplyBacklogItem *pItem)
 	ALFID_T idParent = pItem->idParent;
 	assert(pItem->pControlBlock == NULL || pItem->idParent == pItem->pControlBlock->connectParams.idParent);
 	int k = be32toh(idRemote) & (MAX_CONNECTION_NUM-1);
+
+	AcquireMutex();
 	CSocketItemEx *p0 = tlbSocketsByRemote[k];
-	pItem->prevRemote = p0;	// might be NULL
-	//
 	for(register CSocketItemEx *p = p0; p != NULL; p = p->prevRemote)
 	{
 		if(p->fidPair.peer == idRemote
 		&& p->idParent == idParent
 		&& SOCKADDR_HOSTID(p->sockAddrTo) == remoteHostId)
 		{
+			ReleaseMutex();
 #ifdef TRACE
 			printf_s("\nFound collision when put to remote ALFID's translate look-aside buffer:\n"
 					 "Parent fiber#%u, remote fiber#%u\n", idParent, idRemote);
@@ -397,8 +486,12 @@ bool CSocketSrvTLB::PutToRemoteTLB(CMultiplyBacklogItem *pItem)
 			return false;
 		}
 	}
-	// If no collision found, good!
-	tlbSocketsByRemote[k] = pItem;
+	// If no collision found, good! Link the item before publishing it
+	pItem->prevRemote = p0;	// might be NULL
+	(void)_InterlockedIncrement((PLONG)&versionRemoteTLB);
+	(void)_InterlockedExchangePointer((PVOID *)&tlbSocketsByRemote[k], pItem);
+	(void)_InterlockedIncrement((PLONG)&versionRemoteTLB);
+	ReleaseMutex();
 	return true;
 }
 
@@ -411,20 +504,28 @@ bool CSocketSrvTLB::PutToRemoteTLB(CMultiplyBacklogItem *pItem)
 // Return
 //	true if the socket is registered in the remote TLB
 //	false if TLB cache missed
+// Remark
+//	Assume having obtained the lock of TLB
+//	The detached item keeps its link so that a reader walking through it is not lost,
+//	but the reader would retry as the version is changed
 bool CSocketSrvTLB::DetachFromRemoteTLB(CSocketItemEx *p1)
 {
 	int k = be32toh(p1->fidPair.peer) & (MAX_CONNECTION_NUM - 1);
 	CSocketItemEx* p = tlbSocketsByRemote[k];
 	if (p == p1)
 	{
-		tlbSocketsByRemote[k] = p->prevRemote;
+		(void)_InterlockedIncrement((PLONG)&versionRemoteTLB);
+		(void)_InterlockedExchangePointer((PVOID *)&tlbSocketsByRemote[k], p->prevRemote);
+		(void)_InterlockedIncrement((PLONG)&versionRemoteTLB);
 		return true;
 	}
 	while (p != NULL)
 	{
 		if (p->prevRemote == p1)
 		{
-			p->prevRemote = p1->prevRemote;
+			(void)_InterlockedIncrement((PLONG)&versionRemoteTLB);
+			(void)_InterlockedExchangePointer((PVOID *)&p->prevRemote, p1->prevRemote);
+			(void)_InterlockedIncrement((PLONG)&versionRemoteTLB);
 			return true;
 		}
 		p = p->prevRemote;
@@ -442,18 +543,25 @@ bool CSocketSrvTLB::DetachFromRemoteTLB(CSocketItemEx *p1)
 //	The pointer to the socket item entry that matches the given parameters
 CMultiplyBacklogItem * CSocketSrvTLB::FindByRemoteId(uint32_t remoteHostId, ALFID_T idRemote, ALFID_T idParent)
 {
-	register CSocketItemEx *p = tlbSocketsByRemote[be32toh(idRemote) & (MAX_CONNECTION_NUM-1)];
-	for (; p != NULL; p = p->prevRemote)
+	const int k = be32toh(idRemote) & (MAX_CONNECTION_NUM-1);
+	register CSocketItemEx *p;
+	uint32_t v0;
+	do
 	{
-		if(p->fidPair.peer == idRemote
-		&& p->idParent == idParent
-		&& SOCKADDR_HOSTID(p->sockAddrTo) == remoteHostId)
+		while ((v0 = LCKREAD(versionRemoteTLB)) & 1)
+			;	// some writer is modifying the chain, which is quick
+		for (p = tlbSocketsByRemote[k]; p != NULL; p = p->prevRemote)
 		{
-			return (CMultiplyBacklogItem *)p;
+			if(p->fidPair.peer == idRemote
+			&& p->idParent == idParent
+			&& SOCKADDR_HOSTID(p->sockAddrTo) == remoteHostId)
+			{
+				break;
+			}
 		}
-	}
+	} while (LCKREAD(versionRemoteTLB) != v0);
 	//
-	return (CMultiplyBacklogItem *)p;	// assert(p == NULL);
+	return (CMultiplyBacklogItem *)p;	// might be NULL
 }
 
 
@@ -461,24 +569,74 @@ CMultiplyBacklogItem * CSocketSrvTLB::FindByRemoteId(uint32_t remoteHostId, ALFI
 // Return true if succeeded in obtaining the mutex lock, false if waited but timed-out
 bool CSocketItemEx::WaitUseMutexAt(const char* funcName)
 {
-	uint64_t t0 = GetTickCount64();
-	bool lockedHere;
-	while (!(lockedHere = (_InterlockedCompareExchangePointer((PVOID*)&lockedAt, (PVOID)funcName, 0) == 0))
-		&& IsInUse() && !resetPending)
-	{
-		if (GetTickCount64() - t0 > MAX_LOCK_WAIT_ms)
-			return false;
-		Sleep(TIMER_SLICE_ms);	// if there is some thread that has exclusive access on the lock, wait patiently
-	}
+	const char *holder = (char *)_InterlockedCompareExchangePointer((PVOID*)&lockedAt, (PVOID)funcName, 0);
+	bool lockedHere = (holder == NULL);
+	if (lockedHere)
+		lockWaiters.OnAcquired();
+	else
+		lockedHere = WaitLockAt(funcName, holder);
 
 	if (!IsInUse() || resetPending)
 	{
 		if (lockedHere)
 			lockedAt = 0;
+		lockWaiters.Unpark();	// let the next contender give up as well
 		return false;
 	}
 
-	return true;
+	return lockedHere;
+}
+
+
+
+// Given
+//	const char *	the name of the function that is to lock the socket
+//	const char *	the name of the function that held the lock at the first try
+// Return
+//	true if the lock was obtained
+//	false if timed out, or the socket was reset or freed before the lock was obtained
+// Remark
+//	If some thread has exclusive access on the lock, spin for a while and then sleep patiently
+bool CSocketItemEx::WaitLockAt(const char *funcName, const char *holder)
+{
+	uint64_t t0 = GetTickCount64();
+	int nSpin = lockWaiters.SpinLimit();
+	register int i = 0;
+	bool parked = false;
+	while (IsInUse() && !resetPending)
+	{
+		bool lockedHere;
+		if (i < nSpin)
+		{
+			YieldProcessor();
+			i++;
+			lockedHere = (LCKREAD(lockedAt) == NULL
+				&& _InterlockedCompareExchangePointer((PVOID*)&lockedAt, (PVOID)funcName, 0) == 0);
+		}
+		else
+		{
+			uint64_t t = GetTickCount64() - t0;
+			if (t > MAX_LOCK_WAIT_ms)
+			{
+				lockWaiters.OnTimedOut();
+				return false;
+			}
+			uint32_t seen = lockWaiters.PrepareToPark();
+			lockedHere = (_InterlockedCompareExchangePointer((PVOID*)&lockedAt, (PVOID)funcName, 0) == 0);
+			if (!lockedHere)
+				lockWaiters.Park(seen, uint32_t(MAX_LOCK_WAIT_ms - t));
+			lockWaiters.LeavePark();
+			parked = true;
+		}
+		//
+		if (lockedHere)
+		{
+			lockWaiters.OnAcquired(i, parked);
+			lockContendedBy = holder;
+			return true;
+		}
+	}
+	return false;
 }
 
 
@@ -492,7 +650,13 @@ void CSocketItemEx::SetMutexFree()
 		SendReset();
 	if (resetPending)
 		Free();
+	// Wake up the parked heartbeat if the operation just done left something to send or to acknowledge
+	else if (timerParked && pControlBlock != NULL && lowState >= ESTABLISHED && !IsIdle())
+		RestartKeepAlive();
+	if (pControlBlock != NULL)
+		pControlBlock->perfCounts.lockLLS = lockWaiters.stat;
 	lockedAt = NULL;
+	lockWaiters.Unpark();
 	if (callbackTimerPending)
 		KeepAlive();
 }
@@ -625,7 +789,7 @@ void CSocketItemEx::AffirmConnect(const SConnectParam & initState, ALFID_T idLis
 		return;
 	}
 
-	SetFirstRTT(int64_t(NowUTC() - skb->timeSent));
+	SetFirstRTT(int64_t(NowMonotonic() - skb->timeSent));
 
 	pkt->_init.hs.opCode = CONNECT_REQUEST;
 	// The major version MUST be kept
@@ -818,7 +982,7 @@ void CMultiplyBacklogItem::RespondToMultiply()
 		Reset();
 		return;
 	}
-	// tRecentSend = NowUTC();	// in case it is timed-out prematurely
+	// tRecentSend = NowMonotonic();	// in case it is timed-out prematurely
 	// The opCode field is overridden to PERSIST for sake of clearer transmit transaction management
 	skb->len = CopyOutPlainText(ubuf);
 	CopyOutFVO(skb);
@@ -884,7 +1048,7 @@ void CSocketItemEx::Accept()
 	{
 		// Timer has been set when the socket slot was prepared on getting MULTIPLY
 		((CMultiplyBacklogItem *)this)->RespondToMultiply();
-		tSessionBegin = NowUTC();
+		tSessionBegin = NowMonotonic();
 	}
 	//
 	tPreviousLifeDetection = tPreviousTimeSlot = tSessionBegin;
@@ -954,6 +1118,10 @@ void CSocketItemEx::Free()
 	{
 #ifdef TRACE
 		printf_s("\nSCB of fiber#%u to be destroyed\n", fidPair.source);
+		if (lockWaiters.stat.countContended > 0)
+			printf_s("Lock acquired %" PRId64 " times, contended %" PRId64 ", slept %" PRId64 ", timed out %d; lastly contended by %s\n"
+				, lockWaiters.stat.countAcquired, lockWaiters.stat.countContended, lockWaiters.stat.countParked
+				, lockWaiters.stat.countTimedOut, lockContendedBy);
 #endif
 		lowState = NON_EXISTENT;	// Do not [SetState(NON_EXISTENT);] as the ULA might do further cleanup
 		RemoveTimers();
@@ -28,6 +28,8 @@
  */
 #include "fsp_srv.h"
 
+thread_local timestamp_t tLoopStart;	// See also SetLoopTime
+
 // For experimental purpose it is defined here. with exponential backup off, it is to retry 4 times
 #define RETRANSMISSION_LIMITS	15
 
@@ -44,15 +46,18 @@
 void CSocketItemEx::KeepAlive()
 {
 	const char *sLock = (char *)_InterlockedCompareExchangePointer((PVOID*)&lockedAt, (PVOID)__FUNCTION__, NULL);
-	timestamp_t t1 = NowUTC();
+	timestamp_t t1 = NowMonotonic();
 	// assume it takes little time to get system clock
 
 	callbackTimerPending = 0;
 	if (sLock != NULL)
 	{
 		callbackTimerPending = 1;
+		if (pControlBlock != NULL)
+			pControlBlock->perfCounts.countKeepAliveLockFail++;
 		return;
 	}
+	lockWaiters.OnAcquired();
 	// It might be redundant, but do little harm to do double checks
 	if (!IsInUse() || pControlBlock == NULL)
 	{
@@ -60,6 +65,15 @@ void CSocketItemEx::KeepAlive()
 		SetMutexFree();
 		return;
 	}
+	// The connection is initiated in the timer context once the peer name is resolved. See also CConnectResolver
+	CommandNewSessionSrv *pConnect = pendingConnect;
+	if (pConnect != NULL)
+	{
+		if (pConnect->resolved != 0)
+			CompleteConnect();
+		SetMutexFree();
+		return;
+	}
 
 	// Only need to synchronize the state in the 'cache' and the real state once because TCB is locked
 	if (lowState != NON_EXISTENT)
@@ -101,10 +115,12 @@ void CSocketItemEx::KeepAlive()
 			TIMED_OUT();
 		}
 		DoEventLoop();
+		AdjustHeartbeat();
 		break;
 	case CLOSABLE:
 		// CLOSABLE does NOT time out to CLOSED, and does NOT automatically recycled.
 		DoEventLoop();
+		AdjustHeartbeat();
 		break;
 	case SHUT_REQUESTED:
 		// As if CLOSED, only might have to send lazy ACK_FLUSH. See also OnGetRelease()
@@ -182,7 +198,7 @@ void CSocketItemEx::UpdateRTT(ControlBlock::seq_t snAck, uint32_t tDelay)
 		return;
 	}
 	
-	timestamp_t tNow = NowUTC();
+	timestamp_t tNow = NowMonotonic();
 	int64_t rtt64_us = int64_t(tNow - skb->timeSent - tDelay);
 	if (rtt64_us < 0)
 	{
@@ -280,7 +296,7 @@ bool CSocketItemEx::SendKeepAlive()
 	pSNACK->_h.length = htole16(uint16_t(len));
 	pSNACK->ackSeqNo = htole32(seq0);
 	pSNACK->latestSN = htole32(snLastRecv);
-	pSNACK->tLazyAck = htole32(uint32_t(NowUTC() - tLastRecv));
+	pSNACK->tLazyAck = htole32(uint32_t(NowMonotonic() - tLastRecv));
 #if BYTE_ORDER != LITTLE_ENDIAN
 	while (--n >= 0)
 	{
@@ -337,7 +353,7 @@ bool CSocketItemEx::SendAckFlush()
 	buf2.snack._h.length = SNACK_HEADER_SIZE_LE16;
 	buf2.snack.ackSeqNo = htole32(pControlBlock->recvWindowNextSN);
 	buf2.snack.latestSN = htole32(snLastRecv);
-	buf2.snack.tLazyAck = htole32(uint32_t(NowUTC() - tLastRecv));
+	buf2.snack.tLazyAck = htole32(uint32_t(NowMonotonic() - tLastRecv));
 #if (TRACE & (TRACE_HEARTBEAT | TRACE_PACKET | TRACE_SLIDEWIN))
 	printf_s("Acknowledge flush: local fiber#%u, peer's fiber#%u\n\tAcknowledged seq#%u\n"
 		, fidPair.source, fidPair.peer
@@ -452,9 +468,11 @@ int LOCALAPI CSocketItemEx::AcceptSNACK(ControlBlock::seq_t expectedSN, FSP_Sele
 // 1. Resend one packet (if any)
 // 2. Send a new packet (if any)
 // 3. Lazy acknowledgement and Mobile management
+// Packets emitted in the time slice are staged in the transmit batch and sent together
 // TODO: UNRESOLVED! milky payload SHOULD never be resent?
 void CSocketItemEx::DoEventLoop()
 {
+	STransmitBatch	batch;
 	// Used to loop header of DoResend
 	const int32_t	capacity = pControlBlock->sendBufferBlockN;
 	int32_t			i1 = pControlBlock->sendWindowHeadPos;
@@ -462,12 +480,15 @@ void CSocketItemEx::DoEventLoop()
 	ControlBlock::PFSP_SocketBuf p = pControlBlock->HeadSend() + i1;
 	ControlBlock::PFSP_SocketBuf skb;	// for send new packet.
 	ControlBlock::seq_t limitSN = pControlBlock->GetSendLimitSN();
-	timestamp_t		tNow = NowUTC();
+	timestamp_t		tNow = NowInLoop();
 	bool somePacketResent = false;
 	bool toStopEmitQ = (int32_t(pControlBlock->sendWindowNextSN - limitSN) >= 0);
 	bool toStopResend = (int32_t(seq1 - pControlBlock->sendWindowNextSN) >= 0);
 	bool toZWP;
 
+	// The loop time of this thread might be sampled before the time slot was updated by another thread
+	if (int64_t(tNow - tPreviousTimeSlot) < 0)
+		tNow = tPreviousTimeSlot;
 	if (!toStopEmitQ || !toStopResend)
 		quotaLeft += sendRate_Bpus * (tNow - tPreviousTimeSlot);
 
@@ -504,7 +525,7 @@ loop_start:
 #ifndef UNIT_TEST
 			if (quotaLeft - (p->len + sizeof(FSP_NormalPacketHeader)) < 0)
 				goto l_final;	// No quota left for send or resend
-			if (EmitWithICC(p, seq1) <= 0)
+			if (StageWithICC(batch, p, seq1) <= 0)
 				goto l_final;
 			quotaLeft -= (p->len + sizeof(FSP_NormalPacketHeader));
 			// For TCP-friendly congestion control, loss of packet means congestion encountered
@@ -551,7 +572,7 @@ l_step2:
 #ifndef UNIT_TEST
 		if (quotaLeft - (skb->len + sizeof(FSP_NormalPacketHeader)) < 0)
 			goto l_final;
-		if (EmitWithICC(skb, pControlBlock->sendWindowNextSN) <= 0)
+		if (StageWithICC(batch, skb, pControlBlock->sendWindowNextSN) <= 0)
 			goto l_final;
 		quotaLeft -= (skb->len + sizeof(FSP_NormalPacketHeader));
 #endif
@@ -568,7 +589,7 @@ l_step2:
 	toStopEmitQ = (int32_t(pControlBlock->sendWindowNextSN - limitSN) >= 0);
 
 l_post_step3:
-	if (int64_t(NowUTC() - tNow - TIMER_SLICE_ms * 1000) >= 0)
+	if (int64_t(NowMonotonic() - tNow - TIMER_SLICE_ms * 1000) >= 0)
 		goto l_final;
 
 	if (!toStopResend)
@@ -577,6 +598,9 @@ l_post_step3:
 		goto l_step2;
 
 l_final:
+	// Packets that failed to be flushed would be resent as if they were lost
+	if (batch.count > 0)
+		SendBatch(batch);
 	// Mobile management effectiveness analysis: TODO
 	// Finally, (Really!) Lazy acknowledgement
 	if ((delayAckPending || IsNearEndMoved() || mobileNoticeInFlight)
@@ -58,12 +58,18 @@ typedef uint32_t  u32;
 #	define _InterlockedExchange(a, b)		__atomic_exchange_n((a), (b), __ATOMIC_SEQ_CST)
 #	define _InterlockedExchangeAdd(a, b)	__atomic_fetch_add((a), (b), __ATOMIC_SEQ_CST)
 #	define _InterlockedIncrement(a)			__atomic_add_fetch((a), 1, __ATOMIC_SEQ_CST)
+#	define _InterlockedDecrement(a)			__atomic_sub_fetch((a), 1, __ATOMIC_SEQ_CST)
 #	define _InterlockedOr(a, b)				__atomic_fetch_or((a), (b), __ATOMIC_SEQ_CST)
 #	define _InterlockedExchangePointer(a, b) __atomic_exchange_n((a), (b), __ATOMIC_SEQ_CST)
 #	define _InterlockedCompareExchange(ptr, desired, expected)	\
 	({	__typeof__(*(ptr)) _b = (expected);	\
 		__atomic_compare_exchange_n((ptr), &_b, (desired), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); _b; })
 #	define _InterlockedCompareExchangePointer(a, b, c) _InterlockedCompareExchange((void **)(a), (void *)(b), (void *)(c))
+#	if defined(__i386__) || defined(__x86_64__)
+#	  define YieldProcessor()	__builtin_ia32_pause()
+#	else
+#	  define YieldProcessor()	__asm__ __volatile__("" ::: "memory")
+#	endif
 # endif
 
 # define _InterlockedExchange8(a, b)		__atomic_exchange_n((char *)(a), (char)(b), __ATOMIC_SEQ_CST)
@@ -0,0 +1,423 @@
+/*
+ * The cache of name resolution shared by the FSP lower-layer service and the tunnel/SOCKS gateway
+ *
+    Copyright (c) 2012, Jason Gao
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without modification,
+    are permitted provided that the following conditions are met:
+
+    - Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT,INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "NameCache.h"
+#include <string.h>
+#include <time.h>
+
+CNameCache	CNameCache::Singleton;
+
+CNameCache::CNameCache()
+{
+#if defined(__WINDOWS__)
+	InitializeSRWLock(&lock);
+	InitializeConditionVariable(&resolved);
+#else
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&resolved, NULL);
+#endif
+	ttl_ms = NAME_CACHE_TTL_ms;
+	negativeTTL_ms = NAME_CACHE_NEGATIVE_TTL_ms;
+	backend = ResolveByGetAddrInfo;
+	memset(&stat, 0, sizeof(stat));
+	for (register int i = 0; i < NAME_CACHE_SIZE; i++)
+		entries[i].resolving = 0;
+	Flush();
+}
+
+
+
+CNameCache::~CNameCache()
+{
+#if !defined(__WINDOWS__)
+	pthread_cond_destroy(&resolved);
+	pthread_mutex_destroy(&lock);
+#endif
+}
+
+
+
+// FNV-1a of the address family, the node name and the service name
+uint32_t CNameCache::Hash(const char *name, const char *service, int family)
+{
+	register uint32_t h = 2166136261U ^ (uint32_t)family;
+	h *= 16777619U;
+	for (register const char *s = name; *s != 0; s++)
+	{
+		h ^= (uint8_t)*s;
+		h *= 16777619U;
+	}
+	h *= 16777619U;	// the separator
+	for (register const char *s = service; *s != 0; s++)
+	{
+		h ^= (uint8_t)*s;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+
+
+uint64_t CNameCache::NowInMilliseconds()
+{
+#if defined(__WINDOWS__)
+	return GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+
+
+// Return the index of the entry of the given key, -1 if it is not found. Assume the lock has been acquired
+int CNameCache::Find(uint32_t h, const char *name, const char *service, int family)
+{
+	for (register int i = buckets[h & (NAME_CACHE_BUCKETS - 1)]; i >= 0; i = entries[i].nextInBucket)
+	{
+		register SEntry &e = entries[i];
+		if (e.hash == h && e.family == family && strcmp(e.name, name) == 0 && strcmp(e.service, service) == 0)
+			return i;
+	}
+	return -1;
+}
+
+
+
+// Detach the entry from its bucket and from the chain of recent use. Assume the lock has been acquired
+void CNameCache::Unlink(int i)
+{
+	SEntry &e = entries[i];
+	register int *p = &buckets[e.hash & (NAME_CACHE_BUCKETS - 1)];
+	while (*p != i)
+		p = &entries[*p].nextInBucket;
+	*p = e.nextInBucket;
+
+	if (e.isStatic)
+		return;	// a static entry is not chained in the order of recent use
+	if (e.prevLRU >= 0)
+		entries[e.prevLRU].nextLRU = e.nextLRU;
+	else
+		headLRU = e.nextLRU;
+	if (e.nextLRU >= 0)
+		entries[e.nextLRU].prevLRU = e.prevLRU;
+	else
+		tailLRU = e.prevLRU;
+}
+
+
+
+// Put the entry at the head of the chain of recent use. Assume the lock has been acquired
+void CNameCache::PutAtHead(int i)
+{
+	SEntry &e = entries[i];
+	if (e.isStatic || headLRU == i)
+		return;
+	if (e.prevLRU >= 0)
+	{
+		entries[e.prevLRU].nextLRU = e.nextLRU;
+		if (e.nextLRU >= 0)
+			entries[e.nextLRU].prevLRU = e.prevLRU;
+		else
+			tailLRU = e.prevLRU;
+	}
+	e.prevLRU = -1;
+	e.nextLRU = headLRU;
+	if (headLRU >= 0)
+		entries[headLRU].prevLRU = i;
+	else
+		tailLRU = i;
+	headLRU = i;
+}
+
+
+
+// Return
+//	The index of some free entry, evicting the least recently used one if there is no free entry,
+//	-1 if every entry is either static or in the middle of resolution
+// Remark
+//	Assume the lock has been acquired. The entry returned is detached
+int CNameCache::AllocEntry()
+{
+	register int i = headFree;
+	if (i >= 0)
+	{
+		headFree = entries[i].nextInBucket;
+		return i;
+	}
+
+	for (i = tailLRU; i >= 0 && entries[i].resolving; i = entries[i].prevLRU)
+		continue;
+	if (i < 0)
+		return -1;
+	Unlink(i);
+	stat.countEvicted++;
+	return i;
+}
+
+
+
+// Given
+//	const char *	the node name
+//	const char *	the service name, may be NULL
+//	int				the address family, AF_INET or AF_INET6
+//	const UNameCacheAddress *	the socket addresses of the name
+//	int				number of the addresses
+// Do
+//	Add the entry which is neither resolved by the backend, nor expires, nor is evicted
+// Return
+//	true if the entry is added, false if the names are too long or the cache is full
+// Remark
+//	It is meant to pin some names, say, those of the fixed tunnel servers, and to test offline
+bool CNameCache::AddStaticEntry(const char *name, const char *service, int family, const UNameCacheAddress *addresses, int n)
+{
+	if (service == NULL)
+		service = "";
+	if (strlen(name) >= NAME_CACHE_MAX_NAME || strlen(service) >= NAME_CACHE_MAX_SERVICE
+	 || n <= 0 || n > NAME_CACHE_MAX_ADDRESSES)
+	{
+		return false;
+	}
+
+	uint32_t h = Hash(name, service, family);
+	Lock();
+	int i = Find(h, name, service, family);
+	if (i >= 0 && entries[i].resolving)
+	{
+		Unlock();
+		return false;
+	}
+	if (i >= 0)
+		Unlink(i);
+	else if ((i = AllocEntry()) < 0)
+	{
+		Unlock();
+		return false;
+	}
+
+	SEntry &e = entries[i];
+	e.hash = h;
+	e.family = family;
+	strcpy(e.name, name);
+	strcpy(e.service, service);
+	memcpy(e.addresses, addresses, sizeof(UNameCacheAddress) * n);
+	e.count = n;
+	e.resolving = 0;
+	e.isStatic = 1;
+	e.nextInBucket = buckets[h & (NAME_CACHE_BUCKETS - 1)];
+	buckets[h & (NAME_CACHE_BUCKETS - 1)] = i;
+	Unlock();
+	return true;
+}
+
+
+
+// Given
+//	const char *		the node name
+//	const char *		the service name, may be NULL
+//	int					the address family, AF_INET or AF_INET6
+//	UNameCacheAddress *	the buffer to hold the socket addresses resolved
+//	int					the capacity of the buffer
+// Return
+//	Number of addresses resolved, negative if error
+// Remark
+//	The backend is called without the lock held, and only by the first of the concurrent lookups of the same name
+int CNameCache::Resolve(const char *name, const char *service, int family, UNameCacheAddress *addresses, int capacity)
+{
+	if (service == NULL)
+		service = "";
+	if (strlen(name) >= NAME_CACHE_MAX_NAME || strlen(service) >= NAME_CACHE_MAX_SERVICE)
+		return backend(name, *service != 0 ? service : NULL, family, addresses, capacity);
+
+	uint32_t h = Hash(name, service, family);
+	bool coalesced = false;
+	int i, n;
+	Lock();
+	for (;;)
+	{
+		i = Find(h, name, service, family);
+		if (i < 0)
+			break;
+		SEntry &e = entries[i];
+		if (e.resolving)
+		{
+			if (!coalesced)
+				stat.countCoalesced++;
+			coalesced = true;
+			WaitResolved();
+			continue;	// the entry might have been evicted and reused meanwhile
+		}
+		if (!e.isStatic && int64_t(NowInMilliseconds() - e.tExpire_ms) >= 0)
+			break;
+
+		n = e.count;
+		if (n > 0)
+		{
+			stat.countHit++;
+			if (n > capacity)
+				n = capacity;
+			memcpy(addresses, e.addresses, sizeof(UNameCacheAddress) * n);
+		}
+		else
+		{
+			stat.countNegativeHit++;
+		}
+		PutAtHead(i);
+		Unlock();
+		return n;
+	}
+
+	stat.countMiss++;
+	if (i < 0)
+	{
+		i = AllocEntry();
+		if (i < 0)
+		{
+			Unlock();
+			return backend(name, *service != 0 ? service : NULL, family, addresses, capacity);
+		}
+		SEntry &e = entries[i];
+		e.hash = h;
+		e.family = family;
+		strcpy(e.name, name);
+		strcpy(e.service, service);
+		e.isStatic = 0;
+		e.nextInBucket = buckets[h & (NAME_CACHE_BUCKETS - 1)];
+		buckets[h & (NAME_CACHE_BUCKETS - 1)] = i;
+		e.prevLRU = e.nextLRU = -1;
+		if (headLRU >= 0)
+		{
+			e.nextLRU = headLRU;
+			entries[headLRU].prevLRU = i;
+		}
+		else
+		{
+			tailLRU = i;
+		}
+		headLRU = i;
+	}
+	else
+	{
+		PutAtHead(i);	// the expired entry is refreshed in place
+	}
+	entries[i].resolving = 1;
+	Unlock();
+
+	UNameCacheAddress resolvedAddresses[NAME_CACHE_MAX_ADDRESSES];
+	n = backend(name, *service != 0 ? service : NULL, family, resolvedAddresses, NAME_CACHE_MAX_ADDRESSES);
+
+	Lock();
+	SEntry &e = entries[i];
+	e.count = n;
+	if (n > 0)
+		memcpy(e.addresses, resolvedAddresses, sizeof(UNameCacheAddress) * n);
+	e.tExpire_ms = NowInMilliseconds() + (n > 0 ? ttl_ms : negativeTTL_ms);
+	e.resolving = 0;
+	SignalResolved();
+	Unlock();
+
+	if (n > capacity)
+		n = capacity;
+	if (n > 0)
+		memcpy(addresses, resolvedAddresses, sizeof(UNameCacheAddress) * n);
+	return n;
+}
+
+
+
+// Remove all of the entries that are not being resolved, static or not
+void CNameCache::Flush()
+{
+	register int i;
+	Lock();
+	for (i = 0; i < NAME_CACHE_BUCKETS; i++)
+		buckets[i] = -1;
+	headLRU = tailLRU = headFree = -1;
+	for (i = NAME_CACHE_SIZE - 1; i >= 0; i--)
+	{
+		SEntry &e = entries[i];
+		if (e.resolving)
+		{
+			// keep it findable so that the lookups waiting for it are served
+			e.isStatic = 0;
+			e.nextInBucket = buckets[e.hash & (NAME_CACHE_BUCKETS - 1)];
+			buckets[e.hash & (NAME_CACHE_BUCKETS - 1)] = i;
+			e.prevLRU = -1;
+			e.nextLRU = headLRU;
+			if (headLRU >= 0)
+				entries[headLRU].prevLRU = i;
+			else
+				tailLRU = i;
+			headLRU = i;
+			continue;
+		}
+		e.nextInBucket = headFree;
+		headFree = i;
+	}
+	Unlock();
+}
+
+
+
+void CNameCache::GetStatistics(SNameCacheStatistics &r)
+{
+	Lock();
+	r = stat;
+	Unlock();
+}
+
+
+
+// The default backend which is a thin wrapper of getaddrinfo
+int CNameCache::ResolveByGetAddrInfo(const char *name, const char *service, int family, UNameCacheAddress *addresses, int capacity)
+{
+	struct addrinfo hints;
+	struct addrinfo *pAddrInfo;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = family;
+
+	// assume the project is compiled in ANSI/MBCS language mode
+	if (getaddrinfo(name, service, &hints, &pAddrInfo) != 0)
+		return -1;
+
+	register struct addrinfo *p = pAddrInfo;
+	int n = 0;
+	for (; p != NULL && n < capacity; p = p->ai_next)
+	{
+		if (p->ai_addrlen > sizeof(UNameCacheAddress))
+			continue;
+		memset(&addresses[n], 0, sizeof(UNameCacheAddress));
+		memcpy(&addresses[n], p->ai_addr, p->ai_addrlen);
+		n++;
+	}
+
+	if (pAddrInfo != NULL)
+		freeaddrinfo(pAddrInfo);
+	return n;
+}
@@ -0,0 +1,157 @@
+/*
+ * The cache of name resolution shared by the FSP lower-layer service and the tunnel/SOCKS gateway
+ *
+    Copyright (c) 2012, Jason Gao
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without modification,
+    are permitted provided that the following conditions are met:
+
+    - Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT,INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _FSP_NAME_CACHE_H_
+#define _FSP_NAME_CACHE_H_
+
+#include "Intrins.h"
+
+#if defined(__WINDOWS__)
+# include <winsock2.h>
+# include <ws2tcpip.h>
+#elif defined(__linux__) || defined(__CYGWIN__)
+# include <netdb.h>
+# include <netinet/in.h>
+# include <pthread.h>
+# include <sys/socket.h>
+#endif
+
+// maximum number of names cached, beyond which the least recently used one is evicted
+#ifndef NAME_CACHE_SIZE
+# define NAME_CACHE_SIZE			256
+#endif
+#define NAME_CACHE_BUCKETS			512		// must be some power of 2, better no less than NAME_CACHE_SIZE
+#define NAME_CACHE_MAX_ADDRESSES	4		// as MAX_PHY_INTERFACES
+#define NAME_CACHE_MAX_NAME			256		// RFC1035, maximum length of a full domain name is 255 octets
+#define NAME_CACHE_MAX_SERVICE		32
+// default life of the addresses resolved, and that of the failure to resolve
+#ifndef NAME_CACHE_TTL_ms
+# define NAME_CACHE_TTL_ms			60000
+#endif
+#ifndef NAME_CACHE_NEGATIVE_TTL_ms
+# define NAME_CACHE_NEGATIVE_TTL_ms	5000
+#endif
+
+union UNameCacheAddress
+{
+	struct sockaddr		sa;
+	struct sockaddr_in	ipv4;
+	struct sockaddr_in6	ipv6;
+};
+
+// The resolver backend
+// Given
+//	const char *		the node name
+//	const char *		the service name, may be NULL
+//	int					the address family, AF_INET or AF_INET6
+//	UNameCacheAddress *	the buffer to hold the socket addresses resolved
+//	int					the capacity of the buffer
+// Return
+//	Number of addresses resolved, negative if error
+typedef int (*NameResolverBackend)(const char *, const char *, int, UNameCacheAddress *, int);
+
+struct SNameCacheStatistics
+{
+	uint64_t	countHit;
+	uint64_t	countNegativeHit;	// the name was known to be unresolvable
+	uint64_t	countMiss;
+	uint64_t	countCoalesced;		// waited for the resolution of the same name that was in flight
+	uint64_t	countEvicted;
+};
+
+// A fixed-size hash table of the names resolved, chained in the order of recent use.
+// Lookups of the same name while it is being resolved wait for the only call of the backend.
+// Failure to resolve is cached as well, with a shorter life
+class CNameCache
+{
+	struct SEntry
+	{
+		int			nextInBucket;	// index of the next entry of the same bucket, -1 if it is the last
+		int			prevLRU;		// towards the most recently used
+		int			nextLRU;		// towards the least recently used
+		uint32_t	hash;
+		int			family;
+		int			count;			// number of the addresses, non-positive if the name could not be resolved
+		char		resolving;
+		char		isStatic;		// never expires nor is evicted
+		uint64_t	tExpire_ms;
+		char		name[NAME_CACHE_MAX_NAME];
+		char		service[NAME_CACHE_MAX_SERVICE];
+		UNameCacheAddress	addresses[NAME_CACHE_MAX_ADDRESSES];
+	};
+
+	SEntry		entries[NAME_CACHE_SIZE];
+	int			buckets[NAME_CACHE_BUCKETS];
+	int			headLRU;
+	int			tailLRU;
+	int			headFree;
+	uint32_t	ttl_ms;
+	uint32_t	negativeTTL_ms;
+	NameResolverBackend	backend;
+	SNameCacheStatistics	stat;
+#if defined(__WINDOWS__)
+	SRWLOCK		lock;
+	CONDITION_VARIABLE	resolved;
+	void Lock() { AcquireSRWLockExclusive(&lock); }
+	void Unlock() { ReleaseSRWLockExclusive(&lock); }
+	void WaitResolved() { SleepConditionVariableSRW(&resolved, &lock, INFINITE, 0); }
+	void SignalResolved() { WakeAllConditionVariable(&resolved); }
+#else
+	pthread_mutex_t	lock;
+	pthread_cond_t	resolved;
+	void Lock() { pthread_mutex_lock(&lock); }
+	void Unlock() { pthread_mutex_unlock(&lock); }
+	void WaitResolved() { pthread_cond_wait(&resolved, &lock); }
+	void SignalResolved() { pthread_cond_broadcast(&resolved); }
+#endif
+
+	static uint32_t Hash(const char *, const char *, int);
+	static uint64_t NowInMilliseconds();
+
+	int		Find(uint32_t, const char *, const char *, int);
+	int		AllocEntry();
+	void	Unlink(int);
+	void	PutAtHead(int);
+
+public:
+	static CNameCache	Singleton;
+
+	CNameCache();
+	~CNameCache();
+
+	void	SetBackend(NameResolverBackend p) { backend = (p != NULL ? p : ResolveByGetAddrInfo); }
+	void	SetTTL(uint32_t t, uint32_t tNegative) { ttl_ms = t; negativeTTL_ms = tNegative; }
+	bool	AddStaticEntry(const char *, const char *, int, const UNameCacheAddress *, int);
+	int		Resolve(const char *, const char *, int, UNameCacheAddress *, int);
+	void	Flush();
+	void	GetStatistics(SNameCacheStatistics &);
+
+	static int ResolveByGetAddrInfo(const char *, const char *, int, UNameCacheAddress *, int);
+};
+
+#endif
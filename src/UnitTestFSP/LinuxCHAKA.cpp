@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../Intrins.h"
+
+typedef uint64_t timestamp_t;	// as in FSP.h
+
+static timestamp_t NowUTC()
+{
+	timespec v;
+	clock_gettime(CLOCK_REALTIME, &v);
+	return timestamp_t(v.tv_sec) * 1000000 + v.tv_nsec / 1000;
+}
+
+#include "../Crypto/CHAKA.h"
+
+// Measure the complete CHAKA exchange, both the client's and the server's part, run locally,
+// and the cost of the underlying primitives of the backend selected against those of tweetnacl
+// Build: gcc -O2 -c ../Crypto/CryptoStub.c ../Crypto/curve25519.c ../Crypto/sha256.c ../Crypto/sha512.c ../Crypto/tweetnacl.c
+//	&& g++ -O2 -o LinuxCHAKA LinuxCHAKA.cpp CryptoStub.o curve25519.o sha256.o sha512.o tweetnacl.o
+// Usage: LinuxCHAKA [number of handshakes]
+
+extern "C"
+{
+	int crypto_box_curve25519xsalsa20poly1305_tweet_keypair(unsigned char *, unsigned char *);
+	int crypto_box_curve25519xsalsa20poly1305_tweet_beforenm(unsigned char *, const unsigned char *, const unsigned char *);
+	int crypto_hash_sha512_tweet(unsigned char *, const unsigned char *, unsigned long long);
+}
+
+#define REPEAT		3
+#define ID_LENGTH	SHA256_DIGEST_SIZE	// ChakaStreamcrypt works on a whole hash block at least
+
+static const char	*password = "Passw0rd";
+static const char	*clientId = "FSP_FlowTest@localhost";
+
+static double NowInNanoseconds()
+{
+	timespec v;
+	clock_gettime(CLOCK_MONOTONIC, &v);
+	return v.tv_sec * 1e9 + v.tv_nsec;
+}
+
+
+
+// Return true if both sides agree on the shared key and accept the responses of each other
+static bool OneHandshake(const octet serverPublicKey[CRYPTO_NACL_KEYBYTES], const octet serverPrivateKey[CRYPTO_NACL_KEYBYTES]
+	, const octet salt[CRYPTO_SALT_LENGTH], const octet passwordHash[CRYPTO_NACL_HASHBYTES])
+{
+	SCHAKAPublicInfo	client, server;
+	octet	clientPrivateKey[CRYPTO_NACL_KEYBYTES];
+	octet	clientSharedKey[CRYPTO_NACL_KEYBYTES];
+	octet	serverSharedKey[CRYPTO_NACL_KEYBYTES];
+	octet	idPlain[ID_LENGTH], idCipher[ID_LENGTH], idDecrypted[ID_LENGTH];
+	octet	clientInputHash[CRYPTO_NACL_HASHBYTES];
+	octet	response[CRYPTO_NACL_HASHBYTES];
+
+	// S --> C: the server's public key
+	memset(&client, 0, sizeof(client));
+	memcpy(client.peerPublicKey, serverPublicKey, CRYPTO_NACL_KEYBYTES);
+	// C --> S: the client's public key, timestamp and encrypted identity
+	InitCHAKAClient(client, clientPrivateKey);
+	CryptoNaClGetSharedSecret(clientSharedKey, client.peerPublicKey, clientPrivateKey);
+	memset(idPlain, 0, sizeof(idPlain));
+	strncpy((char *)idPlain, clientId, sizeof(idPlain) - 1);
+	ChakaStreamcrypt(idCipher, idPlain, ID_LENGTH, client.clientNonce, clientSharedKey);
+
+	memset(&server, 0, sizeof(server));
+	memcpy(server.peerPublicKey, client.selfPublicKey, CRYPTO_NACL_KEYBYTES);
+	server.clientNonce = client.clientNonce;
+	InitCHAKAServer(server, serverPublicKey);
+	CryptoNaClGetSharedSecret(serverSharedKey, server.peerPublicKey, serverPrivateKey);
+	ChakaStreamcrypt(idDecrypted, idCipher, ID_LENGTH, server.clientNonce, serverSharedKey);
+	if (memcmp(idDecrypted, idPlain, ID_LENGTH) != 0)
+		return false;
+
+	// S --> C: the salt, the server's timestamp and random, the server's response
+	if (!CHAKAChallengeByServer(server, client.peerResponse, passwordHash))
+		return false;
+	memcpy(client.salt, salt, CRYPTO_SALT_LENGTH);
+	client.serverNonce = server.serverNonce;
+	client.serverRandom = server.serverRandom;
+
+	// C --> S: the client's response
+	MakeSaltedPassword(clientInputHash, client.salt, password);
+	if (!CHAKAResponseByClient(client, clientInputHash, response))
+		return false;
+	memcpy(server.peerResponse, response, CRYPTO_NACL_HASHBYTES);
+
+	return CHAKAValidateByServer(server, passwordHash)
+		&& memcmp(clientSharedKey, serverSharedKey, CRYPTO_NACL_KEYBYTES) == 0;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	octet	serverPublicKey[CRYPTO_NACL_KEYBYTES], serverPrivateKey[CRYPTO_NACL_KEYBYTES];
+	octet	pk[CRYPTO_NACL_KEYBYTES], sk[CRYPTO_NACL_KEYBYTES], k[CRYPTO_NACL_KEYBYTES];
+	octet	salt[CRYPTO_SALT_LENGTH];
+	octet	passwordHash[CRYPTO_NACL_HASHBYTES];
+	octet	h[CRYPTO_NACL_HASHBYTES];
+	int		nRounds = (argc > 1 ? atoi(argv[1]) : 2000);
+	int		nFailed = 0;
+
+	if (nRounds <= 0)
+	{
+		printf("Usage: %s [number of handshakes]\n", argv[0]);
+		return -1;
+	}
+
+	// The backend selected should be interchangeable with tweetnacl
+	for (int i = 0; i < 100; i++)
+	{
+		octet k2[CRYPTO_NACL_KEYBYTES];
+		CryptoNaClKeyPair(pk, sk);
+		crypto_box_curve25519xsalsa20poly1305_tweet_keypair(serverPublicKey, serverPrivateKey);
+		CryptoNaClGetSharedSecret(k, serverPublicKey, sk);
+		crypto_box_curve25519xsalsa20poly1305_tweet_beforenm(k2, pk, serverPrivateKey);
+		if (memcmp(k, k2, sizeof(k)) != 0)
+			nFailed++;
+		CryptoNaClHash(h, k, i);
+		crypto_hash_sha512_tweet(passwordHash, k, i);
+		if (memcmp(h, passwordHash, sizeof(h)) != 0)
+			nFailed++;
+	}
+	printf("Consistency check with tweetnacl %s\n", nFailed == 0 ? "passed" : "FAILED!");
+
+	// The server's long-term key pair and the shadow of the password
+	CryptoNaClKeyPair(serverPublicKey, serverPrivateKey);
+	randombytes(salt, sizeof(salt));
+	MakeSaltedPassword(passwordHash, salt, password);
+
+	const int nPrimitive = nRounds / 4 + 1;
+	double	best[7] = { 1e30, 1e30, 1e30, 1e30, 1e30, 1e30, 1e30 };
+	for (int r = 0; r < REPEAT; r++)
+	{
+		double t[8];
+		t[0] = NowInNanoseconds();
+		for (int n = 0; n < nPrimitive; n++)
+			CryptoNaClKeyPair(pk, sk);
+		t[1] = NowInNanoseconds();
+		for (int n = 0; n < nPrimitive / 16 + 1; n++)
+			crypto_box_curve25519xsalsa20poly1305_tweet_keypair(pk, sk);
+		t[2] = NowInNanoseconds();
+		for (int n = 0; n < nPrimitive; n++)
+			CryptoNaClGetSharedSecret(k, serverPublicKey, sk);
+		t[3] = NowInNanoseconds();
+		for (int n = 0; n < nPrimitive / 16 + 1; n++)
+			crypto_box_curve25519xsalsa20poly1305_tweet_beforenm(k, serverPublicKey, sk);
+		t[4] = NowInNanoseconds();
+		for (int n = 0; n < nPrimitive * 16; n++)
+			CryptoNaClHash(h, passwordHash, sizeof(passwordHash));
+		t[5] = NowInNanoseconds();
+		for (int n = 0; n < nPrimitive * 16; n++)
+			crypto_hash_sha512_tweet(h, passwordHash, sizeof(passwordHash));
+		t[6] = NowInNanoseconds();
+		for (int n = 0; n < nRounds; n++)
+		{
+			if (!OneHandshake(serverPublicKey, serverPrivateKey, salt, passwordHash))
+				nFailed++;
+		}
+		t[7] = NowInNanoseconds();
+
+		const double counts[7] = { double(nPrimitive), double(nPrimitive / 16 + 1), double(nPrimitive)
+			, double(nPrimitive / 16 + 1), double(nPrimitive * 16), double(nPrimitive * 16), double(nRounds) };
+		for (int i = 0; i < 7; i++)
+		{
+			double d = (t[i + 1] - t[i]) / counts[i];
+			if (d < best[i])
+				best[i] = d;
+		}
+	}
+
+	printf("Primitive (us)\tSelected\ttweetnacl\n");
+	printf("Key pair\t%.1f\t\t%.1f\n", best[0] / 1000, best[1] / 1000);
+	printf("Shared secret\t%.1f\t\t%.1f\n", best[2] / 1000, best[3] / 1000);
+	printf("SHA-512(64B)\t%.2f\t\t%.2f\n", best[4] / 1000, best[5] / 1000);
+	printf("Complete CHAKA exchange: %.0f handshakes per second%s\n"
+		, 1e9 / best[6], nFailed == 0 ? "" : ", FAILED!");
+
+	return nFailed;
+}
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../Intrins.h"
+
+// Compare the throughput of the CRC64 implementations, and check that they are bit-identical
+// Build: gcc -O2 -c ../FSP_SRV/CRC64.c && g++ -O2 -o LinuxCRC64 LinuxCRC64.cpp CRC64.o
+// Usage: LinuxCRC64 [number of octets to check per length]
+//	The best of REPEAT runs is reported, in octets per nanosecond (i.e. GB/s)
+
+extern "C"
+{
+	uint64_t CalculateCRC64(uint64_t, const void *, size_t);
+	uint64_t CalculateCRC64_Bytewise(uint64_t, const void *, size_t);
+	uint64_t CalculateCRC64_Slicing8(uint64_t, const void *, size_t);
+	uint64_t CalculateCRC64_CLMUL(uint64_t, const void *, size_t);
+}
+
+#define REPEAT		5
+#define MAX_LENGTH	4096
+
+typedef uint64_t (*CRC64_FUNC)(uint64_t, const void *, size_t);
+
+static const CRC64_FUNC	funcs[] =
+	{ CalculateCRC64_Bytewise, CalculateCRC64_Slicing8, CalculateCRC64_CLMUL, CalculateCRC64 };
+// 24 octets is the fixed header of a KEEP_ALIVE or an acknowledgement, 1024 a full payload
+static const int	lengths[] = { 24, 64, 256, 1024, MAX_LENGTH };
+
+static octet	buffer[MAX_LENGTH + 8];
+
+static double NowInNanoseconds()
+{
+	timespec v;
+	clock_gettime(CLOCK_MONOTONIC, &v);
+	return v.tv_sec * 1e9 + v.tv_nsec;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	long	volume = (argc > 1 ? atol(argv[1]) : 64 * 1024 * 1024);
+	int		nFailed = 0;
+
+	if (volume <= 0)
+	{
+		printf("Usage: %s [number of octets to check per length]\n", argv[0]);
+		return -1;
+	}
+
+	srand((unsigned)time(NULL));
+	for (int i = 0; i < (int)sizeof(buffer); i++)
+		buffer[i] = (octet)rand();
+
+	// Every length from 0 to MAX_LENGTH, at every misalignment, with an arbitrary initial accumulator
+	for (int len = 0; len <= MAX_LENGTH; len++)
+	{
+		for (int k = 0; k < 8; k++)
+		{
+			uint64_t c = ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+			uint64_t r = CalculateCRC64_Bytewise(c, buffer + k, len);
+			for (int f = 1; f < (int)(sizeof(funcs) / sizeof(CRC64_FUNC)); f++)
+			{
+				if (funcs[f](c, buffer + k, len) != r)
+					nFailed++;
+			}
+		}
+	}
+	if (CalculateCRC64(0, "123456789", 9) != 0x6C40DF5F0B497347ULL)
+		nFailed++;
+	printf("Consistency check %s\n", nFailed == 0 ? "passed" : "FAILED!");
+
+	printf("Length\tBytewise\tSlicing-by-8\tCLMUL\t\tSelected (GB/s)\n");
+	for (int s = 0; s < (int)(sizeof(lengths) / sizeof(int)); s++)
+	{
+		const int len = lengths[s];
+		const long nRounds = volume / len;
+		double	best[4] = { 1e30, 1e30, 1e30, 1e30 };
+		uint64_t sink = 0;
+
+		for (int r = 0; r < REPEAT; r++)
+		{
+			for (int f = 0; f < (int)(sizeof(funcs) / sizeof(CRC64_FUNC)); f++)
+			{
+				double t0 = NowInNanoseconds();
+				for (long n = 0; n < nRounds; n++)
+					sink ^= funcs[f](sink, buffer, len);
+				double t = NowInNanoseconds() - t0;
+				if (t < best[f])
+					best[f] = t;
+			}
+		}
+
+		printf("%d\t%.3f\t\t%.3f\t\t%.3f\t\t%.3f%s\n", len
+			, double(nRounds) * len / best[0]
+			, double(nRounds) * len / best[1]
+			, double(nRounds) * len / best[2]
+			, double(nRounds) * len / best[3]
+			, sink == 1 ? " " : "");	// consume the sink so that the loops are not optimized out
+	}
+
+	return nFailed;
+}
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "../FSP_API.h"
+
+// Make a burst of asynchronous connection requests towards some peer over loopback and measure how fast
+// the local LLS turns them into INIT_CONNECT packets, together with the peak number of threads of LLS
+// Build: g++ -O2 -DOVER_UDP_IPv4 -o LinuxConnectBurst LinuxConnectBurst.cpp -L<build>/FSP_DLL -lFSPLib -lpthread -lrt
+// Usage: sudo LinuxConnectBurst [number of connect requests [peer name]]
+//	The peer name is by default "127.0.0.1:80", which takes the numeric fast path; "localhost:80" has to be resolved.
+//	Nobody need listen at the peer, the INIT_CONNECT packets are sniffed on the loopback interface
+
+#define BURST_TIMEOUT_us	5000000
+#define MAX_CONNECTS		250	// the sockets disposed are not recycled by the library at once, run the probe again instead
+
+static int FSPAPI onConnected(FSPHANDLE, PFSP_Context) { return 0; }
+static void FSPAPI onError(FSPHANDLE, FSP_ServiceCode, int) {}
+
+static double NowInMicroseconds()
+{
+	timespec v;
+	clock_gettime(CLOCK_MONOTONIC, &v);
+	return v.tv_sec * 1e6 + v.tv_nsec / 1e3;
+}
+
+
+
+// Return the process ID of the given name, 0 if it is not found
+static int PidOf(const char *name)
+{
+	char buf[64];
+	int pid = 0;
+	snprintf(buf, sizeof(buf), "pidof -s %s", name);
+	FILE *f = popen(buf, "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%d", &pid) != 1)
+		pid = 0;
+	pclose(f);
+	return pid;
+}
+
+
+
+// Return the CPU time consumed by the given process so far, in seconds
+static double CPUTimeOf(int pid)
+{
+	char buf[512];
+	unsigned long utime, stime;
+	snprintf(buf, sizeof(buf), "/proc/%d/stat", pid);
+	FILE *f = fopen(buf, "r");
+	if (f == NULL)
+		return 0;
+	char *s = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	// utime and stime are the 14th and 15th fields, the 2nd one, the command name, is parenthesized
+	if (s == NULL || (s = strrchr(buf, ')')) == NULL
+	 || sscanf(s + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+		return 0;
+	return double(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+
+
+static int		pidLLS;
+static int		peakThreads;
+static volatile bool	finished;
+
+// Sample the number of threads of LLS every millisecond and keep the peak
+static void * SampleThreads(void *)
+{
+	char buf[128];
+	snprintf(buf, sizeof(buf), "/proc/%d/status", pidLLS);
+	while (!finished)
+	{
+		int n = 0;
+		FILE *f = fopen(buf, "r");
+		if (f == NULL)
+			break;
+		char line[128];
+		while (fgets(line, sizeof(line), f) != NULL)
+		{
+			if (sscanf(line, "Threads: %d", &n) == 1)
+				break;
+		}
+		fclose(f);
+		if (n > peakThreads)
+			peakThreads = n;
+		usleep(1000);
+	}
+	return NULL;
+}
+
+
+
+// Make the connect requests in a burst and wait until all of the INIT_CONNECT packets are sniffed
+// Return the number of INIT_CONNECT packets sniffed, together with the time elapsed and the CPU time consumed by LLS
+static int Burst(int sdSniff, const char *peerName, int nConnects, double & elapsed, double & cpu)
+{
+	FSPHANDLE *handles = new FSPHANDLE[nConnects];
+	FSP_SocketParameter parms;
+	memset(&parms, 0, sizeof(parms));
+	parms.onAccepted = onConnected;
+	parms.onError = onError;
+	parms.recvSize = 0;	// the underlying service would give the minimum
+	parms.sendSize = 0;
+
+	const double cpu0 = CPUTimeOf(pidLLS);
+	const double t0 = NowInMicroseconds();
+	int nRequested = 0;
+	for (; nRequested < nConnects; nRequested++)
+	{
+		if ((handles[nRequested] = Connect2(peerName, &parms)) == NULL)
+			break;
+	}
+
+	// None of the INIT_CONNECT packets is retransmitted before RETRANSMIT_INIT_TIMEOUT_ms
+	octet	buf[sizeof(struct iphdr) + 40 + sizeof(struct udphdr) + sizeof(ALFIDPair) + sizeof(FSP_InitiateRequest)];
+	int nInitiated = 0;
+	double t1 = t0;
+	while (nInitiated < nRequested && NowInMicroseconds() - t0 < BURST_TIMEOUT_us)
+	{
+		int n = (int)recv(sdSniff, buf, sizeof(buf), 0);
+		if (n < 0)
+			continue;
+		int len = ((struct iphdr *)buf)->ihl * 4;
+		int offset = len + sizeof(struct udphdr) + sizeof(ALFIDPair);
+		if (n < offset + (int)sizeof(FSP_InitiateRequest) || ((struct udphdr *)(buf + len))->dest != DEFAULT_FSP_UDPPORT)
+			continue;
+		if (((FSP_InitiateRequest *)(buf + offset))->hs.opCode == INIT_CONNECT)
+		{
+			nInitiated++;
+			t1 = NowInMicroseconds();
+		}
+	}
+	elapsed = t1 - t0;
+	cpu = CPUTimeOf(pidLLS) - cpu0;
+
+	for (int i = 0; i < nRequested; i++)
+		Dispose(handles[i]);
+	delete[] handles;
+	return nInitiated;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	int nConnects = (argc > 1 ? atoi(argv[1]) : 200);
+	const char *peerName = (argc > 2 ? argv[2] : "127.0.0.1:80");
+	if (nConnects <= 0 || nConnects > MAX_CONNECTS)
+	{
+		printf("Usage: %s [number of connect requests, at most %d [peer name]]\n", argv[0], MAX_CONNECTS);
+		return -1;
+	}
+
+	int sdSniff = socket(AF_INET, SOCK_RAW, IPPROTO_UDP);
+	if (sdSniff < 0)
+	{
+		perror("Cannot create the raw socket, root privilege is required");
+		return -1;
+	}
+	timeval	timeout = { 0, 100000 };
+	setsockopt(sdSniff, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	pthread_t tid;
+	if ((pidLLS = PidOf("fsp_lls")) <= 0 || pthread_create(&tid, NULL, SampleThreads, NULL) != 0)
+	{
+		printf("fsp_lls is not running\n");
+		return -1;
+	}
+
+	double elapsed, cpu;
+	int nInitiated = Burst(sdSniff, peerName, nConnects, elapsed, cpu);
+	finished = true;
+	pthread_join(tid, NULL);
+
+	printf("INIT_CONNECT sent: %d of %d in %.1f ms, %.0f connects per second\n"
+		, nInitiated, nConnects, elapsed / 1000, nInitiated > 0 ? nInitiated * 1e6 / elapsed : 0.0);
+	printf("CPU time consumed by fsp_lls: %.1f us per connect\n", nInitiated > 0 ? cpu * 1e6 / nInitiated : 0.0);
+	printf("Peak number of threads of fsp_lls: %d\n", peakThreads);
+
+	close(sdSniff);
+	return (nInitiated > 0 ? 0 : 1);
+}
@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../FSP_DLL/FSP_DLL.h"
+
+// Push a transmit transaction through the on-the-wire compression and decompression of the library,
+// packet by packet as BufferData and FetchReceived do, verify the round trip and measure the cost
+// Build: g++ -O2 -DOVER_UDP_IPv4 -DZSTD_DISABLE_ASM -o LinuxDeflate LinuxDeflate.cpp ../FSP_DLL/Deflate.cpp
+//	-x c ../FSP_DLL/lz4.c ../FSP_DLL/zstd/common/*.c ../FSP_DLL/zstd/compress/*.c ../FSP_DLL/zstd/decompress/*.c
+// Usage: LinuxDeflate [text|random|mixed|corpus [size in MB [lz4|zstd [LZ4 acceleration [dictionary]]]]]
+//	'text' is compressible, 'random' is incompressible, 'mixed' alternates the two every megabyte.
+//	'corpus' is the lines of DeflateCorpus.txt, a fixed sample of HTTP, JSON, log and HTML text,
+//	shuffled in each pass and repeated to the size, so run it in this directory.
+//	The acceleration is otherwise selected by the pressure of the send queue, which is absent here.
+//	The dictionary is a file of raw content shared by both ends, e.g. DeflateCorpus.txt for the corpus,
+//	of which the first 64KB is taken
+
+#define CORPUS_SWITCH_SIZE	(1 << 20)
+#define CORPUS_FILE			"DeflateCorpus.txt"
+#define CORPUS_MAX_SIZE		(1 << 20)
+#define CORPUS_MAX_LINES	(1 << 16)
+
+timestamp_t NowMonotonic()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000);
+}
+
+
+
+// Words drawn from a small vocabulary of random words, which LZ4 typically compresses to about a half
+static void FillCompressible(octet *buf, int n, uint32_t &seed)
+{
+	static char vocabulary[256][12];
+	for (int i = 0; i < 256; i++)
+	{
+		int len = 2 + i % 9;
+		for (int j = 0; j < len; j++)
+			vocabulary[i][j] = 'a' + (i * 7 + j * 13 + (i >> 3) * j) % 26;
+		vocabulary[i][len] = ' ';
+		vocabulary[i][len + 1] = 0;
+	}
+	for (int i = 0; i < n; )
+	{
+		seed = seed * 1103515245 + 12345;
+		const char *w = vocabulary[(seed >> 16) % 256];
+		while (*w != 0 && i < n)
+			buf[i++] = *w++;
+	}
+}
+
+
+
+static void FillRandom(octet *buf, int n, uint32_t &seed)
+{
+	for (int i = 0; i < n; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		buf[i] = (octet)(seed >> 16);
+	}
+}
+
+
+
+// Return number of octets read into the buffer, which is filled up to n octets unless the file is absent
+static int ReadFile(const char *path, octet *buf, int n)
+{
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL)
+		return 0;
+	int k = (int)fread(buf, 1, n, fp);
+	fclose(fp);
+	return k;
+}
+
+
+
+// Concatenate the lines of the bundled corpus again and again, in a different order in each pass
+// so that a pass is not merely a long-distance copy of the previous one
+static bool FillCorpus(octet *buf, int n, uint32_t &seed)
+{
+	static octet corpus[CORPUS_MAX_SIZE];
+	static int lineStart[CORPUS_MAX_LINES + 1];
+	int size = ReadFile(CORPUS_FILE, corpus, sizeof(corpus));
+	int m = 0;
+	for (int i = 0; i < size && m < CORPUS_MAX_LINES; i++)
+	{
+		if (i == 0 || corpus[i - 1] == '\n')
+			lineStart[m++] = i;
+	}
+	lineStart[m] = size;
+	if (m == 0)
+		return false;
+
+	static int order[CORPUS_MAX_LINES];
+	for (int j = 0; j < m; j++)
+		order[j] = j;
+	for (int i = 0; i < n; )
+	{
+		for (int j = m - 1; j > 0; j--)
+		{
+			seed = seed * 1103515245 + 12345;
+			int k = (seed >> 8) % (j + 1);
+			int t = order[j];
+			order[j] = order[k];
+			order[k] = t;
+		}
+		for (int j = 0; j < m && i < n; j++)
+		{
+			int len = min(lineStart[order[j] + 1] - lineStart[order[j]], n - i);
+			memcpy(buf + i, corpus + lineStart[order[j]], len);
+			i += len;
+		}
+	}
+	return true;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	const char *kind = (argc > 1 ? argv[1] : "mixed");
+	int size = (argc > 2 ? atoi(argv[2]) : 16) << 20;
+	const char *codec = (argc > 3 ? argv[3] : "lz4");
+	int acceleration = (argc > 4 ? atoi(argv[4]) : 1);
+	if (size <= 0 || (strcmp(codec, "lz4") != 0 && strcmp(codec, "zstd") != 0)
+	 || (strcmp(kind, "text") != 0 && strcmp(kind, "random") != 0 && strcmp(kind, "mixed") != 0 && strcmp(kind, "corpus") != 0))
+	{
+		printf("Usage: %s [text|random|mixed|corpus [size in MB [lz4|zstd [LZ4 acceleration [dictionary]]]]]\n", argv[0]);
+		return -1;
+	}
+
+	octet *input = (octet *)malloc(size);
+	octet *wire = (octet *)malloc(size + size / 8 + (64 << 10));
+	octet *output = (octet *)malloc(size);
+	uint32_t seed = 0x3fdf;
+	if (kind[0] == 'c' && !FillCorpus(input, size, seed))
+	{
+		printf("The corpus %s is not found\n", CORPUS_FILE);
+		return -1;
+	}
+	for (int i = 0; i < size && kind[0] != 'c'; i += CORPUS_SWITCH_SIZE)
+	{
+		int n = min(CORPUS_SWITCH_SIZE, size - i);
+		bool isText = (kind[0] == 't' || (kind[0] == 'm' && (i / CORPUS_SWITCH_SIZE) % 2 == 0));
+		if (isText)
+			FillCompressible(input + i, n, seed);
+		else
+			FillRandom(input + i, n, seed);
+	}
+
+	CSocketItemDl *p = (CSocketItemDl *)calloc(1, sizeof(CSocketItemDl));
+	p->context.codec = (codec[0] == 'z' ? FSP_CODEC_ZSTD : FSP_CODEC_LZ4);
+	if (argc > 5)
+	{
+		static octet dictionary[1 << 16];
+		p->codecDictionary = dictionary;
+		p->codecDictionarySize = ReadFile(argv[5], dictionary, sizeof(dictionary));
+	}
+	if (!p->AllocStreamState() || !p->AllocDecodeState())
+	{
+		printf("No memory\n");
+		return 1;
+	}
+	p->deflatePolicy.acceleration = acceleration;
+
+	// Compression, one packet after another
+	timestamp_t t0 = NowMonotonic();
+	int consumed = 0, wireSize = 0;
+	for (;;)
+	{
+		int k = MAX_BLOCK_SIZE;
+		int m = p->Compress(wire + wireSize, k, input + consumed, size - consumed);
+		if (m < 0)
+		{
+			printf("Compression error %d\n", m);
+			return 1;
+		}
+		consumed += m;
+		wireSize += k;
+		if (consumed >= size && !p->HasInternalBufferedToSend())
+			break;
+		if (k == 0 && m == 0 && consumed >= size)
+		{
+			// flush the last segment
+			k = MAX_BLOCK_SIZE;
+			p->Compress(wire + wireSize, k, NULL, 0);
+			wireSize += k;
+		}
+	}
+	timestamp_t t1 = NowMonotonic();
+
+	// Decompression, one packet after another
+	int fed = 0, delivered = 0;
+	while (delivered < size)
+	{
+		int k = size - delivered;
+		int m = p->Decompress(output + delivered, k, wire + fed, min(MAX_BLOCK_SIZE, wireSize - fed));
+		if (m < 0 || k < 0)
+		{
+			printf("Decompression error %d at %d\n", m < 0 ? m : k, fed);
+			return 1;
+		}
+		fed += m;
+		delivered += k;
+		if (m == 0 && k == 0)
+			break;
+	}
+	timestamp_t t2 = NowMonotonic();
+
+	bool intact = (delivered == size && fed == wireSize && memcmp(input, output, size) == 0);
+	printf("%s by %s%s, %d MB: %d octets on the wire, ratio %.3f, round trip %s\n"
+		, kind, codec, (p->codecDictionarySize > 0 ? " with the dictionary" : ""), size >> 20, wireSize, double(wireSize) / size, intact ? "intact" : "CORRUPTED");
+	printf("Compression %.1f MB/s, decompression %.1f MB/s\n"
+		, double(size) / (t1 - t0), double(size) / (t2 - t1));
+	const FSP_CompressionStatistics &stat = p->deflatePolicy.stat;
+	printf("Segments compressed: %u, stored: %u (%.1f MB); %.1f ms spent in compressing\n"
+		, stat.segmentsCompressed, stat.segmentsStored, stat.bytesStored / 1048576.0, stat.usCompressing / 1000.0);
+	return (intact ? 0 : 1);
+}
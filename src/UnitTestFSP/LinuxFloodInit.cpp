@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "../FSP.h"
+
+// Flood the local LLS with INIT_CONNECT of spoofed sources over loopback while a legitimate initiator
+// keeps on bootstrapping connections towards the same listener, to show that the flood is shed cheaply
+// and the legitimate peer, as well as the sessions already established, are still served
+// Build: g++ -O2 -o LinuxFloodInit LinuxFloodInit.cpp -lpthread
+// Usage: sudo LinuxFloodInit [listener fiber ID [spoofed packets per second [seconds]]]
+//	The listener may be FSP_HTTP, which listens at fiber#80 by default. Set the rate to 0 to measure the baseline
+
+#define	PROBE_INTERVAL_us	20000	// of the legitimate initiator, below LLS_ADMISSION_PREFIX_RATE
+#define	PROBE_TIMEOUT_us	100000
+
+struct SFloodPacket
+{
+	struct iphdr	ip;
+	struct udphdr	udp;
+	ALFIDPair		fidPair;
+	FSP_InitiateRequest	request;
+};
+
+static ALFID_T	idListener;
+static int		floodRate;
+static volatile bool	finished;
+static long		countFlooded;
+
+static timestamp_t NowInMicroseconds()
+{
+	timespec v;
+	clock_gettime(CLOCK_MONOTONIC, &v);
+	return timestamp_t(v.tv_sec) * 1000000 + v.tv_nsec / 1000;
+}
+
+
+
+static void FillRequest(FSP_InitiateRequest & q, uint64_t initCheckCode)
+{
+	timespec v;
+	clock_gettime(CLOCK_REALTIME, &v);
+	q.hs.opCode = INIT_CONNECT;
+	q.hs.major = THIS_FSP_VERSION;
+	q.hs.offset = htobe16(sizeof(FSP_InitiateRequest));
+	q.salt = (uint32_t)random();
+	q.timeStamp = htobe64(timestamp_t(v.tv_sec) * 1000000 + v.tv_nsec / 1000);
+	q.initCheckCode = initCheckCode;
+}
+
+
+
+// Send INIT_CONNECT at the given rate, each from a random source in 127.0.0.0/8 other than 127.0.0.1
+static void * FloodInitConnect(void *)
+{
+	SFloodPacket pkt;
+	sockaddr_in	target;
+	int sd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+	if (sd < 0)
+	{
+		perror("Cannot create the raw socket, root privilege is required");
+		finished = true;
+		return NULL;
+	}
+
+	memset(&target, 0, sizeof(target));
+	target.sin_family = AF_INET;
+	target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.ip.version = 4;
+	pkt.ip.ihl = sizeof(struct iphdr) / 4;
+	pkt.ip.ttl = 64;
+	pkt.ip.protocol = IPPROTO_UDP;
+	pkt.ip.tot_len = htons(sizeof(pkt));
+	pkt.ip.daddr = target.sin_addr.s_addr;
+	pkt.udp.dest = DEFAULT_FSP_UDPPORT;
+	pkt.udp.len = htons(sizeof(pkt) - sizeof(struct iphdr));
+	pkt.fidPair.peer = idListener;
+
+	const timestamp_t t0 = NowInMicroseconds();
+	while (!finished)
+	{
+		// pace by the number of packets that should have been sent so far
+		long n = long((NowInMicroseconds() - t0) * floodRate / 1000000) - countFlooded;
+		if (n <= 0)
+		{
+			usleep(100);
+			continue;
+		}
+		while (n-- > 0)
+		{
+			uint32_t r = (uint32_t)random();
+			pkt.ip.saddr = htonl(0x7F000000 | ((r & 0xFFFFFF) | 2));
+			pkt.udp.source = htons(1024 + (r >> 22));
+			pkt.fidPair.source = (ALFID_T)random();
+			FillRequest(pkt.request, ((uint64_t)random() << 32) | r);
+			if (sendto(sd, &pkt, sizeof(pkt), 0, (sockaddr *)&target, sizeof(target)) < 0 && errno != ENOBUFS)
+			{
+				perror("Cannot send the spoofed INIT_CONNECT");
+				finished = true;
+				break;
+			}
+			countFlooded++;
+		}
+	}
+
+	close(sd);
+	return NULL;
+}
+
+
+
+// Bootstrap connections from 127.0.0.1 and wait for each ACK_INIT_CONNECT
+// Return the number of the challenges received, accumulate the latency in microseconds
+// Remark
+//	The challenge is sent back to the well-known FSP port which is occupied by the LLS itself, so it is sniffed
+static int ProbeInitConnect(int nProbes, double & latency)
+{
+	struct
+	{
+		ALFIDPair		fidPair;
+		FSP_InitiateRequest	request;
+	} q;
+	octet	buf[sizeof(struct iphdr) + 40 + sizeof(struct udphdr) + sizeof(ALFIDPair) + sizeof(FSP_Challenge)];
+	sockaddr_in	addr;
+	int sd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	int sdSniff = socket(AF_INET, SOCK_RAW, IPPROTO_UDP);
+	timeval	timeout = { 0, PROBE_TIMEOUT_us };
+	int	nAcked = 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = DEFAULT_FSP_UDPPORT;
+	if (sd < 0 || sdSniff < 0 || connect(sd, (sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		perror("Cannot create the sockets of the legitimate initiator");
+		return 0;
+	}
+	setsockopt(sdSniff, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	latency = 0;
+	for (int i = 0; i < nProbes && !finished; i++)
+	{
+		uint64_t initCheckCode = ((uint64_t)random() << 32) | (uint64_t)i;
+		q.fidPair.source = htobe32(0x10000 + i);
+		q.fidPair.peer = idListener;
+		FillRequest(q.request, initCheckCode);
+
+		timestamp_t t0 = NowInMicroseconds();
+		if (send(sd, &q, sizeof(q), 0) < 0)
+		{
+			perror("Cannot send INIT_CONNECT");
+			break;
+		}
+		// ACK_INIT_CONNECT of some earlier probe that timed out, or of the spoofed sources, is ignored
+		while (NowInMicroseconds() - t0 < PROBE_TIMEOUT_us)
+		{
+			int n = (int)recv(sdSniff, buf, sizeof(buf), 0);
+			if (n < 0)
+				break;
+			int offset = ((struct iphdr *)buf)->ihl * 4 + sizeof(struct udphdr) + sizeof(ALFIDPair);
+			if (n < offset + (int)sizeof(FSP_Challenge) || ((struct iphdr *)buf)->daddr != htonl(INADDR_LOOPBACK))
+				continue;
+			FSP_Challenge *r = (FSP_Challenge *)(buf + offset);
+			if (r->hs.opCode == ACK_INIT_CONNECT && r->initCheckCode == initCheckCode)
+			{
+				latency += NowInMicroseconds() - t0;
+				nAcked++;
+				break;
+			}
+		}
+		usleep(PROBE_INTERVAL_us);
+	}
+
+	close(sdSniff);
+	close(sd);
+	return nAcked;
+}
+
+
+
+// Return the CPU time consumed by the process of the given name so far, in seconds
+static double CPUTimeOf(const char *name)
+{
+	char buf[512];
+	unsigned long utime, stime;
+	int pid = 0;
+	snprintf(buf, sizeof(buf), "pidof -s %s", name);
+	FILE *f = popen(buf, "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%d", &pid) != 1)
+		pid = 0;
+	pclose(f);
+	if (pid <= 0)
+		return 0;
+
+	snprintf(buf, sizeof(buf), "/proc/%d/stat", pid);
+	f = fopen(buf, "r");
+	if (f == NULL)
+		return 0;
+	char *s = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	// utime and stime are the 14th and 15th fields, the 2nd one, the command name, is parenthesized
+	if (s == NULL || (s = strrchr(buf, ')')) == NULL
+	 || sscanf(s + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+		return 0;
+	return double(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	int fiber = (argc > 1 ? atoi(argv[1]) : 80);
+	int seconds = (argc > 3 ? atoi(argv[3]) : 5);
+	floodRate = (argc > 2 ? atoi(argv[2]) : 100000);
+	if (fiber <= 0 || floodRate < 0 || seconds <= 0)
+	{
+		printf("Usage: %s [listener fiber ID [spoofed packets per second [seconds]]]\n", argv[0]);
+		return -1;
+	}
+
+	idListener = htobe32(fiber);	// as TranslateFSPoverIPv4(&atAddress, 0, htobe32(80)) by FSP_HTTP
+	srandom((unsigned)time(NULL));
+
+	pthread_t tid;
+	double cpu0 = CPUTimeOf("fsp_lls");
+	if (floodRate > 0 && pthread_create(&tid, NULL, FloodInitConnect, NULL) != 0)
+	{
+		perror("Cannot start the flood generator");
+		return -1;
+	}
+
+	const int nProbes = seconds * 1000000 / PROBE_INTERVAL_us;
+	const timestamp_t t0 = NowInMicroseconds();
+	double latency;
+	int nAcked = ProbeInitConnect(nProbes, latency);
+	const double elapsed = (NowInMicroseconds() - t0) / 1e6;
+
+	finished = true;
+	if (floodRate > 0)
+		pthread_join(tid, NULL);
+
+	printf("Spoofed INIT_CONNECT sent: %ld (%.0f per second)\n", countFlooded, countFlooded / elapsed);
+	printf("Legitimate INIT_CONNECT challenged: %d of %d, average latency %.0f us\n"
+		, nAcked, nProbes, nAcked > 0 ? latency / nAcked : 0.0);
+	printf("CPU time consumed by fsp_lls: %.2f s in %.2f s\n", CPUTimeOf("fsp_lls") - cpu0, elapsed);
+
+	return (nAcked > 0 ? 0 : 1);
+}
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../FSP_SRV/gcm-aes.h"
+
+// Compare the per-packet cost of GCM-AES sealing and opening with that of the batched API
+// Build: gcc -O2 -c ../FSP_SRV/gcm-aes.c ../FSP_SRV/rijndael-alg-fst.c
+//	&& g++ -O2 -o LinuxGCMBatch LinuxGCMBatch.cpp gcm-aes.o rijndael-alg-fst.o
+// Usage: LinuxGCMBatch [number of rounds]
+//	A round seals/opens BATCH_SIZE packets of each payload size, and the best of REPEAT runs is reported
+
+#define BATCH_SIZE	16	// as LLS_SEND_BATCH_SIZE
+#define AAD_SIZE	24	// as sizeof(FSP_NormalPacketHeader)
+#define TAG_SIZE	8	// as FSP_TAG_SIZE
+#define REPEAT		5
+
+static const int	payloadSizes[] = { 64, 256, 1024 };
+
+ALIGN(16) static octet		plainText[BATCH_SIZE][1024];
+ALIGN(16) static uint64_t	cipherText[BATCH_SIZE][1024 / sizeof(uint64_t)];
+ALIGN(16) static uint64_t	decrypted[BATCH_SIZE][1024 / sizeof(uint64_t)];
+ALIGN(16) static uint64_t	headers[BATCH_SIZE][AAD_SIZE / sizeof(uint64_t)];
+static octet	tags[BATCH_SIZE][TAG_SIZE];
+
+static double NowInNanoseconds()
+{
+	timespec v;
+	clock_gettime(CLOCK_MONOTONIC, &v);
+	return v.tv_sec * 1e9 + v.tv_nsec;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	GCM_AES_CTX		ctx;
+	GCM_AES_PACKET	packets[BATCH_SIZE];
+	octet	key[16 + GMAC_SALT_LEN];
+	int		nRounds = (argc > 1 ? atoi(argv[1]) : 20000);
+
+	if (nRounds <= 0)
+	{
+		printf("Usage: %s [number of rounds]\n", argv[0]);
+		return -1;
+	}
+
+	srand((unsigned)time(NULL));
+	for (int i = 0; i < (int)sizeof(key); i++)
+		key[i] = (octet)rand();
+	for (int k = 0; k < BATCH_SIZE; k++)
+	{
+		for (int i = 0; i < (int)sizeof(plainText[k]); i++)
+			plainText[k][i] = (octet)rand();
+		for (int i = 0; i < (int)sizeof(headers[k]); i++)
+			((octet *)headers[k])[i] = (octet)rand();
+	}
+	GCM_AES_SetKey(&ctx, key, sizeof(key));
+
+	printf("Payload\tSeal per-packet\tSeal batched\tOpen per-packet\tOpen batched (ns per packet)\n");
+	for (int s = 0; s < (int)(sizeof(payloadSizes) / sizeof(int)); s++)
+	{
+		const uint32_t len = payloadSizes[s];
+		double	best[4] = { 1e30, 1e30, 1e30, 1e30 };
+		int		nFailed = 0;
+
+		for (int r = 0; r < REPEAT; r++)
+		{
+			double t0 = NowInNanoseconds();
+			for (int n = 0; n < nRounds; n++)
+			{
+				for (int k = 0; k < BATCH_SIZE; k++)
+				{
+					GCM_AES_AuthenticatedEncrypt(&ctx, uint64_t(n) * BATCH_SIZE + k
+						, plainText[k], len
+						, headers[k], AAD_SIZE
+						, cipherText[k]
+						, tags[k], TAG_SIZE);
+				}
+			}
+
+			double t1 = NowInNanoseconds();
+			for (int n = 0; n < nRounds; n++)
+			{
+				for (int k = 0; k < BATCH_SIZE; k++)
+				{
+					GCM_AES_PACKET &p = packets[k];
+					p.ctx = &ctx;
+					p.IV = uint64_t(n) * BATCH_SIZE + k;
+					p.salt = 0;
+					p.bytes = len;
+					p.in = plainText[k];
+					p.out = cipherText[k];
+					p.aad = headers[k];
+					p.bytesA = AAD_SIZE;
+					p.bytesT = TAG_SIZE;
+				}
+				GCM_AES_SealBatch(packets, BATCH_SIZE);
+			}
+
+			// The packets of the last round are opened over and over again
+			double t2 = NowInNanoseconds();
+			for (int n = 0; n < nRounds; n++)
+			{
+				for (int k = 0; k < BATCH_SIZE; k++)
+				{
+					if (GCM_AES_AuthenticateAndDecrypt(&ctx, packets[k].IV
+						, (const octet *)cipherText[k], len
+						, headers[k], AAD_SIZE
+						, packets[k].T, TAG_SIZE
+						, decrypted[k]) != 0)
+					{
+						nFailed++;
+					}
+				}
+			}
+
+			for (int k = 0; k < BATCH_SIZE; k++)
+			{
+				packets[k].in = (const octet *)cipherText[k];
+				packets[k].out = decrypted[k];
+			}
+			double t3 = NowInNanoseconds();
+			for (int n = 0; n < nRounds; n++)
+				nFailed += BATCH_SIZE - GCM_AES_OpenBatch(packets, BATCH_SIZE);
+
+			double t4 = NowInNanoseconds();
+			double elapsed[4] = { t1 - t0, t2 - t1, t3 - t2, t4 - t3 };
+			for (int i = 0; i < 4; i++)
+			{
+				if (elapsed[i] < best[i])
+					best[i] = elapsed[i];
+			}
+		}
+
+		for (int k = 0; k < BATCH_SIZE; k++)
+		{
+			if (memcmp(decrypted[k], plainText[k], len) != 0)
+				nFailed++;
+		}
+
+		printf("%u\t%.0f\t\t%.0f\t\t%.0f\t\t%.0f%s\n", len
+			, best[0] / nRounds / BATCH_SIZE
+			, best[1] / nRounds / BATCH_SIZE
+			, best[2] / nRounds / BATCH_SIZE
+			, best[3] / nRounds / BATCH_SIZE
+			, nFailed == 0 ? "" : "\tFAILED!");
+	}
+
+	return 0;
+}
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "../NameCache.h"
+
+// Exercise the name resolution cache offline, with a resolver backend injected that counts the calls
+// Build: g++ -O2 -o LinuxNameCache LinuxNameCache.cpp ../NameCache.cpp -lpthread
+// Usage: LinuxNameCache
+//	Names beginning with "bad" cannot be resolved; names beginning with "slow" take 100ms to resolve
+
+#define COALESCING_THREADS	8
+
+static volatile int	countBackendCalls;
+static CNameCache	cache;	// not the singleton, so that the default backend is never called
+
+static int FakeResolve(const char *name, const char *, int family, UNameCacheAddress *addresses, int capacity)
+{
+	__sync_fetch_and_add(&countBackendCalls, 1);
+	if (strncmp(name, "slow", 4) == 0)
+		usleep(100000);
+	if (strncmp(name, "bad", 3) == 0 || capacity <= 0)
+		return -1;
+	memset(addresses, 0, sizeof(UNameCacheAddress));
+	addresses[0].ipv4.sin_family = (sa_family_t)family;
+	addresses[0].ipv4.sin_addr.s_addr = htonl(0x0A000000 + (uint32_t)strlen(name));
+	return 1;
+}
+
+
+
+static int failures;
+
+static void Check(bool condition, const char *what)
+{
+	printf("%s: %s\n", condition ? "PASS" : "FAIL", what);
+	if (!condition)
+		failures++;
+}
+
+
+
+static void * ResolveSlowly(void *)
+{
+	UNameCacheAddress a;
+	return (void *)(intptr_t)cache.Resolve("slow.example", NULL, AF_INET, &a, 1);
+}
+
+
+
+int main()
+{
+	UNameCacheAddress a;
+	SNameCacheStatistics stat;
+	cache.SetBackend(FakeResolve);
+	cache.SetTTL(50, 20);
+
+	int r1 = cache.Resolve("peer.example", "80", AF_INET, &a, 1);
+	int r2 = cache.Resolve("peer.example", "80", AF_INET, &a, 1);
+	Check(r1 == 1 && r2 == 1 && countBackendCalls == 1, "the second lookup is served by the cache");
+	Check(a.ipv4.sin_addr.s_addr == htonl(0x0A00000C), "the address cached is the one resolved");
+	cache.Resolve("peer.example", "443", AF_INET, &a, 1);
+	Check(countBackendCalls == 2, "the service name is part of the key");
+
+	countBackendCalls = 0;
+	r1 = cache.Resolve("bad.example", NULL, AF_INET, &a, 1);
+	r2 = cache.Resolve("bad.example", NULL, AF_INET, &a, 1);
+	Check(r1 < 0 && r2 < 0 && countBackendCalls == 1, "failure to resolve is cached");
+	usleep(30000);
+	cache.Resolve("bad.example", NULL, AF_INET, &a, 1);
+	Check(countBackendCalls == 2, "failure to resolve expires after the negative TTL");
+
+	countBackendCalls = 0;
+	usleep(60000);
+	cache.Resolve("peer.example", "80", AF_INET, &a, 1);
+	Check(countBackendCalls == 1, "the address resolved expires after the TTL");
+
+	a.ipv4.sin_addr.s_addr = htonl(0xC0A80001);
+	Check(cache.AddStaticEntry("gateway.example", NULL, AF_INET, &a, 1), "a static entry is added");
+	countBackendCalls = 0;
+	usleep(60000);
+	memset(&a, 0, sizeof(a));
+	r1 = cache.Resolve("gateway.example", NULL, AF_INET, &a, 1);
+	Check(r1 == 1 && countBackendCalls == 0 && a.ipv4.sin_addr.s_addr == htonl(0xC0A80001), "a static entry never expires");
+
+	cache.SetTTL(NAME_CACHE_TTL_ms, NAME_CACHE_NEGATIVE_TTL_ms);
+	char name[32];
+	for (int i = 0; i <= NAME_CACHE_SIZE; i++)
+	{
+		snprintf(name, sizeof(name), "host%d.example", i);
+		cache.Resolve(name, NULL, AF_INET, &a, 1);
+	}
+	countBackendCalls = 0;
+	cache.Resolve("gateway.example", NULL, AF_INET, &a, 1);
+	snprintf(name, sizeof(name), "host%d.example", NAME_CACHE_SIZE);
+	cache.Resolve(name, NULL, AF_INET, &a, 1);
+	Check(countBackendCalls == 0, "neither the most recently used nor a static entry is evicted");
+	cache.Resolve("host0.example", NULL, AF_INET, &a, 1);
+	Check(countBackendCalls == 1, "the least recently used entry is evicted");
+
+	countBackendCalls = 0;
+	pthread_t threads[COALESCING_THREADS];
+	for (int i = 0; i < COALESCING_THREADS; i++)
+		pthread_create(&threads[i], NULL, ResolveSlowly, NULL);
+	int nResolved = 0;
+	for (int i = 0; i < COALESCING_THREADS; i++)
+	{
+		void *r;
+		pthread_join(threads[i], &r);
+		nResolved += (r == (void *)1);
+	}
+	Check(nResolved == COALESCING_THREADS && countBackendCalls == 1, "concurrent lookups of the same name are coalesced");
+
+	cache.GetStatistics(stat);
+	printf("Hit: %llu, negative hit: %llu, miss: %llu, coalesced: %llu, evicted: %llu\n"
+		, (unsigned long long)stat.countHit, (unsigned long long)stat.countNegativeHit
+		, (unsigned long long)stat.countMiss, (unsigned long long)stat.countCoalesced
+		, (unsigned long long)stat.countEvicted);
+	Check(stat.countEvicted > 0 && stat.countCoalesced > 0 && stat.countNegativeHit == 1, "the statistics are exported");
+
+	return (failures == 0 ? 0 : 1);
+}
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../FSP_Impl.h"
+
+// Attach more and more ULA channels to the local LLS, as if they were of so many ULA processes,
+// and measure the latency of dispatching a command over some random channel, together with the number of threads of LLS
+// Build: g++ -O2 -DOVER_UDP_IPv4 -o LinuxULAScale LinuxULAScale.cpp
+// Usage: LinuxULAScale [maximum number of channels]
+//	The command is FSP_Reset on fiber#0, for which LLS returns FSP_IPC_Failure at once
+
+#define ROUND_TRIPS	1000
+
+static double NowInMicroseconds()
+{
+	timespec v;
+	clock_gettime(CLOCK_MONOTONIC, &v);
+	return v.tv_sec * 1e6 + v.tv_nsec / 1e3;
+}
+
+
+
+static int ConnectLLS()
+{
+	struct sockaddr_un addr;
+	int sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, SERVICE_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+	if (connect(sd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		close(sd);
+		return -1;
+	}
+	return sd;
+}
+
+
+
+// Return the number of threads of the process of the given name, 0 if it is not found
+static int ThreadsOf(const char *name)
+{
+	char buf[128];
+	int pid = 0, n = 0;
+	snprintf(buf, sizeof(buf), "pidof -s %s", name);
+	FILE *f = popen(buf, "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%d", &pid) != 1)
+		pid = 0;
+	pclose(f);
+	if (pid <= 0)
+		return 0;
+
+	snprintf(buf, sizeof(buf), "/proc/%d/status", pid);
+	f = fopen(buf, "r");
+	if (f == NULL)
+		return 0;
+	while (fgets(buf, sizeof(buf), f) != NULL)
+	{
+		if (sscanf(buf, "Threads: %d", &n) == 1)
+			break;
+	}
+	fclose(f);
+	return n;
+}
+
+
+
+static int CompareDouble(const void *a, const void *b)
+{
+	double d = *(const double *)a - *(const double *)b;
+	return (d < 0 ? -1 : d > 0 ? 1 : 0);
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	int nMax = (argc > 1 ? atoi(argv[1]) : 1000);
+	if (nMax <= 0)
+	{
+		printf("Usage: %s [maximum number of channels]\n", argv[0]);
+		return -1;
+	}
+
+	struct rlimit rl;
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+
+	int *sds = new int[nMax];
+	double *latency = new double[ROUND_TRIPS];
+	UCommandToLLS cmd;
+	SNotification resp;
+	memset((void *)&cmd, 0, sizeof(cmd));
+	cmd.sharedInfo.opCode = FSP_Reset;
+	cmd.sharedInfo.fiberID = 0;
+
+	printf("Channels\tThreads\tMedian(us)\t99%%(us)\tFailed\n");
+	int n = 0;
+	for (int stage = 1; stage <= nMax; stage *= 10)
+	{
+		for (; n < stage; n++)
+		{
+			if ((sds[n] = ConnectLLS()) < 0)
+			{
+				printf("Only %d channels are attached\n", n);
+				return 1;
+			}
+		}
+		// Wait for LLS to register the channels; a channel refused is counted, but its latency is not measured
+		usleep(100000);
+
+		int count = 0, nRefused = 0;
+		for (int i = 0; i < ROUND_TRIPS; i++)
+		{
+			int sd = sds[random() % n];
+			double t0 = NowInMicroseconds();
+			if (send(sd, &cmd, sizeof(cmd), MSG_NOSIGNAL) != sizeof(cmd)
+			 || recv(sd, &resp, sizeof(resp), MSG_WAITALL) != sizeof(resp) || resp.sig != FSP_IPC_Failure)
+			{
+				nRefused++;
+				continue;
+			}
+			latency[count++] = NowInMicroseconds() - t0;
+		}
+		if (count == 0)
+		{
+			printf("%d\t\t%d\tno response\n", n, ThreadsOf("fsp_lls"));
+			return 1;
+		}
+		qsort(latency, count, sizeof(double), CompareDouble);
+		printf("%d\t\t%d\t%.1f\t\t%.1f\t\t%d\n", n, ThreadsOf("fsp_lls")
+			, latency[count / 2], latency[count * 99 / 100], nRefused);
+	}
+
+	for (int i = 0; i < n; i++)
+		close(sds[i]);
+	delete[] sds;
+	delete[] latency;
+	return 0;
+}